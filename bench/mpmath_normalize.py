@@ -0,0 +1,25 @@
+# bench/mpmath_normalize.py
+
+import os
+
+import pyperf
+from mpmath.libmp.libmpf import _normalize
+
+from gmp import _mpmath_normalize, mpz
+
+# Set T=mpmath to run mpmath's pure-Python normalize() on gmp's mpz.
+if os.getenv("T") == "mpmath":
+    normalize = _normalize
+else:
+    normalize = _mpmath_normalize
+
+values = [("1<<7", 5), ("(1<<300) - 1", 53), ("3**2000", 1000),
+          ("3**2000 << 100", 5000)]
+
+runner = pyperf.Runner()
+for v, prec in values:
+    man = mpz(eval(v))
+    bc = man.bit_length()
+    for rnd in ["n", "d"]:
+        bn = f'normalize("{v}", {prec}, "{rnd}")'
+        runner.bench_func(bn, normalize, 0, man, -10, bc, prec, rnd)
@@ -139,7 +139,7 @@ typedef struct {
   if failure, sets the exception
 */
 static int
-parse_internal_render_format_spec(PyObject *obj,
+parse_internal_render_format_spec(PyTypeObject *type,
                                   PyObject *format_spec,
                                   Py_ssize_t start, Py_ssize_t end,
                                   InternalFormatSpec *format,
@@ -292,13 +292,15 @@ parse_internal_render_format_spec(PyObject *obj,
            operating on.  It's format_spec[start:end] (in Python syntax). */
         PyObject* actual_format_spec = PyUnicode_FromKindAndData(kind,
             (char*)data + kind*start, end-start);
-        if (actual_format_spec != NULL) {
+        PyObject *name = PyType_GetFullyQualifiedName(type);
+
+        if (actual_format_spec != NULL && name != NULL) {
             PyErr_Format(PyExc_ValueError,
                          ("Invalid format specifier '%U' for object "
-                          "of type '%.200s'"), actual_format_spec,
-                         PyType_GetFullyQualifiedName(Py_TYPE(obj)));
-            Py_DECREF(actual_format_spec);
+                          "of type '%U'"), actual_format_spec, name);
         }
+        Py_XDECREF(actual_format_spec);
+        Py_XDECREF(name);
         return 0;
     }
     if (end-pos == 1) {
@@ -392,8 +394,7 @@ typedef struct {
                                the n_grouped_digits width. */
 } NumberFieldWidths;
 
-#if PY_VERSION_HEX > 0x030D00A0
-/* _PyUnicode_InsertThousandsGrouping() helper functions */
+/* insert_thousands_grouping() helper functions */
 
 typedef struct {
     const char *grouping;
@@ -433,72 +434,57 @@ GroupGenerator_next(GroupGenerator *self)
     }
 }
 
-/* Fill in some digits, leading zeros, and thousands separator. All
-   are optional, depending on when we're called. */
+/* Write n copies of ch into the string data, starting at pos. */
 static void
-InsertThousandsGrouping_fill(_PyUnicodeWriter *writer, Py_ssize_t *buffer_pos,
-                             PyObject *digits, Py_ssize_t *digits_pos,
-                             Py_ssize_t n_chars, Py_ssize_t n_zeros,
-                             PyObject *thousands_sep, Py_ssize_t thousands_sep_len,
-                             Py_UCS4 *maxchar)
+fill_chars(int kind, void *data, Py_ssize_t pos, Py_ssize_t n, Py_UCS4 ch)
 {
-    if (!writer) {
-        /* if maxchar > 127, maxchar is already set */
-        if (*maxchar == 127 && thousands_sep) {
-            Py_UCS4 maxchar2 = PyUnicode_MAX_CHAR_VALUE(thousands_sep);
-            *maxchar = Py_MAX(*maxchar, maxchar2);
-        }
+    if (kind == PyUnicode_1BYTE_KIND) {
+        memset((Py_UCS1 *)data + pos, (int)ch, (size_t)n);
         return;
     }
-    if (thousands_sep) {
-        *buffer_pos -= thousands_sep_len;
-        /* Copy the thousands_sep chars into the buffer. */
-        PyUnicode_CopyCharacters(writer->buffer, *buffer_pos,
-                                      thousands_sep, 0,
-                                      thousands_sep_len);
-    }
-    *buffer_pos -= n_chars;
-    *digits_pos -= n_chars;
-    PyUnicode_CopyCharacters(writer->buffer, *buffer_pos,
-                                  digits, *digits_pos,
-                                  n_chars);
-    if (n_zeros) {
-        *buffer_pos -= n_zeros;
-        PyUnicode_Fill(writer->buffer, *buffer_pos, n_zeros, '0');
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyUnicode_WRITE(kind, data, pos + i, ch);
     }
 }
 
-static Py_ssize_t
-_PyUnicode_InsertThousandsGrouping(_PyUnicodeWriter *writer,
-                                   Py_ssize_t n_buffer, PyObject *digits,
-                                   Py_ssize_t d_pos, Py_ssize_t n_digits,
-                                   Py_ssize_t min_width, const char *grouping,
-                                   PyObject *thousands_sep, Py_UCS4 *maxchar)
+/* Copy n ASCII characters of str into the string data, starting at pos. */
+static void
+copy_ascii(int kind, void *data, Py_ssize_t pos, const char *str,
+           Py_ssize_t n)
 {
-    min_width = Py_MAX(0, min_width);
-    if (writer) {
-        assert(digits != NULL);
-        assert(maxchar == NULL);
+    if (kind == PyUnicode_1BYTE_KIND) {
+        memcpy((Py_UCS1 *)data + pos, str, (size_t)n);
+        return;
     }
-    else {
-        assert(digits == NULL);
-        assert(maxchar != NULL);
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyUnicode_WRITE(kind, data, pos + i, (Py_UCS4)str[i]);
     }
-    assert(0 <= d_pos);
+}
+
+/* Like CPython's _PyUnicode_InsertThousandsGrouping(), but the n_digits
+   ASCII digits are copied straight from the C string and written
+   backward into the string data, ending just before position end.
+
+   If data is NULL, nothing is written: we only compute the number of
+   characters needed and update maxchar. */
+static Py_ssize_t
+insert_thousands_grouping(int kind, void *data, Py_ssize_t end,
+                          const char *digits, Py_ssize_t n_digits,
+                          Py_ssize_t min_width, const char *grouping,
+                          PyObject *thousands_sep, Py_UCS4 *maxchar)
+{
+    min_width = Py_MAX(0, min_width);
     assert(0 <= n_digits);
     assert(grouping != NULL);
     assert(PyUnicode_Check(thousands_sep));
 
     Py_ssize_t count = 0;
+    Py_ssize_t len;
     Py_ssize_t n_zeros;
-    int loop_broken = 0;
+    Py_ssize_t n_chars;
     int use_separator = 0; /* First time through, don't append the
                               separator. They only go between
                               groups. */
-    Py_ssize_t buffer_pos;
-    Py_ssize_t digits_pos;
-    Py_ssize_t len;
-    Py_ssize_t n_chars;
     Py_ssize_t remaining = n_digits; /* Number of chars remaining to
                                         be looked at */
     /* A generator that returns all of the grouping widths, until it
@@ -506,63 +492,57 @@ _PyUnicode_InsertThousandsGrouping(_PyUnicodeWriter *writer,
     GroupGenerator groupgen;
     GroupGenerator_init(&groupgen, grouping);
     const Py_ssize_t thousands_sep_len = PyUnicode_GetLength(thousands_sep);
+    int sep_kind = PyUnicode_KIND(thousands_sep);
+    const void *sep_data = PyUnicode_DATA(thousands_sep);
 
     /* if digits are not grouped, thousands separator
        should be an empty string */
     assert(!(grouping[0] == CHAR_MAX && thousands_sep_len != 0));
 
-    digits_pos = d_pos + n_digits;
-    if (writer) {
-        buffer_pos = writer->pos + n_buffer;
-        assert(buffer_pos <= PyUnicode_GetLength(writer->buffer));
-        assert(digits_pos <= PyUnicode_GetLength(digits));
-    }
-    else {
-        buffer_pos = n_buffer;
+    if (!data && thousands_sep_len) {
+        *maxchar = Py_MAX(*maxchar, PyUnicode_MAX_CHAR_VALUE(thousands_sep));
     }
-    if (!writer) {
-        *maxchar = 127;
-    }
-    while ((len = GroupGenerator_next(&groupgen)) > 0) {
-        len = Py_MIN(len, Py_MAX(Py_MAX(remaining, min_width), 1));
+    while (1) {
+        int last = 0;
+
+        len = GroupGenerator_next(&groupgen);
+        if (len > 0) {
+            len = Py_MIN(len, Py_MAX(Py_MAX(remaining, min_width), 1));
+        }
+        else {
+            /* The generator is exhausted, the rest is a single group. */
+            len = Py_MAX(Py_MAX(remaining, min_width), 1);
+            last = 1;
+        }
         n_zeros = Py_MAX(0, len - remaining);
         n_chars = Py_MAX(0, Py_MIN(remaining, len));
-        /* Use n_zero zero's and n_chars chars
-           Count only, don't do anything. */
+        /* Use n_zero zero's and n_chars chars */
         count += (use_separator ? thousands_sep_len : 0) + n_zeros + n_chars;
-        /* Copy into the writer. */
-        InsertThousandsGrouping_fill(writer, &buffer_pos,
-                                     digits, &digits_pos,
-                                     n_chars, n_zeros,
-                                     use_separator ? thousands_sep : NULL,
-                                     thousands_sep_len, maxchar);
+        if (data) {
+            if (use_separator) {
+                end -= thousands_sep_len;
+                for (Py_ssize_t i = 0; i < thousands_sep_len; i++) {
+                    PyUnicode_WRITE(kind, data, end + i,
+                                    PyUnicode_READ(sep_kind, sep_data, i));
+                }
+            }
+            end -= n_chars;
+            copy_ascii(kind, data, end, digits + remaining - n_chars,
+                       n_chars);
+            end -= n_zeros;
+            fill_chars(kind, data, end, n_zeros, '0');
+        }
         /* Use a separator next time. */
         use_separator = 1;
         remaining -= n_chars;
         min_width -= len;
-        if (remaining <= 0 && min_width <= 0) {
-            loop_broken = 1;
+        if (last || (remaining <= 0 && min_width <= 0)) {
             break;
         }
         min_width -= thousands_sep_len;
     }
-    if (!loop_broken) {
-        /* We left the loop without using a break statement. */
-        len = Py_MAX(Py_MAX(remaining, min_width), 1);
-        n_zeros = Py_MAX(0, len - remaining);
-        n_chars = Py_MAX(0, Py_MIN(remaining, len));
-        /* Use n_zero zero's and n_chars chars */
-        count += (use_separator ? thousands_sep_len : 0) + n_zeros + n_chars;
-        /* Copy into the writer. */
-        InsertThousandsGrouping_fill(writer, &buffer_pos,
-                                     digits, &digits_pos,
-                                     n_chars, n_zeros,
-                                     use_separator ? thousands_sep : NULL,
-                                     thousands_sep_len, maxchar);
-    }
     return count;
 }
-#endif
 
 /* not all fields of format are used.  for example, precision is
    unused.  should this take discrete params in order to be more clear
@@ -646,16 +626,9 @@ calc_number_widths(NumberFieldWidths *spec, Py_ssize_t n_prefix,
            to have at least one character. */
         spec->n_grouped_digits = 0;
     else {
-        Py_UCS4 grouping_maxchar;
-        spec->n_grouped_digits = _PyUnicode_InsertThousandsGrouping(
-            NULL, 0,
-            NULL, 0, spec->n_digits,
-            spec->n_min_width,
-            locale->grouping, locale->thousands_sep, &grouping_maxchar);
-        if (spec->n_grouped_digits == -1) {
-            return -1; /* LCOV_EXCL_LINE */
-        }
-        *maxchar = Py_MAX(*maxchar, grouping_maxchar);
+        spec->n_grouped_digits = insert_thousands_grouping(
+            0, NULL, 0, NULL, spec->n_digits, spec->n_min_width,
+            locale->grouping, locale->thousands_sep, maxchar);
     }
     /* Given the desired width and the total of digit and non-digit
        space we consume, see if we need any padding. format->width can
@@ -697,59 +670,44 @@ calc_number_widths(NumberFieldWidths *spec, Py_ssize_t n_prefix,
             + spec->n_rpadding);
 }
 
-/* Fill in the digit parts of a number's string representation,
-   as determined in calc_number_widths().
-   Return -1 on error, or 0 on success. */
-static int
-fill_number(PyUnicodeWriter *writer, const NumberFieldWidths *spec,
-            PyObject *digits, Py_ssize_t d_start, PyObject *prefix,
-            Py_ssize_t p_start, Py_UCS4 fill_char, LocaleInfo *locale)
+/* Fill in the parts of a number's string representation, as
+   determined in calc_number_widths(), directly into the new string
+   out.  Digits and prefix are ASCII C strings, remainder is the only
+   character of the remainder part (for 'c' formatting). */
+static void
+fill_number(PyObject *out, const NumberFieldWidths *spec,
+            const char *digits, const char *prefix, Py_UCS4 remainder,
+            Py_UCS4 fill_char, const LocaleInfo *locale)
 {
-    /* Used to keep track of digits, decimal, and remainder. */
-    Py_ssize_t d_pos = d_start;
-    Py_ssize_t r;
-    _PyUnicodeWriter *_writer = (_PyUnicodeWriter *)writer;
-
-    if (spec->n_lpadding) {
-        for (Py_ssize_t i = 0; i < spec->n_lpadding; i++) {
-            PyUnicodeWriter_WriteChar(writer, fill_char);
-        }
-    }
+    int kind = PyUnicode_KIND(out);
+    void *data = PyUnicode_DATA(out);
+    Py_ssize_t pos = 0;
+
+    fill_chars(kind, data, pos, spec->n_lpadding, fill_char);
+    pos += spec->n_lpadding;
     if (spec->n_sign == 1) {
-        PyUnicodeWriter_WriteChar(writer, (Py_UCS4)spec->sign);
-    }
-    if (spec->n_prefix) {
-        PyUnicodeWriter_WriteSubstring(writer, prefix, p_start, spec->n_prefix + p_start);
-    }
-    if (spec->n_spadding) {
-        for (Py_ssize_t i = 0; i < spec->n_spadding; i++) {
-            PyUnicodeWriter_WriteChar(writer, fill_char);
-        }
+        PyUnicode_WRITE(kind, data, pos, (Py_UCS4)spec->sign);
+        pos++;
     }
+    copy_ascii(kind, data, pos, prefix, spec->n_prefix);
+    pos += spec->n_prefix;
+    fill_chars(kind, data, pos, spec->n_spadding, fill_char);
+    pos += spec->n_spadding;
     /* Only for type 'c' special case, it has no digits. */
     if (spec->n_digits != 0) {
-        /* Fill the digits with InsertThousandsGrouping. */
-        r = _PyUnicode_InsertThousandsGrouping(_writer, spec->n_grouped_digits,
-                                               digits, d_pos, spec->n_digits,
-                                               spec->n_min_width,
-                                               locale->grouping,
-                                               locale->thousands_sep, NULL);
-        if (r == -1) {
-            return -1; /* LCOV_EXCL_LINE */
-        }
-        assert(r == spec->n_grouped_digits);
-        d_pos += spec->n_digits;
+        pos += spec->n_grouped_digits;
+        (void)insert_thousands_grouping(kind, data, pos, digits,
+                                        spec->n_digits, spec->n_min_width,
+                                        locale->grouping,
+                                        locale->thousands_sep, NULL);
     }
-    ((_PyUnicodeWriter *)writer)->pos += spec->n_grouped_digits;
     if (spec->n_remainder) {
-        PyUnicodeWriter_WriteSubstring(writer, digits, d_pos, spec->n_remainder + d_pos);
-    }
-    if (spec->n_rpadding) {
-        for (Py_ssize_t i = 0; i < spec->n_rpadding; i++) {
-            PyUnicodeWriter_WriteChar(writer, fill_char);
-        }
+        assert(spec->n_remainder == 1);
+        PyUnicode_WRITE(kind, data, pos, remainder);
+        pos++;
     }
-    return 0;
+    fill_chars(kind, data, pos, spec->n_rpadding, fill_char);
+    assert(pos + spec->n_rpadding == PyUnicode_GET_LENGTH(out));
 }
 
 #if PY_VERSION_HEX > 0x030D00A0
@@ -845,38 +803,153 @@ done:
 #undef GET_LOCALE_STRING
 }
 
-static const char no_grouping[1] = {CHAR_MAX};
+/* Decoded numeric info of the current locale.  It's cached per thread
+   and is invalidated, when the LC_NUMERIC or LC_CTYPE locale (the
+   latter affects decoding of strings) is changed by setlocale(). */
+#define LOCALE_SEP_MAX 8
+
+typedef struct {
+    char *numeric_name;
+    char *ctype_name;
+    Py_UCS4 decimal_point[LOCALE_SEP_MAX];
+    Py_ssize_t decimal_point_len;
+    Py_UCS4 thousands_sep[LOCALE_SEP_MAX];
+    Py_ssize_t thousands_sep_len;
+    char *grouping;
+} LocaleCache;
+
+static _Thread_local LocaleCache locale_cache;
+
+void
+free_locale_cache(void)
+{
+    PyMem_Free(locale_cache.numeric_name);
+    PyMem_Free(locale_cache.ctype_name);
+    PyMem_Free(locale_cache.grouping);
+    memset(&locale_cache, 0, sizeof(LocaleCache));
+}
+
+static char *
+strdup_or_empty(const char *str)
+{
+    return _PyMem_Strdup(str ? str : "");
+}
 
-/* Find the decimal point character(s?), thousands_separator(s?), and
-   grouping description, either for the current locale if type is
-   LT_CURRENT_LOCALE, a hard-coded locale if LT_DEFAULT_LOCALE or
-   LT_UNDERSCORE_LOCALE/LT_UNDER_FOUR_LOCALE, or none if LT_NO_LOCALE. */
 static int
-get_locale_info(enum LocaleType type, enum LocaleType frac_type,
-                LocaleInfo *locale_info)
+is_cached_name(const char *cached, const char *name)
 {
-    switch (type) {
-    case LT_CURRENT_LOCALE: {
+    return cached && !strcmp(cached, name ? name : "");
+}
+
+/* Copy the decoded locale string to the cache buffer, return 0 if it
+   doesn't fit. */
+static int
+cache_locale_string(PyObject *str, Py_UCS4 *buf, Py_ssize_t *len)
+{
+    *len = PyUnicode_GetLength(str);
+    if (*len > LOCALE_SEP_MAX) {
+        return 0; /* LCOV_EXCL_LINE */
+    }
+    for (Py_ssize_t i = 0; i < *len; i++) {
+        buf[i] = PyUnicode_READ_CHAR(str, i);
+    }
+    return 1;
+}
+
+/* Fill locale_info for the LT_CURRENT_LOCALE, using the cached values,
+   if locale wasn't changed.  Return -1 on error. */
+static int
+get_current_locale_info(LocaleInfo *locale_info)
+{
+    LocaleCache *cache = &locale_cache;
+
+    if (!is_cached_name(cache->numeric_name, setlocale(LC_NUMERIC, NULL))
+        || !is_cached_name(cache->ctype_name, setlocale(LC_CTYPE, NULL)))
+    {
+        free_locale_cache();
+        /* Copy names first, _Py_GetLocaleconvNumeric() might
+           temporarily change the LC_CTYPE locale. */
+        cache->numeric_name = strdup_or_empty(setlocale(LC_NUMERIC, NULL));
+        cache->ctype_name = strdup_or_empty(setlocale(LC_CTYPE, NULL));
+        if (!cache->numeric_name || !cache->ctype_name) {
+            /* LCOV_EXCL_START */
+            free_locale_cache();
+            PyErr_NoMemory();
+            return -1;
+            /* LCOV_EXCL_STOP */
+        }
+
         struct lconv *lc = localeconv();
+
         if (_Py_GetLocaleconvNumeric(lc,
                                      &locale_info->decimal_point,
                                      &locale_info->thousands_sep) < 0)
         {
-            return -1; /* LCOV_EXCL_LINE */
+            /* LCOV_EXCL_START */
+            free_locale_cache();
+            return -1;
+            /* LCOV_EXCL_STOP */
         }
         /* localeconv() grouping can become a dangling pointer or point
-           to a different string if another thread calls localeconv() during
-           the string formatting. Copy the string to avoid this risk. */
-        locale_info->grouping_buffer = _PyMem_Strdup(lc->grouping);
-        if (locale_info->grouping_buffer == NULL) {
+           to a different string if another thread calls localeconv()
+           during the string formatting.  Copy the string to avoid this
+           risk. */
+        cache->grouping = _PyMem_Strdup(lc->grouping);
+        if (!cache->grouping) {
             /* LCOV_EXCL_START */
+            free_locale_cache();
             PyErr_NoMemory();
             return -1;
             /* LCOV_EXCL_STOP */
         }
-        locale_info->grouping = locale_info->grouping_buffer;
-        break;
+        if (!cache_locale_string(locale_info->decimal_point,
+                                 cache->decimal_point,
+                                 &cache->decimal_point_len)
+            || !cache_locale_string(locale_info->thousands_sep,
+                                    cache->thousands_sep,
+                                    &cache->thousands_sep_len))
+        {
+            /* LCOV_EXCL_START */
+            /* Too long to be cached, use decoded strings. */
+            locale_info->grouping_buffer = cache->grouping;
+            locale_info->grouping = cache->grouping;
+            cache->grouping = NULL;
+            free_locale_cache();
+            return 0;
+            /* LCOV_EXCL_STOP */
+        }
+        locale_info->grouping = cache->grouping;
+        return 0;
+    }
+    locale_info->decimal_point = PyUnicode_FromKindAndData(
+        PyUnicode_4BYTE_KIND, cache->decimal_point,
+        cache->decimal_point_len);
+    locale_info->thousands_sep = PyUnicode_FromKindAndData(
+        PyUnicode_4BYTE_KIND, cache->thousands_sep,
+        cache->thousands_sep_len);
+    if (!locale_info->decimal_point || !locale_info->thousands_sep) {
+        return -1; /* LCOV_EXCL_LINE */
     }
+    locale_info->grouping = cache->grouping;
+    return 0;
+}
+
+static const char no_grouping[1] = {CHAR_MAX};
+
+/* Find the decimal point character(s?), thousands_separator(s?), and
+   grouping description, either for the current locale if type is
+   LT_CURRENT_LOCALE, a hard-coded locale if LT_DEFAULT_LOCALE or
+   LT_UNDERSCORE_LOCALE/LT_UNDER_FOUR_LOCALE, or none if LT_NO_LOCALE. */
+static int
+get_locale_info(enum LocaleType type, enum LocaleType frac_type,
+                LocaleInfo *locale_info)
+{
+    switch (type) {
+    case LT_CURRENT_LOCALE:
+        if (get_current_locale_info(locale_info) < 0) {
+            return -1; /* LCOV_EXCL_LINE */
+        }
+        break;
     case LT_DEFAULT_LOCALE:
     case LT_UNDERSCORE_LOCALE:
     case LT_UNDER_FOUR_LOCALE:
@@ -919,56 +992,71 @@ free_locale_info(LocaleInfo *locale_info)
 extern PyObject * MPZ_to_str(MPZ_Object *u, int base, int options);
 extern int OPT_PREFIX;
 
-static PyObject *
-format_long_internal(MPZ_Object *value, const InternalFormatSpec *format)
+/* Check flags of the integer presentation type.  Return -1 with an
+   exception set, if they aren't allowed. */
+static int
+check_long_format(const InternalFormatSpec *format)
 {
-    Py_UCS4 maxchar = 127;
-    PyObject *tmp = NULL;
-    Py_ssize_t inumeric_chars;
-    Py_UCS4 sign_char = '\0';
-    Py_ssize_t n_digits;       /* count of digits need from the computed
-                                  string */
-    Py_ssize_t n_remainder = 0; /* Used only for 'c' formatting, which
-                                   produces non-digits */
-    Py_ssize_t n_prefix = 0;   /* Count of prefix chars, (e.g., '0x') */
-    Py_ssize_t n_total;
-    Py_ssize_t prefix = 0;
-    NumberFieldWidths spec;
-    int32_t x = -1;
-
-    /* Locale settings, either from the actual locale or
-       from a hard-code pseudo-locale */
-    LocaleInfo locale = LocaleInfo_STATIC_INIT;
-
     /* no precision allowed on integers */
     if (format->precision != -1) {
         PyErr_SetString(PyExc_ValueError,
                         "Precision not allowed in integer format specifier");
-        goto done;
+        return -1;
     }
     /* no negative zero coercion on integers */
     if (format->no_neg_0) {
         PyErr_SetString(PyExc_ValueError,
                         "Negative zero coercion (z) not allowed in integer"
                         " format specifier");
-        goto done;
+        return -1;
     }
-    /* special case for character formatting */
     if (format->type == 'c') {
         /* error to specify a sign */
         if (format->sign != '\0') {
             PyErr_SetString(PyExc_ValueError,
                             "Sign not allowed with integer"
                             " format specifier 'c'");
-            goto done;
+            return -1;
         }
         /* error to request alternate format */
         if (format->alternate) {
             PyErr_SetString(PyExc_ValueError,
                             "Alternate form (#) not allowed with integer"
                             " format specifier 'c'");
-            goto done;
+            return -1;
         }
+    }
+    return 0;
+}
+
+static PyObject *
+format_long_internal(MPZ_Object *value, const InternalFormatSpec *format)
+{
+    Py_UCS4 maxchar = 127;
+    PyObject *res = NULL;
+    char *buf = NULL;          /* the digits, as computed by zz_get_str() */
+    const char *digits = "";
+    const char *prefix = "";
+    Py_UCS4 remainder = 0;     /* Used only for 'c' formatting */
+    Py_UCS4 sign_char = '\0';
+    Py_ssize_t n_digits;       /* count of digits need from the computed
+                                  string */
+    Py_ssize_t n_remainder = 0; /* Used only for 'c' formatting, which
+                                   produces non-digits */
+    Py_ssize_t n_prefix = 0;   /* Count of prefix chars, (e.g., '0x') */
+    Py_ssize_t n_total;
+    NumberFieldWidths spec;
+    int32_t x = -1;
+
+    /* Locale settings, either from the actual locale or
+       from a hard-code pseudo-locale */
+    LocaleInfo locale = LocaleInfo_STATIC_INIT;
+
+    if (check_long_format(format)) {
+        goto done;
+    }
+    /* special case for character formatting */
+    if (format->type == 'c') {
         /* taken from unicodeobject.c formatchar() */
         /* Integer input truncated to a character */
         if (zz_get(&value->z, &x) || x < 0 || x > 0x10ffff) {
@@ -976,10 +1064,9 @@ format_long_internal(MPZ_Object *value, const InternalFormatSpec *format)
                             "%c arg not in range(0x110000)");
             goto done;
         }
-        tmp = PyUnicode_FromOrdinal((int)x);
-        inumeric_chars = 0;
-        n_digits = 1;
-        maxchar = Py_MAX(maxchar, (Py_UCS4)x);
+        remainder = (Py_UCS4)x;
+        n_digits = 0;
+        maxchar = Py_MAX(maxchar, remainder);
         /* As a sort-of hack, we tell calc_number_widths that we only
            have "remainder" characters. calc_number_widths thinks
            these are characters that don't get formatted, only copied
@@ -989,28 +1076,24 @@ format_long_internal(MPZ_Object *value, const InternalFormatSpec *format)
     }
     else {
         int base;
-        int leading_chars_to_skip = 0;  /* Number of characters added by
-                                           PyNumber_ToBase that we want to
-                                           skip over. */
 
-        /* Compute the base and how many characters will be added by
-           PyNumber_ToBase */
+        /* Compute the base and the prefix for the alternate form */
         switch (format->type) {
         case 'b':
             base = 2;
-            leading_chars_to_skip = 2; /* 0b */
+            prefix = "0b";
             break;
         case 'o':
             base = 8;
-            leading_chars_to_skip = 2; /* 0o */
+            prefix = "0o";
             break;
         case 'x':
             base = 16;
-            leading_chars_to_skip = 2; /* 0x */
+            prefix = "0x";
             break;
         case 'X':
             base = -16;
-            leading_chars_to_skip = 2; /* 0x */
+            prefix = "0X";
             break;
         default:  /* shouldn't be needed, but stops a compiler warning */
         case 'd':
@@ -1026,31 +1109,32 @@ format_long_internal(MPZ_Object *value, const InternalFormatSpec *format)
             /* Fast path */
             return MPZ_to_str(value, base, format->alternate ? OPT_PREFIX : 0);
         }
-        /* Do the hard part, converting to a string in a given base */
-        tmp = MPZ_to_str(value, base, OPT_PREFIX);
-        assert(PyUnicode_Check(tmp));
-        if (tmp == NULL) {
+        /* Do the hard part, converting to a string in a given base.
+           The digits are kept as a C string, they are copied only
+           once: into the result. */
+        size_t len;
+
+        if (zz_sizeinbase(&value->z, base, &len)) {
             goto done; /* LCOV_EXCL_LINE */
         }
-        /* The number of prefix chars is the same as the leading
-           chars to skip */
-        if (format->alternate) {
-            n_prefix = leading_chars_to_skip;
+        buf = malloc(len + 2);
+        if (!buf || zz_get_str(&value->z, base, buf)) {
+            /* LCOV_EXCL_START */
+            PyErr_NoMemory();
+            goto done;
+            /* LCOV_EXCL_STOP */
         }
-        inumeric_chars = 0;
-        n_digits = PyUnicode_GetLength(tmp);
-        prefix = inumeric_chars;
+        digits = buf;
         /* Is a sign character present in the output?  If so, remember it
            and skip it */
-        if (PyUnicode_ReadChar(tmp, inumeric_chars) == '-') {
+        if (digits[0] == '-') {
             sign_char = '-';
-            ++prefix;
-            ++leading_chars_to_skip;
+            digits++;
+        }
+        n_digits = (Py_ssize_t)strlen(digits);
+        if (format->alternate) {
+            n_prefix = (Py_ssize_t)strlen(prefix);
         }
-
-        /* Skip over the leading chars (0x, 0b, etc.) */
-        n_digits -= leading_chars_to_skip;
-        inumeric_chars += leading_chars_to_skip;
     }
     /* Determine the grouping, separator, and decimal point, if any. */
     if (get_locale_info(format->type == 'n' ? LT_CURRENT_LOCALE :
@@ -1060,62 +1144,94 @@ format_long_internal(MPZ_Object *value, const InternalFormatSpec *format)
         goto done; /* LCOV_EXCL_LINE */
     }
     /* Calculate how much memory we'll need. */
-    n_total = calc_number_widths(&spec, n_prefix, sign_char, inumeric_chars,
-                                 inumeric_chars + n_digits, n_remainder, 0, 0,
+    n_total = calc_number_widths(&spec, n_prefix, sign_char, 0,
+                                 n_digits + n_remainder, n_remainder, 0, 0,
                                  &locale, format, &maxchar);
     if (n_total == -1) {
         goto done; /* LCOV_EXCL_LINE */
     }
     /* Allocate the memory. */
-
-    PyUnicodeWriter *writer = PyUnicodeWriter_Create(n_total);
-
-    if (!writer || PyUnicodeWriter_WriteChar(writer, maxchar)) {
+    res = PyUnicode_New(n_total, maxchar);
+    if (!res) {
         goto done; /* LCOV_EXCL_LINE */
     }
-    ((_PyUnicodeWriter *)writer)->pos = 0;
     /* Populate the memory. */
-    if (fill_number(writer, &spec, tmp, inumeric_chars, tmp, prefix,
-                    format->fill_char, &locale))
-    {
-        /* LCOV_EXCL_START */
-        PyUnicodeWriter_Discard(writer);
-        goto done;
-        /* LCOV_EXCL_STOP */
-    }
-    return PyUnicodeWriter_Finish(writer);
+    fill_number(res, &spec, digits, prefix, remainder, format->fill_char,
+                &locale);
 done:
-    Py_XDECREF(tmp);
+    free(buf);
     free_locale_info(&locale);
-    return NULL;
+    return res;
 }
 
 extern PyObject * to_float(PyObject *self);
 
-PyObject *
-__format__(PyObject *self, PyObject *format_spec)
-{
-    if (!PyUnicode_Check(format_spec)) {
-        PyErr_Format(PyExc_TypeError,
-                     "__format__() argument must be str, not %U",
-                     PyType_GetFullyQualifiedName(Py_TYPE(format_spec)));
-        return NULL;
-    }
+/* Per-thread LRU cache of parsed format specifications.  Only short
+   specifications of 1-byte kind are cached. */
+#define FORMAT_CACHE_SIZE 8
+#define FORMAT_CACHE_SPEC_MAX 24
 
-    Py_ssize_t end = PyUnicode_GetLength(format_spec);
+typedef struct {
+    Py_ssize_t len; /* zero for unused entry */
+    Py_UCS1 spec[FORMAT_CACHE_SPEC_MAX];
+    InternalFormatSpec format;
+} FormatCacheEntry;
 
-    if (!end) {
-       return PyObject_Str(self);
+static _Thread_local FormatCacheEntry format_cache[FORMAT_CACHE_SIZE];
+
+/* Parse the nonempty format_spec of given length, return 1 on success
+   and 0 (with an exception set) on failure. */
+static int
+get_format_spec(PyTypeObject *type, PyObject *format_spec, Py_ssize_t end,
+                InternalFormatSpec *format)
+{
+    if (PyUnicode_KIND(format_spec) != PyUnicode_1BYTE_KIND
+        || end > FORMAT_CACHE_SPEC_MAX)
+    {
+        return parse_internal_render_format_spec(type, format_spec, 0, end,
+                                                 format, 'd', '>');
     }
 
-    InternalFormatSpec format;
+    const Py_UCS1 *data = PyUnicode_1BYTE_DATA(format_spec);
+    FormatCacheEntry entry;
+    size_t i = 0;
 
-    if (!parse_internal_render_format_spec(self, format_spec, 0, end,
-                                           &format, 'd', '>'))
+    for (; i < FORMAT_CACHE_SIZE - 1 && format_cache[i].len; i++) {
+        if (format_cache[i].len == end
+            && !memcmp(format_cache[i].spec, data, (size_t)end))
+        {
+            break;
+        }
+    }
+    if (format_cache[i].len == end
+        && !memcmp(format_cache[i].spec, data, (size_t)end))
     {
-        return NULL; /* LCOV_EXCL_LINE */
+        entry = format_cache[i];
     }
-    switch (format.type) {
+    else {
+        if (!parse_internal_render_format_spec(type, format_spec, 0, end,
+                                               format, 'd', '>'))
+        {
+            return 0;
+        }
+        entry.len = end;
+        memcpy(entry.spec, data, (size_t)end);
+        entry.format = *format;
+    }
+    /* Move the entry to front, the last one is dropped on miss. */
+    memmove(&format_cache[1], &format_cache[0],
+            i*sizeof(FormatCacheEntry));
+    format_cache[0] = entry;
+    *format = entry.format;
+    return 1;
+}
+
+/* Format self according to the parsed format_spec. */
+static PyObject *
+format_with_spec(PyObject *self, PyObject *format_spec,
+                 const InternalFormatSpec *format)
+{
+    switch (format->type) {
     case 'b':
     case 'c':
     case 'd':
@@ -1123,7 +1239,7 @@ __format__(PyObject *self, PyObject *format_spec)
     case 'x':
     case 'X':
     case 'n':
-        return format_long_internal((MPZ_Object *)self, &format);
+        return format_long_internal((MPZ_Object *)self, format);
     case 'e':
     case 'E':
     case 'f':
@@ -1145,11 +1261,51 @@ __format__(PyObject *self, PyObject *format_spec)
         return res;
     }
     default:
-        unknown_presentation_type(format.type, PyType_GetFullyQualifiedName(Py_TYPE(self)));
+    {
+        PyObject *name = PyType_GetFullyQualifiedName(Py_TYPE(self));
+
+        if (name) {
+            unknown_presentation_type(format->type, name);
+            Py_DECREF(name);
+        }
         return NULL;
     }
+    }
+}
+
+PyObject *
+__format__(PyObject *self, PyObject *format_spec)
+{
+    if (!PyUnicode_Check(format_spec)) {
+        PyObject *name = PyType_GetFullyQualifiedName(Py_TYPE(format_spec));
+
+        if (name) {
+            PyErr_Format(PyExc_TypeError,
+                         "__format__() argument must be str, not %U", name);
+            Py_DECREF(name);
+        }
+        return NULL;
+    }
+
+    Py_ssize_t end = PyUnicode_GetLength(format_spec);
+
+    if (!end) {
+       return PyObject_Str(self);
+    }
+
+    InternalFormatSpec format;
+
+    if (!get_format_spec(Py_TYPE(self), format_spec, end, &format)) {
+        return NULL;
+    }
+    return format_with_spec(self, format_spec, &format);
 }
 #else
+void
+free_locale_cache(void)
+{
+}
+
 extern PyObject * to_int(PyObject *self);
 
 PyObject *
@@ -1168,3 +1324,159 @@ __format__(PyObject *self, PyObject *format_spec)
     return res;
 }
 #endif /* !defined(PYPY_VERSION) && !defined(GRAALVM_PYTHON) */
+
+/* Compiled format specification, see gmp.compile_format(). */
+typedef struct {
+    PyObject_HEAD
+    PyObject *spec;
+#if !defined(PYPY_VERSION) && !defined(GRAALVM_PYTHON)
+    InternalFormatSpec format;
+    vectorcallfunc vectorcall;
+#endif
+} CompiledFormat_Object;
+
+static void
+CompiledFormat_dealloc(PyObject *self)
+{
+    Py_DECREF(((CompiledFormat_Object *)self)->spec);
+    PyObject_Free(self);
+}
+
+static PyObject *
+CompiledFormat_repr(PyObject *self)
+{
+    return PyUnicode_FromFormat("gmp.compile_format(%R)",
+                                ((CompiledFormat_Object *)self)->spec);
+}
+
+static PyObject *
+CompiledFormat_format(CompiledFormat_Object *self, PyObject *arg)
+{
+#if !defined(PYPY_VERSION) && !defined(GRAALVM_PYTHON)
+    if (MPZ_Check(arg)) {
+        if (!PyUnicode_GET_LENGTH(self->spec)) {
+            return PyObject_Str(arg);
+        }
+        return format_with_spec(arg, self->spec, &self->format);
+    }
+#endif
+    return PyObject_Format(arg, self->spec);
+}
+
+static PyObject *
+CompiledFormat_call(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    if ((kwds && PyDict_GET_SIZE(kwds)) || PyTuple_GET_SIZE(args) != 1) {
+        PyErr_SetString(PyExc_TypeError,
+                        "compiled format takes exactly one argument");
+        return NULL;
+    }
+    return CompiledFormat_format((CompiledFormat_Object *)self,
+                                 PyTuple_GET_ITEM(args, 0));
+}
+
+#if !defined(PYPY_VERSION) && !defined(GRAALVM_PYTHON)
+static PyObject *
+CompiledFormat_vectorcall(PyObject *self, PyObject *const *args,
+                          size_t nargsf, PyObject *kwnames)
+{
+    if ((kwnames && PyTuple_GET_SIZE(kwnames))
+        || PyVectorcall_NARGS(nargsf) != 1)
+    {
+        PyErr_SetString(PyExc_TypeError,
+                        "compiled format takes exactly one argument");
+        return NULL;
+    }
+    return CompiledFormat_format((CompiledFormat_Object *)self, args[0]);
+}
+
+#  if !defined(Py_TPFLAGS_HAVE_VECTORCALL)
+#    define Py_TPFLAGS_HAVE_VECTORCALL _Py_TPFLAGS_HAVE_VECTORCALL
+#  endif
+#endif
+
+PyTypeObject CompiledFormat_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gmp._compiled_format",
+    .tp_basicsize = sizeof(CompiledFormat_Object),
+    .tp_dealloc = CompiledFormat_dealloc,
+    .tp_repr = CompiledFormat_repr,
+    .tp_call = CompiledFormat_call,
+#if !defined(PYPY_VERSION) && !defined(GRAALVM_PYTHON)
+    .tp_vectorcall_offset = offsetof(CompiledFormat_Object, vectorcall),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_VECTORCALL,
+#else
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+#endif
+};
+
+PyObject *
+compile_format(PyObject *Py_UNUSED(module), PyObject *spec)
+{
+    if (!PyUnicode_Check(spec)) {
+        PyObject *name = PyType_GetFullyQualifiedName(Py_TYPE(spec));
+
+        if (name) {
+            PyErr_Format(PyExc_TypeError,
+                         "compile_format() argument must be str, not %U",
+                         name);
+            Py_DECREF(name);
+        }
+        return NULL;
+    }
+
+    CompiledFormat_Object *res = PyObject_New(CompiledFormat_Object,
+                                              &CompiledFormat_Type);
+
+    if (!res) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    res->spec = Py_NewRef(spec);
+#if !defined(PYPY_VERSION) && !defined(GRAALVM_PYTHON)
+    res->vectorcall = CompiledFormat_vectorcall;
+
+    Py_ssize_t end = PyUnicode_GET_LENGTH(spec);
+
+    if (end) {
+        if (!parse_internal_render_format_spec(&MPZ_Type, spec, 0, end,
+                                               &res->format, 'd', '>'))
+        {
+            Py_DECREF(res);
+            return NULL;
+        }
+        switch (res->format.type) {
+        case 'b': case 'c': case 'd': case 'o': case 'x': case 'X':
+        case 'n':
+            if (check_long_format(&res->format)) {
+                Py_DECREF(res);
+                return NULL;
+            }
+            break;
+        case 'e': case 'E': case 'f': case 'F': case 'g':
+        case 'G': case '%':
+            break;
+        default:
+        {
+            PyObject *name = PyType_GetFullyQualifiedName(&MPZ_Type);
+
+            if (name) {
+                unknown_presentation_type(res->format.type, name);
+                Py_DECREF(name);
+            }
+            Py_DECREF(res);
+            return NULL;
+        }
+        }
+    }
+#else
+    /* Validate the spec. */
+    PyObject *tmp = PyObject_Format(Py_GetConstant(Py_CONSTANT_ZERO), spec);
+
+    if (!tmp) {
+        Py_DECREF(res);
+        return NULL;
+    }
+    Py_DECREF(tmp);
+#endif
+    return (PyObject *)res;
+}
@@ -1,6 +1,7 @@
 #include "mpz.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <float.h>
 #include <setjmp.h>
 #include <stdbool.h>
@@ -13,14 +14,30 @@
 #  define MAX_CACHE_SIZE 0
 #endif
 #define MAX_CACHED_SIZEOF 256
+#define MAX_FACTORIAL_CACHE 1000
+
+typedef enum {
+    ZZ_RNDD = 0,
+    ZZ_RNDN = 1,
+    ZZ_RNDU = 2,
+    ZZ_RNDZ = 3,
+    ZZ_RNDA = 4,
+} zz_rnd;
 
 typedef struct {
     MPZ_Object *gmp_cache[MAX_CACHE_SIZE + 1];
     size_t gmp_cache_size;
+    zz_t *fac_cache; /* fac_cache[n] = n! for n < fac_cache_len */
+    size_t fac_cache_len;
+    size_t fac_cache_size; /* cache factorials for n < fac_cache_size */
+    zz_bitcnt_t mpf_prec; /* context of mpf arithmetic */
+    zz_rnd mpf_rnd;
 } gmp_global;
 
 _Thread_local gmp_global global = {
     .gmp_cache_size = 0,
+    .mpf_prec = 53,
+    .mpf_rnd = ZZ_RNDN,
 };
 
 uint8_t bits_per_digit;
@@ -740,6 +757,41 @@ to_float(PyObject *self)
     return PyFloat_FromDouble(d);
 }
 
+static zz_rnd
+get_round_mode(PyObject *rndstr)
+{
+    if (!PyUnicode_Check(rndstr)) {
+invalid:
+        PyErr_SetString(PyExc_ValueError, "invalid rounding mode specified");
+        return (zz_rnd)-1;
+    }
+
+    Py_UCS4 rndchr = PyUnicode_ReadChar(rndstr, 0);
+    zz_rnd rnd = ZZ_RNDN;
+
+    assert(rndchr != -1);
+    switch (rndchr) {
+        case (Py_UCS4)'f':
+            rnd = ZZ_RNDD;
+            break;
+        case (Py_UCS4)'c':
+            rnd = ZZ_RNDU;
+            break;
+        case (Py_UCS4)'d':
+            rnd = ZZ_RNDZ;
+            break;
+        case (Py_UCS4)'u':
+            rnd = ZZ_RNDA;
+            break;
+        case (Py_UCS4)'n':
+            rnd = ZZ_RNDN;
+            break;
+        default:
+            goto invalid;
+    }
+    return rnd;
+}
+
 static inline int64_t
 PyLong_AsSdigit_t(PyObject *obj, int *error)
 {
@@ -755,6 +807,71 @@ PyLong_AsSdigit_t(PyObject *obj, int *error)
     return (int64_t)value;
 }
 
+/* Return up to 64 bits of |u|, starting from the bit start. */
+static uint64_t
+zz_extract_u64(const zz_t *u, zz_bitcnt_t start)
+{
+    zz_size_t k = (zz_size_t)(start/bits_per_digit);
+    unsigned int off = (unsigned int)(start % bits_per_digit), got = 0;
+    uint64_t res = 0;
+
+    for (; got < 64 && k < u->size; k++) {
+        res |= (uint64_t)(u->digits[k] >> off) << got;
+        got += bits_per_digit - off;
+        off = 0;
+    }
+    return res;
+}
+
+/* Compare u with a finite double v exactly, without conversions. */
+static zz_ord
+zz_cmp_dbl(const zz_t *u, double v)
+{
+    zz_ord sign_u = zz_isneg(u) ? ZZ_LT : (zz_iszero(u) ? ZZ_EQ : ZZ_GT);
+    zz_ord sign_v = v < 0 ? ZZ_LT : (v == 0 ? ZZ_EQ : ZZ_GT);
+
+    assert(isfinite(v));
+    if (sign_u != sign_v || sign_u == ZZ_EQ) {
+        return sign_u > sign_v ? ZZ_GT : (sign_u < sign_v ? ZZ_LT : ZZ_EQ);
+    }
+
+    /* Compare magnitudes: 2**(n - 1) <= |u| < 2**n and
+       2**(e - 1) <= |v| < 2**e. */
+    zz_bitcnt_t n = zz_bitlen(u);
+    int e;
+    zz_ord r;
+
+    v = fabs(v);
+    (void)frexp(v, &e);
+    if (e <= 0 || n > (zz_bitcnt_t)e) {
+        r = ZZ_GT;
+    }
+    else if (n < (zz_bitcnt_t)e) {
+        r = ZZ_LT;
+    }
+    else if (e <= 64) {
+        /* Both |u| and floor(|v|) fit in uint64_t. */
+        uint64_t a = zz_extract_u64(u, 0);
+        double f = floor(v);
+        uint64_t b = (uint64_t)f;
+
+        r = a < b ? ZZ_LT : (a > b ? ZZ_GT : (v > f ? ZZ_LT : ZZ_EQ));
+    }
+    else {
+        /* Now |v| = m*2**(e - DBL_MANT_DIG) for an integer m. */
+        zz_bitcnt_t shift = (zz_bitcnt_t)(e - DBL_MANT_DIG);
+        uint64_t a = zz_extract_u64(u, shift);
+        uint64_t b = (uint64_t)ldexp(v, -(int)shift);
+
+        r = a < b ? ZZ_LT : (a > b ? ZZ_GT
+                             : (zz_lsbpos(u) < shift ? ZZ_GT : ZZ_EQ));
+    }
+    if (sign_u == ZZ_LT) {
+        r = -r;
+    }
+    return r;
+}
+
 static PyObject *
 richcompare(PyObject *self, PyObject *other, int op)
 {
@@ -781,6 +898,14 @@ richcompare(PyObject *self, PyObject *other, int op)
             Py_DECREF(v);
         }
     }
+    else if (PyFloat_Check(other)) {
+        double v = PyFloat_AS_DOUBLE(other);
+
+        if (isnan(v)) {
+            return PyBool_FromLong(op == Py_NE);
+        }
+        r = isinf(v) ? (v > 0 ? ZZ_LT : ZZ_GT) : zz_cmp_dbl(&u->z, v);
+    }
     else if (Number_Check(other)) {
         goto numbers;
     }
@@ -908,7 +1033,56 @@ to_bool(PyObject *self)
         goto fallback;                  \
     }
 
-#define BINOP(suff, slot)                                       \
+/* Arithmetic with float's is done in double's, like for int's: the
+   integer operand is converted to double, without creating a Python
+   float object.  Subclasses of float go through the generic path, as
+   they may override reflected methods. */
+static int
+as_double(PyObject *obj, double *d)
+{
+    if (PyFloat_CheckExact(obj)) {
+        *d = PyFloat_AS_DOUBLE(obj);
+        return 0;
+    }
+    if (zz_get(&((MPZ_Object *)obj)->z, d) == ZZ_BUF) {
+        PyErr_SetString(PyExc_OverflowError,
+                        "integer too large to convert to float");
+        return -1;
+    }
+    return 0;
+}
+
+static double
+dbl_add(double a, double b)
+{
+    return a + b;
+}
+
+static double
+dbl_sub(double a, double b)
+{
+    return a - b;
+}
+
+static double
+dbl_mul(double a, double b)
+{
+    return a*b;
+}
+
+static PyObject *
+float_binop(PyObject *self, PyObject *other,
+            double (*func)(double, double))
+{
+    double a, b;
+
+    if (as_double(self, &a) || as_double(other, &b)) {
+        return NULL;
+    }
+    return PyFloat_FromDouble(func(a, b));
+}
+
+#define BINOP(suff, slot, fslot)                                \
     static PyObject *                                           \
     nb_##suff(PyObject *self, PyObject *other)                  \
     {                                                           \
@@ -978,6 +1152,14 @@ done:                                                           \
         Py_XDECREF((PyObject *)u);                              \
         Py_XDECREF((PyObject *)v);                              \
                                                                 \
+        double (*fop)(double, double) = fslot;                  \
+                                                                \
+        if (fop && (PyFloat_CheckExact(self)                    \
+                    || PyFloat_CheckExact(other)))              \
+        {                                                       \
+            return float_binop(self, other, fop);               \
+        }                                                       \
+                                                                \
         PyObject *uf, *vf, *rf;                                 \
                                                                 \
         if (Number_Check(self)) {                               \
@@ -1005,16 +1187,16 @@ done:                                                           \
         return rf;                                              \
     }
 
-BINOP(add, PyNumber_Add)
-BINOP(sub, PyNumber_Subtract)
-BINOP(mul, PyNumber_Multiply)
+BINOP(add, PyNumber_Add, dbl_add)
+BINOP(sub, PyNumber_Subtract, dbl_sub)
+BINOP(mul, PyNumber_Multiply, dbl_mul)
 
 #define zz_quo_(u, v, w) zz_div((u), (v), (w), NULL)
 #define zz_rem_(u, v, w) zz_div((u), (v), NULL, (w))
 
 /* can't overflow */
-BINOP(quo_, PyNumber_FloorDivide)
-BINOP(rem_, PyNumber_Remainder)
+BINOP(quo_, PyNumber_FloorDivide, NULL)
+BINOP(rem_, PyNumber_Remainder, NULL)
 
 static PyObject *
 nb_divmod(PyObject *self, PyObject *other)
@@ -1280,6 +1462,19 @@ fallback:
 numbers:
     Py_XDECREF((PyObject *)u);
     Py_XDECREF((PyObject *)v);
+    if (PyFloat_CheckExact(self) || PyFloat_CheckExact(other)) {
+        double a, b;
+
+        if (as_double(self, &a) || as_double(other, &b)) {
+            return NULL;
+        }
+        if (b == 0) {
+            PyErr_SetString(PyExc_ZeroDivisionError,
+                            "float division by zero");
+            return NULL;
+        }
+        return PyFloat_FromDouble(a/b);
+    }
 
     PyObject *uf, *vf;
 
@@ -1392,521 +1587,2292 @@ zz_rshift(const zz_t *u, const zz_t *v, zz_t *w)
 BINOP_INT(lshift)
 BINOP_INT(rshift)
 
-static PyObject *
-power(PyObject *self, PyObject *other, PyObject *module)
+/* Quotients of u by 2**k, rounded toward -infinity, zero or
+   +infinity. */
+static inline zz_err
+zz_fdiv_q_2exp(const zz_t *u, zz_bitcnt_t k, zz_t *q)
 {
-    MPZ_Object *res = NULL;
-    MPZ_Object *u = NULL, *v = NULL;
-
-    CHECK_OP(u, self);
-    CHECK_OP(v, other);
-    if (Py_IsNone(module)) {
-        if (zz_isneg(&v->z)) {
-            PyObject *uf, *vf, *resf;
-
-            uf = to_float((PyObject *)u);
-            Py_DECREF(u);
-            if (!uf) {
-                Py_DECREF(v);
-                return NULL;
-            }
-            vf = to_float((PyObject *)v);
-            Py_DECREF(v);
-            if (!vf) {
-                Py_DECREF(uf);
-                return NULL;
-            }
-
-            ternaryfunc nb_power = PyType_GetSlot(&PyFloat_Type, Py_nb_power);
-
-            resf = nb_power(uf, vf, Py_None);
-            Py_DECREF(uf);
-            Py_DECREF(vf);
-            return resf;
-        }
+    return zz_quo_2exp(u, k, q);
+}
 
-        uint64_t exp;
+static zz_err
+zz_tdiv_q_2exp(const zz_t *u, zz_bitcnt_t k, zz_t *q)
+{
+    if (!zz_isneg(u)) {
+        return zz_quo_2exp(u, k, q);
+    }
 
-        if (zz_get(&v->z, &exp)) {
-            PyErr_SetString(PyExc_OverflowError,
-                            "too many digits in integer");
-        }
-        else {
-            res = MPZ_new();
-            if (res) {
-                zz_err ret = zz_pow(&u->z, exp, &res->z);
+    zz_err ret;
 
-                if (ret) {
-                    Py_CLEAR(res);
-                    if (ret == ZZ_MEM) {
-                        PyErr_SetNone(PyExc_MemoryError); /* LCOV_EXCL_LINE */
-                    }
-                    else {
-                        PyErr_SetString(PyExc_OverflowError,
-                                        "too many digits in integer");
-                    }
-                }
-            }
-        }
-        Py_DECREF(u);
-        Py_DECREF(v);
-        return (PyObject *)res;
+    if ((ret = zz_neg(u, q)) || (ret = zz_quo_2exp(q, k, q))) {
+        return ret; /* LCOV_EXCL_LINE */
     }
-    else {
-        MPZ_Object *w = NULL;
-
-        CHECK_OP_INT(w, module);
+    return zz_neg(q, q);
+}
 
-        zz_err ret = ZZ_OK;
+static zz_err
+zz_cdiv_q_2exp(const zz_t *u, zz_bitcnt_t k, zz_t *q)
+{
+    zz_err ret;
 
-        res = MPZ_new();
-        if (!res || (ret = zz_powm(&u->z, &v->z, &w->z, &res->z))) {
-            /* LCOV_EXCL_START */
-            if (ret == ZZ_VAL) {
-                PyErr_SetString(PyExc_ValueError,
-                                "base is not invertible for the given modulus");
-            }
-            else {
-                PyErr_NoMemory();
-            }
-            Py_CLEAR(res);
-            /* LCOV_EXCL_STOP */
-        }
-        Py_DECREF(w);
+    if ((ret = zz_neg(u, q)) || (ret = zz_quo_2exp(q, k, q))) {
+        return ret; /* LCOV_EXCL_LINE */
     }
-end:
-    Py_XDECREF((PyObject *)u);
-    Py_XDECREF((PyObject *)v);
-    return (PyObject *)res;
-fallback:
-    Py_XDECREF((PyObject *)u);
-    Py_XDECREF((PyObject *)v);
-    Py_RETURN_NOTIMPLEMENTED;
-numbers:
-    Py_XDECREF((PyObject *)u);
-    Py_XDECREF((PyObject *)v);
+    return zz_neg(q, q);
+}
 
-    PyObject *uf, *vf;
+/* Set r = u - quo(u, k)*2**k, r shouldn't alias u. */
+static zz_err
+zz_rem_2exp(const zz_t *u, zz_bitcnt_t k, zz_t *r,
+            zz_err (*quo)(const zz_t *, zz_bitcnt_t, zz_t *))
+{
+    zz_err ret;
 
-    if (Number_Check(self)) {
-        uf = Py_NewRef(self);
+    assert(r != u);
+    if ((ret = quo(u, k, r))) {
+        return ret; /* LCOV_EXCL_LINE */
     }
-    else {
-        uf = to_float(self);
-        if (!uf) {
-            return NULL;
-        }
+    if (zz_iszero(r)) {
+        return zz_pos(u, r);
     }
-    if (Number_Check(other)) {
-        vf = Py_NewRef(other);
+    if (k > zz_get_bitcnt_max()) {
+        return ZZ_BUF;
     }
-    else {
-        vf = to_float(other);
-        if (!vf) {
-            Py_DECREF(uf);
-            return NULL;
-        }
+    if ((ret = zz_mul_2exp(r, k, r))) {
+        return ret;
     }
-
-    PyObject *res2 = PyNumber_Power(uf, vf, Py_None);
-
-    Py_DECREF(uf);
-    Py_DECREF(vf);
-    return res2;
+    return zz_sub(u, r, r);
 }
 
-static PyNumberMethods as_number = {
-    .nb_add = nb_add,
-    .nb_subtract = nb_sub,
-    .nb_multiply = nb_mul,
-    .nb_divmod = nb_divmod,
-    .nb_floor_divide = nb_quo_,
-    .nb_true_divide = nb_truediv,
-    .nb_remainder = nb_rem_,
-    .nb_power = power,
-    .nb_positive = plus,
-    .nb_negative = nb_negative,
-    .nb_absolute = nb_absolute,
-    .nb_invert = nb_invert,
-    .nb_lshift = nb_lshift,
-    .nb_rshift = nb_rshift,
-    .nb_and = nb_and,
-    .nb_or = nb_or,
-    .nb_xor = nb_xor,
-    .nb_int = to_int,
-    .nb_float = to_float,
-    .nb_index = to_int,
-    .nb_bool = to_bool,
-};
+static zz_err
+zz_tdiv_r_2exp(const zz_t *u, zz_bitcnt_t k, zz_t *r)
+{
+    return zz_rem_2exp(u, k, r, zz_tdiv_q_2exp);
+}
 
-static PyObject *
-get_copy(PyObject *self, void *Py_UNUSED(closure))
+static zz_err
+zz_fdiv_r_2exp(const zz_t *u, zz_bitcnt_t k, zz_t *r)
 {
-    return Py_NewRef(self);
+    return zz_rem_2exp(u, k, r, zz_fdiv_q_2exp);
 }
 
-static PyObject *
-get_one(PyObject *Py_UNUSED(self), void *Py_UNUSED(closure))
+static zz_err
+zz_cdiv_r_2exp(const zz_t *u, zz_bitcnt_t k, zz_t *r)
 {
-    MPZ_Object *res = MPZ_new();
-
-    if (res && zz_set(1, &res->z)) {
-        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
-    }
-    return (PyObject *)res;
+    return zz_rem_2exp(u, k, r, zz_cdiv_q_2exp);
 }
 
-static PyObject *
-get_zero(PyObject *Py_UNUSED(self), void *Py_UNUSED(closure))
+/* Bit access with the two's complement semantics for negative integers,
+   like for bitwise operations.  For u < 0 bits of -u below its lowest set
+   bit are same, and higher bits are inverted, so we can read digits of the
+   magnitude directly. */
+static inline zz_digit_t
+zz_digit_mask(void)
 {
-    return (PyObject *)MPZ_new();
+    return (zz_digit_t)-1 >> (8*sizeof(zz_digit_t) - bits_per_digit);
 }
 
-static PyGetSetDef getsetters[] = {
-    {"numerator", (getter)get_copy, NULL,
-     "the numerator of self (the value itself)", NULL},
-    {"denominator", (getter)get_one, NULL,
-     "the denominator of self (mpz(1))", NULL},
-    {"real", (getter)get_copy, NULL, "the real part of self (the value itself)",
-     NULL},
-    {"imag", (getter)get_zero, NULL, "the imaginary part of self (mpz(0))",
-     NULL},
-    {NULL} /* sentinel */
-};
-
-static PyObject *
-bit_length(PyObject *self, PyObject *Py_UNUSED(args))
+/* Digit k of u, low is the index of the lowest nonzero digit of u. */
+static inline zz_digit_t
+zz_tc_digit(const zz_t *u, zz_size_t k, zz_size_t low)
 {
-    MPZ_Object *u = (MPZ_Object *)self;
-    zz_digit_t digit = zz_bitlen(&u->z);
+    zz_digit_t d = k < u->size ? u->digits[k] : 0;
 
-    return PyLong_FromUnsignedLongLong(digit);
+    if (!zz_isneg(u) || k < low) {
+        return d;
+    }
+    return (k == low ? ~d + 1 : ~d) & zz_digit_mask();
 }
 
-static PyObject *
-bit_count(PyObject *self, PyObject *Py_UNUSED(args))
+static inline zz_size_t
+zz_low_digit(const zz_t *u)
 {
-    MPZ_Object *u = (MPZ_Object *)self;
-    zz_bitcnt_t count = zz_bitcnt(&u->z);
-
-    return PyLong_FromUnsignedLongLong(count);
+    return zz_iszero(u) ? 0 : (zz_size_t)(zz_lsbpos(u)/bits_per_digit);
 }
 
-static PyObject *
-to_bytes(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
-         PyObject *kwnames)
+static bool
+zz_tc_testbit(const zz_t *u, zz_bitcnt_t i)
 {
-    static const char *const keywords[] = {"length", "byteorder", "signed"};
-    const static gmp_pyargs fnargs = {
-        .keywords = keywords,
-        .maxpos = 2,
-        .minargs = 0,
-        .maxargs = 3,
-        .fname = "to_bytes",
-    };
-    Py_ssize_t argidx[3] = {-1, -1, -1};
+    zz_size_t k = (zz_size_t)(i/bits_per_digit);
 
-    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
-        return NULL;
+    if (k >= u->size) {
+        return zz_isneg(u);
     }
+    return (zz_tc_digit(u, k, zz_low_digit(u)) >> (i % bits_per_digit)) & 1;
+}
 
-    Py_ssize_t length = 1;
-    int is_little = 0, is_signed = 0;
+/* Round |u| to DBL_MANT_DIG bits in the direction rnd, set m and e such
+   that 0.5 <= m < 1 and m*2**e is the rounded value.  The u is nonzero. */
+static zz_err
+zz_frexp(const zz_t *u, zz_rnd rnd, double *m, int64_t *e)
+{
+    zz_bitcnt_t bc = zz_bitlen(u);
 
-    if (argidx[0] >= 0) {
-        PyObject *arg = args[argidx[0]];
+    *e = (int64_t)bc;
+    if (bc <= DBL_MANT_DIG) {
+        (void)zz_get(u, m);
+        *m = ldexp(fabs(*m), -(int)bc);
+        return ZZ_OK;
+    }
 
-        if (PyLong_Check(arg)) {
-            length = PyLong_AsSsize_t(arg);
-            if (length < 0) {
-                PyErr_SetString(PyExc_ValueError,
-                                "length argument must be non-negative");
-                return NULL;
-            }
+    bool negative = zz_isneg(u), up = false;
+    zz_bitcnt_t shift = bc - DBL_MANT_DIG, zbits = zz_lsbpos(u);
+    zz_t t;
+    uint64_t q;
+
+    if (zz_init(&t) || zz_abs(u, &t)) {
+        goto err; /* LCOV_EXCL_LINE */
+    }
+    if (rnd == ZZ_RNDD) {
+        rnd = negative ? ZZ_RNDA : ZZ_RNDZ;
+    }
+    else if (rnd == ZZ_RNDU) {
+        rnd = negative ? ZZ_RNDZ : ZZ_RNDA;
+    }
+    /* Some nonzero bits are shifted out? */
+    if (zbits < shift) {
+        if (rnd == ZZ_RNDA) {
+            up = true;
         }
-        else {
-            PyErr_SetString(PyExc_TypeError,
-                            "to_bytes() takes an integer argument 'length'");
-            return NULL;
+        else if (rnd == ZZ_RNDN) {
+            up = zz_tc_testbit(&t, shift - 1)
+                 && (zbits < shift - 1 || zz_tc_testbit(&t, shift));
         }
     }
-    if (argidx[1] >= 0) {
-        PyObject *arg = args[argidx[1]];
+    if (zz_quo_2exp(&t, shift, &t)) {
+        goto err; /* LCOV_EXCL_LINE */
+    }
+    (void)zz_get(&t, &q);
+    zz_clear(&t);
+    *m = ldexp((double)(q + up), -DBL_MANT_DIG);
+    if (*m == 1) {
+        *m = 0.5;
+        (*e)++;
+    }
+    return ZZ_OK;
+    /* LCOV_EXCL_START */
+err:
+    zz_clear(&t);
+    return ZZ_MEM;
+    /* LCOV_EXCL_STOP */
+}
 
-        if (PyUnicode_Check(arg)) {
-            const char *byteorder = PyUnicode_AsUTF8AndSize(arg, NULL);
+/* Round u to the double in the direction rnd.  Return ZZ_BUF, if the
+   result is infinite. */
+static zz_err
+zz_get_dbl_rnd(const zz_t *u, zz_rnd rnd, double *d)
+{
+    if (zz_iszero(u)) {
+        *d = 0.0;
+        return ZZ_OK;
+    }
 
-            if (!byteorder) {
-                return NULL; /* LCOV_EXCL_LINE */
-            }
-            else if (strcmp(byteorder, "big") == 0) {
-                is_little = 0;
-            }
-            else if (strcmp(byteorder, "little") == 0) {
-                is_little = 1;
-            }
-            else {
-                PyErr_SetString(PyExc_ValueError,
-                                "byteorder must be either 'little' or 'big'");
-                return NULL;
-            }
+    double m;
+    int64_t e;
+    bool negative = zz_isneg(u);
+
+    if (zz_frexp(u, rnd, &m, &e)) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+    if (e > DBL_MAX_EXP) {
+        if (rnd == ZZ_RNDZ || (rnd == ZZ_RNDD && !negative)
+            || (rnd == ZZ_RNDU && negative))
+        {
+            *d = negative ? -DBL_MAX : DBL_MAX;
+            return ZZ_OK;
         }
-        else {
-            PyErr_SetString(PyExc_TypeError,
-                            "to_bytes() argument 'byteorder' must be str");
-            return NULL;
+        return ZZ_BUF;
+    }
+    *d = ldexp(negative ? -m : m, (int)e);
+    return ZZ_OK;
+}
+
+/* Find the index of the first bit, equal to bit, starting from start.
+   Return false, if there is no such bit. */
+static bool
+zz_scan(const zz_t *u, zz_bitcnt_t start, bool bit, zz_bitcnt_t *res)
+{
+    zz_digit_t mask = zz_digit_mask(), inv = bit ? 0 : mask;
+    zz_size_t low = zz_low_digit(u);
+    zz_size_t k = (zz_size_t)(start/bits_per_digit);
+    zz_digit_t d = ((zz_tc_digit(u, k, low) ^ inv)
+                    & (mask << (start % bits_per_digit)) & mask);
+
+    while (!d) {
+        if (++k >= u->size) {
+            if (((zz_isneg(u) ? mask : 0) ^ inv) == 0) {
+                return false;
+            }
+            *res = (zz_bitcnt_t)k*bits_per_digit;
+            return true;
         }
+        d = (zz_tc_digit(u, k, low) ^ inv) & mask;
     }
-    if (argidx[2] >= 0) {
-        is_signed = PyObject_IsTrue(args[argidx[2]]);
+    *res = (zz_bitcnt_t)k*bits_per_digit;
+    for (; !(d & 1); d >>= 1) {
+        (*res)++;
     }
-    return MPZ_to_bytes((MPZ_Object *)self, length, is_little, is_signed);
+    return true;
 }
 
-static PyObject *
-_from_bytes(PyObject *Py_UNUSED(type), PyObject *arg)
+/* Population count of a digit.  The compiler builtin is lowered to the
+   popcnt instruction, where it's available for the target. */
+static inline zz_bitcnt_t
+popcount_digit(zz_digit_t d)
 {
-    return (PyObject *)MPZ_from_bytes(arg, 0, 1);
+#if defined(__GNUC__) || defined(__clang__)
+    return (zz_bitcnt_t)__builtin_popcountll(d);
+#else
+    uint64_t x = d;
+
+    x -= (x >> 1) & 0x5555555555555555ULL;
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (zz_bitcnt_t)((x*0x0101010101010101ULL) >> 56);
+#endif
 }
 
-static PyObject *
-from_bytes(PyTypeObject *Py_UNUSED(type), PyObject *const *args,
-           Py_ssize_t nargs, PyObject *kwnames)
+/* Count set bits of |u| in range(start, stop). */
+static zz_bitcnt_t
+zz_bitcnt_range(const zz_t *u, zz_bitcnt_t start, zz_bitcnt_t stop)
 {
-    static const char *const keywords[] = {"bytes", "byteorder", "signed"};
-    const static gmp_pyargs fnargs = {
-        .keywords = keywords,
-        .maxpos = 3,
-        .minargs = 1,
-        .maxargs = 3,
-        .fname = "from_bytes",
-    };
-    Py_ssize_t argidx[3] = {-1, -1, -1};
+    zz_bitcnt_t len = (zz_bitcnt_t)u->size*bits_per_digit;
 
-    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
-        return NULL;
+    if (stop > len) {
+        stop = len;
+    }
+    if (start >= stop) {
+        return 0;
     }
 
-    int is_little = 0, is_signed = 0;
+    zz_digit_t mask = zz_digit_mask();
+    zz_size_t ks = (zz_size_t)(start/bits_per_digit);
+    zz_size_t ke = (zz_size_t)((stop - 1)/bits_per_digit);
+    zz_digit_t first = mask << (start % bits_per_digit) & mask;
+    zz_digit_t last = mask >> (bits_per_digit - 1 - (stop - 1)%bits_per_digit);
 
-    if (argidx[1] >= 0) {
-        PyObject *arg = args[argidx[1]];
+    if (ks == ke) {
+        return popcount_digit(u->digits[ks] & first & last);
+    }
 
-        if (PyUnicode_Check(arg)) {
-            const char *byteorder = PyUnicode_AsUTF8AndSize(arg, NULL);
+    zz_bitcnt_t res = (popcount_digit(u->digits[ks] & first)
+                       + popcount_digit(u->digits[ke] & last));
 
-            if (!byteorder) {
-                return NULL; /* LCOV_EXCL_LINE */
-            }
-            else if (strcmp(byteorder, "big") == 0) {
-                is_little = 0;
-            }
-            else if (strcmp(byteorder, "little") == 0) {
-                is_little = 1;
-            }
-            else {
-                PyErr_SetString(PyExc_ValueError,
-                                ("byteorder must be either 'little'"
-                                 " or 'big'"));
-                return NULL;
-            }
-        }
-        else {
-            PyErr_SetString(PyExc_TypeError,
-                            ("from_bytes() argument 'byteorder'"
-                             " must be str"));
-            return NULL;
-        }
-    }
-    if (argidx[2] >= 0) {
-        is_signed = PyObject_IsTrue(args[argidx[2]]);
+    for (zz_size_t k = ks + 1; k < ke; k++) {
+        res += popcount_digit(u->digits[k]);
     }
-    return (PyObject *)MPZ_from_bytes(args[argidx[0]], is_little, is_signed);
+    return res;
 }
 
-static PyObject *
-as_integer_ratio(PyObject *self, PyObject *Py_UNUSED(args))
+/* Number of different bits of u and v of same sign, in the two's
+   complement. */
+static zz_bitcnt_t
+zz_hamdist(const zz_t *u, const zz_t *v)
 {
-    PyObject *one = get_one(NULL, NULL);
+    zz_bitcnt_t res = 0;
 
-    if (!one) {
-        return NULL; /* LCOV_EXCL_LINE */
+    assert(zz_isneg(u) == zz_isneg(v));
+    if (u->size < v->size) {
+        const zz_t *t = u;
+
+        u = v;
+        v = t;
     }
+    if (!zz_isneg(u)) {
+        zz_size_t k = 0;
 
-    PyObject *u = Py_NewRef(self);
-    PyObject *ratio_tuple = PyTuple_Pack(2, u, one);
+        for (; k < v->size; k++) {
+            res += popcount_digit(u->digits[k] ^ v->digits[k]);
+        }
+        for (; k < u->size; k++) {
+            res += popcount_digit(u->digits[k]);
+        }
+        return res;
+    }
 
-    Py_DECREF(u);
-    Py_DECREF(one);
-    return ratio_tuple;
+    zz_size_t lu = zz_low_digit(u), lv = zz_low_digit(v);
+
+    for (zz_size_t k = 0; k < u->size; k++) {
+        res += popcount_digit(zz_tc_digit(u, k, lu) ^ zz_tc_digit(v, k, lv));
+    }
+    return res;
 }
 
-static PyObject *
-__round__(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+/* Number of common set bits of u and v in the two's complement, u and v
+   must not be both negative. */
+static zz_bitcnt_t
+zz_and_count(const zz_t *u, const zz_t *v)
 {
-    if (nargs > 1) {
-        PyErr_Format(PyExc_TypeError,
-                     "__round__ expected at most 1 argument, got %zu");
-        return NULL;
-    }
+    zz_bitcnt_t res = 0;
 
-    MPZ_Object *u = (MPZ_Object *)self;
+    assert(!zz_isneg(u) || !zz_isneg(v));
+    if (zz_isneg(u) || (!zz_isneg(v) && u->size > v->size)) {
+        const zz_t *t = u;
 
-    if (!nargs) {
-noop:
-        return plus(self);
+        u = v;
+        v = t;
+    }
+    /* Now u is nonnegative and bits of v above u->size don't matter. */
+    if (!zz_isneg(v)) {
+        for (zz_size_t k = 0; k < u->size; k++) {
+            res += popcount_digit(u->digits[k] & v->digits[k]);
+        }
+        return res;
     }
 
-    MPZ_Object *ndigits = NULL;
+    zz_size_t lv = zz_low_digit(v);
 
-    if (MPZ_Check(args[0])) {
-        ndigits = (MPZ_Object *)plus(args[0]);
-    }
-    else {
-        ndigits = MPZ_from_int(args[0]);
-    }
-    if (!ndigits) {
-        return NULL;
-    }
-    if (!zz_isneg(&ndigits->z)) {
-        Py_DECREF(ndigits);
-        goto noop;
+    for (zz_size_t k = 0; k < u->size; k++) {
+        res += popcount_digit(u->digits[k] & zz_tc_digit(v, k, lv));
     }
+    return res;
+}
 
-    zz_t divisor;
-    uint64_t exp;
+/* Absolute value of u modulo nonzero d. */
+static uint32_t
+zz_mod_u32(const zz_t *u, uint32_t d)
+{
+    uint64_t r = 0;
 
-    (void)zz_neg(&ndigits->z, &ndigits->z);
-    if (zz_init(&divisor) || zz_set(10, &divisor)) {
-        /* LCOV_EXCL_START */
-        zz_clear(&divisor);
-        return PyErr_NoMemory();
-        /* LCOV_EXCL_STOP */
-    }
-    if (zz_get(&ndigits->z, &exp)) {
-        zz_clear(&divisor);
-        goto overflow;
+    assert(d && bits_per_digit <= 64);
+    for (zz_size_t i = u->size; i-- > 0;) {
+        zz_digit_t x = u->digits[i];
+
+        if (bits_per_digit <= 32) {
+            r = ((r << bits_per_digit) | x) % d;
+        }
+        else {
+            r = ((r << (bits_per_digit - 32)) | (x >> 32)) % d;
+            r = ((r << 32) | (x & 0xffffffff)) % d;
+        }
     }
+    return (uint32_t)r;
+}
 
-    zz_err ret = zz_pow(&divisor, exp, &divisor);
+static PyObject *
+power(PyObject *self, PyObject *other, PyObject *module)
+{
+    MPZ_Object *res = NULL;
+    MPZ_Object *u = NULL, *v = NULL;
 
-    if (ret) {
-        zz_clear(&divisor);
-        Py_DECREF(ndigits);
-        if (ret == ZZ_MEM) {
-            return PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    CHECK_OP(u, self);
+    CHECK_OP(v, other);
+    if (Py_IsNone(module)) {
+        if (zz_isneg(&v->z)) {
+            PyObject *uf, *vf, *resf;
+
+            uf = to_float((PyObject *)u);
+            Py_DECREF(u);
+            if (!uf) {
+                Py_DECREF(v);
+                return NULL;
+            }
+            vf = to_float((PyObject *)v);
+            Py_DECREF(v);
+            if (!vf) {
+                Py_DECREF(uf);
+                return NULL;
+            }
+
+            ternaryfunc nb_power = PyType_GetSlot(&PyFloat_Type, Py_nb_power);
+
+            resf = nb_power(uf, vf, Py_None);
+            Py_DECREF(uf);
+            Py_DECREF(vf);
+            return resf;
         }
-overflow:
-        PyErr_SetString(PyExc_OverflowError,
-                        "too many digits in integer");
-        return NULL;
+
+        uint64_t exp;
+
+        if (zz_get(&v->z, &exp)) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "too many digits in integer");
+        }
+        else {
+            res = MPZ_new();
+            if (res) {
+                zz_err ret = zz_pow(&u->z, exp, &res->z);
+
+                if (ret) {
+                    Py_CLEAR(res);
+                    if (ret == ZZ_MEM) {
+                        PyErr_SetNone(PyExc_MemoryError); /* LCOV_EXCL_LINE */
+                    }
+                    else {
+                        PyErr_SetString(PyExc_OverflowError,
+                                        "too many digits in integer");
+                    }
+                }
+            }
+        }
+        Py_DECREF(u);
+        Py_DECREF(v);
+        return (PyObject *)res;
     }
-    Py_DECREF(ndigits);
+    else {
+        MPZ_Object *w = NULL;
 
-    MPZ_Object *res = MPZ_new();
+        CHECK_OP_INT(w, module);
 
-    if (!res) {
-        /* LCOV_EXCL_START */
-        zz_clear(&divisor);
-        return NULL;
-        /* LCOV_EXCL_STOP */
+        zz_err ret = ZZ_OK;
+
+        res = MPZ_new();
+        if (!res || (ret = zz_powm(&u->z, &v->z, &w->z, &res->z))) {
+            /* LCOV_EXCL_START */
+            if (ret == ZZ_VAL) {
+                PyErr_SetString(PyExc_ValueError,
+                                "base is not invertible for the given modulus");
+            }
+            else {
+                PyErr_NoMemory();
+            }
+            Py_CLEAR(res);
+            /* LCOV_EXCL_STOP */
+        }
+        Py_DECREF(w);
     }
-    if (zz_divnear(&u->z, &divisor, NULL, &res->z)) {
-        /* LCOV_EXCL_START */
-        zz_clear(&divisor);
-        Py_DECREF(res);
-        return PyErr_NoMemory();
-        /* LCOV_EXCL_STOP */
+end:
+    Py_XDECREF((PyObject *)u);
+    Py_XDECREF((PyObject *)v);
+    return (PyObject *)res;
+fallback:
+    Py_XDECREF((PyObject *)u);
+    Py_XDECREF((PyObject *)v);
+    Py_RETURN_NOTIMPLEMENTED;
+numbers:
+    Py_XDECREF((PyObject *)u);
+    Py_XDECREF((PyObject *)v);
+
+    PyObject *uf, *vf;
+
+    if (Number_Check(self)) {
+        uf = Py_NewRef(self);
     }
-    zz_clear(&divisor);
-    if (zz_sub(&u->z, &res->z, &res->z)) {
-        /* LCOV_EXCL_START */
-        Py_DECREF(res);
-        return PyErr_NoMemory();
-        /* LCOV_EXCL_STOP */
+    else {
+        uf = to_float(self);
+        if (!uf) {
+            return NULL;
+        }
     }
-    return (PyObject *)res;
+    if (Number_Check(other)) {
+        vf = Py_NewRef(other);
+    }
+    else {
+        vf = to_float(other);
+        if (!vf) {
+            Py_DECREF(uf);
+            return NULL;
+        }
+    }
+
+    PyObject *res2 = PyNumber_Power(uf, vf, Py_None);
+
+    Py_DECREF(uf);
+    Py_DECREF(vf);
+    return res2;
+}
+
+static PyNumberMethods as_number = {
+    .nb_add = nb_add,
+    .nb_subtract = nb_sub,
+    .nb_multiply = nb_mul,
+    .nb_divmod = nb_divmod,
+    .nb_floor_divide = nb_quo_,
+    .nb_true_divide = nb_truediv,
+    .nb_remainder = nb_rem_,
+    .nb_power = power,
+    .nb_positive = plus,
+    .nb_negative = nb_negative,
+    .nb_absolute = nb_absolute,
+    .nb_invert = nb_invert,
+    .nb_lshift = nb_lshift,
+    .nb_rshift = nb_rshift,
+    .nb_and = nb_and,
+    .nb_or = nb_or,
+    .nb_xor = nb_xor,
+    .nb_int = to_int,
+    .nb_float = to_float,
+    .nb_index = to_int,
+    .nb_bool = to_bool,
+};
+
+static PyObject *
+get_copy(PyObject *self, void *Py_UNUSED(closure))
+{
+    return Py_NewRef(self);
 }
 
 static PyObject *
-__reduce_ex__(PyObject *self, PyObject *Py_UNUSED(args))
+get_one(PyObject *Py_UNUSED(self), void *Py_UNUSED(closure))
 {
-    MPZ_Object *u = (MPZ_Object *)self;
-    zz_bitcnt_t len = zz_bitlen(&u->z);
+    MPZ_Object *res = MPZ_new();
 
-    return Py_BuildValue("N(N)",
-                         PyObject_GetAttrString(self, "_from_bytes"),
-                         MPZ_to_bytes(u, (Py_ssize_t)(len + 7)/8 + 1, 0, 1));
+    if (res && zz_set(1, &res->z)) {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+    return (PyObject *)res;
 }
 
 static PyObject *
-__sizeof__(PyObject *self, PyObject *Py_UNUSED(ignored))
+get_zero(PyObject *Py_UNUSED(self), void *Py_UNUSED(closure))
+{
+    return (PyObject *)MPZ_new();
+}
+
+static PyGetSetDef getsetters[] = {
+    {"numerator", (getter)get_copy, NULL,
+     "the numerator of self (the value itself)", NULL},
+    {"denominator", (getter)get_one, NULL,
+     "the denominator of self (mpz(1))", NULL},
+    {"real", (getter)get_copy, NULL, "the real part of self (the value itself)",
+     NULL},
+    {"imag", (getter)get_zero, NULL, "the imaginary part of self (mpz(0))",
+     NULL},
+    {NULL} /* sentinel */
+};
+
+static PyObject *
+bit_length(PyObject *self, PyObject *Py_UNUSED(args))
 {
     MPZ_Object *u = (MPZ_Object *)self;
+    zz_digit_t digit = zz_bitlen(&u->z);
 
-    return PyLong_FromSize_t(sizeof(MPZ_Object) - sizeof(zz_t)
-                             + zz_sizeof(&u->z));
+    return PyLong_FromUnsignedLongLong(digit);
 }
 
 static PyObject *
-is_integer(PyObject *Py_UNUSED(self), PyObject *Py_UNUSED(args))
+bit_count(PyObject *self, PyObject *Py_UNUSED(args))
 {
-    Py_RETURN_TRUE;
+    MPZ_Object *u = (MPZ_Object *)self;
+    zz_bitcnt_t count = zz_bitcnt(&u->z);
+
+    return PyLong_FromUnsignedLongLong(count);
 }
 
 static PyObject *
-digits(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
-       PyObject *kwnames)
+to_bytes(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+         PyObject *kwnames)
 {
-    static const char *const keywords[] = {"base"};
+    static const char *const keywords[] = {"length", "byteorder", "signed"};
     const static gmp_pyargs fnargs = {
         .keywords = keywords,
-        .maxpos = 1,
+        .maxpos = 2,
         .minargs = 0,
-        .maxargs = 1,
-        .fname = "digits",
+        .maxargs = 3,
+        .fname = "to_bytes",
     };
-    Py_ssize_t argidx[1] = {-1};
+    Py_ssize_t argidx[3] = {-1, -1, -1};
 
     if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
         return NULL;
     }
 
-    int base = 10;
+    Py_ssize_t length = 1;
+    int is_little = 0, is_signed = 0;
 
-    if (argidx[0] != -1) {
+    if (argidx[0] >= 0) {
         PyObject *arg = args[argidx[0]];
 
         if (PyLong_Check(arg)) {
-            base = PyLong_AsInt(args[argidx[0]]);
-            if (base == -1 && PyErr_Occurred()) {
+            length = PyLong_AsSsize_t(arg);
+            if (length < 0) {
+                PyErr_SetString(PyExc_ValueError,
+                                "length argument must be non-negative");
                 return NULL;
             }
         }
         else {
             PyErr_SetString(PyExc_TypeError,
-                            "digits() takes an integer argument 'base'");
+                            "to_bytes() takes an integer argument 'length'");
             return NULL;
         }
     }
-    return MPZ_to_str((MPZ_Object *)self, base, 0);
-}
-
-extern PyObject * __format__(PyObject *self, PyObject *format_spec);
+    if (argidx[1] >= 0) {
+        PyObject *arg = args[argidx[1]];
 
-/* Explicit signatures for METH_NOARGS methods are redundant
-   since CPython 3.13. */
+        if (PyUnicode_Check(arg)) {
+            const char *byteorder = PyUnicode_AsUTF8AndSize(arg, NULL);
 
-static PyMethodDef methods[] = {
-    {"conjugate", (PyCFunction)plus, METH_NOARGS,
-     "conjugate($self, /)\n--\n\nReturns self."},
-    {"bit_length", bit_length, METH_NOARGS,
-     ("bit_length($self, /)\n--\n\nNumber of bits necessary "
-      "to represent self in binary.")},
-    {"bit_count", bit_count, METH_NOARGS,
-     ("bit_count($self, /)\n--\n\nNumber of ones in the binary "
-      "representation of the absolute value of self.")},
-    {"to_bytes", (PyCFunction)to_bytes, METH_FASTCALL | METH_KEYWORDS,
+            if (!byteorder) {
+                return NULL; /* LCOV_EXCL_LINE */
+            }
+            else if (strcmp(byteorder, "big") == 0) {
+                is_little = 0;
+            }
+            else if (strcmp(byteorder, "little") == 0) {
+                is_little = 1;
+            }
+            else {
+                PyErr_SetString(PyExc_ValueError,
+                                "byteorder must be either 'little' or 'big'");
+                return NULL;
+            }
+        }
+        else {
+            PyErr_SetString(PyExc_TypeError,
+                            "to_bytes() argument 'byteorder' must be str");
+            return NULL;
+        }
+    }
+    if (argidx[2] >= 0) {
+        is_signed = PyObject_IsTrue(args[argidx[2]]);
+    }
+    return MPZ_to_bytes((MPZ_Object *)self, length, is_little, is_signed);
+}
+
+static PyObject *
+_from_bytes(PyObject *Py_UNUSED(type), PyObject *arg)
+{
+    return (PyObject *)MPZ_from_bytes(arg, 0, 1);
+}
+
+static PyObject *
+from_bytes(PyTypeObject *Py_UNUSED(type), PyObject *const *args,
+           Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const keywords[] = {"bytes", "byteorder", "signed"};
+    const static gmp_pyargs fnargs = {
+        .keywords = keywords,
+        .maxpos = 3,
+        .minargs = 1,
+        .maxargs = 3,
+        .fname = "from_bytes",
+    };
+    Py_ssize_t argidx[3] = {-1, -1, -1};
+
+    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
+        return NULL;
+    }
+
+    int is_little = 0, is_signed = 0;
+
+    if (argidx[1] >= 0) {
+        PyObject *arg = args[argidx[1]];
+
+        if (PyUnicode_Check(arg)) {
+            const char *byteorder = PyUnicode_AsUTF8AndSize(arg, NULL);
+
+            if (!byteorder) {
+                return NULL; /* LCOV_EXCL_LINE */
+            }
+            else if (strcmp(byteorder, "big") == 0) {
+                is_little = 0;
+            }
+            else if (strcmp(byteorder, "little") == 0) {
+                is_little = 1;
+            }
+            else {
+                PyErr_SetString(PyExc_ValueError,
+                                ("byteorder must be either 'little'"
+                                 " or 'big'"));
+                return NULL;
+            }
+        }
+        else {
+            PyErr_SetString(PyExc_TypeError,
+                            ("from_bytes() argument 'byteorder'"
+                             " must be str"));
+            return NULL;
+        }
+    }
+    if (argidx[2] >= 0) {
+        is_signed = PyObject_IsTrue(args[argidx[2]]);
+    }
+    return (PyObject *)MPZ_from_bytes(args[argidx[0]], is_little, is_signed);
+}
+
+static PyObject *
+as_integer_ratio(PyObject *self, PyObject *Py_UNUSED(args))
+{
+    PyObject *one = get_one(NULL, NULL);
+
+    if (!one) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+
+    PyObject *u = Py_NewRef(self);
+    PyObject *ratio_tuple = PyTuple_Pack(2, u, one);
+
+    Py_DECREF(u);
+    Py_DECREF(one);
+    return ratio_tuple;
+}
+
+static PyObject *
+__round__(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    if (nargs > 1) {
+        PyErr_Format(PyExc_TypeError,
+                     "__round__ expected at most 1 argument, got %zu");
+        return NULL;
+    }
+
+    MPZ_Object *u = (MPZ_Object *)self;
+
+    if (!nargs) {
+noop:
+        return plus(self);
+    }
+
+    MPZ_Object *ndigits = NULL;
+
+    if (MPZ_Check(args[0])) {
+        ndigits = (MPZ_Object *)plus(args[0]);
+    }
+    else {
+        ndigits = MPZ_from_int(args[0]);
+    }
+    if (!ndigits) {
+        return NULL;
+    }
+    if (!zz_isneg(&ndigits->z)) {
+        Py_DECREF(ndigits);
+        goto noop;
+    }
+
+    zz_t divisor;
+    uint64_t exp;
+
+    (void)zz_neg(&ndigits->z, &ndigits->z);
+    if (zz_init(&divisor) || zz_set(10, &divisor)) {
+        /* LCOV_EXCL_START */
+        zz_clear(&divisor);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    if (zz_get(&ndigits->z, &exp)) {
+        zz_clear(&divisor);
+        goto overflow;
+    }
+
+    zz_err ret = zz_pow(&divisor, exp, &divisor);
+
+    if (ret) {
+        zz_clear(&divisor);
+        Py_DECREF(ndigits);
+        if (ret == ZZ_MEM) {
+            return PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+        }
+overflow:
+        PyErr_SetString(PyExc_OverflowError,
+                        "too many digits in integer");
+        return NULL;
+    }
+    Py_DECREF(ndigits);
+
+    MPZ_Object *res = MPZ_new();
+
+    if (!res) {
+        /* LCOV_EXCL_START */
+        zz_clear(&divisor);
+        return NULL;
+        /* LCOV_EXCL_STOP */
+    }
+    if (zz_divnear(&u->z, &divisor, NULL, &res->z)) {
+        /* LCOV_EXCL_START */
+        zz_clear(&divisor);
+        Py_DECREF(res);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    zz_clear(&divisor);
+    if (zz_sub(&u->z, &res->z, &res->z)) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(res);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    return (PyObject *)res;
+}
+
+static PyObject *
+__reduce_ex__(PyObject *self, PyObject *Py_UNUSED(args))
+{
+    MPZ_Object *u = (MPZ_Object *)self;
+    zz_bitcnt_t len = zz_bitlen(&u->z);
+
+    return Py_BuildValue("N(N)",
+                         PyObject_GetAttrString(self, "_from_bytes"),
+                         MPZ_to_bytes(u, (Py_ssize_t)(len + 7)/8 + 1, 0, 1));
+}
+
+static PyObject *
+__sizeof__(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    MPZ_Object *u = (MPZ_Object *)self;
+
+    return PyLong_FromSize_t(sizeof(MPZ_Object) - sizeof(zz_t)
+                             + zz_sizeof(&u->z));
+}
+
+static PyObject *
+is_integer(PyObject *Py_UNUSED(self), PyObject *Py_UNUSED(args))
+{
+    Py_RETURN_TRUE;
+}
+
+static PyObject *
+digits(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+       PyObject *kwnames)
+{
+    static const char *const keywords[] = {"base"};
+    const static gmp_pyargs fnargs = {
+        .keywords = keywords,
+        .maxpos = 1,
+        .minargs = 0,
+        .maxargs = 1,
+        .fname = "digits",
+    };
+    Py_ssize_t argidx[1] = {-1};
+
+    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
+        return NULL;
+    }
+
+    int base = 10;
+
+    if (argidx[0] != -1) {
+        PyObject *arg = args[argidx[0]];
+
+        if (PyLong_Check(arg)) {
+            base = PyLong_AsInt(args[argidx[0]]);
+            if (base == -1 && PyErr_Occurred()) {
+                return NULL;
+            }
+        }
+        else {
+            PyErr_SetString(PyExc_TypeError,
+                            "digits() takes an integer argument 'base'");
+            return NULL;
+        }
+    }
+    return MPZ_to_str((MPZ_Object *)self, base, 0);
+}
+
+/* Destination of mpz.write_digits(). */
+typedef struct {
+    PyObject *write; /* callable, used to write data */
+    PyObject *fd;    /* file descriptor (first argument of write) or NULL */
+    bool text;       /* write str's, not bytes */
+    Py_ssize_t count; /* number of characters written */
+} digits_sink;
+
+static int
+digits_sink_write(digits_sink *sink, const char *buf, Py_ssize_t len)
+{
+    while (len > 0) {
+        PyObject *data = (sink->text ? PyUnicode_FromStringAndSize(buf, len)
+                          : PyBytes_FromStringAndSize(buf, len));
+
+        if (!data) {
+            return -1; /* LCOV_EXCL_LINE */
+        }
+
+        PyObject *res = (sink->fd
+                         ? PyObject_CallFunctionObjArgs(sink->write, sink->fd,
+                                                        data, NULL)
+                         : PyObject_CallOneArg(sink->write, data));
+
+        Py_DECREF(data);
+        if (!res) {
+            return -1;
+        }
+
+        /* Binary files in raw mode (and os.write()) might do a partial
+           write, non-blocking raw files return None if nothing was
+           written.  Text files return the whole length (or None for
+           some file-like objects). */
+        Py_ssize_t n = len;
+
+        if (Py_IsNone(res) && !sink->text && !sink->fd) {
+            PyObject *exc = PyObject_CallFunction(PyExc_BlockingIOError,
+                                                  "isn", EAGAIN,
+                                                  "write() could not complete"
+                                                  " without blocking",
+                                                  sink->count);
+
+            Py_DECREF(res);
+            if (exc) {
+                PyErr_SetObject(PyExc_BlockingIOError, exc);
+                Py_DECREF(exc);
+            }
+            return -1;
+        }
+        if (PyLong_Check(res)) {
+            n = PyLong_AsSsize_t(res);
+            if (n <= 0 || n > len) {
+                Py_DECREF(res);
+                if (!PyErr_Occurred()) {
+                    PyErr_Format(PyExc_OSError,
+                                 "write() returned %zd, expected 1..%zd",
+                                 n, len);
+                }
+                return -1;
+            }
+        }
+        Py_DECREF(res);
+        sink->count += n;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Write digits of the nonnegative u < powers[level + 1], where
+   powers[i] = base**(chunk*2**i).  If pad is true, exactly
+   chunk*2**(level + 1) digits are written, with leading zeros.
+
+   This splits u by powers[level] until the chunk size is reached, so
+   the digits are written in order and at most chunk digits (plus the
+   temporary quotients and remainders along the current path) are kept
+   in memory. */
+static int
+write_digits_rec(const zz_t *u, int base, Py_ssize_t chunk,
+                 const zz_t *powers, Py_ssize_t level, bool pad, char *buf,
+                 digits_sink *sink)
+{
+    if (level < 0) {
+        if (zz_get_str(u, base, buf)) {
+            /* LCOV_EXCL_START */
+            PyErr_NoMemory();
+            return -1;
+            /* LCOV_EXCL_STOP */
+        }
+
+        Py_ssize_t len = (Py_ssize_t)strlen(buf);
+
+        if (pad && len < chunk) {
+            memmove(buf + chunk - len, buf, (size_t)len);
+            memset(buf, '0', (size_t)(chunk - len));
+            len = chunk;
+        }
+        return digits_sink_write(sink, buf, len);
+    }
+
+    zz_t q, r;
+    int ret = 0;
+
+    if (zz_init(&q) || zz_init(&r) || zz_div(u, &powers[level], &q, &r)) {
+        /* LCOV_EXCL_START */
+        zz_clear(&q);
+        zz_clear(&r);
+        PyErr_NoMemory();
+        return -1;
+        /* LCOV_EXCL_STOP */
+    }
+    if (pad || !zz_iszero(&q)) {
+        ret = write_digits_rec(&q, base, chunk, powers, level - 1, pad, buf,
+                               sink);
+        pad = true;
+    }
+    zz_clear(&q);
+    if (!ret) {
+        ret = write_digits_rec(&r, base, chunk, powers, level - 1, pad, buf,
+                               sink);
+    }
+    zz_clear(&r);
+    return ret;
+}
+
+static PyObject *
+write_digits(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+             PyObject *kwnames)
+{
+    static const char *const keywords[] = {"file", "base", "chunk"};
+    const static gmp_pyargs fnargs = {
+        .keywords = keywords,
+        .maxpos = 3,
+        .minargs = 1,
+        .maxargs = 3,
+        .fname = "write_digits",
+    };
+    Py_ssize_t argidx[3] = {-1, -1, -1};
+
+    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
+        return NULL;
+    }
+
+    int base = 10;
+    Py_ssize_t chunk = 65536;
+
+    if (argidx[1] != -1) {
+        PyObject *arg = args[argidx[1]];
+
+        if (!PyLong_Check(arg)) {
+            PyErr_SetString(PyExc_TypeError,
+                            "write_digits() takes an integer argument 'base'");
+            return NULL;
+        }
+        base = PyLong_AsInt(arg);
+        if (base == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+    if (base < 2 || base > 36) {
+        PyErr_SetString(PyExc_ValueError, "mpz base must be >= 2 and <= 36");
+        return NULL;
+    }
+    if (argidx[2] != -1) {
+        PyObject *arg = args[argidx[2]];
+
+        if (!PyLong_Check(arg)) {
+            PyErr_SetString(PyExc_TypeError,
+                            ("write_digits() takes an integer argument"
+                             " 'chunk'"));
+            return NULL;
+        }
+        chunk = PyLong_AsSsize_t(arg);
+        if (chunk == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (chunk < 1) {
+            PyErr_SetString(PyExc_ValueError, "chunk must be positive");
+            return NULL;
+        }
+    }
+
+    PyObject *file = args[argidx[0]];
+    digits_sink sink = {NULL, NULL, false, 0};
+
+    if (PyLong_Check(file)) {
+        PyObject *os = PyImport_ImportModule("os");
+
+        if (!os) {
+            return NULL; /* LCOV_EXCL_LINE */
+        }
+        sink.write = PyObject_GetAttrString(os, "write");
+        sink.fd = file;
+        Py_DECREF(os);
+        if (!sink.write) {
+            return NULL; /* LCOV_EXCL_LINE */
+        }
+    }
+    else {
+        PyObject *io = PyImport_ImportModule("io");
+
+        if (!io) {
+            return NULL; /* LCOV_EXCL_LINE */
+        }
+
+        PyObject *textio = PyObject_GetAttrString(io, "TextIOBase");
+
+        Py_DECREF(io);
+        if (!textio) {
+            return NULL; /* LCOV_EXCL_LINE */
+        }
+
+        int is_text = PyObject_IsInstance(file, textio);
+
+        Py_DECREF(textio);
+        if (is_text < 0) {
+            return NULL; /* LCOV_EXCL_LINE */
+        }
+        sink.text = is_text;
+        if (PyObject_GetOptionalAttrString(file, "write", &sink.write) < 0) {
+            return NULL; /* LCOV_EXCL_LINE */
+        }
+        if (!sink.write) {
+            PyErr_SetString(PyExc_TypeError,
+                            ("write_digits() argument must be a file object"
+                             " or a file descriptor"));
+            return NULL;
+        }
+    }
+
+    const zz_t *u = &((MPZ_Object *)self)->z;
+    zz_t *powers = NULL, absu;
+    Py_ssize_t npowers = 0, len = chunk;
+    size_t ndigits;
+    char *buf = NULL;
+    PyObject *res = NULL;
+
+    if (zz_isneg(u)) {
+        if (digits_sink_write(&sink, "-", 1)) {
+            goto end;
+        }
+        absu = *u;
+        absu.negative = false;
+        u = &absu;
+    }
+    (void)zz_sizeinbase(u, base, &ndigits);
+    /* Find the number of powers, needed to split u to chunks. */
+    while (len < (Py_ssize_t)ndigits) {
+        npowers++;
+        len = len > PY_SSIZE_T_MAX/2 ? PY_SSIZE_T_MAX : 2*len;
+    }
+    buf = malloc((size_t)Py_MIN(chunk, (Py_ssize_t)ndigits) + 2);
+    if (npowers) {
+        powers = malloc((size_t)npowers*sizeof(zz_t));
+    }
+    if (!buf || (npowers && !powers)) {
+        /* LCOV_EXCL_START */
+        npowers = 0;
+        PyErr_NoMemory();
+        goto end;
+        /* LCOV_EXCL_STOP */
+    }
+    for (Py_ssize_t i = 0; i < npowers; i++) {
+        zz_err ret = zz_init(&powers[i]);
+
+        if (!ret) {
+            ret = (i ? zz_mul(&powers[i - 1], &powers[i - 1], &powers[i])
+                   : zz_set(base, &powers[i]));
+        }
+        if (!ret && !i) {
+            ret = zz_pow(&powers[0], (zz_bitcnt_t)chunk, &powers[0]);
+        }
+        if (ret) {
+            /* LCOV_EXCL_START */
+            npowers = i + 1;
+            PyErr_NoMemory();
+            goto end;
+            /* LCOV_EXCL_STOP */
+        }
+    }
+    if (!write_digits_rec(u, base, chunk, powers, npowers - 1, false, buf,
+                          &sink))
+    {
+        res = PyLong_FromSsize_t(sink.count);
+    }
+end:
+    for (Py_ssize_t i = 0; i < npowers; i++) {
+        zz_clear(&powers[i]);
+    }
+    free(powers);
+    free(buf);
+    Py_DECREF(sink.write);
+    return res;
+}
+
+/* Parser state of mpz.read_digits(). */
+#define READ_DIGITS_BLOCK 65536
+#define READ_DIGITS_CHUNK 65536
+#define READ_DIGITS_DEPTH 64
+
+typedef enum {
+    RD_LEAD,   /* leading whitespace */
+    RD_SIGN,   /* after the sign */
+    RD_ZERO,   /* after the leading zero, which may start a prefix */
+    RD_PREFIX, /* after the base prefix */
+    RD_DIGIT,  /* after a digit */
+    RD_UNDER,  /* after an underscore */
+    RD_TRAIL,  /* trailing whitespace */
+} digits_reader_state;
+
+typedef struct {
+    int base;
+    int orig_base;
+    digits_reader_state state;
+    bool negative;
+    bool zeros_only; /* literal with a leading zero in base 0 */
+    Py_ssize_t pos;  /* number of characters, processed so far */
+    /* Digits are collected to blocks, then converted and pushed to the
+       stack.  Entries of the stack have decreasing number of digits,
+       READ_DIGITS_BLOCK*2**k, equal entries are combined with
+       powers[k] = base**(READ_DIGITS_BLOCK*2**k), like a binary
+       counter, so the work is subquadratic. */
+    char block[READ_DIGITS_BLOCK + 1];
+    Py_ssize_t block_len;
+    zz_t stack[READ_DIGITS_DEPTH];
+    Py_ssize_t ndigits[READ_DIGITS_DEPTH];
+    Py_ssize_t depth;
+    zz_t powers[READ_DIGITS_DEPTH];
+    Py_ssize_t npowers;
+} digits_reader;
+
+static void
+digits_reader_clear(digits_reader *rd)
+{
+    for (Py_ssize_t i = 0; i < rd->depth; i++) {
+        zz_clear(&rd->stack[i]);
+    }
+    for (Py_ssize_t i = 0; i < rd->npowers; i++) {
+        zz_clear(&rd->powers[i]);
+    }
+    free(rd);
+}
+
+/* Make sure, that powers[k] is computed.  Return -1 on error. */
+static int
+digits_reader_power(digits_reader *rd, Py_ssize_t k)
+{
+    while (rd->npowers <= k) {
+        Py_ssize_t i = rd->npowers;
+        zz_err ret = zz_init(&rd->powers[i]);
+
+        if (!ret) {
+            ret = (i ? zz_mul(&rd->powers[i - 1], &rd->powers[i - 1],
+                              &rd->powers[i])
+                   : zz_set(rd->base, &rd->powers[i]));
+        }
+        if (!ret && !i) {
+            ret = zz_pow(&rd->powers[0], READ_DIGITS_BLOCK, &rd->powers[0]);
+        }
+        rd->npowers++;
+        if (ret) {
+            /* LCOV_EXCL_START */
+            PyErr_NoMemory();
+            return -1;
+            /* LCOV_EXCL_STOP */
+        }
+    }
+    return 0;
+}
+
+/* Return k, such that n == READ_DIGITS_BLOCK*2**k or -1. */
+static Py_ssize_t
+digits_reader_level(Py_ssize_t n)
+{
+    Py_ssize_t k = 0;
+
+    while (((Py_ssize_t)READ_DIGITS_BLOCK << k) < n) {
+        k++;
+    }
+    return ((Py_ssize_t)READ_DIGITS_BLOCK << k) == n ? k : -1;
+}
+
+/* Convert the current block and push it to the stack.  Return -1 on
+   error (with exception set). */
+static int
+digits_reader_flush(digits_reader *rd)
+{
+    Py_ssize_t d = rd->depth;
+
+    rd->block[rd->block_len] = '\0';
+    if (zz_init(&rd->stack[d])
+        || zz_set_str(rd->block, rd->base, &rd->stack[d]))
+    {
+        /* LCOV_EXCL_START */
+        zz_clear(&rd->stack[d]);
+        PyErr_NoMemory();
+        return -1;
+        /* LCOV_EXCL_STOP */
+    }
+    rd->ndigits[d] = rd->block_len;
+    rd->depth = ++d;
+    rd->block_len = 0;
+    while (d >= 2 && rd->ndigits[d - 1] == rd->ndigits[d - 2]) {
+        Py_ssize_t k = digits_reader_level(rd->ndigits[d - 1]);
+
+        if (digits_reader_power(rd, k)) {
+            return -1; /* LCOV_EXCL_LINE */
+        }
+        if (zz_mul(&rd->stack[d - 2], &rd->powers[k], &rd->stack[d - 2])
+            || zz_add(&rd->stack[d - 2], &rd->stack[d - 1],
+                      &rd->stack[d - 2]))
+        {
+            /* LCOV_EXCL_START */
+            PyErr_NoMemory();
+            return -1;
+            /* LCOV_EXCL_STOP */
+        }
+        zz_clear(&rd->stack[d - 1]);
+        rd->ndigits[d - 2] *= 2;
+        rd->depth = --d;
+    }
+    return 0;
+}
+
+static int
+digits_reader_error(const digits_reader *rd)
+{
+    PyErr_Format(PyExc_ValueError,
+                 "invalid literal for mpz() with base %d at position %zd",
+                 rd->orig_base, rd->pos);
+    return -1;
+}
+
+static bool
+is_ascii_space(char c)
+{
+    return c == ' ' || ('\t' <= c && c <= '\r');
+}
+
+static int
+digit_value(char c)
+{
+    if ('0' <= c && c <= '9') {
+        return c - '0';
+    }
+    if ('a' <= c && c <= 'z') {
+        return c - 'a' + 10;
+    }
+    if ('A' <= c && c <= 'Z') {
+        return c - 'A' + 10;
+    }
+    return 99;
+}
+
+/* Feed len characters of str to the parser.  Return -1 on error. */
+static int
+digits_reader_feed(digits_reader *rd, const char *str, Py_ssize_t len)
+{
+    for (Py_ssize_t i = 0; i < len; i++, rd->pos++) {
+        char c = str[i];
+
+        switch (rd->state) {
+        case RD_LEAD:
+            if (is_ascii_space(c)) {
+                continue;
+            }
+            if (c == '+' || c == '-') {
+                rd->negative = c == '-';
+                rd->state = RD_SIGN;
+                continue;
+            }
+            /* fall through */
+        case RD_SIGN:
+            if (c == '0' && (rd->base == 0 || rd->base == 2
+                             || rd->base == 8 || rd->base == 16))
+            {
+                rd->state = RD_ZERO;
+                continue;
+            }
+            break;
+        case RD_ZERO:
+        {
+            int pbase = 0;
+
+            switch (c) {
+            case 'b': case 'B':
+                pbase = 2;
+                break;
+            case 'o': case 'O':
+                pbase = 8;
+                break;
+            case 'x': case 'X':
+                pbase = 16;
+                break;
+            }
+            if (pbase && (rd->base == 0 || rd->base == pbase)) {
+                rd->base = pbase;
+                rd->state = RD_PREFIX;
+                continue;
+            }
+            /* That was a digit. */
+            if (rd->base == 0) {
+                rd->base = 10;
+                rd->zeros_only = true;
+            }
+            rd->block[rd->block_len++] = '0';
+            rd->state = RD_DIGIT;
+            goto digit;
+        }
+        case RD_PREFIX:
+        case RD_DIGIT:
+digit:
+            if (c == '_') {
+                rd->state = RD_UNDER;
+                continue;
+            }
+            if (rd->state == RD_DIGIT && is_ascii_space(c)) {
+                rd->state = RD_TRAIL;
+                continue;
+            }
+            break;
+        case RD_UNDER:
+            break;
+        case RD_TRAIL:
+            if (is_ascii_space(c)) {
+                continue;
+            }
+            return digits_reader_error(rd);
+        }
+        /* Only a digit is expected here. */
+        if (rd->base == 0) {
+            rd->base = 10;
+        }
+
+        int d = digit_value(c);
+
+        if (d >= rd->base || (rd->zeros_only && d)) {
+            return digits_reader_error(rd);
+        }
+        if (rd->block_len == READ_DIGITS_BLOCK
+            && digits_reader_flush(rd))
+        {
+            return -1; /* LCOV_EXCL_LINE */
+        }
+        rd->block[rd->block_len++] = c;
+        rd->state = RD_DIGIT;
+    }
+    return 0;
+}
+
+/* Finish parsing, return the result. */
+static MPZ_Object *
+digits_reader_finish(digits_reader *rd)
+{
+    if (rd->state == RD_ZERO) {
+        rd->block[rd->block_len++] = '0';
+        if (rd->base == 0) {
+            rd->base = 10;
+        }
+    }
+    else if (rd->state != RD_DIGIT && rd->state != RD_TRAIL) {
+        digits_reader_error(rd);
+        return NULL;
+    }
+    if (rd->block_len && digits_reader_flush(rd)) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+
+    MPZ_Object *res = MPZ_new();
+    zz_t pow;
+
+    if (!res || zz_init(&pow)) {
+        /* LCOV_EXCL_START */
+        Py_XDECREF(res);
+        return (MPZ_Object *)PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+
+    Py_ssize_t d = rd->depth - 1;
+    zz_t tmp;
+    zz_err ret = zz_init(&tmp);
+
+    /* Combine entries, starting from least significant digits, pow is
+       base**n, where n is the number of digits processed so far. */
+    if (!ret && !(ret = zz_pos(&rd->stack[d], &res->z))
+        && !(ret = zz_set(rd->base, &pow)))
+    {
+        ret = zz_pow(&pow, (zz_bitcnt_t)rd->ndigits[d], &pow);
+    }
+    while (!ret && d-- > 0) {
+        if (!(ret = zz_mul(&rd->stack[d], &pow, &tmp))) {
+            ret = zz_add(&res->z, &tmp, &res->z);
+        }
+        if (!ret && d) {
+            Py_ssize_t k = digits_reader_level(rd->ndigits[d]);
+
+            if (digits_reader_power(rd, k)) {
+                /* LCOV_EXCL_START */
+                zz_clear(&tmp);
+                zz_clear(&pow);
+                Py_DECREF(res);
+                return NULL;
+                /* LCOV_EXCL_STOP */
+            }
+            ret = zz_mul(&pow, &rd->powers[k], &pow);
+        }
+    }
+    zz_clear(&tmp);
+    zz_clear(&pow);
+    if (!ret && rd->negative) {
+        ret = zz_neg(&res->z, &res->z);
+    }
+    if (ret) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(res);
+        return (MPZ_Object *)PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    return res;
+}
+
+static PyObject *
+read_digits(PyTypeObject *Py_UNUSED(type), PyObject *const *args,
+            Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const keywords[] = {"file", "base"};
+    const static gmp_pyargs fnargs = {
+        .keywords = keywords,
+        .maxpos = 2,
+        .minargs = 1,
+        .maxargs = 2,
+        .fname = "read_digits",
+    };
+    Py_ssize_t argidx[2] = {-1, -1};
+
+    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
+        return NULL;
+    }
+
+    int base = 10;
+
+    if (argidx[1] != -1) {
+        PyObject *arg = args[argidx[1]];
+
+        if (!PyLong_Check(arg)) {
+            PyErr_SetString(PyExc_TypeError,
+                            "read_digits() takes an integer argument 'base'");
+            return NULL;
+        }
+        base = PyLong_AsInt(arg);
+        if (base == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+    if (base && (base < 2 || base > 36)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "mpz base must be >= 2 and <= 36, or 0");
+        return NULL;
+    }
+
+    digits_reader *rd = malloc(sizeof(digits_reader));
+
+    if (!rd) {
+        return PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+    rd->base = rd->orig_base = base;
+    rd->state = RD_LEAD;
+    rd->negative = rd->zeros_only = false;
+    rd->pos = rd->block_len = rd->depth = rd->npowers = 0;
+
+    PyObject *file = args[argidx[0]];
+    MPZ_Object *res = NULL;
+
+    if (PyObject_CheckBuffer(file)) {
+        Py_buffer view;
+
+        if (PyObject_GetBuffer(file, &view, PyBUF_SIMPLE) < 0) {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+        if (!digits_reader_feed(rd, view.buf, view.len)) {
+            res = digits_reader_finish(rd);
+        }
+        PyBuffer_Release(&view);
+        goto end;
+    }
+
+    PyObject *read;
+
+    if (PyObject_GetOptionalAttrString(file, "read", &read) < 0) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    if (!read) {
+        PyErr_SetString(PyExc_TypeError,
+                        ("read_digits() argument must be a bytes-like"
+                         " object or a file object"));
+        goto end;
+    }
+
+    PyObject *size = PyLong_FromLong(READ_DIGITS_CHUNK);
+
+    if (!size) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(read);
+        goto end;
+        /* LCOV_EXCL_STOP */
+    }
+    while (1) {
+        PyObject *data = PyObject_CallOneArg(read, size);
+        int ret = -1;
+
+        if (!data) {
+            break;
+        }
+        if (PyUnicode_Check(data)) {
+            Py_ssize_t len;
+            const char *str = PyUnicode_AsUTF8AndSize(data, &len);
+
+            if (str) {
+                ret = len ? digits_reader_feed(rd, str, len) : 1;
+            }
+        }
+        else if (PyObject_CheckBuffer(data)) {
+            Py_buffer view;
+
+            if (!PyObject_GetBuffer(data, &view, PyBUF_SIMPLE)) {
+                ret = (view.len ? digits_reader_feed(rd, view.buf, view.len)
+                       : 1);
+                PyBuffer_Release(&view);
+            }
+        }
+        else {
+            PyObject *name = PyType_GetFullyQualifiedName(Py_TYPE(data));
+
+            if (name) {
+                PyErr_Format(PyExc_TypeError,
+                             "read() should return bytes or str, not %U",
+                             name);
+                Py_DECREF(name);
+            }
+        }
+        Py_DECREF(data);
+        if (ret) {
+            if (ret == 1) {
+                res = digits_reader_finish(rd);
+            }
+            break;
+        }
+    }
+    Py_DECREF(size);
+    Py_DECREF(read);
+end:
+    digits_reader_clear(rd);
+    return (PyObject *)res;
+}
+
+/* Parse an integer argument d.  If |d| fits in uint32_t, it's stored in
+   *small, else a new reference to mpz(d) is returned in *big.  Neither
+   case creates temporary objects for mpz's or small int's. */
+static int
+get_divisor_arg(PyObject *arg, const char *fname, uint32_t *small,
+                MPZ_Object **big)
+{
+    *big = NULL;
+    if (MPZ_Check(arg)) {
+        const zz_t *d = &((MPZ_Object *)arg)->z;
+
+        if (zz_bitlen(d) <= 32) {
+            int64_t v;
+
+            (void)zz_get(d, &v);
+            *small = (uint32_t)(v < 0 ? -v : v);
+        }
+        else {
+            *big = (MPZ_Object *)Py_NewRef(arg);
+        }
+        return 0;
+    }
+    if (!PyLong_Check(arg)) {
+        PyErr_Format(PyExc_TypeError, "%s() takes integer arguments", fname);
+        return -1;
+    }
+
+    int overflow;
+    long long v = PyLong_AsLongLongAndOverflow(arg, &overflow);
+
+    if (!overflow && v >= -(long long)UINT32_MAX && v <= UINT32_MAX) {
+        *small = (uint32_t)(v < 0 ? -v : v);
+        return 0;
+    }
+    *big = MPZ_from_int(arg);
+    return *big ? 0 : -1;
+}
+
+/* Set *r to arg modulo nonzero d, in range(d). */
+static int
+get_residue_arg(PyObject *arg, const char *fname, uint32_t d, uint32_t *r)
+{
+    if (MPZ_Check(arg)) {
+        const zz_t *u = &((MPZ_Object *)arg)->z;
+
+        *r = zz_mod_u32(u, d);
+        if (zz_isneg(u) && *r) {
+            *r = d - *r;
+        }
+        return 0;
+    }
+    if (!PyLong_Check(arg)) {
+        PyErr_Format(PyExc_TypeError, "%s() takes integer arguments", fname);
+        return -1;
+    }
+
+    int overflow;
+    long long v = PyLong_AsLongLongAndOverflow(arg, &overflow);
+
+    if (!overflow) {
+        uint64_t a = v < 0 ? -(uint64_t)v : (uint64_t)v;
+
+        *r = (uint32_t)(a % d);
+        if (v < 0 && *r) {
+            *r = d - *r;
+        }
+        return 0;
+    }
+
+    MPZ_Object *u = MPZ_from_int(arg);
+
+    if (!u) {
+        return -1; /* LCOV_EXCL_LINE */
+    }
+
+    int ret = get_residue_arg((PyObject *)u, fname, d, r);
+
+    Py_DECREF(u);
+    return ret;
+}
+
+/* Parse a bit count (or a bit index).  Values, that don't fit in
+   zz_bitcnt_t, are saturated: for such k the result can be computed or
+   it's too big anyway. */
+static int
+get_bitcnt_arg(PyObject *arg, const char *fname, const char *negmsg,
+               zz_bitcnt_t *k)
+{
+    if (MPZ_Check(arg)) {
+        const zz_t *v = &((MPZ_Object *)arg)->z;
+
+        if (zz_isneg(v)) {
+            goto negative;
+        }
+
+        uint64_t n;
+
+        *k = zz_get(v, &n) ? UINT64_MAX : n;
+        return 0;
+    }
+    if (!PyLong_Check(arg)) {
+        PyErr_Format(PyExc_TypeError, "%s() takes an integer argument",
+                     fname);
+        return -1;
+    }
+
+    int overflow;
+    long long v = PyLong_AsLongLongAndOverflow(arg, &overflow);
+
+    if (overflow < 0 || (!overflow && v < 0)) {
+negative:
+        PyErr_SetString(PyExc_ValueError, negmsg);
+        return -1;
+    }
+    *k = overflow ? UINT64_MAX : (uint64_t)v;
+    return 0;
+}
+
+static PyObject *
+is_divisible(PyObject *self, PyObject *arg)
+{
+    const zz_t *u = &((MPZ_Object *)self)->z;
+    MPZ_Object *d;
+    uint32_t small;
+
+    if (get_divisor_arg(arg, "is_divisible", &small, &d)) {
+        return NULL;
+    }
+    if (!d) {
+        return PyBool_FromLong(small ? !zz_mod_u32(u, small)
+                               : zz_iszero(u));
+    }
+
+    zz_t r;
+
+    if (zz_init(&r) || zz_div(u, &d->z, NULL, &r)) {
+        /* LCOV_EXCL_START */
+        zz_clear(&r);
+        Py_DECREF(d);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    Py_DECREF(d);
+
+    bool res = zz_iszero(&r);
+
+    zz_clear(&r);
+    return PyBool_FromLong(res);
+}
+
+static PyObject *
+is_divisible_2exp(PyObject *self, PyObject *arg)
+{
+    const zz_t *u = &((MPZ_Object *)self)->z;
+    zz_bitcnt_t k;
+
+    if (get_bitcnt_arg(arg, "is_divisible_2exp", "negative shift count",
+                       &k)) {
+        return NULL;
+    }
+    return PyBool_FromLong(zz_iszero(u) || zz_lsbpos(u) >= k);
+}
+
+static PyObject *
+is_congruent(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    if (nargs != 2) {
+        PyErr_SetString(PyExc_TypeError,
+                        "is_congruent() expects two arguments");
+        return NULL;
+    }
+
+    const zz_t *u = &((MPZ_Object *)self)->z;
+    MPZ_Object *c = NULL, *d;
+    uint32_t small;
+
+    if (get_divisor_arg(args[1], "is_congruent", &small, &d)) {
+        return NULL;
+    }
+    if (!d && small) {
+        uint32_t rc;
+
+        if (get_residue_arg(args[0], "is_congruent", small, &rc)) {
+            return NULL;
+        }
+
+        uint32_t ru = zz_mod_u32(u, small);
+
+        if (zz_isneg(u) && ru) {
+            ru = small - ru;
+        }
+        return PyBool_FromLong(ru == rc);
+    }
+    if (!MPZ_Check(args[0]) && !PyLong_Check(args[0])) {
+        Py_XDECREF(d);
+        PyErr_SetString(PyExc_TypeError,
+                        "is_congruent() takes integer arguments");
+        return NULL;
+    }
+    CHECK_OP_INT(c, args[0]);
+    if (!d) {
+        bool res = zz_cmp(u, &c->z) == ZZ_EQ;
+
+        Py_DECREF(c);
+        return PyBool_FromLong(res);
+    }
+
+    zz_t r;
+
+    if (zz_init(&r) || zz_sub(u, &c->z, &r)
+        || zz_div(&r, &d->z, NULL, &r))
+    {
+        /* LCOV_EXCL_START */
+        zz_clear(&r);
+        Py_DECREF(c);
+        Py_DECREF(d);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    Py_DECREF(c);
+    Py_DECREF(d);
+
+    bool res = zz_iszero(&r);
+
+    zz_clear(&r);
+    return PyBool_FromLong(res);
+end:
+    Py_XDECREF(d);
+    return NULL;
+}
+
+#define DIV_2EXP(name)                                             \
+    static PyObject *                                              \
+    name(PyObject *self, PyObject *arg)                            \
+    {                                                              \
+        zz_bitcnt_t k;                                             \
+                                                                   \
+        if (get_bitcnt_arg(arg, #name, "negative shift count",     \
+                           &k))                                    \
+        {                                                          \
+            return NULL;                                           \
+        }                                                          \
+                                                                   \
+        MPZ_Object *res = MPZ_new();                               \
+        zz_err ret = ZZ_OK;                                        \
+                                                                   \
+        if (res && (ret = zz_##name(&((MPZ_Object *)self)->z, k,   \
+                                    &res->z)))                     \
+        {                                                          \
+            Py_CLEAR(res);                                         \
+            if (ret == ZZ_BUF) {                                   \
+                PyErr_SetString(PyExc_OverflowError,               \
+                                "too many digits in integer");     \
+            }                                                      \
+            else {                                                 \
+                PyErr_NoMemory(); /* LCOV_EXCL_LINE */             \
+            }                                                      \
+        }                                                          \
+        return (PyObject *)res;                                    \
+    }
+
+DIV_2EXP(tdiv_q_2exp)
+DIV_2EXP(tdiv_r_2exp)
+DIV_2EXP(fdiv_q_2exp)
+DIV_2EXP(fdiv_r_2exp)
+DIV_2EXP(cdiv_q_2exp)
+DIV_2EXP(cdiv_r_2exp)
+
+static PyObject *
+bit_count_range(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    MPZ_Object *u = (MPZ_Object *)self;
+
+    if (nargs > 2) {
+        PyErr_SetString(PyExc_TypeError,
+                        "bit_count_range() takes at most two arguments");
+        return NULL;
+    }
+
+    zz_bitcnt_t start = 0, stop = UINT64_MAX;
+
+    if ((nargs > 0 && get_bitcnt_arg(args[0], "bit_count_range",
+                                     "negative bit index", &start))
+        || (nargs > 1 && !Py_IsNone(args[1])
+            && get_bitcnt_arg(args[1], "bit_count_range",
+                              "negative bit index", &stop)))
+    {
+        return NULL;
+    }
+    return PyLong_FromUnsignedLongLong(zz_bitcnt_range(&u->z, start, stop));
+}
+
+static PyObject *
+bit_test(PyObject *self, PyObject *arg)
+{
+    zz_bitcnt_t i;
+
+    if (get_bitcnt_arg(arg, "bit_test", "negative bit index", &i)) {
+        return NULL;
+    }
+    return PyBool_FromLong(zz_tc_testbit(&((MPZ_Object *)self)->z, i));
+}
+
+typedef enum {
+    BIT_CLEAR,
+    BIT_SET,
+    BIT_FLIP,
+} bit_op;
+
+static PyObject *
+bit_change(PyObject *self, PyObject *arg, const char *fname, bit_op op)
+{
+    const zz_t *u = &((MPZ_Object *)self)->z;
+    zz_bitcnt_t i;
+
+    if (get_bitcnt_arg(arg, fname, "negative bit index", &i)) {
+        return NULL;
+    }
+
+    bool bit = zz_tc_testbit(u, i);
+
+    if ((op == BIT_SET && bit) || (op == BIT_CLEAR && !bit)) {
+        return plus(self);
+    }
+
+    /* Changing the bit i adds or subtracts 2**i. */
+    MPZ_Object *res = MPZ_new();
+    zz_err ret = ZZ_OK;
+
+    if (!res) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    if (i >= zz_get_bitcnt_max()) {
+        ret = ZZ_BUF;
+    }
+    if (ret || (ret = zz_set(1, &res->z))
+        || (ret = zz_mul_2exp(&res->z, i, &res->z))
+        || (ret = (bit ? zz_sub(u, &res->z, &res->z)
+                   : zz_add(u, &res->z, &res->z))))
+    {
+        Py_DECREF(res);
+        if (ret == ZZ_BUF) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "too many digits in integer");
+            return NULL;
+        }
+        return PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+    return (PyObject *)res;
+}
+
+static PyObject *
+bit_clear(PyObject *self, PyObject *arg)
+{
+    return bit_change(self, arg, "bit_clear", BIT_CLEAR);
+}
+
+static PyObject *
+bit_set(PyObject *self, PyObject *arg)
+{
+    return bit_change(self, arg, "bit_set", BIT_SET);
+}
+
+static PyObject *
+bit_flip(PyObject *self, PyObject *arg)
+{
+    return bit_change(self, arg, "bit_flip", BIT_FLIP);
+}
+
+static PyObject *
+bit_scan(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+         const char *fname, bool bit)
+{
+    zz_bitcnt_t start = 0, res;
+
+    if (nargs > 1) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s() takes at most one argument", fname);
+        return NULL;
+    }
+    if (nargs && get_bitcnt_arg(args[0], fname, "negative bit index",
+                                &start))
+    {
+        return NULL;
+    }
+
+    const zz_t *u = &((MPZ_Object *)self)->z;
+
+    if (!zz_scan(u, start, bit, &res)) {
+        Py_RETURN_NONE;
+    }
+    if (start >= zz_bitlen(u) && nargs) {
+        /* start may be saturated */
+        return PyNumber_Index(args[0]);
+    }
+    return PyLong_FromUInt64(res);
+}
+
+static PyObject *
+bit_scan0(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    return bit_scan(self, args, nargs, "bit_scan0", false);
+}
+
+static PyObject *
+bit_scan1(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    return bit_scan(self, args, nargs, "bit_scan1", true);
+}
+
+/* Set w to bits start to stop - 1 of u, with the two's complement
+   semantics for negative u.  Digits of u, covering these bits, are
+   shifted and masked directly into a buffer for the result. */
+static zz_err
+zz_tc_bits(const zz_t *u, zz_bitcnt_t start, zz_bitcnt_t stop, zz_t *w)
+{
+    if (!zz_isneg(u) && stop > zz_bitlen(u)) {
+        stop = zz_bitlen(u);
+    }
+    if (stop <= start) {
+        return zz_set(0, w);
+    }
+    if (stop - start > zz_get_bitcnt_max()) {
+        return ZZ_BUF;
+    }
+
+    size_t len = (size_t)((stop - start + bits_per_digit - 1)
+                          /bits_per_digit);
+    zz_digit_t *buf = malloc(len*sizeof(zz_digit_t));
+    zz_digit_t mask = zz_digit_mask();
+    zz_size_t k = (zz_size_t)(start/bits_per_digit), low = zz_low_digit(u);
+    unsigned int off = (unsigned int)(start % bits_per_digit);
+    unsigned int top = (unsigned int)((stop - start) % bits_per_digit);
+
+    if (!buf) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+    for (size_t i = 0; i < len; i++, k++) {
+        zz_digit_t d = zz_tc_digit(u, k, low) >> off;
+
+        if (off) {
+            d |= zz_tc_digit(u, k + 1, low) << (bits_per_digit - off);
+        }
+        buf[i] = d & mask;
+    }
+    if (top) {
+        buf[len - 1] &= mask >> (bits_per_digit - top);
+    }
+
+    zz_err ret = zz_import(len, buf, *zz_get_layout(), w);
+
+    free(buf);
+    return ret;
+}
+
+static PyObject *
+bits(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    if (nargs != 2) {
+        PyErr_SetString(PyExc_TypeError, "bits() expects two arguments");
+        return NULL;
+    }
+
+    zz_bitcnt_t start, stop;
+
+    if (get_bitcnt_arg(args[0], "bits", "negative bit index", &start)
+        || get_bitcnt_arg(args[1], "bits", "negative bit index", &stop))
+    {
+        return NULL;
+    }
+
+    MPZ_Object *res = MPZ_new();
+
+    if (!res) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+
+    zz_err ret = zz_tc_bits(&((MPZ_Object *)self)->z, start, stop,
+                            &res->z);
+
+    if (ret) {
+        Py_DECREF(res);
+        if (ret == ZZ_BUF) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "too many digits in integer");
+            return NULL;
+        }
+        return PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+    return (PyObject *)res;
+}
+
+/* Iterator over indices of set bits, see mpz.iter_set(). */
+typedef struct {
+    PyObject_HEAD
+    MPZ_Object *u;
+    zz_bitcnt_t pos;
+    zz_bitcnt_t stop;
+} SetBits_Object;
+
+static void
+SetBits_dealloc(PyObject *self)
+{
+    Py_DECREF(((SetBits_Object *)self)->u);
+    PyObject_Free(self);
+}
+
+static PyObject *
+SetBits_next(PyObject *self)
+{
+    SetBits_Object *it = (SetBits_Object *)self;
+    zz_bitcnt_t i;
+
+    if (it->pos >= it->stop || !zz_scan(&it->u->z, it->pos, true, &i)
+        || i >= it->stop)
+    {
+        it->pos = it->stop;
+        return NULL;
+    }
+    it->pos = i + 1;
+    return PyLong_FromUInt64(i);
+}
+
+static PyTypeObject SetBits_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gmp._set_bits_iterator",
+    .tp_basicsize = sizeof(SetBits_Object),
+    .tp_dealloc = SetBits_dealloc,
+    .tp_iter = PyObject_SelfIter,
+    .tp_iternext = SetBits_next,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+};
+
+static PyObject *
+iter_set(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    zz_bitcnt_t start = 0, stop = UINT64_MAX;
+
+    if (nargs > 2) {
+        PyErr_SetString(PyExc_TypeError,
+                        "iter_set() takes at most two arguments");
+        return NULL;
+    }
+    if (nargs > 0 && get_bitcnt_arg(args[0], "iter_set",
+                                    "negative bit index", &start))
+    {
+        return NULL;
+    }
+    if (nargs > 1 && !Py_IsNone(args[1])
+        && get_bitcnt_arg(args[1], "iter_set", "negative bit index", &stop))
+    {
+        return NULL;
+    }
+
+    SetBits_Object *it = PyObject_New(SetBits_Object, &SetBits_Type);
+
+    if (!it) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    it->u = (MPZ_Object *)Py_NewRef(self);
+    it->pos = start;
+    it->stop = stop;
+    return (PyObject *)it;
+}
+
+static PyObject *
+to_float_rnd(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+             PyObject *kwnames)
+{
+    static const char *const keywords[] = {"rnd"};
+    const static gmp_pyargs fnargs = {
+        .keywords = keywords,
+        .maxpos = 1,
+        .minargs = 0,
+        .maxargs = 1,
+        .fname = "to_float",
+    };
+    Py_ssize_t argidx[1] = {-1};
+
+    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
+        return NULL;
+    }
+
+    zz_rnd rnd = ZZ_RNDN;
+
+    if (argidx[0] != -1) {
+        rnd = get_round_mode(args[argidx[0]]);
+        if (rnd == (zz_rnd)-1) {
+            return NULL;
+        }
+    }
+
+    double d;
+    zz_err ret = zz_get_dbl_rnd(&((MPZ_Object *)self)->z, rnd, &d);
+
+    if (ret == ZZ_BUF) {
+        PyErr_SetString(PyExc_OverflowError,
+                        "integer too large to convert to float");
+        return NULL;
+    }
+    if (ret) {
+        return PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+    return PyFloat_FromDouble(d);
+}
+
+static PyObject *
+from_float_exact(PyObject *Py_UNUSED(type), PyObject *arg)
+{
+    if (!PyFloat_Check(arg)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "from_float_exact() argument must be a float");
+        return NULL;
+    }
+
+    double d = PyFloat_AS_DOUBLE(arg);
+
+    if (isinf(d)) {
+        PyErr_SetString(PyExc_OverflowError,
+                        "cannot convert float infinity to integer");
+        return NULL;
+    }
+    if (isnan(d)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "cannot convert float NaN to integer");
+        return NULL;
+    }
+
+    int e = 0;
+    int64_t m = (int64_t)ldexp(frexp(d, &e), DBL_MANT_DIG);
+
+    e -= DBL_MANT_DIG;
+    if (m) {
+        /* Strip trailing zeros. */
+        while (!(m & 1)) {
+            m /= 2;
+            e++;
+        }
+    }
+    else {
+        e = 0;
+    }
+
+    MPZ_Object *man = MPZ_new();
+
+    if (!man || zz_set(m, &man->z)) {
+        /* LCOV_EXCL_START */
+        Py_XDECREF(man);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    return Py_BuildValue("(Ni)", man, e);
+}
+
+extern PyObject * __format__(PyObject *self, PyObject *format_spec);
+
+/* Explicit signatures for METH_NOARGS methods are redundant
+   since CPython 3.13. */
+
+static PyMethodDef methods[] = {
+    {"conjugate", (PyCFunction)plus, METH_NOARGS,
+     "conjugate($self, /)\n--\n\nReturns self."},
+    {"bit_length", bit_length, METH_NOARGS,
+     ("bit_length($self, /)\n--\n\nNumber of bits necessary "
+      "to represent self in binary.")},
+    {"bit_count", bit_count, METH_NOARGS,
+     ("bit_count($self, /)\n--\n\nNumber of ones in the binary "
+      "representation of the absolute value of self.")},
+    {"to_bytes", (PyCFunction)to_bytes, METH_FASTCALL | METH_KEYWORDS,
      "to_bytes($self, /, length=1, byteorder=\'big\', *, signed=False)\n--\n\n\
 Return an array of bytes representing self.\n\n\
 The integer is represented using length bytes.  An OverflowError is\n\
@@ -1953,664 +3919,6145 @@ The signed argument indicates whether two’s complement is used."},
      "__sizeof__($self, /)\n--\n\nReturns size of self in memory, in bytes."},
     {"is_integer", is_integer, METH_NOARGS,
      "is_integer($self, /)\n--\n\nReturns True."},
+    {"to_float", (PyCFunction)to_float_rnd, METH_FASTCALL | METH_KEYWORDS,
+     ("to_float($self, rnd='n')\n--\n\n"
+      "Return self, rounded to float in the given direction.\n\n"
+      "Rounding modes are same as for mpmath: 'n' (to nearest), 'f'\n"
+      "(floor), 'c' (ceiling), 'd' (down, toward zero) and 'u' (up,\n"
+      "away from zero).  Raise OverflowError, if the result is infinite.")},
+    {"from_float_exact", from_float_exact, METH_O | METH_CLASS,
+     ("from_float_exact($type, f, /)\n--\n\n"
+      "Return a pair (man, exp) of integers such that f == man*2**exp.\n\n"
+      "The man is odd, unless f is zero.")},
     {"digits", (PyCFunction)digits, METH_FASTCALL | METH_KEYWORDS,
      ("digits($self, base=10)\n--\n\n"
       "Return string representing self in the given base.\n\n"
       "Values for base can range between 2 to 36.")},
+    {"write_digits", (PyCFunction)write_digits,
+     METH_FASTCALL | METH_KEYWORDS,
+     ("write_digits($self, file, base=10, chunk=65536)\n--\n\n"
+      "Write digits of self in the given base to file.\n\n"
+      "The file is either a file object or a file descriptor.  Digits\n"
+      "are computed and written progressively, by chunks of the given\n"
+      "size, so the output starts before the conversion finishes and\n"
+      "the whole string is never kept in memory.  Return the number of\n"
+      "characters written.  If a binary file in non-blocking mode can't\n"
+      "accept data, BlockingIOError is raised.")},
+    {"read_digits", (PyCFunction)read_digits,
+     METH_FASTCALL | METH_KEYWORDS | METH_CLASS,
+     ("read_digits($type, file, base=10)\n--\n\n"
+      "Return the integer, represented by digits in the given base.\n\n"
+      "The file is either a bytes-like object or a file object (binary\n"
+      "or text).  Digits are parsed by chunks, so the whole string is\n"
+      "never kept in memory.  Syntax is same as for mpz(str, base),\n"
+      "except that only ASCII digits and whitespace are accepted.")},
+    {"is_divisible", is_divisible, METH_O,
+     ("is_divisible($self, d, /)\n--\n\n"
+      "Return True if self is divisible by d.\n\n"
+      "Only zero is divisible by zero.")},
+    {"is_divisible_2exp", is_divisible_2exp, METH_O,
+     ("is_divisible_2exp($self, k, /)\n--\n\n"
+      "Return True if self is divisible by 2**k.")},
+    {"is_congruent", (PyCFunction)is_congruent, METH_FASTCALL,
+     ("is_congruent($self, c, d, /)\n--\n\n"
+      "Return True if self is congruent to c modulo d.\n\n"
+      "For zero d, return True only if self == c.")},
+    {"tdiv_q_2exp", tdiv_q_2exp, METH_O,
+     ("tdiv_q_2exp($self, k, /)\n--\n\n"
+      "Return self/2**k, rounded toward zero.")},
+    {"tdiv_r_2exp", tdiv_r_2exp, METH_O,
+     ("tdiv_r_2exp($self, k, /)\n--\n\n"
+      "Return the remainder of self.tdiv_q_2exp(k).\n\n"
+      "The result has the sign of self.")},
+    {"fdiv_q_2exp", fdiv_q_2exp, METH_O,
+     ("fdiv_q_2exp($self, k, /)\n--\n\n"
+      "Return self/2**k, rounded toward minus infinity.\n\n"
+      "This is same as self >> k.")},
+    {"fdiv_r_2exp", fdiv_r_2exp, METH_O,
+     ("fdiv_r_2exp($self, k, /)\n--\n\n"
+      "Return the remainder of self.fdiv_q_2exp(k).\n\n"
+      "The result is nonnegative, same as self % 2**k.")},
+    {"cdiv_q_2exp", cdiv_q_2exp, METH_O,
+     ("cdiv_q_2exp($self, k, /)\n--\n\n"
+      "Return self/2**k, rounded toward plus infinity.")},
+    {"cdiv_r_2exp", cdiv_r_2exp, METH_O,
+     ("cdiv_r_2exp($self, k, /)\n--\n\n"
+      "Return the remainder of self.cdiv_q_2exp(k).\n\n"
+      "The result is nonpositive.")},
+    {"bit_count_range", (PyCFunction)bit_count_range, METH_FASTCALL,
+     ("bit_count_range($self, start=0, stop=None, /)\n--\n\n"
+      "Number of ones in range(start, stop) of bits of abs(self).")},
+    {"bit_test", bit_test, METH_O,
+     ("bit_test($self, i, /)\n--\n\n"
+      "Return the value of the bit i of self.\n\n"
+      "Negative integers are in two's complement, like for bitwise\n"
+      "operations: (-1).bit_test(i) is True for all i.")},
+    {"bit_set", bit_set, METH_O,
+     ("bit_set($self, i, /)\n--\n\n"
+      "Return self with the bit i set, i.e. self | 1 << i.")},
+    {"bit_clear", bit_clear, METH_O,
+     ("bit_clear($self, i, /)\n--\n\n"
+      "Return self with the bit i cleared, i.e. self & ~(1 << i).")},
+    {"bit_flip", bit_flip, METH_O,
+     ("bit_flip($self, i, /)\n--\n\n"
+      "Return self with the bit i inverted, i.e. self ^ 1 << i.")},
+    {"bit_scan0", (PyCFunction)bit_scan0, METH_FASTCALL,
+     ("bit_scan0($self, start=0, /)\n--\n\n"
+      "Return the index of the first clear bit, starting at start.\n\n"
+      "Return None, if there is no such bit.")},
+    {"bit_scan1", (PyCFunction)bit_scan1, METH_FASTCALL,
+     ("bit_scan1($self, start=0, /)\n--\n\n"
+      "Return the index of the first set bit, starting at start.\n\n"
+      "Return None, if there is no such bit.")},
+    {"bits", (PyCFunction)bits, METH_FASTCALL,
+     ("bits($self, start, stop, /)\n--\n\n"
+      "Return the integer, formed by bits start to stop-1 of self.\n\n"
+      "That's (self >> start) % 2**(stop - start), or zero if\n"
+      "stop <= start.")},
+    {"iter_set", (PyCFunction)iter_set, METH_FASTCALL,
+     ("iter_set($self, start=0, stop=None, /)\n--\n\n"
+      "Return an iterator over indices of set bits of self.\n\n"
+      "Only indices in range(start, stop) are produced.  For negative\n"
+      "integers and stop=None the iterator is infinite.")},
     {"_from_bytes", _from_bytes, METH_O | METH_CLASS, NULL},
     {NULL} /* sentinel */
 };
 
-PyDoc_STRVAR(mpz_doc,
-             "mpz(number=0, /)\nmpz(string, /, base=10)\n\n\
-Convert a number or a string to an integer.  If numeric argument is not\n\
-an int subclass, return mpz(int(number)).\n\n\
-If argument is not a number or if base is given, then it must be a string,\n\
-bytes, or bytearray instance representing an integer literal in the\n\
-given base.  The literal can be preceded by '+' or '-' and be surrounded\n\
-by whitespace.  Valid bases are 0 and 2-36.  Base 0 means to interpret \n\
-the base from the string as an integer literal.");
+PyDoc_STRVAR(mpz_doc,
+             "mpz(number=0, /)\nmpz(string, /, base=10)\n\n\
+Convert a number or a string to an integer.  If numeric argument is not\n\
+an int subclass, return mpz(int(number)).\n\n\
+If argument is not a number or if base is given, then it must be a string,\n\
+bytes, or bytearray instance representing an integer literal in the\n\
+given base.  The literal can be preceded by '+' or '-' and be surrounded\n\
+by whitespace.  Valid bases are 0 and 2-36.  Base 0 means to interpret \n\
+the base from the string as an integer literal.");
+
+PyTypeObject MPZ_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gmp.mpz",
+    .tp_basicsize = sizeof(MPZ_Object),
+    .tp_new = new,
+    .tp_dealloc = dealloc,
+    .tp_repr = repr,
+    .tp_str = str,
+    .tp_richcompare = richcompare,
+    .tp_hash = hash,
+    .tp_as_number = &as_number,
+    .tp_getset = getsetters,
+    .tp_methods = methods,
+    .tp_doc = mpz_doc,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_vectorcall = vectorcall,
+};
+
+/* Lowest 64 bits of u in the two's complement. */
+static uint64_t
+zz_get_low64(const zz_t *u)
+{
+    uint64_t res = zz_extract_u64(u, 0);
+
+    return zz_isneg(u) ? -res : res;
+}
+
+/* Set q = u/v, if v divides u (else the result is undefined).  When the
+   quotient is much shorter than the divisor, it's computed from leading
+   bits of operands (giving q or q - 1, like in the Jebelean's algorithm)
+   and then corrected with lowest 64 bits of q = u*v**-1 mod 2**64. */
+static zz_err
+zz_divexact(const zz_t *u, const zz_t *v, zz_t *q)
+{
+    if (zz_iszero(v)) {
+        return ZZ_VAL;
+    }
+
+    zz_bitcnt_t ub = zz_bitlen(u), vb = zz_bitlen(v);
+
+    if (ub < vb || vb < 2*(ub - vb + 1) + 128) {
+        return zz_div(u, v, q, NULL);
+    }
+
+    bool negative = zz_isneg(u) != zz_isneg(v);
+    zz_bitcnt_t t = vb - (ub - vb + 1) - 64, z = zz_lsbpos(v);
+    uint64_t ql, vl = zz_extract_u64(v, z), inv;
+    zz_t a, b, au = *u, av = *v; /* magnitudes, sharing digits */
+    zz_err ret = ZZ_OK;
+
+    au.negative = av.negative = false;
+    /* the lowest bits: (u/2**z)*(v/2**z)**-1 mod 2**64 */
+    inv = vl; /* correct to 3 bits for odd vl */
+    for (int i = 0; i < 5; i++) {
+        inv *= 2 - vl*inv;
+    }
+    ql = zz_extract_u64(u, z)*inv;
+    /* the quotient of leading bits, only they are copied */
+    if (zz_init(&a) || zz_init(&b)) {
+        /* LCOV_EXCL_START */
+        ret = ZZ_MEM;
+        goto end;
+        /* LCOV_EXCL_STOP */
+    }
+    if ((ret = zz_quo_2exp(&au, t, &a)) || (ret = zz_quo_2exp(&av, t, &b))
+        || (ret = zz_div(&a, &b, q, NULL)))
+    {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    if (zz_get_low64(q) != ql && (ret = zz_add(q, 1, q))) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    if (negative) {
+        ret = zz_neg(q, q);
+    }
+end:
+    zz_clear(&a);
+    zz_clear(&b);
+    return ret;
+}
+
+static PyObject *
+gmp_gcd(PyObject *Py_UNUSED(module), PyObject *const *args, Py_ssize_t nargs)
+{
+    MPZ_Object *res = MPZ_new();
+
+    if (!res) {
+        return (PyObject *)res; /* LCOV_EXCL_LINE */
+    }
+    for (Py_ssize_t i = 0; i < nargs; i++) {
+        MPZ_Object *arg;
+
+        CHECK_OP_INT(arg, args[i]);
+        if (zz_cmp(&res->z, 1) == ZZ_EQ) {
+            Py_DECREF(arg);
+            continue;
+        }
+        if (zz_gcdext(&res->z, &arg->z, &res->z, NULL, NULL)) {
+            /* LCOV_EXCL_START */
+            Py_DECREF(res);
+            Py_DECREF(arg);
+            return PyErr_NoMemory();
+            /* LCOV_EXCL_STOP */
+        }
+        Py_DECREF(arg);
+    }
+    return (PyObject *)res;
+end:
+    Py_DECREF(res);
+    return NULL;
+}
+
+static PyObject *
+gmp_gcdext(PyObject *Py_UNUSED(module), PyObject *const *args,
+           Py_ssize_t nargs)
+{
+    if (nargs != 2) {
+        PyErr_SetString(PyExc_TypeError, "gcdext() expects two arguments");
+        return NULL;
+    }
+    MPZ_Object *x = NULL, *y = NULL;
+    MPZ_Object *g = MPZ_new(), *s = MPZ_new(), *t = MPZ_new();
+
+    if (!g || !s || !t) {
+        /* LCOV_EXCL_START */
+        Py_XDECREF((PyObject *)g);
+        Py_XDECREF((PyObject *)s);
+        Py_XDECREF((PyObject *)t);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    CHECK_OP_INT(x, args[0]);
+    CHECK_OP_INT(y, args[1]);
+
+    zz_err ret = zz_gcdext(&x->z, &y->z, &g->z, &s->z, &t->z);
+
+    Py_XDECREF((PyObject *)x);
+    Py_XDECREF((PyObject *)y);
+    if (ret == ZZ_MEM) {
+        return PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+    PyObject *tup = PyTuple_Pack(3, g, s, t);
+
+    Py_DECREF(g);
+    Py_DECREF(s);
+    Py_DECREF(t);
+    return tup;
+end:
+    Py_DECREF(g);
+    Py_DECREF(s);
+    Py_DECREF(t);
+    Py_XDECREF((PyObject *)x);
+    Py_XDECREF((PyObject *)y);
+    return NULL;
+}
+
+static PyObject *
+gmp_lcm(PyObject *Py_UNUSED(module), PyObject *const *args, Py_ssize_t nargs)
+{
+    MPZ_Object *res = MPZ_new();
+
+    if (!res || zz_set(1, &res->z)) {
+        return PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+    for (Py_ssize_t i = 0; i < nargs; i++) {
+        MPZ_Object *arg;
+
+        CHECK_OP_INT(arg, args[i]);
+        if (zz_cmp(&res->z, 0) == ZZ_EQ) {
+            Py_DECREF(arg);
+            continue;
+        }
+
+        zz_err ret = zz_lcm(&res->z, &arg->z, &res->z);
+
+        if (ret) {
+            /* LCOV_EXCL_START */
+            Py_DECREF(res);
+            Py_DECREF(arg);
+            if (ret == ZZ_BUF) {
+                PyErr_SetString(PyExc_OverflowError,
+                                "too many digits in integer");
+                return NULL;
+            }
+            return PyErr_NoMemory();
+            /* LCOV_EXCL_STOP */
+        }
+        Py_DECREF(arg);
+    }
+    return (PyObject *)res;
+end:
+    Py_DECREF(res);
+    return NULL;
+}
+
+static PyObject *
+gmp_divexact(PyObject *Py_UNUSED(module), PyObject *const *args,
+             Py_ssize_t nargs)
+{
+    if (nargs != 2) {
+        PyErr_SetString(PyExc_TypeError, "divexact() expects two arguments");
+        return NULL;
+    }
+
+    MPZ_Object *u = NULL, *v = NULL, *res = MPZ_new();
+
+    if (!res) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    CHECK_OP_INT(u, args[0]);
+    CHECK_OP_INT(v, args[1]);
+
+    zz_err ret = zz_divexact(&u->z, &v->z, &res->z);
+
+    Py_DECREF(u);
+    Py_DECREF(v);
+    if (ret == ZZ_OK) {
+        return (PyObject *)res;
+    }
+    if (ret == ZZ_VAL) {
+        PyErr_SetString(PyExc_ZeroDivisionError, "division by zero");
+    }
+    else {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+    Py_DECREF(res);
+    return NULL;
+end:
+    Py_XDECREF(u);
+    Py_DECREF(res);
+    return NULL;
+}
+
+static PyObject *
+gmp_frexp(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    MPZ_Object *x;
+    PyObject *res = NULL;
+
+    CHECK_OP_INT(x, arg);
+
+    double m = 0;
+    int64_t e = 0;
+
+    if (!zz_iszero(&x->z)) {
+        if (zz_frexp(&x->z, ZZ_RNDN, &m, &e)) {
+            PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+            goto end; /* LCOV_EXCL_LINE */
+        }
+        if (zz_isneg(&x->z)) {
+            m = -m;
+        }
+    }
+    res = Py_BuildValue("(dL)", m, (long long)e);
+end:
+    Py_XDECREF(x);
+    return res;
+}
+
+static PyObject *
+gmp_hamdist(PyObject *Py_UNUSED(module), PyObject *const *args,
+            Py_ssize_t nargs)
+{
+    if (nargs != 2) {
+        PyErr_SetString(PyExc_TypeError, "hamdist() expects two arguments");
+        return NULL;
+    }
+
+    MPZ_Object *u = NULL, *v = NULL;
+
+    CHECK_OP_INT(u, args[0]);
+    CHECK_OP_INT(v, args[1]);
+
+    PyObject *res = NULL;
+
+    if (zz_isneg(&u->z) != zz_isneg(&v->z)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "hamdist() arguments must have same sign");
+    }
+    else {
+        res = PyLong_FromUnsignedLongLong(zz_hamdist(&u->z, &v->z));
+    }
+    Py_DECREF(u);
+    Py_DECREF(v);
+    return res;
+end:
+    Py_XDECREF(u);
+    return NULL;
+}
+
+static PyObject *
+gmp_and_count(PyObject *Py_UNUSED(module), PyObject *const *args,
+              Py_ssize_t nargs)
+{
+    if (nargs != 2) {
+        PyErr_SetString(PyExc_TypeError, "and_count() expects two arguments");
+        return NULL;
+    }
+
+    MPZ_Object *u = NULL, *v = NULL;
+
+    CHECK_OP_INT(u, args[0]);
+    CHECK_OP_INT(v, args[1]);
+
+    PyObject *res = NULL;
+
+    if (zz_isneg(&u->z) && zz_isneg(&v->z)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "and_count() arguments must not be both negative");
+    }
+    else {
+        res = PyLong_FromUnsignedLongLong(zz_and_count(&u->z, &v->z));
+    }
+    Py_DECREF(u);
+    Py_DECREF(v);
+    return res;
+end:
+    Py_XDECREF(u);
+    return NULL;
+}
+
+/* Bitwise reduction of an iterable of integers.  The result is
+   accumulated in place, mpz's from the iterable aren't copied. */
+static PyObject *
+bitwise_reduce(PyObject *arg, const char *fname, int64_t init,
+               zz_err (*func)(const zz_t *, const zz_t *, zz_t *))
+{
+    PyObject *it = PyObject_GetIter(arg);
+
+    if (!it) {
+        return NULL;
+    }
+
+    MPZ_Object *res = MPZ_new();
+
+    if (!res || zz_set(init, &res->z)) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(it);
+        Py_XDECREF(res);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+
+    PyObject *item;
+
+    while ((item = PyIter_Next(it))) {
+        MPZ_Object *x;
+
+        if (MPZ_Check(item)) {
+            x = (MPZ_Object *)item;
+        }
+        else if (PyLong_Check(item)) {
+            x = MPZ_from_int(item);
+            Py_DECREF(item);
+            if (!x) {
+                goto err; /* LCOV_EXCL_LINE */
+            }
+        }
+        else {
+            Py_DECREF(item);
+            PyErr_Format(PyExc_TypeError,
+                         "%s() expects an iterable of integers", fname);
+            goto err;
+        }
+
+        zz_err ret = func(&res->z, &x->z, &res->z);
+
+        Py_DECREF(x);
+        if (ret) {
+            /* LCOV_EXCL_START */
+            PyErr_NoMemory();
+            goto err;
+            /* LCOV_EXCL_STOP */
+        }
+    }
+    if (PyErr_Occurred()) {
+        goto err;
+    }
+    Py_DECREF(it);
+    return (PyObject *)res;
+err:
+    Py_DECREF(it);
+    Py_DECREF(res);
+    return NULL;
+}
+
+static PyObject *
+gmp_and_reduce(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    return bitwise_reduce(arg, "and_reduce", -1, zz_and);
+}
+
+static PyObject *
+gmp_or_reduce(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    return bitwise_reduce(arg, "or_reduce", 0, zz_or);
+}
+
+static PyObject *
+gmp_xor_reduce(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    return bitwise_reduce(arg, "xor_reduce", 0, zz_xor);
+}
+
+static PyObject *
+gmp_isqrt(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    MPZ_Object *x, *root = MPZ_new();
+
+    if (!root) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    CHECK_OP_INT(x, arg);
+
+    zz_err ret = zz_sqrtrem(&x->z, &root->z, NULL);
+
+    Py_DECREF(x);
+    if (ret == ZZ_OK) {
+        return (PyObject *)root;
+    }
+    if (ret == ZZ_VAL) {
+        PyErr_SetString(PyExc_ValueError,
+                        "isqrt() argument must be nonnegative");
+    }
+    else {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+end:
+    Py_DECREF(root);
+    return NULL;
+}
+
+static PyObject *
+gmp_isqrt_rem(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    MPZ_Object *x, *root = MPZ_new(), *rem = MPZ_new();
+    PyObject *tup = NULL;
+
+    if (!root || !rem) {
+        /* LCOV_EXCL_START */
+        Py_XDECREF((PyObject *)root);
+        Py_XDECREF((PyObject *)rem);
+        return NULL;
+        /* LCOV_EXCL_STOP */
+    }
+    CHECK_OP_INT(x, arg);
+
+    zz_err ret = zz_sqrtrem(&x->z, &root->z, &rem->z);
+
+    Py_DECREF(x);
+    if (ret == ZZ_OK) {
+        tup = PyTuple_Pack(2, root, rem);
+    }
+    else if (ret == ZZ_VAL) {
+        PyErr_SetString(PyExc_ValueError,
+                        "isqrt() argument must be nonnegative");
+    }
+    else {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+end:
+    Py_DECREF(root);
+    Py_DECREF(rem);
+    return tup;
+}
+
+/* Set res = n!, using (and filling) the per-thread table of factorials
+   for n < global.fac_cache_size. */
+static zz_err
+zz_fac_cached(uint64_t n, zz_t *res)
+{
+    if (n >= global.fac_cache_size) {
+        return zz_fac((zz_digit_t)n, res);
+    }
+    if (!global.fac_cache) {
+        global.fac_cache = malloc(MAX_FACTORIAL_CACHE*sizeof(zz_t));
+        if (!global.fac_cache) {
+            return ZZ_MEM; /* LCOV_EXCL_LINE */
+        }
+    }
+    while (global.fac_cache_len <= n) {
+        size_t i = global.fac_cache_len;
+        zz_t *f = &global.fac_cache[i];
+
+        if (zz_init(f) || zz_set((int64_t)(i ? i : 1), f)
+            || (i && zz_mul(f, &global.fac_cache[i - 1], f)))
+        {
+            /* LCOV_EXCL_START */
+            zz_clear(f);
+            return ZZ_MEM;
+            /* LCOV_EXCL_STOP */
+        }
+        global.fac_cache_len++;
+    }
+    return zz_pos(&global.fac_cache[n], res);
+}
+
+/* Drop cached factorials for n >= size. */
+static void
+fac_cache_truncate(size_t size)
+{
+    while (global.fac_cache_len > size) {
+        zz_clear(&global.fac_cache[--global.fac_cache_len]);
+    }
+    if (!global.fac_cache_len) {
+        free(global.fac_cache);
+        global.fac_cache = NULL;
+    }
+}
+
+static PyObject *
+gmp_set_factorial_cache(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    Py_ssize_t size = PyLong_AsSsize_t(arg);
+
+    if (size == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (size < 0 || size > MAX_FACTORIAL_CACHE) {
+        PyErr_Format(PyExc_ValueError,
+                     "set_factorial_cache() size must be in range(0, %d)",
+                     MAX_FACTORIAL_CACHE + 1);
+        return NULL;
+    }
+    fac_cache_truncate((size_t)size);
+    global.fac_cache_size = (size_t)size;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+gmp_fac(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    MPZ_Object *x, *res = MPZ_new();
+
+    if (!res) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    CHECK_OP_INT(x, arg);
+    if (zz_isneg(&x->z)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "fac() not defined for negative values");
+        goto err;
+    }
+
+    uint64_t n;
+
+    if (zz_get(&x->z, &n)) {
+overflow:
+        PyErr_Format(PyExc_OverflowError,
+                     "fac() argument should not exceed %ld",
+                     ULONG_MAX);
+        goto err;
+    }
+    Py_XDECREF((PyObject *)x);
+
+    zz_err ret = zz_fac_cached(n, &res->z);
+
+    if (ret) {
+        /* LCOV_EXCL_START */
+        if (ret == ZZ_BUF) {
+            goto overflow;
+        }
+        PyErr_NoMemory();
+        goto err;
+        /* LCOV_EXCL_STOP */
+    }
+    return (PyObject *)res;
+err:
+end:
+    Py_DECREF(res);
+    return NULL;
+}
+
+static PyObject *
+gmp_comb(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    if (nargs != 2) {
+        PyErr_SetString(PyExc_TypeError, "two arguments required");
+        return NULL;
+    }
+
+    MPZ_Object *x, *y, *res = MPZ_new();
+
+    if (!res) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    CHECK_OP_INT(x, args[0]);
+    CHECK_OP_INT(y, args[1]);
+    if (zz_isneg(&x->z) || zz_isneg(&y->z)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "comb() not defined for negative values");
+        goto err;
+    }
+
+    uint64_t n, k;
+
+    if (zz_get(&x->z, &n) || zz_get(&y->z, &k)) {
+overflow:
+        PyErr_Format(PyExc_OverflowError,
+                     "comb() arguments should not exceed %ld",
+                     ULONG_MAX);
+        goto err;
+    }
+    Py_XDECREF((PyObject *)x);
+    Py_XDECREF((PyObject *)y);
+
+    zz_err ret = zz_bin(n, k, &res->z);
+
+    if (ret) {
+        /* LCOV_EXCL_START */
+        if (ret == ZZ_BUF) {
+            goto overflow;
+        }
+        PyErr_NoMemory();
+        goto err;
+        /* LCOV_EXCL_STOP */
+    }
+    return (PyObject *)res;
+err:
+end:
+    Py_DECREF(res);
+    return NULL;
+}
+
+static PyObject *
+gmp_perm(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    if (nargs > 2 || nargs < 1) {
+        PyErr_SetString(PyExc_TypeError, "one or two arguments required");
+        return NULL;
+    }
+    if (nargs == 1) {
+        return gmp_fac(self, args[0]);
+    }
+
+    MPZ_Object *x, *y, *res = MPZ_new();
+
+    if (!res) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    CHECK_OP_INT(x, args[0]);
+    CHECK_OP_INT(y, args[1]);
+    if (zz_isneg(&x->z) || zz_isneg(&y->z)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "perm() not defined for negative values");
+        goto err;
+    }
+
+    uint64_t n, k;
+
+    if (zz_get(&x->z, &n) || zz_get(&y->z, &k)) {
+overflow:
+        PyErr_Format(PyExc_OverflowError,
+                     "perm() arguments should not exceed %ld",
+                     ULONG_MAX);
+        goto err;
+    }
+    Py_XDECREF((PyObject *)x);
+    Py_XDECREF((PyObject *)y);
+    if (k > n) {
+        return (PyObject *)res;
+    }
+
+    MPZ_Object *den = MPZ_new();
+
+    if (!den) {
+        /* LCOV_EXCL_START */
+        PyErr_NoMemory();
+        goto err;
+        /* LCOV_EXCL_STOP */
+    }
+
+    zz_err ret = zz_fac_cached(n, &res->z);
+
+    if (ret || zz_fac_cached(n - k, &den->z)
+        || zz_divexact(&res->z, &den->z, &res->z))
+    {
+        /* LCOV_EXCL_START */
+        Py_DECREF(den);
+        if (ret == ZZ_BUF) {
+            goto overflow;
+        }
+        PyErr_NoMemory();
+        goto err;
+        /* LCOV_EXCL_STOP */
+    }
+    Py_DECREF(den);
+    return (PyObject *)res;
+err:
+end:
+    Py_DECREF(res);
+    return NULL;
+}
+
+/* Convert a sequence of integers to a C array of new references. */
+static MPZ_Object **
+MPZ_array_from_seq(PyObject *obj, const char *fname, Py_ssize_t *len)
+{
+    PyObject *seq = PySequence_Fast(obj, "expected a sequence of integers");
+
+    if (!seq) {
+        return NULL;
+    }
+    *len = PySequence_Fast_GET_SIZE(seq);
+
+    MPZ_Object **res = malloc(((size_t)*len + 1)*sizeof(MPZ_Object *));
+
+    if (!res) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(seq);
+        return (MPZ_Object **)PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    for (Py_ssize_t i = 0; i < *len; i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+
+        if (MPZ_Check(item)) {
+            res[i] = (MPZ_Object *)Py_NewRef(item);
+        }
+        else if (PyLong_Check(item)) {
+            res[i] = MPZ_from_int(item);
+        }
+        else {
+            PyErr_Format(PyExc_TypeError,
+                         "%s() expects a sequence of integers", fname);
+            res[i] = NULL;
+        }
+        if (!res[i]) {
+            while (i--) {
+                Py_DECREF(res[i]);
+            }
+            free(res);
+            Py_DECREF(seq);
+            return NULL;
+        }
+    }
+    Py_DECREF(seq);
+    return res;
+}
+
+static void
+MPZ_array_clear(MPZ_Object **arr, Py_ssize_t len)
+{
+    for (Py_ssize_t i = 0; i < len; i++) {
+        Py_DECREF(arr[i]);
+    }
+    free(arr);
+}
+
+static zz_t *
+zz_array_new(size_t len)
+{
+    zz_t *arr = malloc((len + 1)*sizeof(zz_t));
+
+    if (!arr) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (zz_init(&arr[i])) {
+            /* LCOV_EXCL_START */
+            while (i--) {
+                zz_clear(&arr[i]);
+            }
+            free(arr);
+            return NULL;
+            /* LCOV_EXCL_STOP */
+        }
+    }
+    return arr;
+}
+
+static void
+zz_array_free(zz_t *arr, size_t len)
+{
+    if (arr) {
+        for (size_t i = 0; i < len; i++) {
+            zz_clear(&arr[i]);
+        }
+        free(arr);
+    }
+}
+
+/* Product tree: levels[0] holds copies of the leaves, each next level
+   holds products of adjacent pairs (an odd node is carried up as is),
+   the last level has a single node, the product of all leaves. */
+typedef struct {
+    size_t nlevels;
+    size_t *lens;
+    zz_t **levels;
+} zz_tree;
+
+static void
+zz_tree_clear(zz_tree *tree)
+{
+    for (size_t i = 0; i < tree->nlevels; i++) {
+        zz_array_free(tree->levels[i], tree->lens[i]);
+    }
+    free(tree->levels);
+    free(tree->lens);
+    tree->nlevels = 0;
+    tree->levels = NULL;
+    tree->lens = NULL;
+}
+
+static zz_err
+zz_tree_init(size_t n, const zz_t *const *leaves, zz_tree *tree)
+{
+    size_t nlevels = 1;
+
+    assert(n > 0);
+    for (size_t len = n; len > 1; len = (len + 1)/2) {
+        nlevels++;
+    }
+    tree->nlevels = 0;
+    tree->lens = malloc(nlevels*sizeof(size_t));
+    tree->levels = malloc(nlevels*sizeof(zz_t *));
+    if (!tree->lens || !tree->levels) {
+        /* LCOV_EXCL_START */
+        zz_tree_clear(tree);
+        return ZZ_MEM;
+        /* LCOV_EXCL_STOP */
+    }
+    for (size_t i = 0, len = n; i < nlevels; i++, len = (len + 1)/2) {
+        zz_t *level = zz_array_new(len);
+
+        if (!level) {
+            /* LCOV_EXCL_START */
+            zz_tree_clear(tree);
+            return ZZ_MEM;
+            /* LCOV_EXCL_STOP */
+        }
+        tree->levels[i] = level;
+        tree->lens[i] = len;
+        tree->nlevels++;
+        for (size_t j = 0; j < len; j++) {
+            zz_err ret;
+
+            if (!i) {
+                ret = zz_pos(leaves[j], &level[j]);
+            }
+            else if (2*j + 1 < tree->lens[i - 1]) {
+                ret = zz_mul(&tree->levels[i - 1][2*j],
+                             &tree->levels[i - 1][2*j + 1], &level[j]);
+            }
+            else {
+                ret = zz_pos(&tree->levels[i - 1][2*j], &level[j]);
+            }
+            if (ret) {
+                zz_tree_clear(tree);
+                return ret;
+            }
+        }
+    }
+    return ZZ_OK;
+}
+
+/* Remainder tree: reduce x modulo every node of the product tree (or
+   modulo squares of nodes, if square is true), going from the root down
+   to leaves.  On success, rems holds remainders for all leaves. */
+static zz_err
+zz_tree_rems(const zz_tree *tree, const zz_t *x, bool square, zz_t *rems)
+{
+    size_t top = tree->nlevels - 1, curlen = 1;
+    zz_t *cur = top ? zz_array_new(1) : rems, sq;
+    zz_err ret = ZZ_OK;
+
+    if (!cur || zz_init(&sq)) {
+        /* LCOV_EXCL_START */
+        if (cur != rems) {
+            zz_array_free(cur, 1);
+        }
+        return ZZ_MEM;
+        /* LCOV_EXCL_STOP */
+    }
+
+    const zz_t *node = &tree->levels[top][0];
+
+    if (square) {
+        ret = zz_mul(node, node, &sq);
+        node = &sq;
+    }
+    if (!ret) {
+        ret = zz_div(x, node, NULL, &cur[0]);
+    }
+    for (size_t i = top; !ret && i--;) {
+        size_t len = tree->lens[i];
+        zz_t *next = i ? zz_array_new(len) : rems;
+
+        if (!next) {
+            ret = ZZ_MEM; /* LCOV_EXCL_LINE */
+            break; /* LCOV_EXCL_LINE */
+        }
+        for (size_t j = 0; !ret && j < len; j++) {
+            node = &tree->levels[i][j];
+            if (square) {
+                ret = zz_mul(node, node, &sq);
+                node = &sq;
+            }
+            if (!ret) {
+                ret = zz_div(&cur[j/2], node, NULL, &next[j]);
+            }
+        }
+        zz_array_free(cur, curlen);
+        cur = next;
+        curlen = len;
+    }
+    if (cur != rems) {
+        zz_array_free(cur, curlen); /* LCOV_EXCL_LINE */
+    }
+    zz_clear(&sq);
+    return ret;
+}
+
+/* Bernstein's batch GCD: gcds[i] = gcd(moduli[i], P/moduli[i]), where P is
+   the product of all moduli.  The remainder tree reduces P modulo squares
+   of the product tree nodes, so at leaves we have P mod moduli[i]**2. */
+static zz_err
+zz_batch_gcd(size_t n, const zz_t *const *moduli, zz_t *const *gcds)
+{
+    zz_tree tree;
+    zz_err ret = zz_tree_init(n, moduli, &tree);
+
+    if (ret) {
+        return ret;
+    }
+
+    zz_t *rems = zz_array_new(n);
+
+    if (!rems) {
+        /* LCOV_EXCL_START */
+        zz_tree_clear(&tree);
+        return ZZ_MEM;
+        /* LCOV_EXCL_STOP */
+    }
+    ret = zz_tree_rems(&tree, &tree.levels[tree.nlevels - 1][0], true, rems);
+    for (size_t j = 0; !ret && j < n; j++) {
+        ret = zz_div(&rems[j], moduli[j], &rems[j], NULL);
+        if (!ret) {
+            ret = zz_gcdext(&rems[j], moduli[j], gcds[j], NULL, NULL);
+        }
+    }
+    zz_array_free(rems, n);
+    zz_tree_clear(&tree);
+    return ret;
+}
+
+/* Precompute inverses[i] = (P/moduli[i])**-1 mod moduli[i] for the CRT,
+   where P is the product of all moduli.  Return ZZ_VAL, if moduli are not
+   pairwise coprime. */
+static zz_err
+zz_crt_inverses(const zz_tree *tree, zz_t *inverses)
+{
+    const zz_t *prod = &tree->levels[tree->nlevels - 1][0];
+    zz_err ret = zz_tree_rems(tree, prod, true, inverses);
+    zz_t g, s;
+
+    if (ret || zz_init(&g) || zz_init(&s)) {
+        return ret ? ret : ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+    for (size_t j = 0; !ret && j < tree->lens[0]; j++) {
+        const zz_t *m = &tree->levels[0][j];
+
+        /* (P mod m**2)/m == (P/m) mod m */
+        if ((ret = zz_div(&inverses[j], m, &inverses[j], NULL))
+            || (ret = zz_gcdext(&inverses[j], m, &g, &s, NULL)))
+        {
+            break; /* LCOV_EXCL_LINE */
+        }
+        if (zz_cmp(&g, 1) != ZZ_EQ) {
+            ret = ZZ_VAL;
+            break;
+        }
+        ret = zz_div(&s, m, NULL, &inverses[j]);
+    }
+    zz_clear(&g);
+    zz_clear(&s);
+    return ret;
+}
+
+/* Find x mod P, such that x = residues[i] mod moduli[i] for all i.  Terms
+   residues[i]*inverses[i]*P/moduli[i] are summed bottom-up along the
+   product tree, without computing P/moduli[i] directly. */
+static zz_err
+zz_crt(const zz_tree *tree, const zz_t *inverses,
+       const zz_t *const *residues, zz_t *res)
+{
+    size_t curlen = tree->lens[0];
+    zz_t *cur = zz_array_new(curlen), tmp;
+    zz_err ret = ZZ_OK;
+
+    if (!cur || zz_init(&tmp)) {
+        /* LCOV_EXCL_START */
+        zz_array_free(cur, curlen);
+        return ZZ_MEM;
+        /* LCOV_EXCL_STOP */
+    }
+    for (size_t j = 0; !ret && j < curlen; j++) {
+        ret = zz_mul(residues[j], &inverses[j], &cur[j]);
+        if (!ret) {
+            ret = zz_div(&cur[j], &tree->levels[0][j], NULL, &cur[j]);
+        }
+    }
+    for (size_t i = 1; !ret && i < tree->nlevels; i++) {
+        const zz_t *prev = tree->levels[i - 1];
+        size_t len = tree->lens[i];
+        zz_t *next = zz_array_new(len);
+
+        if (!next) {
+            ret = ZZ_MEM; /* LCOV_EXCL_LINE */
+            break; /* LCOV_EXCL_LINE */
+        }
+        for (size_t j = 0; !ret && j < len; j++) {
+            if (2*j + 1 < curlen) {
+                if (!(ret = zz_mul(&cur[2*j], &prev[2*j + 1], &next[j]))
+                    && !(ret = zz_mul(&cur[2*j + 1], &prev[2*j], &tmp)))
+                {
+                    ret = zz_add(&next[j], &tmp, &next[j]);
+                }
+            }
+            else {
+                ret = zz_pos(&cur[2*j], &next[j]);
+            }
+        }
+        zz_array_free(cur, curlen);
+        cur = next;
+        curlen = len;
+    }
+    if (!ret) {
+        ret = zz_div(&cur[0], &tree->levels[tree->nlevels - 1][0], NULL, res);
+    }
+    zz_array_free(cur, curlen);
+    zz_clear(&tmp);
+    return ret;
+}
+
+static PyObject *
+gmp_batch_gcd(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    Py_ssize_t len;
+    MPZ_Object **moduli = MPZ_array_from_seq(arg, "batch_gcd", &len);
+
+    if (!moduli) {
+        return NULL;
+    }
+
+    PyObject *res = PyList_New(len);
+    const zz_t **zs = malloc(((size_t)len + 1)*sizeof(zz_t *));
+    zz_t **gcds = malloc(((size_t)len + 1)*sizeof(zz_t *));
+
+    if (!res || !zs || !gcds) {
+        /* LCOV_EXCL_START */
+        PyErr_NoMemory();
+        goto err;
+        /* LCOV_EXCL_STOP */
+    }
+    for (Py_ssize_t i = 0; i < len; i++) {
+        if (zz_cmp(&moduli[i]->z, 0) != ZZ_GT) {
+            PyErr_SetString(PyExc_ValueError,
+                            "batch_gcd() moduli must be positive");
+            goto err;
+        }
+        zs[i] = &moduli[i]->z;
+    }
+    for (Py_ssize_t i = 0; i < len; i++) {
+        MPZ_Object *g = MPZ_new();
+
+        if (!g) {
+            goto err; /* LCOV_EXCL_LINE */
+        }
+        PyList_SET_ITEM(res, i, (PyObject *)g);
+        gcds[i] = &g->z;
+    }
+    if (len && zz_batch_gcd((size_t)len, zs, gcds)) {
+        /* LCOV_EXCL_START */
+        PyErr_NoMemory();
+        goto err;
+        /* LCOV_EXCL_STOP */
+    }
+    free(zs);
+    free(gcds);
+    MPZ_array_clear(moduli, len);
+    return res;
+err:
+    Py_XDECREF(res);
+    free(zs);
+    free(gcds);
+    MPZ_array_clear(moduli, len);
+    return NULL;
+}
+
+typedef struct {
+    PyObject_HEAD
+    zz_tree tree;
+    zz_t *inverses;
+} CRTBasis_Object;
+
+static CRTBasis_Object *
+CRTBasis_from_seq(PyTypeObject *type, PyObject *obj, const char *fname,
+                  bool need_inverses)
+{
+    Py_ssize_t len;
+    MPZ_Object **moduli = MPZ_array_from_seq(obj, fname, &len);
+
+    if (!moduli) {
+        return NULL;
+    }
+
+    CRTBasis_Object *res = PyObject_New(CRTBasis_Object, type);
+
+    if (!res) {
+        /* LCOV_EXCL_START */
+        MPZ_array_clear(moduli, len);
+        return NULL;
+        /* LCOV_EXCL_STOP */
+    }
+    res->tree.nlevels = 0;
+    res->tree.lens = NULL;
+    res->tree.levels = NULL;
+    res->inverses = NULL;
+
+    const zz_t **zs = malloc(((size_t)len + 1)*sizeof(zz_t *));
+    zz_err ret = ZZ_OK;
+
+    if (!zs) {
+        /* LCOV_EXCL_START */
+        PyErr_NoMemory();
+        goto err;
+        /* LCOV_EXCL_STOP */
+    }
+    for (Py_ssize_t i = 0; i < len; i++) {
+        if (zz_cmp(&moduli[i]->z, 0) != ZZ_GT) {
+            PyErr_Format(PyExc_ValueError, "%s() moduli must be positive",
+                         fname);
+            goto err;
+        }
+        zs[i] = &moduli[i]->z;
+    }
+    if (len) {
+        ret = zz_tree_init((size_t)len, zs, &res->tree);
+        if (!ret && need_inverses) {
+            res->inverses = zz_array_new((size_t)len);
+            if (!res->inverses) {
+                ret = ZZ_MEM; /* LCOV_EXCL_LINE */
+            }
+            else {
+                ret = zz_crt_inverses(&res->tree, res->inverses);
+            }
+        }
+    }
+    if (ret == ZZ_VAL) {
+        PyErr_Format(PyExc_ValueError,
+                     "%s() moduli must be pairwise coprime", fname);
+        goto err;
+    }
+    if (ret) {
+        /* LCOV_EXCL_START */
+        PyErr_NoMemory();
+        goto err;
+        /* LCOV_EXCL_STOP */
+    }
+    free(zs);
+    MPZ_array_clear(moduli, len);
+    return res;
+err:
+    Py_DECREF(res);
+    free(zs);
+    MPZ_array_clear(moduli, len);
+    return NULL;
+}
+
+static PyObject *
+CRTBasis_new(PyTypeObject *type, PyObject *args, PyObject *keywds)
+{
+    static char *kwlist[] = {"moduli", NULL};
+    PyObject *moduli;
+
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O", kwlist, &moduli)) {
+        return NULL;
+    }
+    return (PyObject *)CRTBasis_from_seq(type, moduli, "CRTBasis", true);
+}
+
+static void
+CRTBasis_dealloc(PyObject *self)
+{
+    CRTBasis_Object *u = (CRTBasis_Object *)self;
+
+    if (u->inverses) {
+        zz_array_free(u->inverses, u->tree.lens[0]);
+    }
+    zz_tree_clear(&u->tree);
+    PyObject_Free(self);
+}
+
+static PyObject *
+CRTBasis_multimod(PyObject *self, PyObject *arg)
+{
+    CRTBasis_Object *u = (CRTBasis_Object *)self;
+    size_t len = u->tree.nlevels ? u->tree.lens[0] : 0;
+    MPZ_Object *x;
+
+    CHECK_OP_INT(x, arg);
+
+    PyObject *res = PyList_New((Py_ssize_t)len);
+    zz_t *rems = zz_array_new(len);
+
+    if (!res || !rems) {
+        /* LCOV_EXCL_START */
+        Py_XDECREF(res);
+        zz_array_free(rems, 0);
+        Py_DECREF(x);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    if (len && zz_tree_rems(&u->tree, &x->z, false, rems)) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(res);
+        zz_array_free(rems, len);
+        Py_DECREF(x);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    Py_DECREF(x);
+    for (size_t i = 0; i < len; i++) {
+        MPZ_Object *r = MPZ_new();
+
+        if (!r || zz_pos(&rems[i], &r->z)) {
+            /* LCOV_EXCL_START */
+            Py_XDECREF(r);
+            Py_DECREF(res);
+            zz_array_free(rems, len);
+            return PyErr_NoMemory();
+            /* LCOV_EXCL_STOP */
+        }
+        PyList_SET_ITEM(res, (Py_ssize_t)i, (PyObject *)r);
+    }
+    zz_array_free(rems, len);
+    return res;
+end:
+    return NULL;
+}
+
+static PyObject *
+CRTBasis_crt(PyObject *self, PyObject *arg)
+{
+    CRTBasis_Object *u = (CRTBasis_Object *)self;
+    size_t len = u->tree.nlevels ? u->tree.lens[0] : 0;
+    Py_ssize_t nres;
+    MPZ_Object **residues = MPZ_array_from_seq(arg, "crt", &nres);
+
+    if (!residues) {
+        return NULL;
+    }
+    if ((size_t)nres != len) {
+        MPZ_array_clear(residues, nres);
+        PyErr_SetString(PyExc_ValueError,
+                        "crt() expects as many residues as moduli");
+        return NULL;
+    }
+
+    MPZ_Object *res = MPZ_new();
+    const zz_t **zs = malloc((len + 1)*sizeof(zz_t *));
+
+    if (!res || !zs) {
+        /* LCOV_EXCL_START */
+        Py_XDECREF(res);
+        free(zs);
+        MPZ_array_clear(residues, nres);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    for (size_t i = 0; i < len; i++) {
+        zs[i] = &residues[i]->z;
+    }
+    if (len && zz_crt(&u->tree, u->inverses, zs, &res->z)) {
+        /* LCOV_EXCL_START */
+        Py_CLEAR(res);
+        PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    free(zs);
+    MPZ_array_clear(residues, nres);
+    return (PyObject *)res;
+}
+
+static PyObject *
+CRTBasis_get_modulus(PyObject *self, void *Py_UNUSED(closure))
+{
+    CRTBasis_Object *u = (CRTBasis_Object *)self;
+    MPZ_Object *res = MPZ_new();
+
+    if (!res) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    if (u->tree.nlevels
+        ? zz_pos(&u->tree.levels[u->tree.nlevels - 1][0], &res->z)
+        : zz_set(1, &res->z))
+    {
+        /* LCOV_EXCL_START */
+        Py_DECREF(res);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    return (PyObject *)res;
+}
+
+static Py_ssize_t
+CRTBasis_length(PyObject *self)
+{
+    CRTBasis_Object *u = (CRTBasis_Object *)self;
+
+    return u->tree.nlevels ? (Py_ssize_t)u->tree.lens[0] : 0;
+}
+
+static PySequenceMethods CRTBasis_as_sequence = {
+    .sq_length = CRTBasis_length,
+};
+
+static PyGetSetDef CRTBasis_getsetters[] = {
+    {"modulus", (getter)CRTBasis_get_modulus, NULL,
+     "the product of all moduli", NULL},
+    {NULL} /* sentinel */
+};
+
+static PyMethodDef CRTBasis_methods[] = {
+    {"multimod", CRTBasis_multimod, METH_O,
+     ("multimod($self, x, /)\n--\n\n"
+      "Return a list of remainders of x modulo each modulus.")},
+    {"crt", CRTBasis_crt, METH_O,
+     ("crt($self, residues, /)\n--\n\n"
+      "Return the unique integer x in range(self.modulus) such that\n"
+      "x % m == r for all moduli m and corresponding residues r.")},
+    {NULL} /* sentinel */
+};
+
+PyDoc_STRVAR(CRTBasis_doc,
+             "CRTBasis(moduli)\n\n\
+Precomputed data for conversions between integers and their residues\n\
+modulo given positive, pairwise coprime moduli.\n\n\
+The product tree of moduli and the inverses, required for the Chinese\n\
+remainder theorem, are computed once, so repeated conversions via\n\
+multimod() and crt() methods are cheaper.");
+
+static PyTypeObject CRTBasis_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gmp.CRTBasis",
+    .tp_basicsize = sizeof(CRTBasis_Object),
+    .tp_new = CRTBasis_new,
+    .tp_dealloc = CRTBasis_dealloc,
+    .tp_as_sequence = &CRTBasis_as_sequence,
+    .tp_getset = CRTBasis_getsetters,
+    .tp_methods = CRTBasis_methods,
+    .tp_doc = CRTBasis_doc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+};
+
+static PyObject *
+gmp_multimod(PyObject *Py_UNUSED(module), PyObject *const *args,
+             Py_ssize_t nargs)
+{
+    if (nargs != 2) {
+        PyErr_SetString(PyExc_TypeError, "multimod() expects two arguments");
+        return NULL;
+    }
+
+    PyObject *basis = (PyObject *)CRTBasis_from_seq(&CRTBasis_Type, args[1],
+                                                    "multimod", false);
+
+    if (!basis) {
+        return NULL;
+    }
+
+    PyObject *res = CRTBasis_multimod(basis, args[0]);
+
+    Py_DECREF(basis);
+    return res;
+}
+
+static PyObject *
+gmp_crt(PyObject *Py_UNUSED(module), PyObject *const *args, Py_ssize_t nargs)
+{
+    if (nargs != 2) {
+        PyErr_SetString(PyExc_TypeError, "crt() expects two arguments");
+        return NULL;
+    }
+
+    PyObject *basis = (PyObject *)CRTBasis_from_seq(&CRTBasis_Type, args[1],
+                                                    "crt", true);
+
+    if (!basis) {
+        return NULL;
+    }
+
+    PyObject *res = CRTBasis_crt(basis, args[0]);
+
+    Py_DECREF(basis);
+    return res;
+}
+
+/* Odd primes below 2**16, in increasing order.  Every composite number
+   below 2**32 has a factor in this table. */
+#define SMALL_PRIMES_BOUND 65536
+#define NSMALL_PRIMES 6541
+
+static uint32_t small_primes[NSMALL_PRIMES];
+
+static void
+init_small_primes(void)
+{
+    static uint8_t sieve[SMALL_PRIMES_BOUND/2];
+    size_t k = 0;
+
+    memset(sieve, 0, sizeof(sieve));
+    for (uint32_t i = 1; i < SMALL_PRIMES_BOUND/2; i++) {
+        uint32_t p = 2*i + 1;
+
+        if (sieve[i]) {
+            continue;
+        }
+        assert(k < NSMALL_PRIMES);
+        small_primes[k++] = p;
+        for (uint32_t j = p*p/2; j < SMALL_PRIMES_BOUND/2; j += p) {
+            sieve[j] = 1;
+        }
+    }
+    assert(k == NSMALL_PRIMES);
+}
+
+/* Compute res[i] = u mod small_primes[i] for i < k and nonnegative u,
+   doing one bignum division per a block of primes (with the product,
+   fitting in int64_t). */
+static zz_err
+zz_mod_small_primes(const zz_t *u, size_t k, uint32_t *res)
+{
+    zz_t r;
+
+    if (zz_init(&r)) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+    for (size_t i = 0; i < k;) {
+        int64_t prod = small_primes[i], rem;
+        size_t j = i + 1;
+
+        while (j < k && prod <= INT64_MAX/small_primes[j]) {
+            prod *= small_primes[j++];
+        }
+        if (zz_div(u, prod, NULL, &r)) {
+            /* LCOV_EXCL_START */
+            zz_clear(&r);
+            return ZZ_MEM;
+            /* LCOV_EXCL_STOP */
+        }
+        (void)zz_get(&r, &rem);
+        for (; i < j; i++) {
+            res[i] = (uint32_t)((uint64_t)rem % small_primes[i]);
+        }
+    }
+    zz_clear(&r);
+    return ZZ_OK;
+}
+
+/* Deterministic test for n < 2**32 by trial division. */
+static bool
+is_prime_u32(uint64_t n)
+{
+    if (n < 2) {
+        return false;
+    }
+    if (n < 4) {
+        return true;
+    }
+    if (!(n & 1)) {
+        return false;
+    }
+    for (size_t i = 0; i < NSMALL_PRIMES; i++) {
+        uint64_t p = small_primes[i];
+
+        if (p*p > n) {
+            break;
+        }
+        if (n % p == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Test bit i of the nonnegative u. */
+static inline bool
+zz_testbit(const zz_t *u, zz_bitcnt_t i)
+{
+    zz_bitcnt_t k = i / bits_per_digit;
+
+    assert(!zz_isneg(u));
+    if (k >= (zz_bitcnt_t)u->size) {
+        return false;
+    }
+    return (u->digits[k] >> (i % bits_per_digit)) & 1;
+}
+
+/* The Jacobi symbol (a/n) for odd positive n. */
+static zz_err
+zz_jacobi(const zz_t *a, const zz_t *n, int *res)
+{
+    zz_t x, y;
+    int t = 1;
+
+    if (zz_init(&x) || zz_init(&y) || zz_div(a, n, NULL, &x)
+        || zz_pos(n, &y))
+    {
+        /* LCOV_EXCL_START */
+err:
+        zz_clear(&x);
+        zz_clear(&y);
+        return ZZ_MEM;
+        /* LCOV_EXCL_STOP */
+    }
+    while (!zz_iszero(&x)) {
+        zz_bitcnt_t z = zz_lsbpos(&x);
+        zz_digit_t y8 = y.digits[0] & 7;
+
+        if (z && zz_quo_2exp(&x, z, &x)) {
+            goto err; /* LCOV_EXCL_LINE */
+        }
+        if ((z & 1) && (y8 == 3 || y8 == 5)) {
+            t = -t;
+        }
+
+        zz_t tmp = x;
+
+        x = y;
+        y = tmp;
+        if ((x.digits[0] & 3) == 3 && (y.digits[0] & 3) == 3) {
+            t = -t;
+        }
+        if (zz_div(&x, &y, NULL, &x)) {
+            goto err; /* LCOV_EXCL_LINE */
+        }
+    }
+    *res = zz_cmp(&y, 1) == ZZ_EQ ? t : 0;
+    zz_clear(&x);
+    zz_clear(&y);
+    return ZZ_OK;
+}
+
+/* Strong probable prime test to the given base for odd n > base. */
+static zz_err
+zz_sprp(const zz_t *n, int64_t base, bool *res)
+{
+    zz_t nm1, d, b, x;
+    zz_err ret = ZZ_OK;
+
+    if (zz_init(&nm1) || zz_init(&d) || zz_init(&b) || zz_init(&x)
+        || zz_sub(n, 1, &nm1))
+    {
+        /* LCOV_EXCL_START */
+        ret = ZZ_MEM;
+        goto end;
+        /* LCOV_EXCL_STOP */
+    }
+
+    zz_bitcnt_t s = zz_lsbpos(&nm1);
+
+    if ((ret = zz_quo_2exp(&nm1, s, &d)) || (ret = zz_set(base, &b))
+        || (ret = zz_powm(&b, &d, n, &x)))
+    {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    *res = true;
+    if (zz_cmp(&x, 1) == ZZ_EQ || zz_cmp(&x, &nm1) == ZZ_EQ) {
+        goto end;
+    }
+    while (--s) {
+        if ((ret = zz_mul(&x, &x, &x)) || (ret = zz_div(&x, n, NULL, &x))) {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+        if (zz_cmp(&x, &nm1) == ZZ_EQ) {
+            goto end;
+        }
+        if (zz_cmp(&x, 1) == ZZ_EQ) {
+            break;
+        }
+    }
+    *res = false;
+end:
+    zz_clear(&nm1);
+    zz_clear(&d);
+    zz_clear(&b);
+    zz_clear(&x);
+    return ret;
+}
+
+/* Replace x with x/2 mod n for odd n. */
+static zz_err
+zz_halfmod(zz_t *x, const zz_t *n)
+{
+    zz_err ret = zz_div(x, n, NULL, x);
+
+    if (!ret && zz_isodd(x)) {
+        ret = zz_add(x, n, x);
+    }
+    if (!ret) {
+        ret = zz_quo_2exp(x, 1, x);
+    }
+    return ret;
+}
+
+/* Strong Lucas probable prime test with parameters, selected by the
+   Selfridge's method A, for odd n, which has no small factors. */
+static zz_err
+zz_strong_lucas(const zz_t *n, bool *res)
+{
+    zz_t D, d, U, V, Qk, t;
+    int64_t Di = 5;
+    zz_err ret = ZZ_OK;
+
+    if (zz_init(&D) || zz_init(&d) || zz_init(&U) || zz_init(&V)
+        || zz_init(&Qk) || zz_init(&t))
+    {
+        /* LCOV_EXCL_START */
+        ret = ZZ_MEM;
+        goto end;
+        /* LCOV_EXCL_STOP */
+    }
+    *res = false;
+    for (;;) {
+        int j;
+
+        if ((ret = zz_set(Di, &D)) || (ret = zz_jacobi(&D, n, &j))) {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+        if (j == -1) {
+            break;
+        }
+        if (j == 0) {
+            goto end;
+        }
+        /* The search never ends for perfect squares. */
+        if (Di == 13) {
+            if ((ret = zz_sqrtrem(n, &t, &U))) {
+                goto end; /* LCOV_EXCL_LINE */
+            }
+            if (zz_iszero(&U)) {
+                goto end;
+            }
+        }
+        Di = Di > 0 ? -(Di + 2) : -(Di - 2);
+    }
+
+    int64_t Q = (1 - Di)/4;
+
+    if ((ret = zz_add(n, 1, &d))) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+
+    zz_bitcnt_t s = zz_lsbpos(&d);
+
+    if ((ret = zz_quo_2exp(&d, s, &d)) || (ret = zz_set(1, &U))
+        || (ret = zz_set(1, &V)) || (ret = zz_set(Q, &Qk)))
+    {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    for (zz_bitcnt_t i = zz_bitlen(&d) - 1; i--;) {
+        /* U_2k = U_k*V_k, V_2k = V_k**2 - 2*Q**k */
+        if ((ret = zz_mul(&U, &V, &U)) || (ret = zz_div(&U, n, NULL, &U))
+            || (ret = zz_mul(&V, &V, &V)) || (ret = zz_sub(&V, &Qk, &V))
+            || (ret = zz_sub(&V, &Qk, &V)) || (ret = zz_div(&V, n, NULL, &V))
+            || (ret = zz_mul(&Qk, &Qk, &Qk))
+            || (ret = zz_div(&Qk, n, NULL, &Qk)))
+        {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+        if (zz_testbit(&d, i)) {
+            /* U_k+1 = (U_k + V_k)/2, V_k+1 = (D*U_k + V_k)/2 */
+            if ((ret = zz_mul(&U, Di, &t)) || (ret = zz_add(&t, &V, &t))
+                || (ret = zz_add(&U, &V, &U)) || (ret = zz_halfmod(&U, n))
+                || (ret = zz_halfmod(&t, n)) || (ret = zz_pos(&t, &V))
+                || (ret = zz_mul(&Qk, Q, &Qk))
+                || (ret = zz_div(&Qk, n, NULL, &Qk)))
+            {
+                goto end; /* LCOV_EXCL_LINE */
+            }
+        }
+    }
+    if (zz_iszero(&U) || zz_iszero(&V)) {
+        *res = true;
+        goto end;
+    }
+    while (--s) {
+        if ((ret = zz_mul(&V, &V, &V)) || (ret = zz_sub(&V, &Qk, &V))
+            || (ret = zz_sub(&V, &Qk, &V)) || (ret = zz_div(&V, n, NULL, &V)))
+        {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+        if (zz_iszero(&V)) {
+            *res = true;
+            goto end;
+        }
+        if ((ret = zz_mul(&Qk, &Qk, &Qk))
+            || (ret = zz_div(&Qk, n, NULL, &Qk)))
+        {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+    }
+end:
+    zz_clear(&D);
+    zz_clear(&d);
+    zz_clear(&U);
+    zz_clear(&V);
+    zz_clear(&Qk);
+    zz_clear(&t);
+    return ret;
+}
+
+/* Baillie-PSW test (plus reps Miller-Rabin tests to bases 3, 5, 7, ...)
+   for odd n >= 2**32 without small factors. */
+static zz_err
+zz_bpsw(const zz_t *n, size_t reps, bool *res)
+{
+    zz_err ret = zz_sprp(n, 2, res);
+
+    if (ret || !*res) {
+        return ret;
+    }
+    ret = zz_strong_lucas(n, res);
+    for (size_t i = 0; !ret && *res && i < reps; i++) {
+        ret = zz_sprp(n, small_primes[i], res);
+    }
+    return ret;
+}
+
+#define TRIAL_DIV_PRIMES 300
+
+static zz_err
+zz_is_prime(const zz_t *n, size_t reps, bool *res)
+{
+    uint64_t v;
+
+    if (zz_isneg(n)) {
+        *res = false;
+        return ZZ_OK;
+    }
+    if (!zz_get(n, &v) && v < ((uint64_t)1 << 32)) {
+        *res = is_prime_u32(v);
+        return ZZ_OK;
+    }
+    if (!zz_isodd(n)) {
+        *res = false;
+        return ZZ_OK;
+    }
+
+    uint32_t rems[TRIAL_DIV_PRIMES];
+
+    if (zz_mod_small_primes(n, TRIAL_DIV_PRIMES, rems)) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+    for (size_t i = 0; i < TRIAL_DIV_PRIMES; i++) {
+        if (!rems[i]) {
+            *res = false;
+            return ZZ_OK;
+        }
+    }
+    if (reps > NSMALL_PRIMES) {
+        reps = NSMALL_PRIMES;
+    }
+    return zz_bpsw(n, reps, res);
+}
+
+/* Find the next (if up is true) or previous prime for n.  Return ZZ_VAL,
+   if there is no prime below n. */
+static zz_err
+zz_next_prime(const zz_t *n, bool up, zz_t *res)
+{
+    uint64_t v;
+
+    if (up ? zz_cmp(n, 2) == ZZ_LT : zz_cmp(n, 2) != ZZ_GT) {
+        return up ? zz_set(2, res) : ZZ_VAL;
+    }
+    /* the greatest prime below 2**32 is 2**32 - 5 */
+    if (!zz_get(n, &v) && v < (1ULL << 32) - 5) {
+        do {
+            v = up ? v + 1 : v - 1;
+        } while (!is_prime_u32(v));
+        return zz_set((int64_t)v, res);
+    }
+
+    int64_t step = up ? 2 : -2;
+    zz_err ret = zz_add(n, zz_isodd(n) ? step : step/2, res);
+    uint32_t rems[TRIAL_DIV_PRIMES];
+
+    if (ret || (ret = zz_mod_small_primes(res, TRIAL_DIV_PRIMES, rems))) {
+        return ret; /* LCOV_EXCL_LINE */
+    }
+    for (;;) {
+        size_t i = 0;
+
+        for (; i < TRIAL_DIV_PRIMES && rems[i]; i++) {
+        }
+        if (i == TRIAL_DIV_PRIMES) {
+            bool is_prime;
+
+            if ((ret = zz_bpsw(res, 0, &is_prime))) {
+                return ret; /* LCOV_EXCL_LINE */
+            }
+            if (is_prime) {
+                return ZZ_OK;
+            }
+        }
+        for (i = 0; i < TRIAL_DIV_PRIMES; i++) {
+            uint32_t p = small_primes[i];
+
+            rems[i] = (uint32_t)(up ? (rems[i] + 2) % p
+                                 : (rems[i] + p - 2) % p);
+        }
+        if ((ret = zz_add(res, step, res))) {
+            return ret; /* LCOV_EXCL_LINE */
+        }
+    }
+}
+
+static PyObject *
+gmp_is_prime(PyObject *Py_UNUSED(module), PyObject *const *args,
+             Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const keywords[] = {"n", "reps"};
+    const static gmp_pyargs fnargs = {
+        .keywords = keywords,
+        .maxpos = 2,
+        .minargs = 1,
+        .maxargs = 2,
+        .fname = "is_prime",
+    };
+    Py_ssize_t argidx[2] = {-1, -1};
+
+    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
+        return NULL;
+    }
+
+    Py_ssize_t reps = 0;
+
+    if (argidx[1] >= 0) {
+        reps = PyLong_AsSsize_t(args[argidx[1]]);
+        if (reps == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (reps < 0) {
+            PyErr_SetString(PyExc_ValueError,
+                            "is_prime() reps must be nonnegative");
+            return NULL;
+        }
+    }
+
+    if (argidx[0] < 0) {
+        PyErr_SetString(PyExc_TypeError,
+                        "is_prime() missing required argument 'n'");
+        return NULL;
+    }
+
+    MPZ_Object *x;
+
+    CHECK_OP_INT(x, args[argidx[0]]);
+
+    bool res;
+    zz_err ret = zz_is_prime(&x->z, (size_t)reps, &res);
+
+    Py_DECREF(x);
+    if (ret) {
+        return PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+    return PyBool_FromLong(res);
+end:
+    return NULL;
+}
+
+static PyObject *
+next_prime_impl(PyObject *arg, bool up)
+{
+    MPZ_Object *x, *res = MPZ_new();
+
+    if (!res) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    CHECK_OP_INT(x, arg);
+
+    zz_err ret = zz_next_prime(&x->z, up, &res->z);
+
+    Py_DECREF(x);
+    if (ret == ZZ_OK) {
+        return (PyObject *)res;
+    }
+    if (ret == ZZ_VAL) {
+        PyErr_SetString(PyExc_ValueError, "no primes below the argument");
+    }
+    else {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+end:
+    Py_DECREF(res);
+    return NULL;
+}
+
+static PyObject *
+gmp_next_prime(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    return next_prime_impl(arg, true);
+}
+
+static PyObject *
+gmp_prev_prime(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    return next_prime_impl(arg, false);
+}
+
+/* Set res = u**-1 mod m, with the sign of m (like pow(u, -1, m) for
+   integers).  Return ZZ_VAL if u isn't invertible. */
+static zz_err
+zz_invert_mod(const zz_t *u, const zz_t *m, zz_t *res)
+{
+    zz_t g, s;
+    zz_err ret = ZZ_OK;
+
+    if (zz_init(&g) || zz_init(&s)
+        || zz_gcdext(u, m, &g, &s, NULL))
+    {
+        /* LCOV_EXCL_START */
+        ret = ZZ_MEM;
+        goto end;
+        /* LCOV_EXCL_STOP */
+    }
+    if (zz_cmp(&g, 1) != ZZ_EQ) {
+        ret = ZZ_VAL;
+        goto end;
+    }
+    ret = zz_div(&s, m, NULL, res);
+end:
+    zz_clear(&g);
+    zz_clear(&s);
+    return ret;
+}
+
+/* The Kronecker symbol (u/n), extending the Jacobi symbol to any n. */
+static zz_err
+zz_kronecker(const zz_t *u, const zz_t *n, int *res)
+{
+    if (zz_iszero(n)) {
+        *res = zz_cmp(u, 1) == ZZ_EQ || zz_cmp(u, -1) == ZZ_EQ;
+        return ZZ_OK;
+    }
+
+    int t = zz_isneg(n) && zz_isneg(u) ? -1 : 1;
+    zz_bitcnt_t v = zz_lsbpos(n);
+    zz_t m;
+    zz_err ret;
+
+    if (v) {
+        int64_t r;
+
+        if (!zz_isodd(u)) {
+            *res = 0;
+            return ZZ_OK;
+        }
+        if ((ret = zz_init(&m)) || (ret = zz_div(u, 8, NULL, &m))) {
+            /* LCOV_EXCL_START */
+            zz_clear(&m);
+            return ret;
+            /* LCOV_EXCL_STOP */
+        }
+        (void)zz_get(&m, &r);
+        zz_clear(&m);
+        /* (u/2) = 1 for u = +-1 mod 8 and -1 for u = +-3 mod 8 */
+        if ((v & 1) && (r == 3 || r == 5)) {
+            t = -t;
+        }
+    }
+    if ((ret = zz_init(&m)) || (ret = zz_abs(n, &m))
+        || (ret = zz_quo_2exp(&m, v, &m)) || (ret = zz_jacobi(u, &m, res)))
+    {
+        /* LCOV_EXCL_START */
+        zz_clear(&m);
+        return ret;
+        /* LCOV_EXCL_STOP */
+    }
+    zz_clear(&m);
+    *res *= t;
+    return ZZ_OK;
+}
+
+/* Set res to the least nonnegative square root of u modulo an odd
+   prime p, using the Tonelli-Shanks algorithm.  Return ZZ_VAL if u is a
+   quadratic nonresidue.  The primality of p isn't checked, but for an
+   odd composite p loops are bounded: ZZ_VAL is returned or res is
+   unspecified. */
+static zz_err
+zz_sqrtmod(const zz_t *u, const zz_t *p, zz_t *res)
+{
+    zz_t a, q, z, c, t, r, b;
+    zz_err ret = ZZ_OK;
+    int j;
+
+    if (zz_init(&a) || zz_init(&q) || zz_init(&z) || zz_init(&c)
+        || zz_init(&t) || zz_init(&r) || zz_init(&b)
+        || zz_div(u, p, NULL, &a) || zz_jacobi(&a, p, &j))
+    {
+        /* LCOV_EXCL_START */
+        ret = ZZ_MEM;
+        goto end;
+        /* LCOV_EXCL_STOP */
+    }
+    if (zz_iszero(&a)) {
+        ret = zz_set(0, res);
+        goto end;
+    }
+    if (j != 1) {
+        ret = ZZ_VAL;
+        goto end;
+    }
+    /* p - 1 = q*2**s with odd q */
+    if ((ret = zz_sub(p, 1, &q))) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+
+    zz_bitcnt_t s = zz_lsbpos(&q);
+
+    if ((ret = zz_quo_2exp(&q, s, &q))) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    /* a quadratic nonresidue z, for prime p the least one is below
+       2*log(p)**2 under the GRH */
+    for (int64_t k = 2;; k++) {
+        if ((ret = zz_set(k, &z)) || (ret = zz_jacobi(&z, p, &j))) {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+        if (j == -1) {
+            break;
+        }
+        if ((uint64_t)k > zz_bitlen(p)*zz_bitlen(p)) {
+            ret = ZZ_VAL;
+            goto end;
+        }
+    }
+    /* c = z**q, t = a**q, r = a**((q + 1)/2) */
+    if ((ret = zz_powm(&z, &q, p, &c)) || (ret = zz_powm(&a, &q, p, &t))
+        || (ret = zz_add(&q, 1, &q)) || (ret = zz_quo_2exp(&q, 1, &q))
+        || (ret = zz_powm(&a, &q, p, &r)))
+    {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    while (zz_cmp(&t, 1) != ZZ_EQ) {
+        /* the least i, such that t**(2**i) = 1 */
+        zz_bitcnt_t i = 0;
+
+        if ((ret = zz_pos(&t, &b))) {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+        while (zz_cmp(&b, 1) != ZZ_EQ && i < s) {
+            if ((ret = zz_mul(&b, &b, &b)) || (ret = zz_div(&b, p, NULL, &b))) {
+                goto end; /* LCOV_EXCL_LINE */
+            }
+            i++;
+        }
+        if (i >= s) {
+            ret = ZZ_VAL; /* p isn't a prime */
+            goto end;
+        }
+        /* b = c**(2**(s - i - 1)) */
+        if ((ret = zz_pos(&c, &b))) {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+        for (zz_bitcnt_t k = 0; k < s - i - 1; k++) {
+            if ((ret = zz_mul(&b, &b, &b)) || (ret = zz_div(&b, p, NULL, &b))) {
+                goto end; /* LCOV_EXCL_LINE */
+            }
+        }
+        s = i;
+        if ((ret = zz_mul(&b, &b, &c)) || (ret = zz_div(&c, p, NULL, &c))
+            || (ret = zz_mul(&t, &c, &t)) || (ret = zz_div(&t, p, NULL, &t))
+            || (ret = zz_mul(&r, &b, &r)) || (ret = zz_div(&r, p, NULL, &r)))
+        {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+    }
+    /* choose the least of r and p - r */
+    if ((ret = zz_sub(p, &r, &b))) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    ret = zz_pos(zz_cmp(&b, &r) == ZZ_LT ? &b : &r, res);
+end:
+    zz_clear(&a);
+    zz_clear(&q);
+    zz_clear(&z);
+    zz_clear(&c);
+    zz_clear(&t);
+    zz_clear(&r);
+    zz_clear(&b);
+    return ret;
+}
+
+static PyObject *
+gmp_invert(PyObject *Py_UNUSED(module), PyObject *const *args,
+           Py_ssize_t nargs)
+{
+    if (nargs != 2) {
+        PyErr_SetString(PyExc_TypeError, "invert() expects two arguments");
+        return NULL;
+    }
+
+    MPZ_Object *x = NULL, *m = NULL, *res = MPZ_new();
+
+    if (!res) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    CHECK_OP_INT(x, args[0]);
+    CHECK_OP_INT(m, args[1]);
+    if (zz_iszero(&m->z)) {
+        PyErr_SetString(PyExc_ZeroDivisionError, "division by zero");
+        goto end;
+    }
+
+    zz_err ret = zz_invert_mod(&x->z, &m->z, &res->z);
+
+    if (ret == ZZ_OK) {
+        Py_DECREF(x);
+        Py_DECREF(m);
+        return (PyObject *)res;
+    }
+    if (ret == ZZ_VAL) {
+        PyErr_SetString(PyExc_ValueError,
+                        "base is not invertible for the given modulus");
+    }
+    else {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+end:
+    Py_XDECREF(x);
+    Py_XDECREF(m);
+    Py_DECREF(res);
+    return NULL;
+}
+
+typedef enum {
+    SYMBOL_JACOBI,
+    SYMBOL_LEGENDRE,
+    SYMBOL_KRONECKER,
+} symbol_kind;
+
+static PyObject *
+symbol_impl(PyObject *const *args, Py_ssize_t nargs, const char *fname,
+            symbol_kind kind)
+{
+    if (nargs != 2) {
+        PyErr_Format(PyExc_TypeError, "%s() expects two arguments", fname);
+        return NULL;
+    }
+
+    MPZ_Object *x = NULL, *n = NULL;
+    PyObject *res = NULL;
+    zz_err ret;
+    int s;
+
+    CHECK_OP_INT(x, args[0]);
+    CHECK_OP_INT(n, args[1]);
+    if (kind == SYMBOL_KRONECKER) {
+        ret = zz_kronecker(&x->z, &n->z, &s);
+    }
+    else if (!zz_isodd(&n->z) || zz_cmp(&n->z, kind == SYMBOL_JACOBI ? 0 : 2)
+                                 != ZZ_GT)
+    {
+        PyErr_Format(PyExc_ValueError, "%s() n must be %s", fname,
+                     kind == SYMBOL_JACOBI ? "odd and positive"
+                                           : "an odd prime");
+        goto end;
+    }
+    else {
+        ret = zz_jacobi(&x->z, &n->z, &s);
+    }
+    if (ret) {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+    else {
+        res = PyLong_FromLong(s);
+    }
+end:
+    Py_XDECREF(x);
+    Py_XDECREF(n);
+    return res;
+}
+
+static PyObject *
+gmp_jacobi(PyObject *Py_UNUSED(module), PyObject *const *args,
+           Py_ssize_t nargs)
+{
+    return symbol_impl(args, nargs, "jacobi", SYMBOL_JACOBI);
+}
+
+static PyObject *
+gmp_legendre(PyObject *Py_UNUSED(module), PyObject *const *args,
+             Py_ssize_t nargs)
+{
+    return symbol_impl(args, nargs, "legendre", SYMBOL_LEGENDRE);
+}
+
+static PyObject *
+gmp_kronecker(PyObject *Py_UNUSED(module), PyObject *const *args,
+              Py_ssize_t nargs)
+{
+    return symbol_impl(args, nargs, "kronecker", SYMBOL_KRONECKER);
+}
+
+static PyObject *
+gmp_sqrtmod(PyObject *Py_UNUSED(module), PyObject *const *args,
+            Py_ssize_t nargs)
+{
+    if (nargs != 2) {
+        PyErr_SetString(PyExc_TypeError, "sqrtmod() expects two arguments");
+        return NULL;
+    }
+
+    MPZ_Object *x = NULL, *p = NULL, *res = MPZ_new();
+
+    if (!res) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    CHECK_OP_INT(x, args[0]);
+    CHECK_OP_INT(p, args[1]);
+
+    zz_err ret;
+
+    /* p isn't tested for primality, but it can't be less than 2 or even */
+    if (zz_cmp(&p->z, 2) == ZZ_LT
+        || (!zz_isodd(&p->z) && zz_cmp(&p->z, 2) != ZZ_EQ))
+    {
+        PyErr_SetString(PyExc_ValueError, "sqrtmod() p must be a prime");
+        goto end;
+    }
+    if (zz_cmp(&p->z, 2) == ZZ_EQ) {
+        ret = zz_div(&x->z, &p->z, NULL, &res->z);
+    }
+    else {
+        ret = zz_sqrtmod(&x->z, &p->z, &res->z);
+    }
+    if (ret == ZZ_OK) {
+        Py_DECREF(x);
+        Py_DECREF(p);
+        return (PyObject *)res;
+    }
+    if (ret == ZZ_VAL) {
+        PyErr_SetString(PyExc_ValueError, "sqrtmod() no square root exists");
+        goto end;
+    }
+    PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+end:
+    Py_XDECREF(x);
+    Py_XDECREF(p);
+    Py_DECREF(res);
+    return NULL;
+}
+
+/* Odd numbers are sieved by primes from the small_primes table in
+   segments.  That's enough to find primes below 2**32, for greater
+   numbers survivors are checked by the Baillie-PSW test. */
+#define SIEVE_SEGMENT 32768
+
+/* Set sieve[i] for i < len, if the odd number low + 2*i has a prime
+   factor p from the small_primes table with p**2 <= low + 2*i, else
+   clear it.  If rems is NULL, low + 2*len must fit in uint64_t, else
+   rems[j] is low mod small_primes[j] for the (big) low, that isn't
+   needed here otherwise. */
+static void
+sieve_segment(uint64_t low, const uint32_t *rems, uint8_t *sieve,
+              size_t len)
+{
+    uint64_t high = low + 2*(uint64_t)len;
+
+    memset(sieve, 0, len);
+    for (size_t i = 0; i < NSMALL_PRIMES; i++) {
+        uint64_t p = small_primes[i], k;
+
+        if (!rems && p*p >= high) {
+            break;
+        }
+        /* first odd multiple of p, not less than low and p**2 */
+        k = (p - (rems ? rems[i] : low % p)) % p;
+        if (k & 1) {
+            k += p;
+        }
+        k /= 2;
+        if (!rems && low + 2*k < p*p) {
+            k = (p*p - low)/2;
+        }
+        for (; k < len; k += p) {
+            sieve[k] = 1;
+        }
+    }
+}
+
+typedef struct {
+    PyObject_HEAD
+    zz_t low;
+    zz_t stop;
+    size_t pos;
+    size_t len;
+    bool need_test;
+    uint8_t sieve[SIEVE_SEGMENT];
+} Primes_Object;
+
+/* Sieve the next segment of odd numbers, starting from low. */
+static zz_err
+primes_fill(Primes_Object *it)
+{
+    zz_t t;
+    uint64_t low, avail;
+
+    if (zz_init(&t) || zz_sub(&it->stop, &it->low, &t)) {
+        /* LCOV_EXCL_START */
+        zz_clear(&t);
+        return ZZ_MEM;
+        /* LCOV_EXCL_STOP */
+    }
+    /* number of odd values in [low, stop) */
+    if (zz_cmp(&t, 0) != ZZ_GT) {
+        it->len = 0;
+    }
+    else if (zz_get(&t, &avail) || avail >= 2*SIEVE_SEGMENT) {
+        it->len = SIEVE_SEGMENT;
+    }
+    else {
+        it->len = (size_t)(avail + 1)/2;
+    }
+    zz_clear(&t);
+    it->pos = 0;
+    if (!it->len) {
+        return ZZ_OK;
+    }
+
+    uint64_t high = 0;
+    bool small = !zz_get(&it->low, &low);
+
+    if (small) {
+        high = low + 2*(uint64_t)it->len;
+        small = high > low;
+    }
+    it->need_test = !small || high > (1ULL << 32);
+    if (small) {
+        sieve_segment(low, NULL, it->sieve, it->len);
+        return ZZ_OK;
+    }
+
+    uint32_t *rems = malloc(NSMALL_PRIMES*sizeof(uint32_t));
+
+    if (!rems || zz_mod_small_primes(&it->low, NSMALL_PRIMES, rems)) {
+        /* LCOV_EXCL_START */
+        free(rems);
+        return ZZ_MEM;
+        /* LCOV_EXCL_STOP */
+    }
+    sieve_segment(0, rems, it->sieve, it->len);
+    free(rems);
+    return ZZ_OK;
+}
+
+static PyObject *
+Primes_new(PyTypeObject *type, PyObject *args, PyObject *keywds)
+{
+    PyObject *start = NULL, *stop = NULL;
+    MPZ_Object *u = NULL, *v = NULL;
+
+    if (keywds && PyDict_Size(keywds)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "primes() takes no keyword arguments");
+        return NULL;
+    }
+    if (!PyArg_UnpackTuple(args, "primes", 1, 2, &start, &stop)) {
+        return NULL;
+    }
+    if (!stop) {
+        stop = start;
+        start = NULL;
+    }
+    if (start) {
+        CHECK_OP_INT(u, start);
+    }
+    CHECK_OP_INT(v, stop);
+
+    Primes_Object *it = PyObject_New(Primes_Object, type);
+
+    if (!it) {
+        /* LCOV_EXCL_START */
+        Py_XDECREF(u);
+        Py_DECREF(v);
+        return NULL;
+        /* LCOV_EXCL_STOP */
+    }
+    if (zz_init(&it->low) || zz_init(&it->stop)) {
+        /* LCOV_EXCL_START */
+        zz_clear(&it->low);
+        PyObject_Free(it);
+        Py_XDECREF(u);
+        Py_DECREF(v);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    it->pos = it->len = 0;
+    if (zz_pos(&v->z, &it->stop)) {
+        goto err; /* LCOV_EXCL_LINE */
+    }
+    if (u && zz_cmp(&u->z, 2) == ZZ_GT) {
+        /* low is the first odd number to check */
+        if (zz_pos(&u->z, &it->low)
+            || (!zz_isodd(&it->low) && zz_add(&it->low, 1, &it->low)))
+        {
+            goto err; /* LCOV_EXCL_LINE */
+        }
+    }
+    else if (zz_set(2, &it->low)) {
+        goto err; /* LCOV_EXCL_LINE */
+    }
+    Py_XDECREF(u);
+    Py_DECREF(v);
+    return (PyObject *)it;
+    /* LCOV_EXCL_START */
+err:
+    Py_XDECREF(u);
+    Py_DECREF(v);
+    Py_DECREF(it);
+    return PyErr_NoMemory();
+    /* LCOV_EXCL_STOP */
+end:
+    Py_XDECREF(u);
+    return NULL;
+}
+
+static void
+Primes_dealloc(PyObject *self)
+{
+    Primes_Object *it = (Primes_Object *)self;
+
+    zz_clear(&it->low);
+    zz_clear(&it->stop);
+    PyObject_Free(self);
+}
+
+static PyObject *
+Primes_next(PyObject *self)
+{
+    Primes_Object *it = (Primes_Object *)self;
+    MPZ_Object *res = MPZ_new();
+
+    if (!res) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    if (zz_cmp(&it->low, 2) == ZZ_EQ) {
+        if (zz_set(3, &it->low)) {
+            goto err; /* LCOV_EXCL_LINE */
+        }
+        if (zz_cmp(&it->stop, 2) == ZZ_GT) {
+            if (zz_set(2, &res->z)) {
+                goto err; /* LCOV_EXCL_LINE */
+            }
+            return (PyObject *)res;
+        }
+    }
+    for (;;) {
+        for (; it->pos < it->len; it->pos++) {
+            bool is_prime = true;
+
+            if (it->sieve[it->pos]) {
+                continue;
+            }
+            if (zz_add(&it->low, 2*(int64_t)it->pos, &res->z)) {
+                goto err; /* LCOV_EXCL_LINE */
+            }
+            if (it->need_test && zz_cmp(&res->z, (int64_t)1 << 32) != ZZ_LT
+                && zz_bpsw(&res->z, 0, &is_prime))
+            {
+                goto err; /* LCOV_EXCL_LINE */
+            }
+            if (is_prime) {
+                it->pos++;
+                return (PyObject *)res;
+            }
+        }
+        if (it->len && zz_add(&it->low, 2*(int64_t)it->len, &it->low)) {
+            goto err; /* LCOV_EXCL_LINE */
+        }
+        if (primes_fill(it)) {
+            goto err; /* LCOV_EXCL_LINE */
+        }
+        if (!it->len) {
+            Py_DECREF(res);
+            return NULL;
+        }
+    }
+    /* LCOV_EXCL_START */
+err:
+    Py_DECREF(res);
+    return PyErr_NoMemory();
+    /* LCOV_EXCL_STOP */
+}
+
+PyDoc_STRVAR(Primes_doc,
+             "primes(stop, /)\nprimes(start, stop, /)\n\n\
+Return an iterator over primes p, such that start <= p < stop.");
+
+static PyTypeObject Primes_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gmp.primes",
+    .tp_basicsize = sizeof(Primes_Object),
+    .tp_new = Primes_new,
+    .tp_dealloc = Primes_dealloc,
+    .tp_iter = PyObject_SelfIter,
+    .tp_iternext = Primes_next,
+    .tp_doc = Primes_doc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+};
+
+/* Set root = floor(u**(1/k)) for nonnegative u and k > 0.  Long roots
+   are approximated recursively from the leading bits of u and then
+   refined by Newton's iteration from above. */
+static zz_err
+zz_iroot(const zz_t *u, uint64_t k, zz_t *root)
+{
+    zz_bitcnt_t b = zz_bitlen(u);
+
+    if (k == 1) {
+        return zz_pos(u, root);
+    }
+    if (b <= k) {
+        return zz_set(zz_iszero(u) ? 0 : 1, root);
+    }
+
+    zz_bitcnt_t rb = b/k;
+    zz_t x, t, q;
+    zz_err ret = ZZ_OK;
+
+    if (zz_init(&x) || zz_init(&t) || zz_init(&q)) {
+        /* LCOV_EXCL_START */
+        ret = ZZ_MEM;
+        goto end;
+        /* LCOV_EXCL_STOP */
+    }
+    if (rb >= 32) {
+        zz_bitcnt_t s = rb/2;
+
+        if ((ret = zz_quo_2exp(u, k*s, &t)) || (ret = zz_iroot(&t, k, &x))
+            || (ret = zz_add(&x, 1, &x)) || (ret = zz_mul_2exp(&x, s, &x)))
+        {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+    }
+    else {
+        /* Short roots are estimated from leading bits of u in double
+           precision, with an error much less than one. */
+        zz_bitcnt_t shift = b > 64 ? b - 64 : 0;
+        double d;
+
+        if ((ret = zz_quo_2exp(u, shift, &t))) {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+        (void)zz_get(&t, &d);
+        d = exp2(log2(d)/(double)k + (double)shift/(double)k);
+        if ((ret = zz_set((int64_t)d + 1, &x))) {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+    }
+    /* x >= root here, iterate x = ((k - 1)*x + u/x**(k - 1))/k, while x
+       decreases. */
+    for (;;) {
+        if ((ret = zz_pow(&x, k - 1, &t)) || (ret = zz_div(u, &t, &q, NULL))
+            || (ret = zz_set((int64_t)(k - 1), &t))
+            || (ret = zz_mul(&t, &x, &t)) || (ret = zz_add(&t, &q, &t))
+            || (ret = zz_set((int64_t)k, &q))
+            || (ret = zz_div(&t, &q, &t, NULL)))
+        {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+        if (zz_cmp(&t, &x) != ZZ_LT) {
+            break;
+        }
+
+        zz_t tmp = x;
+
+        x = t;
+        t = tmp;
+    }
+    ret = zz_pos(&x, root);
+end:
+    zz_clear(&x);
+    zz_clear(&t);
+    zz_clear(&q);
+    return ret;
+}
+
+/* Set root to the k-th root of u, truncated towards zero, and rem to
+   u - root**k (if rem isn't NULL).  Return ZZ_VAL for negative u and
+   even k. */
+static zz_err
+zz_rootrem(const zz_t *u, uint64_t k, zz_t *root, zz_t *rem)
+{
+    bool negative = zz_isneg(u);
+    zz_t a, r;
+    zz_err ret;
+
+    if (negative && !(k & 1)) {
+        return ZZ_VAL;
+    }
+    if (zz_init(&a) || zz_init(&r)) {
+        /* LCOV_EXCL_START */
+        zz_clear(&a);
+        zz_clear(&r);
+        return ZZ_MEM;
+        /* LCOV_EXCL_STOP */
+    }
+    if ((ret = zz_abs(u, &a)) || (ret = zz_iroot(&a, k, &r))
+        || (negative && (ret = zz_neg(&r, &r))))
+    {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    if (rem && ((ret = zz_pow(&r, k, &a)) || (ret = zz_sub(u, &a, rem)))) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    ret = zz_pos(&r, root);
+end:
+    zz_clear(&a);
+    zz_clear(&r);
+    return ret;
+}
+
+/* Integer factorization.  After trial division by primes from the
+   small_primes table, composite cofactors are split by the Pollard-Brent
+   rho method and by the Lenstra's elliptic curve method (ECM) on
+   Montgomery curves with the Suyama's parametrization. */
+typedef enum {
+    FACTOR_AUTO,
+    FACTOR_RHO,
+    FACTOR_ECM,
+} factor_method;
+
+typedef struct {
+    factor_method method;
+    PyObject *clock;
+    double deadline;
+    zz_t *factors;
+    size_t len;
+    size_t alloc;
+    uint8_t *sieve; /* sieve[i] is set, if 2*i + 1 isn't a prime */
+    uint64_t sieve_bound;
+} factor_state;
+
+static void
+factor_state_clear(factor_state *st)
+{
+    zz_array_free(st->factors, st->len);
+    free(st->sieve);
+    Py_XDECREF(st->clock);
+}
+
+/* Check for signals and the deadline.  Return -1 with an exception set,
+   if the computation should be interrupted. */
+static int
+factor_check(factor_state *st)
+{
+    if (PyErr_CheckSignals() < 0) {
+        return -1; /* LCOV_EXCL_LINE */
+    }
+    if (st->clock) {
+        PyObject *now = PyObject_CallNoArgs(st->clock);
+
+        if (!now) {
+            return -1; /* LCOV_EXCL_LINE */
+        }
+
+        double t = PyFloat_AsDouble(now);
+
+        Py_DECREF(now);
+        if (t == -1.0 && PyErr_Occurred()) {
+            return -1; /* LCOV_EXCL_LINE */
+        }
+        if (t > st->deadline) {
+            PyErr_SetString(PyExc_TimeoutError, "factor() timed out");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+factor_push(factor_state *st, const zz_t *p)
+{
+    if (st->len == st->alloc) {
+        size_t alloc = st->alloc ? 2*st->alloc : 16;
+        zz_t *tmp = realloc(st->factors, alloc*sizeof(zz_t));
+
+        if (!tmp) {
+            goto nomem; /* LCOV_EXCL_LINE */
+        }
+        st->factors = tmp;
+        st->alloc = alloc;
+    }
+    if (zz_init(&st->factors[st->len])
+        || zz_pos(p, &st->factors[st->len]))
+    {
+        /* LCOV_EXCL_START */
+        zz_clear(&st->factors[st->len]);
+        goto nomem;
+        /* LCOV_EXCL_STOP */
+    }
+    st->len++;
+    return 0;
+    /* LCOV_EXCL_START */
+nomem:
+    PyErr_NoMemory();
+    return -1;
+    /* LCOV_EXCL_STOP */
+}
+
+/* Sieve odd numbers up to the bound (at most 2**32), extending the
+   sieve from the previous bound. */
+static int
+factor_sieve(factor_state *st, uint64_t bound)
+{
+    if (bound <= st->sieve_bound) {
+        return 0;
+    }
+
+    size_t start = st->sieve ? (size_t)(st->sieve_bound/2 + 1) : 0;
+    size_t len = (size_t)(bound/2 + 1);
+    uint8_t *sieve = realloc(st->sieve, len);
+
+    if (!sieve) {
+        /* LCOV_EXCL_START */
+        PyErr_NoMemory();
+        return -1;
+        /* LCOV_EXCL_STOP */
+    }
+    sieve_segment(2*start + 1, NULL, sieve + start, len - start);
+    sieve[0] = 1;
+    st->sieve = sieve;
+    st->sieve_bound = bound;
+    return 0;
+}
+
+static inline zz_err
+zz_mulmod(const zz_t *u, const zz_t *v, const zz_t *n, zz_t *w)
+{
+    zz_err ret = zz_mul(u, v, w);
+
+    return ret ? ret : zz_div(w, n, NULL, w);
+}
+
+#define RHO_BATCH 128
+
+/* Try to find a nontrivial divisor d of the composite n by the
+   Pollard-Brent rho method with x**2 + c as the iteration function.
+   If budget isn't NULL, at most *budget iterations are done and the
+   budget is decreased by their number.  Return 1 on success, 0 if the
+   cycle was closed without finding a divisor or the budget is exhausted
+   and -1 on errors. */
+static int
+factor_rho(factor_state *st, const zz_t *n, int64_t c, uint64_t *budget,
+           zz_t *d)
+{
+    zz_t x, y, ys, q, t;
+    int res = -1;
+
+    if (zz_init(&x) || zz_init(&y) || zz_init(&ys) || zz_init(&q)
+        || zz_init(&t) || zz_set(2, &y) || zz_set(1, &q) || zz_set(1, d))
+    {
+        goto nomem; /* LCOV_EXCL_LINE */
+    }
+    for (uint64_t r = 1; zz_cmp(d, 1) == ZZ_EQ; r *= 2) {
+        if (zz_pos(&y, &x)) {
+            goto nomem; /* LCOV_EXCL_LINE */
+        }
+        for (uint64_t i = 0; i < r; i++) {
+            if (zz_mulmod(&y, &y, n, &y) || zz_add(&y, c, &y)) {
+                goto nomem; /* LCOV_EXCL_LINE */
+            }
+        }
+        for (uint64_t k = 0; k < r && zz_cmp(d, 1) == ZZ_EQ;
+             k += RHO_BATCH)
+        {
+            if (zz_pos(&y, &ys)) {
+                goto nomem; /* LCOV_EXCL_LINE */
+            }
+            for (uint64_t i = 0; i < RHO_BATCH && i < r - k; i++) {
+                if (zz_mulmod(&y, &y, n, &y) || zz_add(&y, c, &y)
+                    || zz_sub(&x, &y, &t) || zz_mulmod(&q, &t, n, &q))
+                {
+                    goto nomem; /* LCOV_EXCL_LINE */
+                }
+            }
+            if (zz_gcdext(&q, n, d, NULL, NULL)) {
+                goto nomem; /* LCOV_EXCL_LINE */
+            }
+            if (budget) {
+                *budget -= *budget < RHO_BATCH ? *budget : RHO_BATCH;
+            }
+            if (factor_check(st)) {
+                goto end;
+            }
+            if (zz_cmp(d, 1) == ZZ_EQ && budget && !*budget) {
+                res = 0;
+                goto end;
+            }
+        }
+    }
+    /* The batch has collected all factors of n, step back. */
+    if (zz_cmp(d, n) == ZZ_EQ) {
+        do {
+            if (zz_mulmod(&ys, &ys, n, &ys) || zz_add(&ys, c, &ys)
+                || zz_sub(&x, &ys, &t) || zz_gcdext(&t, n, d, NULL, NULL))
+            {
+                goto nomem; /* LCOV_EXCL_LINE */
+            }
+        } while (zz_cmp(d, 1) == ZZ_EQ);
+    }
+    res = zz_cmp(d, n) != ZZ_EQ;
+    goto end;
+    /* LCOV_EXCL_START */
+nomem:
+    PyErr_NoMemory();
+    /* LCOV_EXCL_STOP */
+end:
+    zz_clear(&x);
+    zz_clear(&y);
+    zz_clear(&ys);
+    zz_clear(&q);
+    zz_clear(&t);
+    return res;
+}
+
+/* Points of Montgomery curves in XZ coordinates. */
+typedef struct {
+    zz_t x;
+    zz_t z;
+} ecm_point;
+
+typedef struct {
+    const zz_t *n;
+    zz_t a24; /* (A + 2)/4 */
+    zz_t t1;
+    zz_t t2;
+    zz_t t3;
+    zz_t t4;
+    ecm_point r0;
+    ecm_point r1;
+} ecm_curve;
+
+static ecm_point *
+ecm_points_new(size_t len)
+{
+    ecm_point *arr = malloc(len*sizeof(ecm_point));
+
+    if (!arr) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (zz_init(&arr[i].x) || zz_init(&arr[i].z)) {
+            /* LCOV_EXCL_START */
+            zz_clear(&arr[i].x);
+            zz_clear(&arr[i].z);
+            while (i--) {
+                zz_clear(&arr[i].x);
+                zz_clear(&arr[i].z);
+            }
+            free(arr);
+            return NULL;
+            /* LCOV_EXCL_STOP */
+        }
+    }
+    return arr;
+}
+
+static void
+ecm_points_free(ecm_point *arr, size_t len)
+{
+    if (arr) {
+        for (size_t i = 0; i < len; i++) {
+            zz_clear(&arr[i].x);
+            zz_clear(&arr[i].z);
+        }
+        free(arr);
+    }
+}
+
+/* Set r = 2*p, r may alias p. */
+static zz_err
+ecm_dbl(ecm_curve *c, const ecm_point *p, ecm_point *r)
+{
+    const zz_t *n = c->n;
+
+    if (zz_add(&p->x, &p->z, &c->t1) || zz_mulmod(&c->t1, &c->t1, n, &c->t1)
+        || zz_sub(&p->x, &p->z, &c->t2)
+        || zz_mulmod(&c->t2, &c->t2, n, &c->t2)
+        || zz_sub(&c->t1, &c->t2, &c->t3)
+        || zz_mulmod(&c->t1, &c->t2, n, &r->x)
+        || zz_mulmod(&c->a24, &c->t3, n, &c->t4)
+        || zz_add(&c->t4, &c->t2, &c->t4)
+        || zz_mulmod(&c->t3, &c->t4, n, &r->z))
+    {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+    return ZZ_OK;
+}
+
+/* Set r = p + q, given d = p - q.  The r may alias any argument. */
+static zz_err
+ecm_add(ecm_curve *c, const ecm_point *p, const ecm_point *q,
+        const ecm_point *d, ecm_point *r)
+{
+    const zz_t *n = c->n;
+
+    if (zz_sub(&p->x, &p->z, &c->t1) || zz_add(&q->x, &q->z, &c->t2)
+        || zz_mulmod(&c->t1, &c->t2, n, &c->t1)
+        || zz_add(&p->x, &p->z, &c->t2) || zz_sub(&q->x, &q->z, &c->t3)
+        || zz_mulmod(&c->t2, &c->t3, n, &c->t2)
+        || zz_add(&c->t1, &c->t2, &c->t3)
+        || zz_mulmod(&c->t3, &c->t3, n, &c->t3)
+        || zz_sub(&c->t1, &c->t2, &c->t4)
+        || zz_mulmod(&c->t4, &c->t4, n, &c->t4)
+        || zz_mulmod(&d->z, &c->t3, n, &c->t3)
+        || zz_mulmod(&d->x, &c->t4, n, &c->t4))
+    {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+
+    zz_t tmp = r->x;
+
+    r->x = c->t3;
+    c->t3 = tmp;
+    tmp = r->z;
+    r->z = c->t4;
+    c->t4 = tmp;
+    return ZZ_OK;
+}
+
+/* Set p = k*p (k > 0) with the Montgomery ladder. */
+static zz_err
+ecm_mul(ecm_curve *c, uint64_t k, ecm_point *p)
+{
+    ecm_point *r0 = &c->r0, *r1 = &c->r1;
+
+    if (zz_pos(&p->x, &r0->x) || zz_pos(&p->z, &r0->z) || ecm_dbl(c, p, r1)) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+
+    int i = 63;
+
+    while (!(k >> i)) {
+        i--;
+    }
+    while (i--) {
+        if ((k >> i) & 1) {
+            if (ecm_add(c, r0, r1, p, r0) || ecm_dbl(c, r1, r1)) {
+                return ZZ_MEM; /* LCOV_EXCL_LINE */
+            }
+        }
+        else {
+            if (ecm_add(c, r0, r1, p, r1) || ecm_dbl(c, r0, r0)) {
+                return ZZ_MEM; /* LCOV_EXCL_LINE */
+            }
+        }
+    }
+
+    ecm_point tmp = *p;
+
+    *p = *r0;
+    *r0 = tmp;
+    return ZZ_OK;
+}
+
+/* Stage 1 of the ECM: multiply the point q by powers of all primes up
+   to b1, collected in machine words, and set d = gcd(Z(q), n).  If step
+   is set, the point is multiplied by one prime at a time and the gcd is
+   checked after each step.  Return -1 on errors. */
+static int
+ecm_stage1(factor_state *st, ecm_curve *c, ecm_point *q, uint64_t b1,
+           bool step, zz_t *d)
+{
+    uint64_t k = 1;
+
+    for (uint64_t p = 2; p <= b1; p = p == 2 ? 3 : p + 2) {
+        if (p > 2 && st->sieve[p/2]) {
+            continue;
+        }
+        if (step) {
+            for (uint64_t pe = p; pe <= b1; pe *= p) {
+                if (ecm_mul(c, p, q)
+                    || zz_gcdext(&q->z, c->n, d, NULL, NULL))
+                {
+                    goto nomem; /* LCOV_EXCL_LINE */
+                }
+                if (zz_cmp(d, 1) != ZZ_EQ) {
+                    return 0;
+                }
+            }
+            if (factor_check(st)) {
+                return -1;
+            }
+            continue;
+        }
+
+        uint64_t pe = p;
+
+        while (pe <= b1/p) {
+            pe *= p;
+        }
+        if (k > UINT64_MAX/pe) {
+            if (ecm_mul(c, k, q)) {
+                goto nomem; /* LCOV_EXCL_LINE */
+            }
+            if (factor_check(st)) {
+                return -1;
+            }
+            k = 1;
+        }
+        k *= pe;
+    }
+    if (ecm_mul(c, k, q) || zz_gcdext(&q->z, c->n, d, NULL, NULL)) {
+        goto nomem; /* LCOV_EXCL_LINE */
+    }
+    return 0;
+    /* LCOV_EXCL_START */
+nomem:
+    PyErr_NoMemory();
+    return -1;
+    /* LCOV_EXCL_STOP */
+}
+
+/* Try to find a nontrivial divisor d of the composite n with a single
+   curve of the ECM, given by sigma.  The b1 and b2 are bounds for the
+   stage 1 and the stage 2 (standard continuation), the sieve must cover
+   b2.  Return 1 on success, 0 on failure and -1 on errors. */
+static int
+factor_ecm(factor_state *st, const zz_t *n, int64_t sigma, uint64_t b1,
+           uint64_t b2, zz_t *d)
+{
+    ecm_curve c = {.n = n};
+    ecm_point *q = NULL, *s = NULL;
+    zz_t u, v, g, acc, *beta = NULL;
+    uint64_t D = 2;
+    int res = -1;
+
+    while (4*D*D < b2) {
+        D++;
+    }
+    assert(b1 > 2*D + 1 && b2 <= st->sieve_bound);
+    if (zz_init(&c.a24) || zz_init(&c.t1) || zz_init(&c.t2)
+        || zz_init(&c.t3) || zz_init(&c.t4) || zz_init(&c.r0.x)
+        || zz_init(&c.r0.z) || zz_init(&c.r1.x) || zz_init(&c.r1.z)
+        || zz_init(&u) || zz_init(&v) || zz_init(&g) || zz_init(&acc)
+        || !(q = ecm_points_new(3)) || !(s = ecm_points_new(D + 1))
+        || !(beta = zz_array_new(D + 1)))
+    {
+        goto nomem; /* LCOV_EXCL_LINE */
+    }
+    /* The Suyama's parametrization: u = sigma**2 - 5, v = 4*sigma,
+       the starting point is (u**3 : v**3) and (A + 2)/4 is
+       (v - u)**3*(3*u + v)/(16*u**3*v). */
+    if (zz_set(sigma, &u) || zz_mul(&u, &u, &u) || zz_sub(&u, 5, &u)
+        || zz_div(&u, n, NULL, &u) || zz_set(4*sigma, &v)
+        || zz_div(&v, n, NULL, &v) || zz_mulmod(&u, &u, n, &q->x)
+        || zz_mulmod(&q->x, &u, n, &q->x) || zz_mulmod(&v, &v, n, &q->z)
+        || zz_mulmod(&q->z, &v, n, &q->z) || zz_sub(&v, &u, &g)
+        || zz_mulmod(&g, &g, n, &acc) || zz_mulmod(&acc, &g, n, &acc)
+        || zz_add(&u, &u, &g) || zz_add(&g, &u, &g) || zz_add(&g, &v, &g)
+        || zz_mulmod(&acc, &g, n, &acc) || zz_mulmod(&q->x, &v, n, &g)
+        || zz_mul_2exp(&g, 4, &g) || zz_div(&g, n, NULL, &g)
+        || zz_gcdext(&g, n, d, &c.a24, NULL))
+    {
+        goto nomem; /* LCOV_EXCL_LINE */
+    }
+    if (zz_cmp(d, 1) != ZZ_EQ) {
+        res = zz_cmp(d, n) != ZZ_EQ;
+        goto end;
+    }
+    if (zz_mulmod(&acc, &c.a24, n, &c.a24)) {
+        goto nomem; /* LCOV_EXCL_LINE */
+    }
+
+    /* If all prime factors of n were found at once in the stage 1,
+       backtrack from the starting point, kept in q[1]. */
+    if (zz_pos(&q->x, &q[1].x) || zz_pos(&q->z, &q[1].z)) {
+        goto nomem; /* LCOV_EXCL_LINE */
+    }
+    if (ecm_stage1(st, &c, q, b1, false, d)) {
+        goto end;
+    }
+    if (zz_cmp(d, n) == ZZ_EQ) {
+        ecm_point tmp = q[0];
+
+        q[0] = q[1];
+        q[1] = tmp;
+        if (ecm_stage1(st, &c, q, b1, true, d)) {
+            goto end;
+        }
+    }
+    if (zz_cmp(d, 1) != ZZ_EQ) {
+        res = zz_cmp(d, n) != ZZ_EQ;
+        goto end;
+    }
+
+    /* Stage 2: for every prime p = r + 2*j in (b1, b2] accumulate the
+       cross product X(R)*Z(S[j]) - X(S[j])*Z(R), where R = r*Q,
+       S[j] = 2*j*Q and r runs over odd numbers with the step 2*D. */
+    uint64_t b = b1 & 1 ? b1 : b1 - 1;
+    ecm_point *r = &q[1], *t = &q[2];
+
+    if (ecm_dbl(&c, q, &s[1]) || ecm_dbl(&c, &s[1], &s[2])) {
+        goto nomem; /* LCOV_EXCL_LINE */
+    }
+    for (uint64_t j = 3; j <= D; j++) {
+        if (ecm_add(&c, &s[j - 1], &s[1], &s[j - 2], &s[j])) {
+            goto nomem; /* LCOV_EXCL_LINE */
+        }
+    }
+    for (uint64_t j = 1; j <= D; j++) {
+        if (zz_mulmod(&s[j].x, &s[j].z, n, &beta[j])) {
+            goto nomem; /* LCOV_EXCL_LINE */
+        }
+    }
+    if (zz_pos(&q->x, &r->x) || zz_pos(&q->z, &r->z)
+        || ecm_mul(&c, b, r) || zz_pos(&q->x, &t->x)
+        || zz_pos(&q->z, &t->z) || ecm_mul(&c, b - 2*D, t)
+        || zz_set(1, &acc))
+    {
+        goto nomem; /* LCOV_EXCL_LINE */
+    }
+    for (uint64_t rr = b, i = 0; rr < b2; rr += 2*D, i++) {
+        if (zz_mulmod(&r->x, &r->z, n, &g)) {
+            goto nomem; /* LCOV_EXCL_LINE */
+        }
+        for (uint64_t j = 1; j <= D && rr + 2*j <= b2; j++) {
+            if (st->sieve[(rr + 2*j)/2]) {
+                continue;
+            }
+            /* (X(R) - X(S))*(Z(R) + Z(S)) - X(R)*Z(R) + X(S)*Z(S) */
+            if (zz_sub(&r->x, &s[j].x, &u) || zz_add(&r->z, &s[j].z, &v)
+                || zz_mul(&u, &v, &u) || zz_sub(&u, &g, &u)
+                || zz_add(&u, &beta[j], &u)
+                || zz_mulmod(&acc, &u, n, &acc))
+            {
+                goto nomem; /* LCOV_EXCL_LINE */
+            }
+        }
+        /* (R, T) = (R + S[D], R) */
+        if (ecm_add(&c, r, &s[D], t, t)) {
+            goto nomem; /* LCOV_EXCL_LINE */
+        }
+
+        ecm_point *tmp = r;
+
+        r = t;
+        t = tmp;
+        if (i % 64 == 63 && factor_check(st)) {
+            goto end;
+        }
+    }
+    if (zz_gcdext(&acc, n, d, NULL, NULL)) {
+        goto nomem; /* LCOV_EXCL_LINE */
+    }
+    res = zz_cmp(d, 1) != ZZ_EQ && zz_cmp(d, n) != ZZ_EQ;
+    goto end;
+    /* LCOV_EXCL_START */
+nomem:
+    PyErr_NoMemory();
+    /* LCOV_EXCL_STOP */
+end:
+    zz_clear(&c.a24);
+    zz_clear(&c.t1);
+    zz_clear(&c.t2);
+    zz_clear(&c.t3);
+    zz_clear(&c.t4);
+    zz_clear(&c.r0.x);
+    zz_clear(&c.r0.z);
+    zz_clear(&c.r1.x);
+    zz_clear(&c.r1.z);
+    zz_clear(&u);
+    zz_clear(&v);
+    zz_clear(&g);
+    zz_clear(&acc);
+    ecm_points_free(q, 3);
+    ecm_points_free(s, D + 1);
+    zz_array_free(beta, D + 1);
+    return res;
+}
+
+/* The ECM schedule: stage 1 bounds and numbers of curves for them, the
+   stage 2 bound is 50*b1. */
+static const struct {
+    uint64_t b1;
+    size_t curves;
+} ecm_levels[] = {{2000, 25}, {11000, 90}, {50000, 300}, {250000, 2000}};
+
+#define RHO_MAXITER (1 << 16)
+
+/* Find a nontrivial divisor d of the composite n, that has no small
+   prime factors and isn't a perfect power.  Return 1 on success, 0 if
+   the ECM schedule was exhausted and -1 on errors. */
+static int
+factor_split(factor_state *st, const zz_t *n, zz_t *d)
+{
+    int res;
+
+    if (st->method != FACTOR_ECM) {
+        uint64_t budget = RHO_MAXITER;
+
+        /* Choose another c, if the cycle was closed without finding a
+           divisor. */
+        for (int64_t c = 1; st->method == FACTOR_RHO || budget; c++) {
+            if ((res = factor_rho(st, n, c, st->method == FACTOR_AUTO
+                                            ? &budget : NULL, d)))
+            {
+                return res;
+            }
+        }
+    }
+
+    size_t len = sizeof(ecm_levels)/sizeof(ecm_levels[0]);
+    int64_t sigma = 6;
+
+    for (size_t i = 0; i < len; i++) {
+        uint64_t b1 = ecm_levels[i].b1, b2 = 50*b1;
+
+        if (factor_sieve(st, b2)) {
+            return -1; /* LCOV_EXCL_LINE */
+        }
+        for (size_t j = 0; j < ecm_levels[i].curves; j++) {
+            if ((res = factor_ecm(st, n, sigma++, b1, b2, d))) {
+                return res;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Collect prime factors of n, that has no small prime factors. */
+static int
+factor_rec(factor_state *st, const zz_t *n)
+{
+    zz_t d, q;
+    bool is_prime;
+    int res = -1;
+
+    if (zz_init(&d) || zz_init(&q) || zz_bpsw(n, 0, &is_prime)) {
+        goto nomem; /* LCOV_EXCL_LINE */
+    }
+    if (is_prime) {
+        res = factor_push(st, n);
+        goto end;
+    }
+    /* If n = r**k for a prime k, factor r once and repeat its factors
+       k times.  Here r > 2**16, so k <= bitlen(n)/16. */
+    for (size_t i = 0; i <= NSMALL_PRIMES; i++) {
+        uint64_t k = i ? small_primes[i - 1] : 2;
+
+        if (k > zz_bitlen(n)/16) {
+            break;
+        }
+        if (zz_rootrem(n, k, &d, &q)) {
+            goto nomem; /* LCOV_EXCL_LINE */
+        }
+        if (!zz_iszero(&q)) {
+            continue;
+        }
+
+        size_t start = st->len;
+
+        if (factor_rec(st, &d)) {
+            goto end;
+        }
+
+        size_t stop = st->len;
+
+        for (uint64_t j = 1; j < k; j++) {
+            for (size_t l = start; l < stop; l++) {
+                /* Copy first, factor_push() may move st->factors. */
+                if (zz_pos(&st->factors[l], &q)) {
+                    goto nomem; /* LCOV_EXCL_LINE */
+                }
+                if (factor_push(st, &q)) {
+                    goto end; /* LCOV_EXCL_LINE */
+                }
+            }
+        }
+        res = 0;
+        goto end;
+    }
+    if ((res = factor_split(st, n, &d)) <= 0) {
+        if (!res) {
+            PyErr_SetString(PyExc_RuntimeError,
+                            "factor() failed to split a composite");
+            res = -1;
+        }
+        goto end;
+    }
+    res = -1;
+    if (zz_divexact(n, &d, &q)) {
+        goto nomem; /* LCOV_EXCL_LINE */
+    }
+    res = factor_rec(st, &d) ? -1 : factor_rec(st, &q);
+    goto end;
+    /* LCOV_EXCL_START */
+nomem:
+    PyErr_NoMemory();
+    /* LCOV_EXCL_STOP */
+end:
+    zz_clear(&d);
+    zz_clear(&q);
+    return res;
+}
+
+/* Collect prime factors of the positive n. */
+static int
+factor_impl(factor_state *st, const zz_t *n)
+{
+    zz_t m, q, r;
+    uint32_t *rems = malloc(NSMALL_PRIMES*sizeof(uint32_t));
+    zz_bitcnt_t z = zz_lsbpos(n);
+    int res = -1;
+
+    if (zz_init(&m) || zz_init(&q) || zz_init(&r) || !rems
+        || zz_quo_2exp(n, z, &m) || zz_set(2, &q))
+    {
+        goto nomem; /* LCOV_EXCL_LINE */
+    }
+    while (z--) {
+        if (factor_push(st, &q)) {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+    }
+    if (zz_mod_small_primes(&m, NSMALL_PRIMES, rems)) {
+        goto nomem; /* LCOV_EXCL_LINE */
+    }
+    for (size_t i = 0; i < NSMALL_PRIMES && zz_cmp(&m, 1) != ZZ_EQ; i++) {
+        int64_t p = small_primes[i];
+
+        if (rems[i]) {
+            continue;
+        }
+        for (;;) {
+            if (zz_div(&m, p, &q, &r)) {
+                goto nomem; /* LCOV_EXCL_LINE */
+            }
+            if (!zz_iszero(&r)) {
+                break;
+            }
+
+            zz_t tmp = m;
+
+            m = q;
+            q = tmp;
+            if (zz_set(p, &r) || factor_push(st, &r)) {
+                goto end; /* LCOV_EXCL_LINE */
+            }
+        }
+    }
+    if (zz_cmp(&m, 1) == ZZ_EQ) {
+        res = 0;
+    }
+    /* The least composite without small factors is 65537**2 > 2**32. */
+    else if (zz_cmp(&m, (int64_t)1 << 32) == ZZ_LT) {
+        res = factor_push(st, &m);
+    }
+    else {
+        res = factor_rec(st, &m);
+    }
+    goto end;
+    /* LCOV_EXCL_START */
+nomem:
+    PyErr_NoMemory();
+    /* LCOV_EXCL_STOP */
+end:
+    zz_clear(&m);
+    zz_clear(&q);
+    zz_clear(&r);
+    free(rems);
+    return res;
+}
+
+static int
+zz_qsort_cmp(const void *a, const void *b)
+{
+    zz_ord r = zz_cmp((const zz_t *)a, (const zz_t *)b);
+
+    return r == ZZ_LT ? -1 : r == ZZ_GT;
+}
+
+static PyObject *
+gmp_factor(PyObject *Py_UNUSED(module), PyObject *const *args,
+           Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const keywords[] = {"n", "method", "timeout"};
+    const static gmp_pyargs fnargs = {
+        .keywords = keywords,
+        .maxpos = 3,
+        .minargs = 1,
+        .maxargs = 3,
+        .fname = "factor",
+    };
+    Py_ssize_t argidx[3] = {-1, -1, -1};
+    factor_state st = {.method = FACTOR_AUTO};
+    MPZ_Object *x = NULL;
+    PyObject *res = NULL;
+
+    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
+        return NULL;
+    }
+    if (argidx[0] < 0) {
+        PyErr_SetString(PyExc_TypeError,
+                        "factor() missing required argument 'n'");
+        return NULL;
+    }
+    if (argidx[1] >= 0) {
+        PyObject *method = args[argidx[1]];
+
+        if (!PyUnicode_Check(method)) {
+            goto bad_method;
+        }
+        if (PyUnicode_CompareWithASCIIString(method, "rho") == 0) {
+            st.method = FACTOR_RHO;
+        }
+        else if (PyUnicode_CompareWithASCIIString(method, "ecm") == 0) {
+            st.method = FACTOR_ECM;
+        }
+        else if (PyUnicode_CompareWithASCIIString(method, "auto")) {
+bad_method:
+            PyErr_SetString(PyExc_ValueError,
+                            "factor() method must be 'auto', 'rho' or 'ecm'");
+            return NULL;
+        }
+    }
+    CHECK_OP_INT(x, args[argidx[0]]);
+    if (zz_cmp(&x->z, 0) != ZZ_GT) {
+        PyErr_SetString(PyExc_ValueError,
+                        "factor() argument must be positive");
+        goto end;
+    }
+    if (argidx[2] >= 0 && !Py_IsNone(args[argidx[2]])) {
+        double timeout = PyFloat_AsDouble(args[argidx[2]]);
+
+        if (timeout == -1.0 && PyErr_Occurred()) {
+            goto end;
+        }
+
+        PyObject *time = PyImport_ImportModule("time");
+
+        if (!time) {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+        st.clock = PyObject_GetAttrString(time, "monotonic");
+        Py_DECREF(time);
+        if (!st.clock) {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+
+        PyObject *now = PyObject_CallNoArgs(st.clock);
+
+        if (!now) {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+        st.deadline = PyFloat_AsDouble(now) + timeout;
+        Py_DECREF(now);
+    }
+    if (factor_impl(&st, &x->z)) {
+        goto end;
+    }
+    if (st.len) {
+        qsort(st.factors, st.len, sizeof(zz_t), zz_qsort_cmp);
+    }
+    if (!(res = PyList_New(0))) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    for (size_t i = 0; i < st.len;) {
+        size_t j = i + 1;
+
+        while (j < st.len && zz_cmp(&st.factors[i], &st.factors[j]) == ZZ_EQ) {
+            j++;
+        }
+
+        MPZ_Object *p = MPZ_new();
+        PyObject *item;
+
+        if (!p || zz_pos(&st.factors[i], &p->z)) {
+            /* LCOV_EXCL_START */
+            Py_XDECREF(p);
+            PyErr_NoMemory();
+            Py_CLEAR(res);
+            goto end;
+            /* LCOV_EXCL_STOP */
+        }
+        item = Py_BuildValue("(Nn)", p, (Py_ssize_t)(j - i));
+        if (!item || PyList_Append(res, item)) {
+            /* LCOV_EXCL_START */
+            Py_XDECREF(item);
+            Py_CLEAR(res);
+            goto end;
+            /* LCOV_EXCL_STOP */
+        }
+        Py_DECREF(item);
+        i = j;
+    }
+end:
+    Py_XDECREF(x);
+    factor_state_clear(&st);
+    return res;
+}
+
+/* Bitmasks of quadratic residues for small moduli, the product of all
+   but the first fits in int64_t. */
+static const struct {
+    int64_t m;
+    uint64_t mask;
+} qr_masks[] = {
+    {64, 0x202021202030213}, {63, 0x402483012450293}, {11, 0x23b},
+    {13, 0x161b}, {17, 0x1a317}, {19, 0x30af3}, {23, 0x5335f},
+    {29, 0x13d122f3}, {31, 0x121d47b7}, {37, 0x165e211e9b},
+    {41, 0x1b382b50737}, {43, 0x35883a3ee53}, {47, 0x4351b2753df},
+};
+
+static zz_err
+zz_is_square(const zz_t *u, bool *res)
+{
+    *res = false;
+    if (zz_isneg(u)) {
+        return ZZ_OK;
+    }
+    if (zz_iszero(u)) {
+        *res = true;
+        return ZZ_OK;
+    }
+    if (!((qr_masks[0].mask >> (u->digits[0] & 63)) & 1)) {
+        return ZZ_OK;
+    }
+
+    size_t len = sizeof(qr_masks)/sizeof(qr_masks[0]);
+    int64_t prod = 1, r;
+    zz_t s, t;
+    zz_err ret = ZZ_OK;
+
+    for (size_t i = 1; i < len; i++) {
+        prod *= qr_masks[i].m;
+    }
+    if (zz_init(&s) || zz_init(&t) || zz_div(u, prod, NULL, &t)) {
+        /* LCOV_EXCL_START */
+        ret = ZZ_MEM;
+        goto end;
+        /* LCOV_EXCL_STOP */
+    }
+    (void)zz_get(&t, &r);
+    for (size_t i = 1; i < len; i++) {
+        if (!((qr_masks[i].mask >> (r % qr_masks[i].m)) & 1)) {
+            goto end;
+        }
+    }
+    if (!(ret = zz_sqrtrem(u, &s, &t))) {
+        *res = zz_iszero(&t);
+    }
+end:
+    zz_clear(&s);
+    zz_clear(&t);
+    return ret;
+}
+
+static uint64_t
+powmod_u32(uint64_t b, uint64_t e, uint64_t m)
+{
+    uint64_t r = 1;
+
+    for (b %= m; e; e >>= 1) {
+        if (e & 1) {
+            r = r*b % m;
+        }
+        b = b*b % m;
+    }
+    return r;
+}
+
+/* Test if u = v**k for some integers v and k > 1.  Roots with less than
+   40 bits are estimated in double precision and filtered modulo a prime
+   before exact check, others are computed with zz_rootrem(). */
+static zz_err
+zz_is_power(const zz_t *u, bool *res)
+{
+    *res = true;
+    if (zz_cmp(u, 1) != ZZ_GT && zz_cmp(u, -1) != ZZ_LT) {
+        return ZZ_OK;
+    }
+
+    bool negative = zz_isneg(u);
+    zz_t a, r, t;
+    zz_err ret = ZZ_OK;
+
+    if (zz_init(&a) || zz_init(&r) || zz_init(&t) || zz_abs(u, &a)) {
+        /* LCOV_EXCL_START */
+        ret = ZZ_MEM;
+        goto end;
+        /* LCOV_EXCL_STOP */
+    }
+    if (!negative && ((ret = zz_is_square(&a, res)) || *res)) {
+        goto end;
+    }
+    *res = false;
+
+    /* For u = v**p, p divides the exponent of 2 in u. */
+    zz_bitcnt_t b = zz_bitlen(&a), v = zz_lsbpos(&a);
+    const uint64_t M = 4294967291;  /* the greatest prime below 2**32 */
+    int64_t amod;
+    double l;
+
+    if (v == 1) {
+        goto end;
+    }
+    if ((ret = zz_div(&a, (int64_t)M, NULL, &t))) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    (void)zz_get(&t, &amod);
+
+    zz_bitcnt_t shift = b > 64 ? b - 64 : 0;
+
+    if ((ret = zz_quo_2exp(&a, shift, &t))) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    (void)zz_get(&t, &l);
+    l = log2(l);
+    for (uint64_t p = 3; p <= b; p += 2) {
+        if ((v && v % p) || !is_prime_u32(p)) {
+            continue;
+        }
+        if (b/p >= 40) {
+            if ((ret = zz_rootrem(&a, p, &r, &t))) {
+                goto end; /* LCOV_EXCL_LINE */
+            }
+            if (zz_iszero(&t)) {
+                *res = true;
+                goto end;
+            }
+            continue;
+        }
+
+        double y = exp2(l/(double)p + (double)shift/(double)p);
+        uint64_t w = (uint64_t)(y + 0.5);
+
+        if (w < 2 || powmod_u32(w, p, M) != (uint64_t)amod) {
+            continue;
+        }
+        if ((ret = zz_set((int64_t)w, &r)) || (ret = zz_pow(&r, p, &t))) {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+        if (zz_cmp(&t, &a) == ZZ_EQ) {
+            *res = true;
+            goto end;
+        }
+    }
+end:
+    zz_clear(&a);
+    zz_clear(&r);
+    zz_clear(&t);
+    return ret;
+}
+
+static PyObject *
+iroot_impl(PyObject *const *args, Py_ssize_t nargs, const char *fname,
+           bool with_rem)
+{
+    if (nargs != 2) {
+        PyErr_Format(PyExc_TypeError, "%s() expects two arguments", fname);
+        return NULL;
+    }
+
+    long long k = PyLong_AsLongLong(args[1]);
+
+    if (k == -1 && PyErr_Occurred()) {
+        return NULL;
+    }
+    if (k <= 0) {
+        PyErr_Format(PyExc_ValueError, "%s() k must be positive", fname);
+        return NULL;
+    }
+
+    MPZ_Object *x = NULL, *root = MPZ_new(), *rem = NULL;
+    PyObject *res = NULL;
+
+    if (!root || (with_rem && !(rem = MPZ_new()))) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    CHECK_OP_INT(x, args[0]);
+
+    zz_err ret = zz_rootrem(&x->z, (uint64_t)k, &root->z,
+                            with_rem ? &rem->z : NULL);
+
+    if (ret == ZZ_OK) {
+        res = with_rem ? PyTuple_Pack(2, root, rem) : Py_NewRef(root);
+    }
+    else if (ret == ZZ_VAL) {
+        PyErr_Format(PyExc_ValueError,
+                     "%s() argument must be nonnegative for even k", fname);
+    }
+    else {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+end:
+    Py_XDECREF(x);
+    Py_XDECREF(root);
+    Py_XDECREF(rem);
+    return res;
+}
+
+static PyObject *
+gmp_iroot(PyObject *Py_UNUSED(module), PyObject *const *args,
+          Py_ssize_t nargs)
+{
+    return iroot_impl(args, nargs, "iroot", false);
+}
+
+static PyObject *
+gmp_iroot_rem(PyObject *Py_UNUSED(module), PyObject *const *args,
+              Py_ssize_t nargs)
+{
+    return iroot_impl(args, nargs, "iroot_rem", true);
+}
+
+static PyObject *
+gmp_is_square(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    MPZ_Object *x;
+
+    CHECK_OP_INT(x, arg);
+
+    bool res;
+    zz_err ret = zz_is_square(&x->z, &res);
+
+    Py_DECREF(x);
+    if (ret) {
+        return PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+    return PyBool_FromLong(res);
+end:
+    return NULL;
+}
+
+static PyObject *
+gmp_is_power(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    MPZ_Object *x;
+
+    CHECK_OP_INT(x, arg);
+
+    bool res;
+    zz_err ret = zz_is_power(&x->z, &res);
+
+    Py_DECREF(x);
+    if (ret) {
+        return PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+    return PyBool_FromLong(res);
+end:
+    return NULL;
+}
+
+/* Products of many small factors: factors are collected into machine
+   words, that are multiplied with a balanced product tree. */
+typedef struct {
+    zz_t *arr;
+    size_t len;
+    size_t alloc;
+    int64_t acc;
+} zz_prod;
+
+static zz_err
+zz_prod_push(zz_prod *prod)
+{
+    if (prod->len == prod->alloc) {
+        size_t alloc = prod->alloc ? 2*prod->alloc : 16;
+        zz_t *tmp = realloc(prod->arr, alloc*sizeof(zz_t));
+
+        if (!tmp) {
+            return ZZ_MEM; /* LCOV_EXCL_LINE */
+        }
+        prod->arr = tmp;
+        prod->alloc = alloc;
+    }
+
+    zz_t *leaf = &prod->arr[prod->len];
+
+    if (zz_init(leaf) || zz_set(prod->acc, leaf)) {
+        /* LCOV_EXCL_START */
+        zz_clear(leaf);
+        return ZZ_MEM;
+        /* LCOV_EXCL_STOP */
+    }
+    prod->len++;
+    prod->acc = 1;
+    return ZZ_OK;
+}
+
+/* Multiply the product by 0 < v <= INT64_MAX. */
+static inline zz_err
+zz_prod_mul(zz_prod *prod, uint64_t v)
+{
+    if ((uint64_t)prod->acc > INT64_MAX/v) {
+        zz_err ret = zz_prod_push(prod);
+
+        if (ret) {
+            return ret; /* LCOV_EXCL_LINE */
+        }
+    }
+    prod->acc *= (int64_t)v;
+    return ZZ_OK;
+}
+
+/* Set res to the product and reset the accumulator. */
+static zz_err
+zz_prod_finish(zz_prod *prod, zz_t *res)
+{
+    zz_err ret = zz_prod_push(prod);
+    size_t len = prod->len;
+    zz_t *arr = prod->arr;
+
+    while (!ret && len > 1) {
+        for (size_t i = 0; i < len/2; i++) {
+            if ((ret = zz_mul(&arr[2*i], &arr[2*i + 1], &arr[i]))) {
+                break; /* LCOV_EXCL_LINE */
+            }
+        }
+        if (len & 1) {
+            zz_t tmp = arr[len/2];
+
+            arr[len/2] = arr[len - 1];
+            arr[len - 1] = tmp;
+        }
+        len = (len + 1)/2;
+    }
+    if (!ret) {
+        ret = zz_pos(&arr[0], res);
+    }
+    zz_array_free(prod->arr, prod->len);
+    prod->arr = NULL;
+    prod->len = prod->alloc = 0;
+    return ret;
+}
+
+/* Set f = F(n) and f1 = F(n - 1) (if f1 isn't NULL), using doubling
+   formulas F(2*k) = F(k)*(2*F(k + 1) - F(k)) and F(2*k + 1) = F(k)**2
+   + F(k + 1)**2. */
+static zz_err
+zz_fib2(uint64_t n, zz_t *f, zz_t *f1)
+{
+    zz_t a, b, t;
+    zz_err ret = ZZ_OK;
+
+    if (zz_init(&a) || zz_init(&b) || zz_init(&t) || zz_set(1, &b)) {
+        /* LCOV_EXCL_START */
+        ret = ZZ_MEM;
+        goto end;
+        /* LCOV_EXCL_STOP */
+    }
+    /* a = F(k), b = F(k + 1), where k is the leading bits of n */
+    for (int i = 63; i >= 0; i--) {
+        if (!(n >> i)) {
+            continue;
+        }
+        if ((ret = zz_add(&b, &b, &t)) || (ret = zz_sub(&t, &a, &t))
+            || (ret = zz_mul(&a, &t, &t)) || (ret = zz_mul(&a, &a, &a))
+            || (ret = zz_mul(&b, &b, &b)) || (ret = zz_add(&a, &b, &b)))
+        {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+
+        zz_t tmp = a;
+
+        a = t;
+        t = tmp;
+        if ((n >> i) & 1) {
+            if ((ret = zz_add(&a, &b, &t))) {
+                goto end; /* LCOV_EXCL_LINE */
+            }
+            tmp = a;
+            a = b;
+            b = t;
+            t = tmp;
+        }
+    }
+    if ((ret = zz_pos(&a, f)) || (f1 && (ret = zz_sub(&b, &a, f1)))) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+end:
+    zz_clear(&a);
+    zz_clear(&b);
+    zz_clear(&t);
+    return ret;
+}
+
+static zz_err
+zz_fib(uint64_t n, zz_t *res)
+{
+    return zz_fib2(n, res, NULL);
+}
+
+/* L(n) = F(n) + 2*F(n - 1) */
+static zz_err
+zz_lucas(uint64_t n, zz_t *res)
+{
+    zz_t f1;
+    zz_err ret = ZZ_MEM;
+
+    if (zz_init(&f1) || (ret = zz_fib2(n, res, &f1))
+        || (ret = zz_add(res, &f1, res)) || (ret = zz_add(res, &f1, res)))
+    {
+        zz_clear(&f1);
+        return ret;
+    }
+    zz_clear(&f1);
+    return ZZ_OK;
+}
+
+/* Call func(p, data) for every prime p up to n < 2**32, found with a
+   segmented sieve. */
+static zz_err
+foreach_prime(uint64_t n, zz_err (*func)(uint64_t, void *), void *data)
+{
+    uint8_t *sieve = malloc(SIEVE_SEGMENT);
+    zz_err ret = ZZ_OK;
+
+    if (!sieve) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+    assert(n < ((uint64_t)1 << 32));
+    if (n >= 2) {
+        ret = func(2, data);
+    }
+    for (uint64_t lo = 3; lo <= n && !ret; lo += 2*SIEVE_SEGMENT) {
+        sieve_segment(lo, NULL, sieve, SIEVE_SEGMENT);
+        for (size_t i = 0; i < SIEVE_SEGMENT && lo + 2*i <= n; i++) {
+            if (!sieve[i] && (ret = func(lo + 2*i, data))) {
+                break; /* LCOV_EXCL_LINE */
+            }
+        }
+    }
+    free(sieve);
+    return ret;
+}
+
+static zz_err
+primorial_cb(uint64_t p, void *data)
+{
+    return zz_prod_mul((zz_prod *)data, p);
+}
+
+static zz_err
+zz_primorial(uint64_t n, zz_t *res)
+{
+    zz_prod prod = {.acc = 1};
+    zz_err ret = foreach_prime(n, primorial_cb, &prod);
+
+    if (ret) {
+        /* LCOV_EXCL_START */
+        zz_array_free(prod.arr, prod.len);
+        return ret;
+        /* LCOV_EXCL_STOP */
+    }
+    return zz_prod_finish(&prod, res);
+}
+
+/* Multiplicity of p in n! */
+static uint64_t
+fac_valuation(uint64_t n, uint64_t p)
+{
+    uint64_t e = 0;
+
+    while (n) {
+        n /= p;
+        e += n;
+    }
+    return e;
+}
+
+typedef struct {
+    uint64_t n;
+    zz_prod prods[32];
+} double_fac_state;
+
+static zz_err
+double_fac_cb(uint64_t p, void *data)
+{
+    double_fac_state *st = data;
+
+    if (p == 2) {
+        return ZZ_OK;
+    }
+
+    uint64_t e = fac_valuation(st->n, p) - fac_valuation(st->n/2, p);
+
+    for (size_t j = 0; e; j++, e >>= 1) {
+        zz_err ret;
+
+        if ((e & 1) && (ret = zz_prod_mul(&st->prods[j], p))) {
+            return ret; /* LCOV_EXCL_LINE */
+        }
+    }
+    return ZZ_OK;
+}
+
+/* n!! = n*(n - 2)*(n - 4)*...; for even n it's 2**(n/2)*(n/2)!, for odd
+   n = 2*k + 1 the multiplicity of each odd prime p in n!! is computed
+   from n!/k! and the result is assembled as prod(Q[j]**(2**j)), where
+   Q[j] is the product of primes, having the bit j set in multiplicity. */
+static zz_err
+zz_double_fac(uint64_t n, zz_t *res)
+{
+    if (!(n & 1)) {
+        zz_err ret = zz_fac((zz_digit_t)(n/2), res);
+
+        return ret ? ret : zz_mul_2exp(res, n/2, res);
+    }
+
+    double_fac_state st = {.n = n};
+    zz_t q;
+    zz_err ret = ZZ_OK;
+    size_t top = 0;
+
+    for (size_t j = 0; j < 32; j++) {
+        st.prods[j].acc = 1;
+    }
+    if (zz_init(&q) || zz_set(1, res)) {
+        /* LCOV_EXCL_START */
+        ret = ZZ_MEM;
+        goto end;
+        /* LCOV_EXCL_STOP */
+    }
+    if ((ret = foreach_prime(n, double_fac_cb, &st))) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    for (size_t j = 0; j < 32; j++) {
+        if (st.prods[j].len || st.prods[j].acc > 1) {
+            top = j + 1;
+        }
+    }
+    while (top--) {
+        if ((ret = zz_mul(res, res, res))
+            || (ret = zz_prod_finish(&st.prods[top], &q))
+            || (ret = zz_mul(res, &q, res)))
+        {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+    }
+end:
+    for (size_t j = 0; j < 32; j++) {
+        zz_array_free(st.prods[j].arr, st.prods[j].len);
+    }
+    zz_clear(&q);
+    return ret;
+}
+
+/* Get a nonnegative integer argument, not greater than max. */
+static int
+get_ui_arg(PyObject *arg, const char *fname, uint64_t max, uint64_t *n)
+{
+    MPZ_Object *x;
+
+    CHECK_OP_INT(x, arg);
+    if (zz_isneg(&x->z)) {
+        Py_DECREF(x);
+        PyErr_Format(PyExc_ValueError,
+                     "%s() not defined for negative values", fname);
+        return -1;
+    }
+    if (zz_get(&x->z, n) || *n > max) {
+        Py_DECREF(x);
+        PyErr_Format(PyExc_OverflowError,
+                     "%s() argument should not exceed %llu", fname,
+                     (unsigned long long)max);
+        return -1;
+    }
+    Py_DECREF(x);
+    return 0;
+end:
+    return -1;
+}
+
+static PyObject *
+ui_func_impl(PyObject *arg, const char *fname, uint64_t max,
+             zz_err (*func)(uint64_t, zz_t *))
+{
+    uint64_t n;
+
+    if (get_ui_arg(arg, fname, max, &n)) {
+        return NULL;
+    }
+
+    MPZ_Object *res = MPZ_new();
+
+    if (!res) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+
+    zz_err ret = func(n, &res->z);
+
+    if (ret == ZZ_OK) {
+        return (PyObject *)res;
+    }
+    /* LCOV_EXCL_START */
+    Py_DECREF(res);
+    if (ret == ZZ_BUF) {
+        PyErr_SetString(PyExc_OverflowError, "too many digits in integer");
+        return NULL;
+    }
+    return PyErr_NoMemory();
+    /* LCOV_EXCL_STOP */
+}
+
+/* The largest n, such that F(n + 1) and L(n) fit into the maximal bit
+   count: they have less than 0.6943*n + 2 bits. */
+static uint64_t
+fib_max(void)
+{
+    uint64_t b = zz_get_bitcnt_max() - 2;
+
+    return b > UINT64_MAX/2 ? UINT64_MAX : b + b/16*7;
+}
+
+static PyObject *
+gmp_fib(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    return ui_func_impl(arg, "fib", fib_max(), zz_fib);
+}
+
+static PyObject *
+gmp_lucas(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    return ui_func_impl(arg, "lucas", fib_max(), zz_lucas);
+}
+
+static PyObject *
+gmp_primorial(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    return ui_func_impl(arg, "primorial", UINT32_MAX, zz_primorial);
+}
+
+static PyObject *
+gmp_double_factorial(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    return ui_func_impl(arg, "double_factorial", UINT32_MAX, zz_double_fac);
+}
+
+static PyObject *
+gmp_fib2(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    uint64_t n;
+
+    if (get_ui_arg(arg, "fib2", fib_max(), &n)) {
+        return NULL;
+    }
+
+    MPZ_Object *f = MPZ_new(), *f1 = MPZ_new();
+    PyObject *res = NULL;
+    zz_err ret;
+
+    if (!f || !f1) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    if ((ret = zz_fib2(n, &f->z, &f1->z))) {
+        /* LCOV_EXCL_START */
+        if (ret == ZZ_BUF) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "too many digits in integer");
+        }
+        else {
+            PyErr_NoMemory();
+        }
+        goto end;
+        /* LCOV_EXCL_STOP */
+    }
+    res = PyTuple_Pack(2, f, f1);
+end:
+    Py_XDECREF(f);
+    Py_XDECREF(f1);
+    return res;
+}
+
+/* Row of binomial coefficients C(n, k) for k = 0, ..., n, computed with
+   C(n, k + 1) = C(n, k)*(n - k)/(k + 1) for the first half. */
+static PyObject *
+gmp_comb_row(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    uint64_t n;
+
+    if (get_ui_arg(arg, "comb_row", PY_SSIZE_T_MAX - 1, &n)) {
+        return NULL;
+    }
+
+    PyObject *res = PyList_New((Py_ssize_t)n + 1);
+    MPZ_Object *prev = MPZ_new();
+    zz_t t;
+
+    if (!res || !prev || zz_init(&t) || zz_set(1, &prev->z)) {
+        /* LCOV_EXCL_START */
+        Py_XDECREF(res);
+        Py_XDECREF(prev);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    PyList_SET_ITEM(res, 0, (PyObject *)prev);
+    for (uint64_t k = 0; k < n/2; k++) {
+        MPZ_Object *c = MPZ_new();
+
+        if (!c || zz_set((int64_t)(n - k), &t)
+            || zz_mul(&prev->z, &t, &c->z)
+            || zz_div(&c->z, (int64_t)(k + 1), &c->z, NULL))
+        {
+            /* LCOV_EXCL_START */
+            Py_XDECREF(c);
+            Py_DECREF(res);
+            zz_clear(&t);
+            return PyErr_NoMemory();
+            /* LCOV_EXCL_STOP */
+        }
+        PyList_SET_ITEM(res, (Py_ssize_t)k + 1, (PyObject *)c);
+        prev = c;
+    }
+    zz_clear(&t);
+    for (uint64_t k = n/2 + 1; k <= n; k++) {
+        PyList_SET_ITEM(res, (Py_ssize_t)k,
+                        Py_NewRef(PyList_GET_ITEM(res, (Py_ssize_t)(n - k))));
+    }
+    return res;
+}
+
+/* Set u to the value of int or mpz object. */
+static zz_err
+zz_set_pyint(PyObject *obj, zz_t *u)
+{
+    if (MPZ_Check(obj)) {
+        return zz_pos(&((MPZ_Object *)obj)->z, u);
+    }
+
+    int error;
+    int64_t v = PyLong_AsSdigit_t(obj, &error);
+
+    if (!error) {
+        return zz_set(v, u);
+    }
+
+    MPZ_Object *tmp = MPZ_from_int(obj);
+
+    if (!tmp) {
+        PyErr_Clear(); /* LCOV_EXCL_LINE */
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+
+    zz_err ret = zz_pos(&tmp->z, u);
+
+    Py_DECREF(tmp);
+    return ret;
+}
+
+static PyObject *
+zz_to_pyint(const zz_t *u)
+{
+    int64_t v;
+
+    if (zz_get(u, &v) == ZZ_OK) {
+        return PyLong_FromInt64(v);
+    }
+
+    MPZ_Object *tmp = MPZ_new();
+
+    if (!tmp || zz_pos(u, &tmp->z)) {
+        /* LCOV_EXCL_START */
+        Py_XDECREF(tmp);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+
+    PyObject *res = MPZ_to_int(tmp);
+
+    Py_DECREF(tmp);
+    return res;
+}
+
+/* Round |u|*2**exp to prec bits in the given direction and strip trailing
+   zero bits from the mantissa, written to man (which may be u).  The
+   rounding bits are inspected in place, so the mantissa is shifted at
+   most once (twice, if rounding up creates trailing zeros). */
+static zz_err
+zz_mpmath_normalize(zz_bitcnt_t prec, zz_rnd rnd, bool *negative,
+                    const zz_t *u, zz_t *man, zz_t *exp, zz_bitcnt_t *bc)
+{
+    /* If the mantissa is 0, return the normalized representation. */
+    if (zz_iszero(u)) {
+        *negative = false;
+        *bc = 0;
+        if (zz_set(0, man)) {
+            return ZZ_MEM; /* LCOV_EXCL_LINE */
+        }
+        return zz_set(0, exp);
+    }
+
+    zz_bitcnt_t zbits = zz_lsbpos(u), shift = 0;
+    bool up = false;
+
+    if (*bc > prec) {
+        shift = *bc - prec;
+        if (rnd == ZZ_RNDD) {
+            rnd = *negative ? ZZ_RNDA : ZZ_RNDZ;
+        }
+        else if (rnd == ZZ_RNDU) {
+            rnd = *negative ? ZZ_RNDZ : ZZ_RNDA;
+        }
+        /* Nonzero bits are shifted out? */
+        if (zbits < shift) {
+            if (rnd == ZZ_RNDA) {
+                up = true;
+            }
+            else if (rnd == ZZ_RNDN) {
+                up = zz_tc_testbit(u, shift - 1)
+                     && (zbits < shift - 1 || zz_tc_testbit(u, shift));
+            }
+        }
+        *bc = prec;
+    }
+    /* Strip trailing zero bits together with rounding. */
+    if (!up && zz_scan(u, shift, true, &zbits) && zbits > shift) {
+        *bc -= zbits - shift;
+        shift = zbits;
+    }
+    if (shift) {
+        if (zz_quo_2exp(u, shift, man) || zz_add(exp, shift, exp)) {
+            return ZZ_MEM; /* LCOV_EXCL_LINE */
+        }
+    }
+    else if (u != man && zz_pos(u, man)) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+    if (up) {
+        if (zz_add(man, 1, man)) {
+            return ZZ_MEM; /* LCOV_EXCL_LINE */
+        }
+        /* Carry might produce trailing zeros, e.g. if one less than
+           a power of 2 was rounded up. */
+        zbits = zz_lsbpos(man);
+        if (zbits && (zz_quo_2exp(man, zbits, man)
+                      || zz_add(exp, zbits, exp)))
+        {
+            return ZZ_MEM; /* LCOV_EXCL_LINE */
+        }
+        *bc = zz_bitlen(man);
+    }
+    return ZZ_OK;
+}
+
+/* Normalize mpf with the mantissa man (an mpz) and the exponent exp (an int),
+   set new references to the resulting mantissa and exponent. */
+static int
+mpmath_normalize_obj(bool *negative, PyObject *man, PyObject *exp,
+                     zz_bitcnt_t *bc, zz_bitcnt_t prec, zz_rnd rnd,
+                     PyObject **rman, PyObject **rexp)
+{
+    const zz_t *u = &((MPZ_Object *)man)->z;
+
+    /* Reuse arguments, if the mantissa is already normalized. */
+    if (*bc <= prec && zz_isodd(u)) {
+        *rman = Py_NewRef(man);
+        *rexp = Py_NewRef(exp);
+        return 0;
+    }
+
+    MPZ_Object *res = MPZ_new();
+    zz_t e;
+    zz_err ret = ZZ_MEM;
+
+    if (zz_init(&e) || !res || zz_set_pyint(exp, &e)
+        || (ret = zz_mpmath_normalize(prec, rnd, negative, u, &res->z,
+                                      &e, bc)))
+    {
+        /* LCOV_EXCL_START */
+        Py_XDECREF((PyObject *)res);
+        zz_clear(&e);
+        if (ret == ZZ_BUF) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "too many digits in integer");
+            return -1;
+        }
+        PyErr_NoMemory();
+        return -1;
+        /* LCOV_EXCL_STOP */
+    }
+    *rexp = zz_to_pyint(&e);
+    zz_clear(&e);
+    if (!*rexp) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(res);
+        return -1;
+        /* LCOV_EXCL_STOP */
+    }
+    *rman = (PyObject *)res;
+    return 0;
+}
+
+static int
+mpmath_normalize_args(PyObject *sign_obj, PyObject *man, PyObject *exp,
+                      PyObject *bc_obj, bool *negative, zz_bitcnt_t *bc)
+{
+    long sign = PyLong_AsLong(sign_obj);
+
+    *negative = (bool)sign;
+    *bc = PyLong_AsUnsignedLongLong(bc_obj);
+    if (sign == -1 || *bc == (zz_bitcnt_t)(-1) || !MPZ_Check(man)
+        || !PyLong_Check(exp))
+    {
+        PyErr_SetString(PyExc_TypeError,
+                        ("arguments long, MPZ_Object*, PyObject*, "
+                         "long, long, char needed"));
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+gmp__mpmath_normalize(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    if (nargs != 6) {
+        PyErr_SetString(PyExc_TypeError, "6 arguments required");
+        return NULL;
+    }
+
+    bool negative;
+    zz_bitcnt_t bc, prec = PyLong_AsUnsignedLongLong(args[4]);
+    zz_rnd rnd = get_round_mode(args[5]);
+
+    if (prec == (zz_bitcnt_t)(-1)
+        || mpmath_normalize_args(args[0], args[1], args[2], args[3],
+                                 &negative, &bc))
+    {
+        PyErr_SetString(PyExc_TypeError,
+                        ("arguments long, MPZ_Object*, PyObject*, "
+                         "long, long, char needed"));
+        return NULL;
+    }
+    if (rnd == -1) {
+        return NULL;
+    }
+
+    PyObject *man, *exp;
+
+    if (mpmath_normalize_obj(&negative, args[1], args[2], &bc, prec, rnd,
+                             &man, &exp))
+    {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    return Py_BuildValue("(bNNK)", negative, man, exp, bc);
+}
+
+static PyObject *
+gmp__mpmath_normalize_many(PyObject *self, PyObject *const *args,
+                           Py_ssize_t nargs)
+{
+    if (nargs != 6) {
+        PyErr_SetString(PyExc_TypeError, "6 arguments required");
+        return NULL;
+    }
+
+    zz_bitcnt_t prec = PyLong_AsUnsignedLongLong(args[4]);
+
+    if (prec == (zz_bitcnt_t)(-1) && PyErr_Occurred()) {
+        PyErr_SetString(PyExc_TypeError, "bad prec argument");
+        return NULL;
+    }
+
+    zz_rnd rnd = get_round_mode(args[5]);
+
+    if (rnd == -1) {
+        return NULL;
+    }
+
+    PyObject *seqs[4] = {NULL}, *res[4] = {NULL};
+    Py_ssize_t len = 0;
+
+    for (size_t i = 0; i < 4; i++) {
+        seqs[i] = PySequence_Fast(args[i], ("_mpmath_normalize_many() "
+                                            "expects sequences"));
+        if (!seqs[i]) {
+            goto err;
+        }
+        if (i && len != PySequence_Fast_GET_SIZE(seqs[i])) {
+            PyErr_SetString(PyExc_ValueError,
+                            "sequences must have the same length");
+            goto err;
+        }
+        len = PySequence_Fast_GET_SIZE(seqs[i]);
+    }
+    for (size_t i = 0; i < 4; i++) {
+        res[i] = PyList_New(len);
+        if (!res[i]) {
+            goto err; /* LCOV_EXCL_LINE */
+        }
+    }
+    for (Py_ssize_t j = 0; j < len; j++) {
+        PyObject *man = PySequence_Fast_GET_ITEM(seqs[1], j);
+        PyObject *exp = PySequence_Fast_GET_ITEM(seqs[2], j);
+        PyObject *rman, *rexp, *rsign, *rbc;
+        bool negative;
+        zz_bitcnt_t bc;
+
+        if (mpmath_normalize_args(PySequence_Fast_GET_ITEM(seqs[0], j), man,
+                                  exp, PySequence_Fast_GET_ITEM(seqs[3], j),
+                                  &negative, &bc)
+            || mpmath_normalize_obj(&negative, man, exp, &bc, prec, rnd,
+                                    &rman, &rexp))
+        {
+            goto err;
+        }
+        rsign = PyLong_FromLong(negative);
+        rbc = PyLong_FromUnsignedLongLong(bc);
+        PyList_SET_ITEM(res[0], j, rsign);
+        PyList_SET_ITEM(res[1], j, rman);
+        PyList_SET_ITEM(res[2], j, rexp);
+        PyList_SET_ITEM(res[3], j, rbc);
+        if (!rsign || !rbc) {
+            goto err; /* LCOV_EXCL_LINE */
+        }
+    }
+    for (size_t i = 0; i < 4; i++) {
+        Py_DECREF(seqs[i]);
+    }
+    return Py_BuildValue("(NNNN)", res[0], res[1], res[2], res[3]);
+err:
+    for (size_t i = 0; i < 4; i++) {
+        Py_XDECREF(seqs[i]);
+        Py_XDECREF(res[i]);
+    }
+    return NULL;
+}
+
+static PyObject *
+gmp__mpmath_create(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    if (nargs < 2 || nargs > 4) {
+        PyErr_Format(PyExc_TypeError,
+                     "_mpmath_create() takes from 2 to 4 arguments");
+        return NULL;
+    }
+
+    MPZ_Object *man;
+
+    if (MPZ_Check(args[0])) {
+        man = (MPZ_Object *)plus(args[0]);
+    }
+    else if (PyLong_Check(args[0])) {
+        man = MPZ_from_int(args[0]);
+        if (!man) {
+            return NULL; /* LCOV_EXCL_LINE */
+        }
+    }
+    else {
+        PyErr_Format(PyExc_TypeError, "_mpmath_create() expects an integer");
+        return NULL;
+    }
+    if (!PyLong_Check(args[1])) {
+        Py_DECREF(man);
+        PyErr_Format(PyExc_TypeError,
+                     "_mpmath_create() expects an integer exp");
+        return NULL;
+    }
+
+    bool negative = zz_isneg(&man->z);
+    zz_bitcnt_t bc = zz_bitlen(&man->z);
+    zz_bitcnt_t prec = 0;
+    zz_rnd rnd = ZZ_RNDZ;
+
+    if (negative) {
+        (void)zz_abs(&man->z, &man->z);
+    }
+    if (nargs > 2) {
+        prec = PyLong_AsUnsignedLongLong(args[2]);
+        if (prec == (zz_bitcnt_t)(-1) && PyErr_Occurred()) {
+            Py_DECREF(man);
+            PyErr_SetString(PyExc_TypeError, "bad prec argument");
+            return NULL;
+        }
+    }
+    if (nargs > 3) {
+        rnd = get_round_mode(args[3]);
+
+        if (rnd == -1) {
+            Py_DECREF(man);
+            return NULL;
+        }
+    }
+    if (!prec) {
+        prec = bc;
+    }
+
+    zz_t exp;
+    zz_err ret = ZZ_MEM;
+
+    if (zz_init(&exp) || zz_set_pyint(args[1], &exp)
+        || (ret = zz_mpmath_normalize(prec, rnd, &negative, &man->z,
+                                      &man->z, &exp, &bc)))
+    {
+        /* LCOV_EXCL_START */
+        Py_DECREF(man);
+        zz_clear(&exp);
+        if (ret == ZZ_BUF) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "too many digits in integer");
+            return NULL;
+        }
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+
+    PyObject *iexp = zz_to_pyint(&exp);
+
+    zz_clear(&exp);
+    if (!iexp) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(man);
+        return NULL;
+        /* LCOV_EXCL_STOP */
+    }
+    return Py_BuildValue("(bNNK)", negative, man, iexp, bc);
+}
+
+/* Low-level arithmetic on mpmath's raw mpf values, i.e. tuples
+   (sign, man, exp, bc) with value (-1)**sign*man*2**exp, and on the mpf
+   type below.  Special values have zero mantissa and are distinguished
+   by the exponent.  Algorithms are same as for the mpmath.libmp.libmpf
+   module. */
+
+typedef enum {
+    MPF_REGULAR,
+    MPF_ZERO,
+    MPF_NAN,
+    MPF_INF,
+    MPF_NINF,
+} mpf_kind;
+
+/* An operand: the mantissa and the exponent are either borrowed from
+   the obj or stored in ref and exp_buf, if converted. */
+typedef struct {
+    PyObject *obj;
+    bool negative;
+    mpf_kind kind;
+    const zz_t *man;
+    const zz_t *exp;
+    zz_bitcnt_t bc;
+    MPZ_Object *ref;
+    zz_t exp_buf;
+} mpf_arg;
+
+/* A result: the mantissa and the exponent are written to the storage,
+   provided by the caller. */
+typedef struct {
+    mpf_kind kind;
+    bool negative;
+    zz_t *man;
+    zz_t *exp;
+    zz_bitcnt_t bc;
+} mpf_res;
+
+static int
+mpf_arg_init(PyObject *obj, mpf_arg *x)
+{
+    x->obj = obj;
+    x->ref = NULL;
+    x->exp = &x->exp_buf;
+    if (zz_init(&x->exp_buf)) {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+        return -1; /* LCOV_EXCL_LINE */
+    }
+    return 0;
+}
+
+static void
+mpf_arg_clear(mpf_arg *x)
+{
+    Py_XDECREF(x->ref);
+    zz_clear(&x->exp_buf);
+}
+
+static int
+mpf_seterr(zz_err ret)
+{
+    if (ret == ZZ_BUF) {
+        PyErr_SetString(PyExc_OverflowError, "too many digits in integer");
+        return -1;
+    }
+    PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    return -1; /* LCOV_EXCL_LINE */
+}
+
+/* Parse the mpmath's raw mpf tuple. */
+static int
+mpf_arg_parse(PyObject *obj, const char *fname, mpf_arg *x)
+{
+    if (mpf_arg_init(obj, x)) {
+        return -1; /* LCOV_EXCL_LINE */
+    }
+    if (!PyTuple_Check(obj) || PyTuple_GET_SIZE(obj) != 4) {
+        goto bad;
+    }
+
+    PyObject *sign = PyTuple_GET_ITEM(obj, 0);
+    PyObject *man = PyTuple_GET_ITEM(obj, 1);
+    PyObject *exp = PyTuple_GET_ITEM(obj, 2);
+
+    if (!PyLong_Check(sign) || (!MPZ_Check(man) && !PyLong_Check(man))
+        || (!MPZ_Check(exp) && !PyLong_Check(exp)))
+    {
+        goto bad;
+    }
+
+    int negative = PyObject_IsTrue(sign);
+
+    if (negative == -1) {
+        return -1; /* LCOV_EXCL_LINE */
+    }
+    x->negative = negative;
+    if (MPZ_Check(man)) {
+        x->man = &((MPZ_Object *)man)->z;
+    }
+    else {
+        x->ref = MPZ_from_int(man);
+        if (!x->ref) {
+            return -1; /* LCOV_EXCL_LINE */
+        }
+        x->man = &x->ref->z;
+    }
+    if (zz_isneg(x->man)) {
+        goto bad;
+    }
+    if (zz_set_pyint(exp, &x->exp_buf)) {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+        return -1; /* LCOV_EXCL_LINE */
+    }
+    x->bc = zz_bitlen(x->man);
+    if (x->bc) {
+        x->kind = MPF_REGULAR;
+    }
+    else if (zz_iszero(x->exp)) {
+        x->kind = MPF_ZERO;
+    }
+    else if (zz_cmp(x->exp, -123) == ZZ_EQ) {
+        x->kind = MPF_NAN;
+    }
+    else if (zz_cmp(x->exp, -456) == ZZ_EQ) {
+        x->kind = MPF_INF;
+    }
+    else if (zz_cmp(x->exp, -789) == ZZ_EQ) {
+        x->kind = MPF_NINF;
+    }
+    else {
+        goto bad;
+    }
+    return 0;
+bad:
+    PyErr_Format(PyExc_TypeError, "%s() expects mpf tuples", fname);
+    return -1;
+}
+
+static int
+get_prec_arg(PyObject *arg, zz_bitcnt_t *prec)
+{
+    if (!PyLong_Check(arg)) {
+        PyErr_SetString(PyExc_TypeError, "bad prec argument");
+        return -1;
+    }
+
+    int error;
+    int64_t v = PyLong_AsSdigit_t(arg, &error);
+
+    if (error || v < 0 || (uint64_t)v > zz_get_bitcnt_max()) {
+        PyErr_SetString(PyExc_ValueError, "bad prec argument");
+        return -1;
+    }
+    *prec = (zz_bitcnt_t)v;
+    return 0;
+}
+
+static int
+mpf_sign(const mpf_arg *x)
+{
+    switch (x->kind) {
+        case MPF_REGULAR:
+            return x->negative ? -1 : 1;
+        case MPF_INF:
+            return 1;
+        case MPF_NINF:
+            return -1;
+        default:
+            return 0;
+    }
+}
+
+static bool
+mpf_isspecial(const mpf_arg *x)
+{
+    return x->kind != MPF_REGULAR && x->kind != MPF_ZERO;
+}
+
+static int
+mpf_res_special(mpf_res *r, mpf_kind kind)
+{
+    r->kind = kind;
+    r->negative = kind == MPF_NINF;
+    r->bc = 0;
+    if (zz_set(0, r->man) || zz_set(0, r->exp)) {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+        return -1; /* LCOV_EXCL_LINE */
+    }
+    return 0;
+}
+
+/* Normalize the result to prec bits (or to the mantissa size, if prec is
+   zero). */
+static int
+mpf_res_round(mpf_res *r, bool negative, zz_bitcnt_t prec, zz_rnd rnd)
+{
+    zz_bitcnt_t bc = zz_bitlen(r->man);
+    zz_err ret = zz_mpmath_normalize(prec ? prec : bc, rnd, &negative,
+                                     r->man, r->man, r->exp, &bc);
+
+    if (ret) {
+        return mpf_seterr(ret); /* LCOV_EXCL_LINE */
+    }
+    r->kind = bc ? MPF_REGULAR : MPF_ZERO;
+    r->negative = negative;
+    r->bc = bc;
+    return 0;
+}
+
+/* Set r to (negative, x.man, x.exp), rounded to prec bits. */
+static int
+mpf_res_set(mpf_res *r, const mpf_arg *x, bool negative, zz_bitcnt_t prec,
+            zz_rnd rnd)
+{
+    if (zz_pos(x->man, r->man) || zz_pos(x->exp, r->exp)) {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+        return -1; /* LCOV_EXCL_LINE */
+    }
+    return mpf_res_round(r, negative, prec, rnd);
+}
+
+/* Following functions return 1, if the result is s itself, 0, if it's
+   written to r, and -1 on errors. */
+
+static int
+mpf_addsub(const mpf_arg *s, const mpf_arg *t, zz_bitcnt_t prec, zz_rnd rnd,
+           bool sub, mpf_res *r)
+{
+    bool sneg = s->negative, tneg = t->negative ^ sub;
+
+    if (s->kind != MPF_REGULAR || t->kind != MPF_REGULAR) {
+        mpf_kind tkind = t->kind;
+
+        if (sub && tkind == MPF_INF) {
+            tkind = MPF_NINF;
+        }
+        else if (sub && tkind == MPF_NINF) {
+            tkind = MPF_INF;
+        }
+        if (mpf_isspecial(s)) {
+            if (s->kind == tkind || !mpf_isspecial(t)) {
+                return 1;
+            }
+            return mpf_res_special(r, MPF_NAN);
+        }
+        if (s->kind == MPF_ZERO && t->kind == MPF_REGULAR) {
+            return mpf_res_set(r, t, tneg, prec, rnd);
+        }
+        if (s->kind == MPF_REGULAR && !mpf_isspecial(t)) {
+            return mpf_res_set(r, s, sneg, prec, rnd);
+        }
+        return mpf_res_special(r, tkind);
+    }
+
+    zz_t offset, delta;
+    zz_err ret = ZZ_MEM;
+    uint64_t shift;
+
+    if (zz_init(&offset) || zz_init(&delta)
+        || zz_sub(s->exp, t->exp, &offset))
+    {
+        goto err; /* LCOV_EXCL_LINE */
+    }
+    /* Let s has the bigger exponent. */
+    if (zz_isneg(&offset)) {
+        const mpf_arg *tmp = s;
+        bool b = sneg;
+
+        s = t;
+        t = tmp;
+        sneg = tneg;
+        tneg = b;
+        (void)zz_neg(&offset, &offset);
+    }
+    if (prec && zz_cmp(&offset, 100) == ZZ_GT) {
+        /* Outside precision range; only need to perturb. */
+        if (zz_add(&offset, (int64_t)s->bc, &delta)
+            || zz_sub(&delta, (int64_t)t->bc, &delta))
+        {
+            goto err; /* LCOV_EXCL_LINE */
+        }
+        if (zz_cmp(&delta, (int64_t)prec + 4) == ZZ_GT) {
+            if (zz_mul_2exp(s->man, prec + 4, r->man)
+                || (sneg == tneg ? zz_add(r->man, 1, r->man)
+                    : zz_sub(r->man, 1, r->man))
+                || zz_sub(s->exp, (int64_t)prec + 4, r->exp))
+            {
+                goto err; /* LCOV_EXCL_LINE */
+            }
+            zz_clear(&offset);
+            zz_clear(&delta);
+            return mpf_res_round(r, sneg, prec, rnd);
+        }
+    }
+    if (zz_get(&offset, &shift) || shift > zz_get_bitcnt_max()) {
+        ret = ZZ_BUF;
+        goto err;
+    }
+    if (zz_mul_2exp(s->man, shift, r->man)
+        || (sneg && zz_neg(r->man, r->man))
+        || (tneg ? zz_sub(r->man, t->man, r->man)
+            : zz_add(r->man, t->man, r->man))
+        || zz_pos(t->exp, r->exp))
+    {
+        goto err; /* LCOV_EXCL_LINE */
+    }
+    zz_clear(&offset);
+    zz_clear(&delta);
+    sneg = zz_isneg(r->man);
+    (void)zz_abs(r->man, r->man);
+    return mpf_res_round(r, sneg, prec, rnd);
+err:
+    zz_clear(&offset);
+    zz_clear(&delta);
+    return mpf_seterr(ret);
+}
+
+static int
+mpf_add(const mpf_arg *s, const mpf_arg *t, zz_bitcnt_t prec, zz_rnd rnd,
+        mpf_res *r)
+{
+    return mpf_addsub(s, t, prec, rnd, false, r);
+}
+
+static int
+mpf_sub(const mpf_arg *s, const mpf_arg *t, zz_bitcnt_t prec, zz_rnd rnd,
+        mpf_res *r)
+{
+    return mpf_addsub(s, t, prec, rnd, true, r);
+}
+
+static int
+mpf_mul(const mpf_arg *s, const mpf_arg *t, zz_bitcnt_t prec, zz_rnd rnd,
+        mpf_res *r)
+{
+    if (s->kind == MPF_REGULAR && t->kind == MPF_REGULAR) {
+        if (zz_mul(s->man, t->man, r->man) || zz_add(s->exp, t->exp, r->exp)) {
+            PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+            return -1; /* LCOV_EXCL_LINE */
+        }
+        return mpf_res_round(r, s->negative ^ t->negative, prec, rnd);
+    }
+    if (!mpf_isspecial(s) && !mpf_isspecial(t)) {
+        return mpf_res_special(r, MPF_ZERO);
+    }
+    if (s->kind == MPF_NAN || t->kind == MPF_NAN) {
+        return mpf_res_special(r, MPF_NAN);
+    }
+    if (mpf_isspecial(t)) {
+        const mpf_arg *tmp = s;
 
-PyTypeObject MPZ_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "gmp.mpz",
-    .tp_basicsize = sizeof(MPZ_Object),
-    .tp_new = new,
-    .tp_dealloc = dealloc,
-    .tp_repr = repr,
-    .tp_str = str,
-    .tp_richcompare = richcompare,
-    .tp_hash = hash,
-    .tp_as_number = &as_number,
-    .tp_getset = getsetters,
-    .tp_methods = methods,
-    .tp_doc = mpz_doc,
-    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
-    .tp_vectorcall = vectorcall,
-};
+        s = t;
+        t = tmp;
+    }
+    if (t->kind == MPF_ZERO) {
+        return mpf_res_special(r, MPF_NAN);
+    }
+    return mpf_res_special(r, (mpf_sign(s)*mpf_sign(t) > 0 ? MPF_INF
+                               : MPF_NINF));
+}
+
+static int
+mpf_div(const mpf_arg *s, const mpf_arg *t, zz_bitcnt_t prec, zz_rnd rnd,
+        mpf_res *r)
+{
+    if (s->kind != MPF_REGULAR || t->kind != MPF_REGULAR) {
+        if (t->kind == MPF_ZERO) {
+            PyErr_SetString(PyExc_ZeroDivisionError, "division by zero");
+            return -1;
+        }
+        if (s->kind == MPF_ZERO) {
+            return mpf_res_special(r, (t->kind == MPF_NAN ? MPF_NAN
+                                       : MPF_ZERO));
+        }
+        if ((mpf_isspecial(s) && mpf_isspecial(t))
+            || s->kind == MPF_NAN || t->kind == MPF_NAN)
+        {
+            return mpf_res_special(r, MPF_NAN);
+        }
+        if (!mpf_isspecial(t)) {
+            return mpf_res_special(r, (mpf_sign(s)*mpf_sign(t) > 0 ? MPF_INF
+                                       : MPF_NINF));
+        }
+        return mpf_res_special(r, MPF_ZERO);
+    }
+
+    zz_t rem;
+    zz_err ret = ZZ_MEM;
+
+    if (zz_init(&rem) || zz_sub(s->exp, t->exp, r->exp)) {
+        goto err; /* LCOV_EXCL_LINE */
+    }
+    if (zz_cmp(t->man, 1) == ZZ_EQ) {
+        if (zz_pos(s->man, r->man)) {
+            goto err; /* LCOV_EXCL_LINE */
+        }
+    }
+    else {
+        /* Same strategy as for addition: if there is a remainder, perturb
+           the result a few bits outside the precision range before
+           rounding. */
+        int64_t extra = (int64_t)prec - (int64_t)s->bc + (int64_t)t->bc + 5;
+
+        if (extra < 5) {
+            extra = 5;
+        }
+        if ((uint64_t)extra > zz_get_bitcnt_max()) {
+            ret = ZZ_BUF;
+            goto err;
+        }
+        if ((ret = zz_mul_2exp(s->man, (zz_bitcnt_t)extra, r->man))
+            || (ret = zz_div(r->man, t->man, r->man, &rem)))
+        {
+            goto err; /* LCOV_EXCL_LINE */
+        }
+        if (!zz_iszero(&rem)) {
+            if ((ret = zz_mul_2exp(r->man, 1, r->man))
+                || (ret = zz_add(r->man, 1, r->man)))
+            {
+                goto err; /* LCOV_EXCL_LINE */
+            }
+            extra++;
+        }
+        if ((ret = zz_sub(r->exp, extra, r->exp))) {
+            goto err; /* LCOV_EXCL_LINE */
+        }
+    }
+    zz_clear(&rem);
+    return mpf_res_round(r, s->negative ^ t->negative, prec, rnd);
+err:
+    zz_clear(&rem);
+    return mpf_seterr(ret);
+}
+
+static int
+mpf_sqrt(const mpf_arg *s, zz_bitcnt_t prec, zz_rnd rnd, mpf_res *r)
+{
+    if (s->negative) {
+        PyErr_SetString(PyExc_ValueError, "square root of a negative number");
+        return -1;
+    }
+    if (s->kind != MPF_REGULAR) {
+        return 1;
+    }
+
+    zz_t rem;
+    zz_err ret = ZZ_MEM;
+    zz_bitcnt_t bc = s->bc;
+
+    if (zz_init(&rem) || zz_pos(s->man, r->man) || zz_pos(s->exp, r->exp)) {
+        goto err; /* LCOV_EXCL_LINE */
+    }
+    if (zz_isodd(r->exp)) {
+        if ((ret = zz_sub(r->exp, 1, r->exp))
+            || (ret = zz_mul_2exp(r->man, 1, r->man)))
+        {
+            goto err; /* LCOV_EXCL_LINE */
+        }
+        bc++;
+    }
+    else if (zz_cmp(r->man, 1) == ZZ_EQ) {
+        zz_clear(&rem);
+        (void)zz_quo_2exp(r->exp, 1, r->exp);
+        return mpf_res_round(r, false, prec, rnd);
+    }
+
+    int64_t shift = 2*(int64_t)prec - (int64_t)bc + 4;
+
+    if (shift < 4) {
+        shift = 4;
+    }
+    shift += shift & 1;
+    if ((uint64_t)shift > zz_get_bitcnt_max()) {
+        ret = ZZ_BUF;
+        goto err;
+    }
+    if ((ret = zz_mul_2exp(r->man, (zz_bitcnt_t)shift, r->man))
+        || (ret = zz_sqrtrem(r->man, r->man,
+                             rnd == ZZ_RNDD || rnd == ZZ_RNDZ
+                             ? NULL : &rem)))
+    {
+        goto err; /* LCOV_EXCL_LINE */
+    }
+    /* Perturb up. */
+    if (!zz_iszero(&rem)) {
+        if ((ret = zz_mul_2exp(r->man, 1, r->man))
+            || (ret = zz_add(r->man, 1, r->man)))
+        {
+            goto err; /* LCOV_EXCL_LINE */
+        }
+        shift += 2;
+    }
+    if ((ret = zz_sub(r->exp, shift, r->exp))) {
+        goto err; /* LCOV_EXCL_LINE */
+    }
+    zz_clear(&rem);
+    (void)zz_quo_2exp(r->exp, 1, r->exp);
+    return mpf_res_round(r, false, prec, rnd);
+err:
+    zz_clear(&rem);
+    return mpf_seterr(ret);
+}
 
+typedef int (*mpf_binop)(const mpf_arg *, const mpf_arg *, zz_bitcnt_t,
+                         zz_rnd, mpf_res *);
+
+/* Build the mpf tuple from the result, steals the man reference. */
 static PyObject *
-gmp_gcd(PyObject *Py_UNUSED(module), PyObject *const *args, Py_ssize_t nargs)
+mpf_res_to_tuple(const mpf_res *r, MPZ_Object *man)
 {
-    MPZ_Object *res = MPZ_new();
+    switch (r->kind) {
+        case MPF_NAN:
+            return Py_BuildValue("(iNii)", 0, man, -123, -1);
+        case MPF_INF:
+            return Py_BuildValue("(iNii)", 0, man, -456, -2);
+        case MPF_NINF:
+            return Py_BuildValue("(iNii)", 1, man, -789, -3);
+        default:
+            break;
+    }
 
-    if (!res) {
-        return (PyObject *)res; /* LCOV_EXCL_LINE */
+    PyObject *iexp = zz_to_pyint(r->exp);
+
+    if (!iexp) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(man);
+        return NULL;
+        /* LCOV_EXCL_STOP */
     }
-    for (Py_ssize_t i = 0; i < nargs; i++) {
-        MPZ_Object *arg;
+    return Py_BuildValue("(bNNK)", r->negative, man, iexp, r->bc);
+}
 
-        CHECK_OP_INT(arg, args[i]);
-        if (zz_cmp(&res->z, 1) == ZZ_EQ) {
-            Py_DECREF(arg);
-            continue;
+static int
+parse_mpf_args(PyObject *const *args, Py_ssize_t nargs, Py_ssize_t nmpf,
+               bool prec_required, const char *fname, mpf_arg *x,
+               zz_bitcnt_t *prec, zz_rnd *rnd)
+{
+    Py_ssize_t nmin = nmpf + prec_required;
+
+    if (nargs < nmin || nargs > nmpf + 2) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s() takes from %zd to %zd arguments",
+                     fname, nmin, nmpf + 2);
+        return -1;
+    }
+    *prec = 0;
+    *rnd = ZZ_RNDZ;
+    if (nargs > nmpf && get_prec_arg(args[nmpf], prec)) {
+        return -1;
+    }
+    if (prec_required && !*prec) {
+        PyErr_Format(PyExc_ValueError, "%s() requires positive precision",
+                     fname);
+        return -1;
+    }
+    if (nargs > nmpf + 1) {
+        *rnd = get_round_mode(args[nmpf + 1]);
+        if (*rnd == (zz_rnd)-1) {
+            return -1;
         }
-        if (zz_gcdext(&res->z, &arg->z, &res->z, NULL, NULL)) {
-            /* LCOV_EXCL_START */
-            Py_DECREF(res);
-            Py_DECREF(arg);
-            return PyErr_NoMemory();
-            /* LCOV_EXCL_STOP */
+    }
+    for (Py_ssize_t i = 0; i < nmpf; i++) {
+        if (mpf_arg_parse(args[i], fname, &x[i])) {
+            for (Py_ssize_t j = 0; j <= i; j++) {
+                mpf_arg_clear(&x[j]);
+            }
+            return -1;
         }
-        Py_DECREF(arg);
     }
-    return (PyObject *)res;
+    return 0;
+}
+
+/* Call func (a binary operation, or sqrt() if t is NULL) on mpf tuples. */
+static PyObject *
+mpf_tuple_op(mpf_arg *s, mpf_arg *t, zz_bitcnt_t prec, zz_rnd rnd,
+             mpf_binop func)
+{
+    MPZ_Object *man = MPZ_new();
+    zz_t exp;
+    PyObject *res = NULL;
+
+    if (zz_init(&exp) || !man) {
+        /* LCOV_EXCL_START */
+        Py_XDECREF(man);
+        PyErr_NoMemory();
+        goto end;
+        /* LCOV_EXCL_STOP */
+    }
+
+    mpf_res r = {.man = &man->z, .exp = &exp};
+    int ret = t ? func(s, t, prec, rnd, &r) : mpf_sqrt(s, prec, rnd, &r);
+
+    if (ret) {
+        Py_DECREF(man);
+        if (ret == 1) {
+            res = Py_NewRef(s->obj);
+        }
+    }
+    else {
+        res = mpf_res_to_tuple(&r, man);
+    }
 end:
-    Py_DECREF(res);
-    return NULL;
+    zz_clear(&exp);
+    mpf_arg_clear(s);
+    if (t) {
+        mpf_arg_clear(t);
+    }
+    return res;
 }
 
+#define MPF_TUPLE_BINOP(name, prec_required)                              \
+    static PyObject *                                                     \
+    gmp__mpmath_##name(PyObject *self, PyObject *const *args,             \
+                       Py_ssize_t nargs)                                  \
+    {                                                                     \
+        mpf_arg x[2];                                                     \
+        zz_bitcnt_t prec;                                                 \
+        zz_rnd rnd;                                                       \
+                                                                          \
+        if (parse_mpf_args(args, nargs, 2, prec_required,                 \
+                           "_mpmath_" #name, x, &prec, &rnd))             \
+        {                                                                 \
+            return NULL;                                                  \
+        }                                                                 \
+        return mpf_tuple_op(&x[0], &x[1], prec, rnd, mpf_##name);         \
+    }
+
+MPF_TUPLE_BINOP(add, false)
+MPF_TUPLE_BINOP(sub, false)
+MPF_TUPLE_BINOP(mul, false)
+MPF_TUPLE_BINOP(div, true)
+
 static PyObject *
-gmp_gcdext(PyObject *Py_UNUSED(module), PyObject *const *args,
-           Py_ssize_t nargs)
+gmp__mpmath_sqrt(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    mpf_arg x;
+    zz_bitcnt_t prec;
+    zz_rnd rnd;
+
+    if (parse_mpf_args(args, nargs, 1, true, "_mpmath_sqrt", &x, &prec,
+                       &rnd))
+    {
+        return NULL;
+    }
+    return mpf_tuple_op(&x, NULL, prec, rnd, NULL);
+}
+
+static PyObject *
+gmp__mpmath_shift(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
 {
     if (nargs != 2) {
-        PyErr_SetString(PyExc_TypeError, "gcdext() expects two arguments");
+        PyErr_SetString(PyExc_TypeError,
+                        "_mpmath_shift() takes exactly 2 arguments");
+        return NULL;
+    }
+    if (!PyLong_Check(args[1]) && !MPZ_Check(args[1])) {
+        PyErr_SetString(PyExc_TypeError,
+                        "_mpmath_shift() expects an integer shift");
         return NULL;
     }
-    MPZ_Object *x = NULL, *y = NULL;
-    MPZ_Object *g = MPZ_new(), *s = MPZ_new(), *t = MPZ_new();
 
-    if (!g || !s || !t) {
+    mpf_arg x;
+
+    if (mpf_arg_parse(args[0], "_mpmath_shift", &x)) {
+        mpf_arg_clear(&x);
+        return NULL;
+    }
+    if (x.kind != MPF_REGULAR) {
+        mpf_arg_clear(&x);
+        return Py_NewRef(args[0]);
+    }
+
+    zz_t n;
+
+    if (zz_init(&n) || zz_set_pyint(args[1], &n)
+        || zz_add(&x.exp_buf, &n, &x.exp_buf))
+    {
         /* LCOV_EXCL_START */
-        Py_XDECREF((PyObject *)g);
-        Py_XDECREF((PyObject *)s);
-        Py_XDECREF((PyObject *)t);
+        zz_clear(&n);
+        mpf_arg_clear(&x);
         return PyErr_NoMemory();
         /* LCOV_EXCL_STOP */
     }
-    CHECK_OP_INT(x, args[0]);
-    CHECK_OP_INT(y, args[1]);
+    zz_clear(&n);
 
-    zz_err ret = zz_gcdext(&x->z, &y->z, &g->z, &s->z, &t->z);
+    PyObject *iexp = zz_to_pyint(x.exp);
 
-    Py_XDECREF((PyObject *)x);
-    Py_XDECREF((PyObject *)y);
-    if (ret == ZZ_MEM) {
-        return PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    mpf_arg_clear(&x);
+    if (!iexp) {
+        return NULL; /* LCOV_EXCL_LINE */
     }
-    PyObject *tup = PyTuple_Pack(3, g, s, t);
 
-    Py_DECREF(g);
-    Py_DECREF(s);
-    Py_DECREF(t);
-    return tup;
-end:
-    Py_DECREF(g);
-    Py_DECREF(s);
-    Py_DECREF(t);
-    Py_XDECREF((PyObject *)x);
-    Py_XDECREF((PyObject *)y);
-    return NULL;
+    PyObject *t = args[0];
+
+    return Py_BuildValue("(OONO)", PyTuple_GET_ITEM(t, 0),
+                         PyTuple_GET_ITEM(t, 1), iexp,
+                         PyTuple_GET_ITEM(t, 3));
 }
 
-static PyObject *
-gmp_lcm(PyObject *Py_UNUSED(module), PyObject *const *args, Py_ssize_t nargs)
+typedef struct {
+    PyObject_HEAD
+    mpf_kind kind;
+    bool negative;
+    zz_t man;
+    zz_t exp;
+    zz_bitcnt_t bc;
+} MPF_Object;
+
+static PyTypeObject MPF_Type;
+
+#define MPF_Check(u) PyObject_TypeCheck((u), &MPF_Type)
+
+static MPF_Object *
+MPF_new(void)
 {
-    MPZ_Object *res = MPZ_new();
+    MPF_Object *res = PyObject_New(MPF_Object, &MPF_Type);
 
-    if (!res || zz_set(1, &res->z)) {
-        return PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    if (!res) {
+        return NULL; /* LCOV_EXCL_LINE */
     }
-    for (Py_ssize_t i = 0; i < nargs; i++) {
-        MPZ_Object *arg;
+    if (zz_init(&res->man) || zz_init(&res->exp)) {
+        return (MPF_Object *)PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+    res->kind = MPF_ZERO;
+    res->negative = false;
+    res->bc = 0;
+    return res;
+}
 
-        CHECK_OP_INT(arg, args[i]);
-        if (zz_cmp(&res->z, 0) == ZZ_EQ) {
-            Py_DECREF(arg);
-            continue;
-        }
+static void
+MPF_dealloc(PyObject *self)
+{
+    MPF_Object *u = (MPF_Object *)self;
 
-        zz_err ret = zz_lcm(&res->z, &arg->z, &res->z);
+    zz_clear(&u->man);
+    zz_clear(&u->exp);
+    PyObject_Free(self);
+}
 
-        if (ret) {
-            /* LCOV_EXCL_START */
-            Py_DECREF(res);
-            Py_DECREF(arg);
-            if (ret == ZZ_BUF) {
-                PyErr_SetString(PyExc_OverflowError,
-                                "too many digits in integer");
-                return NULL;
-            }
-            return PyErr_NoMemory();
-            /* LCOV_EXCL_STOP */
+/* Set x to the exact value of an mpf, integer or float object.  Return 1,
+   if obj has some other type. */
+static int
+mpf_arg_from_obj(PyObject *obj, mpf_arg *x)
+{
+    if (mpf_arg_init(obj, x)) {
+        return -1; /* LCOV_EXCL_LINE */
+    }
+    if (MPF_Check(obj)) {
+        MPF_Object *u = (MPF_Object *)obj;
+
+        x->negative = u->negative;
+        x->kind = u->kind;
+        x->man = &u->man;
+        x->exp = &u->exp;
+        x->bc = u->bc;
+        return 0;
+    }
+    if (MPZ_Check(obj) && !zz_isneg(&((MPZ_Object *)obj)->z)) {
+        x->negative = false;
+        x->man = &((MPZ_Object *)obj)->z;
+    }
+    else if (MPZ_Check(obj) || PyLong_Check(obj)) {
+        x->ref = (MPZ_Check(obj) ? (MPZ_Object *)plus(obj)
+                  : MPZ_from_int(obj));
+        if (!x->ref) {
+            return -1; /* LCOV_EXCL_LINE */
+        }
+        x->negative = zz_isneg(&x->ref->z);
+        (void)zz_abs(&x->ref->z, &x->ref->z);
+        x->man = &x->ref->z;
+    }
+    else if (PyFloat_Check(obj)) {
+        double d = PyFloat_AS_DOUBLE(obj);
+
+        x->negative = d < 0;
+        if (isnan(d)) {
+            x->negative = false;
+            x->kind = MPF_NAN;
+            x->bc = 0;
+            return 0;
+        }
+        if (isinf(d)) {
+            x->kind = d > 0 ? MPF_INF : MPF_NINF;
+            x->bc = 0;
+            return 0;
+        }
+
+        int e;
+        int64_t m = (int64_t)ldexp(frexp(fabs(d), &e), DBL_MANT_DIG);
+
+        x->ref = MPZ_new();
+        if (!x->ref || zz_set(m, &x->ref->z)
+            || zz_set(e - DBL_MANT_DIG, &x->exp_buf))
+        {
+            PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+            return -1; /* LCOV_EXCL_LINE */
         }
-        Py_DECREF(arg);
+        x->man = &x->ref->z;
     }
-    return (PyObject *)res;
-end:
-    Py_DECREF(res);
-    return NULL;
+    else {
+        return 1;
+    }
+    x->bc = zz_bitlen(x->man);
+    x->kind = x->bc ? MPF_REGULAR : MPF_ZERO;
+    if (!x->bc) {
+        x->negative = false;
+    }
+    return 0;
+}
+
+static void
+MPF_set_res(MPF_Object *u, const mpf_res *r)
+{
+    u->kind = r->kind;
+    u->negative = r->negative;
+    u->bc = r->bc;
 }
 
+/* Round x to the context precision. */
 static PyObject *
-gmp_isqrt(PyObject *Py_UNUSED(module), PyObject *arg)
+MPF_from_arg(const mpf_arg *x, bool negative)
 {
-    MPZ_Object *x, *root = MPZ_new();
+    MPF_Object *res = MPF_new();
 
-    if (!root) {
+    if (!res) {
         return NULL; /* LCOV_EXCL_LINE */
     }
-    CHECK_OP_INT(x, arg);
 
-    zz_err ret = zz_sqrtrem(&x->z, &root->z, NULL);
+    mpf_res r = {.man = &res->man, .exp = &res->exp};
+    int ret;
 
-    Py_DECREF(x);
-    if (ret == ZZ_OK) {
-        return (PyObject *)root;
-    }
-    if (ret == ZZ_VAL) {
-        PyErr_SetString(PyExc_ValueError,
-                        "isqrt() argument must be nonnegative");
+    if (x->kind == MPF_REGULAR) {
+        ret = mpf_res_set(&r, x, negative, global.mpf_prec, global.mpf_rnd);
     }
     else {
-        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+        ret = mpf_res_special(&r, x->kind);
     }
-end:
-    Py_DECREF(root);
-    return NULL;
+    if (ret) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(res);
+        return NULL;
+        /* LCOV_EXCL_STOP */
+    }
+    MPF_set_res(res, &r);
+    return (PyObject *)res;
 }
 
 static PyObject *
-gmp_isqrt_rem(PyObject *Py_UNUSED(module), PyObject *arg)
+MPF_new_type(PyTypeObject *type, PyObject *args, PyObject *keywds)
 {
-    MPZ_Object *x, *root = MPZ_new(), *rem = MPZ_new();
-    PyObject *tup = NULL;
+    static char *kwlist[] = {"", NULL};
+    PyObject *arg = NULL;
 
-    if (!root || !rem) {
-        /* LCOV_EXCL_START */
-        Py_XDECREF((PyObject *)root);
-        Py_XDECREF((PyObject *)rem);
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "|O", kwlist, &arg)) {
         return NULL;
-        /* LCOV_EXCL_STOP */
     }
-    CHECK_OP_INT(x, arg);
+    if (!arg) {
+        return (PyObject *)MPF_new();
+    }
 
-    zz_err ret = zz_sqrtrem(&x->z, &root->z, &rem->z);
+    mpf_arg x;
+    int ret;
 
-    Py_DECREF(x);
-    if (ret == ZZ_OK) {
-        tup = PyTuple_Pack(2, root, rem);
-    }
-    else if (ret == ZZ_VAL) {
-        PyErr_SetString(PyExc_ValueError,
-                        "isqrt() argument must be nonnegative");
+    if (PyTuple_Check(arg)) {
+        ret = mpf_arg_parse(arg, "mpf", &x);
     }
     else {
-        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+        ret = mpf_arg_from_obj(arg, &x);
+        if (ret == 1) {
+            PyErr_SetString(PyExc_TypeError,
+                            "mpf() argument must be a number or an mpf tuple");
+        }
     }
-end:
-    Py_DECREF(root);
-    Py_DECREF(rem);
-    return tup;
+    if (ret) {
+        mpf_arg_clear(&x);
+        return NULL;
+    }
+
+    PyObject *res = MPF_from_arg(&x, x.negative);
+
+    mpf_arg_clear(&x);
+    return res;
 }
 
 static PyObject *
-gmp_fac(PyObject *Py_UNUSED(module), PyObject *arg)
+MPF_to_tuple(const MPF_Object *u)
 {
-    MPZ_Object *x, *res = MPZ_new();
+    MPZ_Object *man = MPZ_new();
 
-    if (!res) {
+    if (!man || zz_pos(&u->man, &man->z)) {
+        /* LCOV_EXCL_START */
+        Py_XDECREF(man);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+
+    mpf_res r = {u->kind, u->negative, &man->z, (zz_t *)&u->exp, u->bc};
+
+    return mpf_res_to_tuple(&r, man);
+}
+
+static PyObject *
+MPF_get_mpf(PyObject *self, void *Py_UNUSED(closure))
+{
+    return MPF_to_tuple((MPF_Object *)self);
+}
+
+static PyObject *
+MPF_repr(PyObject *self)
+{
+    PyObject *t = MPF_to_tuple((MPF_Object *)self);
+
+    if (!t) {
         return NULL; /* LCOV_EXCL_LINE */
     }
-    CHECK_OP_INT(x, arg);
-    if (zz_isneg(&x->z)) {
-        PyErr_SetString(PyExc_ValueError,
-                        "fac() not defined for negative values");
-        goto err;
+
+    PyObject *res = PyUnicode_FromFormat("mpf(%R)", t);
+
+    Py_DECREF(t);
+    return res;
+}
+
+/* Round the regular x to the double in the given direction. */
+static int
+mpf_get_dbl(const mpf_arg *x, zz_rnd rnd, double *res)
+{
+    switch (x->kind) {
+        case MPF_ZERO:
+            *res = 0.0;
+            return 0;
+        case MPF_NAN:
+            *res = NAN;
+            return 0;
+        case MPF_INF:
+            *res = INFINITY;
+            return 0;
+        case MPF_NINF:
+            *res = -INFINITY;
+            return 0;
+        default:
+            break;
     }
 
-    uint64_t n;
+    bool away = (rnd == ZZ_RNDA || (rnd == ZZ_RNDU && !x->negative)
+                 || (rnd == ZZ_RNDD && x->negative));
+    zz_t man, exp;
+    int64_t e;
 
-    if (zz_get(&x->z, &n)) {
-overflow:
-        PyErr_Format(PyExc_OverflowError,
-                     "fac() argument should not exceed %ld",
-                     ULONG_MAX);
-        goto err;
+    /* 2**(e - 1) <= |x| < 2**e */
+    if (zz_init(&man) || zz_init(&exp)
+        || zz_add(x->exp, (int64_t)x->bc, &exp))
+    {
+        goto err; /* LCOV_EXCL_LINE */
     }
-    Py_XDECREF((PyObject *)x);
+    if (zz_get(&exp, &e)) {
+        e = zz_isneg(&exp) ? INT64_MIN : INT64_MAX;
+    }
+    if (e > DBL_MAX_EXP) {
+        *res = away || rnd == ZZ_RNDN ? INFINITY : DBL_MAX;
+    }
+    else if (e <= DBL_MIN_EXP - DBL_MANT_DIG) {
+        /* Less than the smallest subnormal. */
+        bool up = away || (rnd == ZZ_RNDN
+                           && e == DBL_MIN_EXP - DBL_MANT_DIG
+                           && zz_cmp(x->man, 1) != ZZ_EQ);
 
-    zz_err ret = zz_fac((zz_digit_t)n, &res->z);
+        *res = up ? ldexp(1, DBL_MIN_EXP - DBL_MANT_DIG) : 0.0;
+    }
+    else {
+        zz_bitcnt_t prec = DBL_MANT_DIG, bc = x->bc;
+        bool negative = x->negative;
+        int64_t m;
 
-    if (ret) {
-        /* LCOV_EXCL_START */
-        if (ret == ZZ_BUF) {
-            goto overflow;
+        if (e < DBL_MIN_EXP) {
+            prec = (zz_bitcnt_t)(e - (DBL_MIN_EXP - DBL_MANT_DIG));
         }
-        PyErr_NoMemory();
-        goto err;
-        /* LCOV_EXCL_STOP */
+        if (zz_pos(x->exp, &exp)
+            || zz_mpmath_normalize(prec, rnd, &negative, x->man, &man,
+                                   &exp, &bc))
+        {
+            goto err; /* LCOV_EXCL_LINE */
+        }
+        (void)zz_get(&man, &m);
+        (void)zz_get(&exp, &e);
+        *res = ldexp((double)m, (int)e);
     }
-    return (PyObject *)res;
+    if (x->negative) {
+        *res = -*res;
+    }
+    zz_clear(&man);
+    zz_clear(&exp);
+    return 0;
+    /* LCOV_EXCL_START */
 err:
-end:
-    Py_DECREF(res);
-    return NULL;
+    zz_clear(&man);
+    zz_clear(&exp);
+    PyErr_NoMemory();
+    return -1;
+    /* LCOV_EXCL_STOP */
 }
 
 static PyObject *
-gmp_comb(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+MPF_to_float(PyObject *self)
 {
-    if (nargs != 2) {
-        PyErr_SetString(PyExc_TypeError, "two arguments required");
-        return NULL;
-    }
+    mpf_arg x;
+    double d;
 
-    MPZ_Object *x, *y, *res = MPZ_new();
+    (void)mpf_arg_from_obj(self, &x);
 
-    if (!res) {
+    int ret = mpf_get_dbl(&x, ZZ_RNDN, &d);
+
+    mpf_arg_clear(&x);
+    if (ret) {
         return NULL; /* LCOV_EXCL_LINE */
     }
-    CHECK_OP_INT(x, args[0]);
-    CHECK_OP_INT(y, args[1]);
-    if (zz_isneg(&x->z) || zz_isneg(&y->z)) {
-        PyErr_SetString(PyExc_ValueError,
-                        "comb() not defined for negative values");
-        goto err;
-    }
+    return PyFloat_FromDouble(d);
+}
 
-    uint64_t n, k;
+static int
+MPF_bool(PyObject *self)
+{
+    return ((MPF_Object *)self)->kind != MPF_ZERO;
+}
 
-    if (zz_get(&x->z, &n) || zz_get(&y->z, &k)) {
-overflow:
-        PyErr_Format(PyExc_OverflowError,
-                     "comb() arguments should not exceed %ld",
-                     ULONG_MAX);
-        goto err;
-    }
-    Py_XDECREF((PyObject *)x);
-    Py_XDECREF((PyObject *)y);
+static PyObject *
+MPF_unop(PyObject *self, int op)
+{
+    MPF_Object *u = (MPF_Object *)self;
+    mpf_arg x;
 
-    zz_err ret = zz_bin(n, k, &res->z);
+    (void)mpf_arg_from_obj(self, &x);
 
-    if (ret) {
-        /* LCOV_EXCL_START */
-        if (ret == ZZ_BUF) {
-            goto overflow;
+    bool negative = u->negative;
+
+    if (op == '-') {
+        negative = !negative;
+        if (x.kind == MPF_INF) {
+            x.kind = MPF_NINF;
+        }
+        else if (x.kind == MPF_NINF) {
+            x.kind = MPF_INF;
         }
-        PyErr_NoMemory();
-        goto err;
-        /* LCOV_EXCL_STOP */
     }
-    return (PyObject *)res;
-err:
-end:
-    Py_DECREF(res);
-    return NULL;
+    else if (op == 'a') {
+        negative = false;
+        if (x.kind == MPF_NINF) {
+            x.kind = MPF_INF;
+        }
+    }
+
+    PyObject *res = MPF_from_arg(&x, negative);
+
+    mpf_arg_clear(&x);
+    return res;
 }
 
 static PyObject *
-gmp_perm(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+MPF_neg(PyObject *self)
 {
-    if (nargs > 2 || nargs < 1) {
-        PyErr_SetString(PyExc_TypeError, "one or two arguments required");
-        return NULL;
-    }
-    if (nargs == 1) {
-        return gmp_fac(self, args[0]);
-    }
+    return MPF_unop(self, '-');
+}
 
-    MPZ_Object *x, *y, *res = MPZ_new();
+static PyObject *
+MPF_pos(PyObject *self)
+{
+    return MPF_unop(self, '+');
+}
 
-    if (!res) {
-        return NULL; /* LCOV_EXCL_LINE */
-    }
-    CHECK_OP_INT(x, args[0]);
-    CHECK_OP_INT(y, args[1]);
-    if (zz_isneg(&x->z) || zz_isneg(&y->z)) {
-        PyErr_SetString(PyExc_ValueError,
-                        "perm() not defined for negative values");
-        goto err;
-    }
+static PyObject *
+MPF_abs(PyObject *self)
+{
+    return MPF_unop(self, 'a');
+}
 
-    uint64_t n, k;
+static PyObject *
+MPF_binop(PyObject *self, PyObject *other, mpf_binop func)
+{
+    mpf_arg x, y;
+    PyObject *res = NULL;
+    int ret = mpf_arg_from_obj(self, &x);
 
-    if (zz_get(&x->z, &n) || zz_get(&y->z, &k)) {
-overflow:
-        PyErr_Format(PyExc_OverflowError,
-                     "perm() arguments should not exceed %ld",
-                     ULONG_MAX);
-        goto err;
+    if (ret) {
+        mpf_arg_clear(&x);
+        goto end;
     }
-    Py_XDECREF((PyObject *)x);
-    Py_XDECREF((PyObject *)y);
-    if (k > n) {
-        return (PyObject *)res;
+    ret = mpf_arg_from_obj(other, &y);
+    if (ret) {
+        goto clear;
     }
 
-    MPZ_Object *den = MPZ_new();
+    MPF_Object *u = MPF_new();
 
-    if (!den) {
-        /* LCOV_EXCL_START */
-        PyErr_NoMemory();
-        goto err;
-        /* LCOV_EXCL_STOP */
+    if (!u) {
+        ret = -1; /* LCOV_EXCL_LINE */
+        goto clear2; /* LCOV_EXCL_LINE */
     }
 
-    zz_err ret = zz_fac((zz_digit_t)n, &res->z);
+    mpf_res r = {.man = &u->man, .exp = &u->exp};
 
-    if (ret || zz_fac((zz_digit_t)(n-k), &den->z)
-        || zz_div(&res->z, &den->z, &res->z, NULL))
-    {
-        /* LCOV_EXCL_START */
-        Py_DECREF(den);
-        if (ret == ZZ_BUF) {
-            goto overflow;
+    ret = func(&x, &y, global.mpf_prec, global.mpf_rnd, &r);
+    if (ret == 1) {
+        Py_DECREF(u);
+        ret = 0;
+        if (MPF_Check(self)) {
+            res = Py_NewRef(self);
+        }
+        else {
+            res = MPF_from_arg(&x, x.negative);
         }
-        PyErr_NoMemory();
-        goto err;
-        /* LCOV_EXCL_STOP */
     }
-    Py_DECREF(den);
-    return (PyObject *)res;
-err:
+    else if (!ret) {
+        MPF_set_res(u, &r);
+        res = (PyObject *)u;
+    }
+    else {
+        Py_DECREF(u);
+    }
+clear2:
+    mpf_arg_clear(&y);
+clear:
+    mpf_arg_clear(&x);
 end:
-    Py_DECREF(res);
-    return NULL;
+    if (ret == 1) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    return res;
 }
 
-typedef enum {
-    ZZ_RNDD = 0,
-    ZZ_RNDN = 1,
-    ZZ_RNDU = 2,
-    ZZ_RNDZ = 3,
-    ZZ_RNDA = 4,
-} zz_rnd;
+#define MPF_BINOP(name)                                     \
+    static PyObject *                                       \
+    MPF_##name(PyObject *self, PyObject *other)             \
+    {                                                       \
+        return MPF_binop(self, other, mpf_##name);          \
+    }
 
-static zz_rnd
-get_round_mode(PyObject *rndstr)
+MPF_BINOP(add)
+MPF_BINOP(sub)
+MPF_BINOP(mul)
+MPF_BINOP(div)
+
+static PyObject *
+MPF_sqrt(PyObject *self, PyObject *Py_UNUSED(args))
 {
-    if (!PyUnicode_Check(rndstr)) {
-invalid:
-        PyErr_SetString(PyExc_ValueError, "invalid rounding mode specified");
-        return (zz_rnd)-1;
+    mpf_arg x;
+
+    (void)mpf_arg_from_obj(self, &x);
+
+    MPF_Object *res = MPF_new();
+
+    if (!res) {
+        mpf_arg_clear(&x); /* LCOV_EXCL_LINE */
+        return NULL; /* LCOV_EXCL_LINE */
     }
 
-    Py_UCS4 rndchr = PyUnicode_ReadChar(rndstr, 0);
-    zz_rnd rnd = ZZ_RNDN;
+    mpf_res r = {.man = &res->man, .exp = &res->exp};
+    int ret = mpf_sqrt(&x, global.mpf_prec, global.mpf_rnd, &r);
 
-    assert(rndchr != -1);
-    switch (rndchr) {
-        case (Py_UCS4)'f':
-            rnd = ZZ_RNDD;
-            break;
-        case (Py_UCS4)'c':
-            rnd = ZZ_RNDU;
-            break;
-        case (Py_UCS4)'d':
-            rnd = ZZ_RNDZ;
-            break;
-        case (Py_UCS4)'u':
-            rnd = ZZ_RNDA;
-            break;
-        case (Py_UCS4)'n':
-            rnd = ZZ_RNDN;
-            break;
-        default:
-            goto invalid;
+    mpf_arg_clear(&x);
+    if (ret) {
+        Py_DECREF(res);
+        return ret == 1 ? Py_NewRef(self) : NULL;
     }
-    return rnd;
+    MPF_set_res(res, &r);
+    return (PyObject *)res;
 }
 
-static zz_err
-zz_mpmath_normalize(zz_bitcnt_t prec, zz_rnd rnd, bool *negative,
-                     zz_t *man, zz_t *exp, zz_bitcnt_t *bc)
+/* Compare finite or infinite s and t. */
+static int
+mpf_cmp(const mpf_arg *s, const mpf_arg *t, int *res)
 {
-    /* If the mantissa is 0, return the normalized representation. */
-    if (zz_iszero(man)) {
-        *negative = false;
-        *bc = 0;
-        return zz_set(0, exp);
-    }
-    /* if size <= prec and the number is odd return it */
-    if (*bc <= prec && zz_isodd(man)) {
-        return ZZ_OK;
-    }
-    if (*bc > prec) {
-        zz_bitcnt_t shift = *bc - prec;
-
-do_rnd:
-        switch (rnd) {
-            case ZZ_RNDD:
-                rnd = *negative ? ZZ_RNDA : ZZ_RNDZ;
-                goto do_rnd;
-            case ZZ_RNDU:
-                rnd = *negative ? ZZ_RNDZ : ZZ_RNDA;
-                goto do_rnd;
-            case ZZ_RNDZ:
-                zz_quo_2exp(man, shift, man);
-                break;
-            case ZZ_RNDA:
-                zz_neg(man, man);
-                zz_quo_2exp(man, shift, man);
-                zz_abs(man, man);
-                break;
-            case ZZ_RNDN:
-            default:
-                {
-                    bool t = zz_lsbpos(man) + 2 <= shift;
-
-                    if (zz_quo_2exp(man, shift - 1, man)) {
-                        return ZZ_MEM; /* LCOV_EXCL_LINE */
-                    }
-                    t = zz_isodd(man) && (man->digits[0]&2 || t);
-                    if (zz_quo_2exp(man, 1, man)) {
-                        return ZZ_MEM; /* LCOV_EXCL_LINE */
-                    }
-                    if (t && zz_add(man, 1, man)) {
-                        return ZZ_MEM; /* LCOV_EXCL_LINE */
-                    }
-                }
-        }
+    int ss = mpf_sign(s), ts = mpf_sign(t);
 
-        zz_t tmp;
-        zz_err ret = ZZ_OK;
+    if (ss != ts || !ss || mpf_isspecial(s) || mpf_isspecial(t)) {
+        int sinf = s->kind == MPF_INF ? 1 : s->kind == MPF_NINF ? -1 : 0;
+        int tinf = t->kind == MPF_INF ? 1 : t->kind == MPF_NINF ? -1 : 0;
 
-        if (zz_init(&tmp) || (ret = zz_add(exp, shift, exp))) {
-            /* LCOV_EXCL_START */
-            zz_clear(&tmp);
-            return ret;
-            /* LCOV_EXCL_STOP */
+        if (sinf != tinf) {
+            *res = sinf < tinf ? -1 : 1;
         }
-        zz_clear(&tmp);
-        *bc = prec;
-    }
-
-    zz_bitcnt_t zbits = 0;
-
-    /* Strip trailing 0 bits. */
-    if (!zz_iszero(man) && (zbits = zz_lsbpos(man))) {
-        if (zz_quo_2exp(man, zbits, man)) {
-            return ZZ_MEM; /* LCOV_EXCL_LINE */
+        else {
+            *res = ss < ts ? -1 : ss > ts;
         }
+        return 0;
     }
 
-    zz_t tmp;
-    zz_err ret = ZZ_OK;
+    /* Same signs, compare magnitudes. */
+    zz_t se, te;
+    zz_ord c;
 
-    if (zz_init(&tmp) || (ret = zz_add(exp, zbits, exp))) {
-        /* LCOV_EXCL_START */
-        zz_clear(&tmp);
-        return ret;
-        /* LCOV_EXCL_STOP */
+    if (zz_init(&se) || zz_init(&te)
+        || zz_add(s->exp, (int64_t)s->bc, &se)
+        || zz_add(t->exp, (int64_t)t->bc, &te))
+    {
+        goto err; /* LCOV_EXCL_LINE */
     }
-    zz_clear(&tmp);
-    *bc -= zbits;
-    /* Check if one less than a power of 2 was rounded up. */
-    if (zz_cmp(man, 1) == ZZ_EQ) {
-        *bc = 1;
+    c = zz_cmp(&se, &te);
+    if (c == ZZ_EQ) {
+        /* Align mantissas. */
+        if (s->bc < t->bc) {
+            if (zz_mul_2exp(s->man, t->bc - s->bc, &se)) {
+                goto err; /* LCOV_EXCL_LINE */
+            }
+            c = zz_cmp(&se, t->man);
+        }
+        else {
+            if (zz_mul_2exp(t->man, s->bc - t->bc, &te)) {
+                goto err; /* LCOV_EXCL_LINE */
+            }
+            c = zz_cmp(s->man, &te);
+        }
     }
-    return ZZ_OK;
+    zz_clear(&se);
+    zz_clear(&te);
+    *res = c == ZZ_LT ? -1 : c == ZZ_GT;
+    if (ss < 0) {
+        *res = -*res;
+    }
+    return 0;
+    /* LCOV_EXCL_START */
+err:
+    zz_clear(&se);
+    zz_clear(&te);
+    PyErr_NoMemory();
+    return -1;
+    /* LCOV_EXCL_STOP */
 }
 
 static PyObject *
-gmp__mpmath_normalize(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+MPF_richcompare(PyObject *self, PyObject *other, int op)
 {
-    if (nargs != 6) {
-        PyErr_SetString(PyExc_TypeError, "6 arguments required");
-        return NULL;
+    mpf_arg x, y;
+    int r;
+
+    (void)mpf_arg_from_obj(self, &x);
+    r = mpf_arg_from_obj(other, &y);
+    if (r) {
+        mpf_arg_clear(&x);
+        mpf_arg_clear(&y);
+        if (r == 1) {
+            Py_RETURN_NOTIMPLEMENTED;
+        }
+        return NULL; /* LCOV_EXCL_LINE */
     }
 
-    long sign = PyLong_AsLong(args[0]);
-    bool negative = (bool)sign;
-    zz_bitcnt_t bc = PyLong_AsUnsignedLongLong(args[3]);
-    zz_bitcnt_t prec = PyLong_AsUnsignedLongLong(args[4]);
-    PyObject *rndstr = args[5];
-    zz_rnd rnd = get_round_mode(rndstr);
+    bool nan = x.kind == MPF_NAN || y.kind == MPF_NAN;
+    int c = 0;
 
-    if (sign == -1 || bc == (zz_bitcnt_t)(-1) || prec == (zz_bitcnt_t)(-1)
-        || !MPZ_Check(args[1]) || !PyLong_Check(args[2]))
-    {
-        PyErr_SetString(PyExc_TypeError,
-                        ("arguments long, MPZ_Object*, PyObject*, "
-                         "long, long, char needed"));
-        return NULL;
+    r = nan ? 0 : mpf_cmp(&x, &y, &c);
+    mpf_arg_clear(&x);
+    mpf_arg_clear(&y);
+    if (r) {
+        return NULL; /* LCOV_EXCL_LINE */
     }
-    if (rnd == -1) {
-        return NULL;
+    if (nan) {
+        return PyBool_FromLong(op == Py_NE);
     }
+    Py_RETURN_RICHCOMPARE(c, 0, op);
+}
 
-    MPZ_Object *man = (MPZ_Object *)plus(args[1]);
-    MPZ_Object *exp = MPZ_from_int(args[2]);
-    zz_err ret = ZZ_OK;
+static Py_hash_t
+MPF_hash(PyObject *self)
+{
+    MPF_Object *u = (MPF_Object *)self;
+
+    switch (u->kind) {
+        case MPF_ZERO:
+            return 0;
+        case MPF_NAN:
+            return Py_HashPointer(self);
+        case MPF_INF:
+            return 314159;
+        case MPF_NINF:
+            return -314159;
+        default:
+            break;
+    }
 
-    if (!exp || !man || (ret = zz_mpmath_normalize(prec, rnd, &negative,
-                                                   &man->z, &exp->z, &bc)))
-    {
+    /* Same as for float's: man*2**exp modulo the hash modulus, which is
+       a Mersenne prime 2**hbits - 1. */
+    unsigned int hbits = 0;
+    zz_t w;
+    uint64_t r, e;
+
+    for (uint64_t m = (uint64_t)pyhash_modulus; m; m >>= 1) {
+        hbits++;
+    }
+    if (zz_init(&w) || zz_div(&u->man, (int64_t)pyhash_modulus, NULL, &w)) {
         /* LCOV_EXCL_START */
-        Py_XDECREF((PyObject *)man);
-        Py_XDECREF((PyObject *)exp);
-        if (ret == ZZ_BUF) {
-            PyErr_SetString(PyExc_OverflowError,
-                            "too many digits in integer");
-            return NULL;
-        }
-        return PyErr_NoMemory();
+        zz_clear(&w);
+        PyErr_NoMemory();
+        return -1;
         /* LCOV_EXCL_STOP */
     }
-
-    PyObject *iexp = MPZ_to_int(exp);
-
-    Py_DECREF(exp);
-    if (!iexp) {
+    (void)zz_get(&w, &r);
+    if (zz_div(&u->exp, (int64_t)hbits, NULL, &w)) {
         /* LCOV_EXCL_START */
-        Py_DECREF(man);
-        return NULL;
+        zz_clear(&w);
+        PyErr_NoMemory();
+        return -1;
         /* LCOV_EXCL_STOP */
     }
-    return Py_BuildValue("(bNNK)", negative, man, iexp, bc);
+    (void)zz_get(&w, &e);
+    zz_clear(&w);
+    r = ((r << e) & (uint64_t)pyhash_modulus) | r >> (hbits - e);
+
+    Py_hash_t h = u->negative ? -(Py_hash_t)r : (Py_hash_t)r;
+
+    return h == -1 ? -2 : h;
 }
 
+static PyNumberMethods MPF_as_number = {
+    .nb_add = MPF_add,
+    .nb_subtract = MPF_sub,
+    .nb_multiply = MPF_mul,
+    .nb_true_divide = MPF_div,
+    .nb_negative = MPF_neg,
+    .nb_positive = MPF_pos,
+    .nb_absolute = MPF_abs,
+    .nb_bool = MPF_bool,
+    .nb_float = MPF_to_float,
+};
+
+static PyGetSetDef MPF_getsetters[] = {
+    {"_mpf_", (getter)MPF_get_mpf, NULL,
+     "the raw mpmath's mpf tuple (sign, man, exp, bc)", NULL},
+    {NULL} /* sentinel */
+};
+
+static PyMethodDef MPF_methods[] = {
+    {"sqrt", MPF_sqrt, METH_NOARGS,
+     ("sqrt($self, /)\n--\n\n"
+      "Return the square root of self.")},
+    {NULL} /* sentinel */
+};
+
+PyDoc_STRVAR(MPF_doc,
+             "mpf(x=0, /)\n\n\
+Binary floating-point number with arbitrary precision.\n\n\
+The argument x might be an integer, a float, an mpf or the raw mpmath's\n\
+tuple (sign, man, exp, bc).  Its value is rounded to the context\n\
+precision.  Arithmetic operations round results to the context\n\
+precision in the context rounding mode, see set_mpf_context().");
+
+static PyTypeObject MPF_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gmp.mpf",
+    .tp_basicsize = sizeof(MPF_Object),
+    .tp_new = MPF_new_type,
+    .tp_dealloc = MPF_dealloc,
+    .tp_repr = MPF_repr,
+    .tp_richcompare = MPF_richcompare,
+    .tp_hash = MPF_hash,
+    .tp_as_number = &MPF_as_number,
+    .tp_getset = MPF_getsetters,
+    .tp_methods = MPF_methods,
+    .tp_doc = MPF_doc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+};
+
 static PyObject *
-gmp__mpmath_create(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+gmp_get_mpf_context(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
 {
-    if (nargs < 2 || nargs > 4) {
-        PyErr_Format(PyExc_TypeError,
-                     "_mpmath_create() takes from 2 to 4 arguments");
-        return NULL;
-    }
-
-    MPZ_Object *man;
+    return Py_BuildValue("(KC)", (unsigned long long)global.mpf_prec,
+                         "fncdu"[global.mpf_rnd]);
+}
 
-    if (MPZ_Check(args[0])) {
-        man = (MPZ_Object *)plus(args[0]);
-    }
-    else if (PyLong_Check(args[0])) {
-        man = MPZ_from_int(args[0]);
-        if (!man) {
-            return NULL; /* LCOV_EXCL_LINE */
-        }
-    }
-    else {
-        PyErr_Format(PyExc_TypeError, "_mpmath_create() expects an integer");
-        return NULL;
-    }
-    if (!PyLong_Check(args[1])) {
-        Py_DECREF(man);
-        PyErr_Format(PyExc_TypeError,
-                     "_mpmath_create() expects an integer exp");
+static PyObject *
+gmp_set_mpf_context(PyObject *Py_UNUSED(module), PyObject *const *args,
+                    Py_ssize_t nargs)
+{
+    if (nargs < 1 || nargs > 2) {
+        PyErr_SetString(PyExc_TypeError,
+                        "set_mpf_context() takes 1 or 2 arguments");
         return NULL;
     }
 
-    bool negative = zz_isneg(&man->z);
-    zz_bitcnt_t bc = zz_bitlen(&man->z);
-    zz_bitcnt_t prec = 0;
-    zz_rnd rnd = ZZ_RNDZ;
-
-    if (negative) {
-        (void)zz_abs(&man->z, &man->z);
-    }
-    if (nargs > 2) {
-        prec = PyLong_AsUnsignedLongLong(args[2]);
-        if (prec == (zz_bitcnt_t)(-1) && PyErr_Occurred()) {
-            Py_DECREF(man);
-            PyErr_SetString(PyExc_TypeError, "bad prec argument");
-            return NULL;
-        }
-    }
-    if (nargs > 3) {
-        rnd = get_round_mode(args[3]);
+    zz_bitcnt_t prec;
+    zz_rnd rnd = ZZ_RNDN;
 
-        if (rnd == -1) {
-            Py_DECREF(man);
-            return NULL;
-        }
+    if (get_prec_arg(args[0], &prec)) {
+        return NULL;
     }
     if (!prec) {
-        prec = bc;
+        PyErr_SetString(PyExc_ValueError,
+                        "set_mpf_context() requires positive precision");
+        return NULL;
     }
-
-    MPZ_Object *exp = MPZ_from_int(args[1]);
-    zz_err ret = ZZ_OK;
-
-    if (!exp || (ret = zz_mpmath_normalize(prec, rnd, &negative,
-                                           &man->z, &exp->z, &bc)))
-    {
-        /* LCOV_EXCL_START */
-        Py_DECREF(man);
-        Py_XDECREF((PyObject *)exp);
-        if (ret == ZZ_BUF) {
-            PyErr_SetString(PyExc_OverflowError,
-                            "too many digits in integer");
+    if (nargs == 2) {
+        rnd = get_round_mode(args[1]);
+        if (rnd == (zz_rnd)-1) {
             return NULL;
         }
-        return PyErr_NoMemory();
-        /* LCOV_EXCL_STOP */
-    }
-
-    PyObject *iexp = MPZ_to_int(exp);
-
-    Py_DECREF(exp);
-    if (!iexp) {
-        /* LCOV_EXCL_START */
-        Py_DECREF(man);
-        return NULL;
-        /* LCOV_EXCL_STOP */
     }
-    return Py_BuildValue("(bNNK)", negative, man, iexp, bc);
+    global.mpf_prec = prec;
+    global.mpf_rnd = rnd;
+    Py_RETURN_NONE;
 }
 
+extern void free_locale_cache(void);
+extern PyObject * compile_format(PyObject *module, PyObject *spec);
+extern PyTypeObject CompiledFormat_Type;
+
 static PyObject *
 gmp__free_cache(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
 {
@@ -2621,6 +10068,8 @@ gmp__free_cache(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
         zz_clear(&u->z);
         PyObject_Free(self);
     }
+    fac_cache_truncate(0);
+    free_locale_cache();
     Py_RETURN_NONE;
 }
 
@@ -2634,12 +10083,78 @@ static PyMethodDef gmp_functions[] = {
     {"lcm", (PyCFunction)gmp_lcm, METH_FASTCALL,
      ("lcm($module, /, *integers)\n--\n\n"
       "Least Common Multiple.")},
+    {"divexact", (PyCFunction)gmp_divexact, METH_FASTCALL,
+     ("divexact($module, x, y, /)\n--\n\n"
+      "Return x/y, if y divides x.\n\n"
+      "If y is more than twice as long as the quotient, only leading\n"
+      "and lowest bits of operands are used, that's faster than x//y.\n"
+      "The result is undefined if x isn't divisible by y.")},
+    {"frexp", gmp_frexp, METH_O,
+     ("frexp($module, x, /)\n--\n\n"
+      "Return the mantissa and exponent of the integer x as the pair\n"
+      "(m, e).\n\n"
+      "m is a float and e is an integer such that x ~ m*2**e, where\n"
+      "0.5 <= abs(m) < 1 (m is rounded to nearest) or m is zero.  Unlike\n"
+      "math.frexp(), it works for integers which are too large to\n"
+      "convert to float.")},
+    {"hamdist", (PyCFunction)gmp_hamdist, METH_FASTCALL,
+     ("hamdist($module, x, y, /)\n--\n\n"
+      "Return the Hamming distance of x and y.\n\n"
+      "That's the number of different bits in the two's complement\n"
+      "representation, i.e. (x ^ y).bit_count().  Arguments must have\n"
+      "same sign.")},
+    {"and_count", (PyCFunction)gmp_and_count, METH_FASTCALL,
+     ("and_count($module, x, y, /)\n--\n\n"
+      "Return the number of common set bits of x and y.\n\n"
+      "That's (x & y).bit_count(), computed without building x & y.\n"
+      "Arguments must not be both negative.")},
+    {"and_reduce", gmp_and_reduce, METH_O,
+     ("and_reduce($module, iterable, /)\n--\n\n"
+      "Return the bitwise and of integers from iterable.\n\n"
+      "The result is -1 for an empty iterable.")},
+    {"or_reduce", gmp_or_reduce, METH_O,
+     ("or_reduce($module, iterable, /)\n--\n\n"
+      "Return the bitwise or of integers from iterable.\n\n"
+      "The result is 0 for an empty iterable.")},
+    {"xor_reduce", gmp_xor_reduce, METH_O,
+     ("xor_reduce($module, iterable, /)\n--\n\n"
+      "Return the bitwise exclusive or of integers from iterable.\n\n"
+      "The result is 0 for an empty iterable.")},
     {"isqrt", gmp_isqrt, METH_O,
      ("isqrt($module, n, /)\n--\n\n"
       "Return the integer part of the square root of n.")},
     {"isqrt_rem", gmp_isqrt_rem, METH_O,
      ("isqrt_rem($module, n, /)\n--\n\n"
       "Return a 2-element tuple (s,t) such that s=isqrt(n) and t=n-s*s.")},
+    {"double_factorial", gmp_double_factorial, METH_O,
+     ("double_factorial($module, n, /)\n--\n\n"
+      "Return n!! = n*(n-2)*(n-4)*..., the product of all positive\n"
+      "integers up to n that have the same parity as n.")},
+    {"fib", gmp_fib, METH_O,
+     ("fib($module, n, /)\n--\n\nReturn the n-th Fibonacci number.")},
+    {"fib2", gmp_fib2, METH_O,
+     ("fib2($module, n, /)\n--\n\n"
+      "Return a 2-element tuple with the n-th and (n-1)-th Fibonacci\n"
+      "numbers.")},
+    {"lucas", gmp_lucas, METH_O,
+     ("lucas($module, n, /)\n--\n\nReturn the n-th Lucas number.")},
+    {"primorial", gmp_primorial, METH_O,
+     ("primorial($module, n, /)\n--\n\n"
+      "Return the product of all primes less than or equal to n.")},
+    {"iroot", (PyCFunction)gmp_iroot, METH_FASTCALL,
+     ("iroot($module, x, k, /)\n--\n\n"
+      "Return the integer part of the k-th root of x.\n\n"
+      "For negative x (and odd k) the root is truncated towards zero.")},
+    {"iroot_rem", (PyCFunction)gmp_iroot_rem, METH_FASTCALL,
+     ("iroot_rem($module, x, k, /)\n--\n\n"
+      "Return a 2-element tuple (y,r) such that y=iroot(x,k) and\n"
+      "r=x-y**k.")},
+    {"is_square", gmp_is_square, METH_O,
+     ("is_square($module, x, /)\n--\n\n"
+      "Return True if x is a perfect square.")},
+    {"is_power", gmp_is_power, METH_O,
+     ("is_power($module, x, /)\n--\n\n"
+      "Return True if x=y**k for some integers y and k>1.")},
     {"factorial", gmp_fac, METH_O,
      ("factorial($module, n, /)\n--\n\n"
       "Find n!.")},
@@ -2647,17 +10162,125 @@ static PyMethodDef gmp_functions[] = {
      ("comb($module, n, k, /)\n--\n\nNumber of ways to choose k"
       " items from n items without repetition and order.\n\n"
       "Also called the binomial coefficient.")},
+    {"comb_row", gmp_comb_row, METH_O,
+     ("comb_row($module, n, /)\n--\n\n"
+      "Return a list of binomial coefficients comb(n, k) for k in\n"
+      "range(n + 1).")},
+    {"set_factorial_cache", gmp_set_factorial_cache, METH_O,
+     ("set_factorial_cache($module, size, /)\n--\n\n"
+      "Cache factorials of integers less than size (at most 1000)\n"
+      "for the current thread.  They are reused by factorial() and\n"
+      "perm().  The default size 0 disables the cache.")},
     {"perm", (PyCFunction)gmp_perm, METH_FASTCALL,
      ("perm($module, n, k=None, /)\n--\n\nNumber of ways to choose k"
       " items from n items without repetition and with order.")},
+    {"batch_gcd", gmp_batch_gcd, METH_O,
+     ("batch_gcd($module, moduli, /)\n--\n\n"
+      "Return a list of gcd(n, prod(moduli)/n) for each n in moduli.\n\n"
+      "Uses Bernstein's product and remainder trees, which is much faster\n"
+      "than computing pairwise GCDs for large sequences.")},
+    {"multimod", (PyCFunction)gmp_multimod, METH_FASTCALL,
+     ("multimod($module, x, moduli, /)\n--\n\n"
+      "Return a list of remainders of x modulo each of positive moduli.")},
+    {"crt", (PyCFunction)gmp_crt, METH_FASTCALL,
+     ("crt($module, residues, moduli, /)\n--\n\n"
+      "Chinese remainder theorem.\n\n"
+      "Return the unique integer x in range(prod(moduli)) such that\n"
+      "x % m == r for all pairwise coprime moduli m and corresponding\n"
+      "residues r.")},
+    {"is_prime", (PyCFunction)gmp_is_prime, METH_FASTCALL | METH_KEYWORDS,
+     ("is_prime($module, /, n, reps=0)\n--\n\n"
+      "Return True if n is a probable prime.\n\n"
+      "Numbers below 2**32 are tested by trial division, for greater\n"
+      "values the Baillie-PSW test is used, followed by reps rounds\n"
+      "of the Miller-Rabin test to bases 3, 5, 7, etc.  No composite\n"
+      "passing the Baillie-PSW test is known.")},
+    {"next_prime", gmp_next_prime, METH_O,
+     ("next_prime($module, n, /)\n--\n\n"
+      "Return the smallest probable prime, greater than n.")},
+    {"prev_prime", gmp_prev_prime, METH_O,
+     ("prev_prime($module, n, /)\n--\n\n"
+      "Return the greatest probable prime, less than n.")},
+    {"factor", (PyCFunction)gmp_factor, METH_FASTCALL | METH_KEYWORDS,
+     ("factor($module, /, n, method='auto', timeout=None)\n--\n\n"
+      "Return a sorted list of pairs (p, e) of (probable) prime factors\n"
+      "of the positive integer n and their multiplicities.\n\n"
+      "After trial division, composite cofactors are split by the\n"
+      "Pollard-Brent rho method (method='rho'), the elliptic curve\n"
+      "method (method='ecm') or both: rho to find small factors, then\n"
+      "ECM (method='auto').  If timeout (in seconds) is not None and\n"
+      "exceeded, TimeoutError is raised.\n\n"
+      "The ECM uses a fixed schedule of curves with stage 1 bounds up\n"
+      "to 250000, which finds prime factors of up to about 35 digits.\n"
+      "If all curves fail to split a composite cofactor (with larger\n"
+      "prime factors), RuntimeError is raised.")},
+    {"invert", (PyCFunction)gmp_invert, METH_FASTCALL,
+     ("invert($module, x, m, /)\n--\n\n"
+      "Return y such that x*y == 1 modulo m, same as pow(x, -1, m).")},
+    {"jacobi", (PyCFunction)gmp_jacobi, METH_FASTCALL,
+     ("jacobi($module, x, n, /)\n--\n\n"
+      "Return the Jacobi symbol (x/n) for odd positive n.")},
+    {"legendre", (PyCFunction)gmp_legendre, METH_FASTCALL,
+     ("legendre($module, x, p, /)\n--\n\n"
+      "Return the Legendre symbol (x/p) for odd prime p.\n\n"
+      "The primality of p isn't checked.")},
+    {"kronecker", (PyCFunction)gmp_kronecker, METH_FASTCALL,
+     ("kronecker($module, x, n, /)\n--\n\n"
+      "Return the Kronecker symbol (x/n).")},
+    {"sqrtmod", (PyCFunction)gmp_sqrtmod, METH_FASTCALL,
+     ("sqrtmod($module, x, p, /)\n--\n\n"
+      "Return the least nonnegative y such that y*y == x modulo prime p.\n\n"
+      "Raise ValueError if x is a quadratic nonresidue.  The primality\n"
+      "of p isn't tested, for a composite p the result is unspecified.")},
     {"_mpmath_normalize", (PyCFunction)gmp__mpmath_normalize, METH_FASTCALL,
      ("_mpmath_normalize($module, sign, man, exp, bc, prec, rnd, /)\n--\n\n"
       "Helper function for mpmath.")},
+    {"_mpmath_normalize_many", (PyCFunction)gmp__mpmath_normalize_many,
+     METH_FASTCALL,
+     ("_mpmath_normalize_many($module, signs, mans, exps, bcs, prec, rnd, /)"
+      "\n--\n\nHelper function for mpmath.\n\n"
+      "Normalize a batch of mpf's, given as parallel sequences of their\n"
+      "components.  Return a tuple of four lists.")},
     {"_mpmath_create", (PyCFunction)gmp__mpmath_create, METH_FASTCALL,
      ("_mpmath_create($module, man, exp, prec=0, rnd='d', /)\n--\n\n"
       "Helper function for mpmath.")},
+    {"_mpmath_add", (PyCFunction)gmp__mpmath_add, METH_FASTCALL,
+     ("_mpmath_add($module, s, t, prec=0, rnd='d', /)\n--\n\n"
+      "Helper function for mpmath.")},
+    {"_mpmath_sub", (PyCFunction)gmp__mpmath_sub, METH_FASTCALL,
+     ("_mpmath_sub($module, s, t, prec=0, rnd='d', /)\n--\n\n"
+      "Helper function for mpmath.")},
+    {"_mpmath_mul", (PyCFunction)gmp__mpmath_mul, METH_FASTCALL,
+     ("_mpmath_mul($module, s, t, prec=0, rnd='d', /)\n--\n\n"
+      "Helper function for mpmath.")},
+    {"_mpmath_div", (PyCFunction)gmp__mpmath_div, METH_FASTCALL,
+     ("_mpmath_div($module, s, t, prec, rnd='d', /)\n--\n\n"
+      "Helper function for mpmath.")},
+    {"_mpmath_sqrt", (PyCFunction)gmp__mpmath_sqrt, METH_FASTCALL,
+     ("_mpmath_sqrt($module, s, prec, rnd='d', /)\n--\n\n"
+      "Helper function for mpmath.")},
+    {"_mpmath_shift", (PyCFunction)gmp__mpmath_shift, METH_FASTCALL,
+     ("_mpmath_shift($module, s, n, /)\n--\n\n"
+      "Helper function for mpmath.")},
+    {"get_mpf_context", gmp_get_mpf_context, METH_NOARGS,
+     ("get_mpf_context($module, /)\n--\n\n"
+      "Return the precision and the rounding mode of mpf arithmetic\n"
+      "in the current thread.")},
+    {"set_mpf_context", (PyCFunction)gmp_set_mpf_context, METH_FASTCALL,
+     ("set_mpf_context($module, prec, rnd='n', /)\n--\n\n"
+      "Set the precision (in bits) and the rounding mode of mpf\n"
+      "arithmetic in the current thread.  Rounding modes are same as\n"
+      "for mpmath: 'n' (to nearest), 'f' (floor), 'c' (ceiling),\n"
+      "'d' (down, toward zero) and 'u' (up, away from zero).  Default\n"
+      "context is (53, 'n').")},
+    {"compile_format", compile_format, METH_O,
+     ("compile_format($module, spec, /)\n--\n\n"
+      "Return a callable, that formats its argument per spec.\n\n"
+      "The spec is parsed only once, so this is faster than calling\n"
+      "format(x, spec) for many mpz's with the same spec.  Other\n"
+      "arguments are formatted with format().")},
     {"_free_cache", gmp__free_cache, METH_NOARGS,
-     "_free_cache($module)\n--\n\nFree mpz's cache."},
+     "_free_cache($module)\n--\n\nFree mpz's, factorial and locale caches."},
     {NULL} /* sentinel */
 };
 
@@ -2684,6 +10307,22 @@ gmp_exec(PyObject *m)
     if (PyModule_AddType(m, &MPZ_Type) < 0) {
         return -1; /* LCOV_EXCL_LINE */
     }
+    if (PyModule_AddType(m, &CRTBasis_Type) < 0) {
+        return -1; /* LCOV_EXCL_LINE */
+    }
+    if (PyModule_AddType(m, &Primes_Type) < 0) {
+        return -1; /* LCOV_EXCL_LINE */
+    }
+    if (PyModule_AddType(m, &MPF_Type) < 0) {
+        return -1; /* LCOV_EXCL_LINE */
+    }
+    if (PyType_Ready(&SetBits_Type) < 0) {
+        return -1; /* LCOV_EXCL_LINE */
+    }
+    if (PyType_Ready(&CompiledFormat_Type) < 0) {
+        return -1; /* LCOV_EXCL_LINE */
+    }
+    init_small_primes();
 
     PyTypeObject *MPZ_InfoType = PyStructSequence_NewType(&mpz_info_desc);
 
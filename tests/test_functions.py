@@ -1,31 +1,83 @@
+import functools
 import inspect
 import math
+import operator
 import platform
 
 import gmp
 import pytest
 from gmp import (
+    CRTBasis,
+    _mpmath_add,
     _mpmath_create,
+    _mpmath_div,
+    _mpmath_mul,
     _mpmath_normalize,
+    _mpmath_normalize_many,
+    _mpmath_shift,
+    _mpmath_sqrt,
+    _mpmath_sub,
+    and_count,
+    and_reduce,
+    batch_gcd,
     comb,
+    comb_row,
+    crt,
+    divexact,
+    double_factorial,
     fac,
+    factor,
     factorial,
+    fib,
+    fib2,
     gcd,
     gcdext,
+    hamdist,
+    invert,
+    iroot,
+    iroot_rem,
+    is_power,
+    is_prime,
+    is_square,
     isqrt,
     isqrt_rem,
+    jacobi,
+    kronecker,
     lcm,
+    legendre,
+    lucas,
     mpz,
+    multimod,
+    next_prime,
+    or_reduce,
     perm,
+    prev_prime,
+    primes,
+    primorial,
+    set_factorial_cache,
+    sqrtmod,
+    xor_reduce,
 )
 from hypothesis import example, given
 from hypothesis.strategies import booleans, integers, lists, sampled_from
 from utils import (
+    BITCNT_MAX,
+    MAX_FACTORIAL_CACHE,
+    MPMATH_INF,
+    MPMATH_NAN,
     bigints,
+    mpmath_add,
+    mpmath_div,
     mpmath_from_man_exp,
+    mpmath_mpfs,
+    mpmath_mul,
     mpmath_normalize,
+    mpmath_sqrt,
+    mpmath_sub,
     python_gcdext,
+    python_is_prime,
     python_isqrtrem,
+    python_kronecker,
 )
 
 
@@ -38,6 +90,85 @@ def test_isqrt(x):
         assert fm(x) == r
 
 
+@given(bigints(), bigints())
+@example(-(1<<64), -1)
+@example(-(1<<64), -(1<<128))
+def test_hamdist(x, y):
+    mx, my = mpz(x), mpz(y)
+    if (x < 0) != (y < 0):
+        with pytest.raises(ValueError, match="must have same sign"):
+            hamdist(mx, my)
+        return
+    r = (x ^ y).bit_count()
+    assert hamdist(mx, my) == r
+    assert hamdist(x, my) == r
+    assert hamdist(mx, y) == r
+
+
+@given(lists(bigints(), max_size=6))
+def test_bitwise_reduce(xs):
+    ms = [mpz(x) if i % 2 else x for i, x in enumerate(xs)]
+    assert and_reduce(ms) == functools.reduce(operator.and_, xs, -1)
+    assert or_reduce(iter(ms)) == functools.reduce(operator.or_, xs, 0)
+    assert xor_reduce(ms) == functools.reduce(operator.xor, xs, 0)
+    if len(xs) >= 2:
+        x, y = xs[:2]
+        if x < 0 and y < 0:
+            with pytest.raises(ValueError, match="not be both negative"):
+                and_count(x, y)
+        else:
+            assert and_count(ms[0], ms[1]) == (x & y).bit_count()
+    for f in [and_reduce, or_reduce, xor_reduce]:
+        with pytest.raises(TypeError, match="iterable of integers"):
+            f([1, 2.5])
+        with pytest.raises(TypeError):
+            f(1)
+
+
+@given(bigints(), bigints())
+@example(3, 1<<1000)
+@example(-(1<<100) + 1, -((1<<1000) + 1))
+@example((1<<64) - 1, (3<<1000) + 1)
+def test_divexact(x, y):
+    if not y:
+        with pytest.raises(ZeroDivisionError):
+            divexact(mpz(x), y)
+        return
+    mx, my = mpz(x), mpz(y)
+    assert divexact(mx*my, my) == x
+    assert divexact(x*y, y) == x
+
+
+@given(bigints(), integers(min_value=1, max_value=1000))
+@example(1<<200, 200)
+@example(-(3**333), 111)
+def test_iroot(x, k):
+    if x < 0 and k % 2 == 0:
+        k += 1
+    mx = mpz(x)
+    r = iroot(mx, k)
+    assert abs(r)**k <= abs(x) < (abs(r) + 1)**k
+    assert (r < 0) == (x < 0)
+    assert iroot(x, mpz(k)) == r
+    assert iroot_rem(mx, k) == (r, x - r**k)
+
+
+@given(bigints(), integers(min_value=2, max_value=20))
+@example(0, 2)
+@example(-1, 2)
+@example(2**64 + 1, 2)
+def test_is_power(x, k):
+    mx = mpz(x)
+    assert is_square(mx) == (x >= 0 and math.isqrt(x)**2 == x)
+    assert is_square(x*x)
+    assert is_power(x**k)
+    if x % 2:
+        assert not is_power(2*x**k)
+    r = any(iroot(abs(x), j)**j == abs(x) and (x > 0 or j % 2)
+            for j in range(2, max(abs(x).bit_length() + 1, 2)))
+    assert is_power(mx) == (r or abs(x) <= 1)
+
+
 @given(integers(min_value=0, max_value=12345))
 def test_factorial(x):
     mx = mpz(x)
@@ -46,6 +177,25 @@ def test_factorial(x):
     assert math.factorial(x) == r
 
 
+@given(integers(min_value=0, max_value=12345))
+def test_fib(n):
+    a, b = 0, 1
+    for _ in range(n):
+        a, b = b, a + b
+    mn = mpz(n)
+    assert fib(mn) == a
+    assert fib2(mn) == (a, b - a)
+    assert lucas(n) == a + 2*(b - a)
+
+
+@given(integers(min_value=0, max_value=12345))
+def test_primorial(n):
+    mn = mpz(n)
+    assert primorial(mn) == math.prod(primes(n + 1))
+    assert double_factorial(mn) == math.prod(range(n, 0, -2))
+    assert double_factorial(n) == math.prod(range(n, 0, -2))
+
+
 @given(integers(min_value=0, max_value=12345),
        integers(min_value=0, max_value=12345))
 def test_comb(x, y):
@@ -58,6 +208,29 @@ def test_comb(x, y):
     assert comb(x, y) == r
 
 
+@given(integers(min_value=0, max_value=1000))
+def test_comb_row(n):
+    assert comb_row(mpz(n)) == [math.comb(n, k) for k in range(n + 1)]
+
+
+@given(integers(min_value=0, max_value=MAX_FACTORIAL_CACHE),
+       integers(min_value=0, max_value=1500),
+       integers(min_value=0, max_value=1500))
+def test_factorial_cache(size, x, y):
+    try:
+        set_factorial_cache(size)
+        assert factorial(x) == math.factorial(x)
+        assert comb(x, y) == math.comb(x, y)
+        assert perm(x, y) == math.perm(x, y)
+        assert factorial(y) == math.factorial(y)
+        set_factorial_cache(size//2)
+        assert comb(x, y) == math.comb(x, y)
+        gmp._free_cache()
+        assert perm(x, y) == math.perm(x, y)
+    finally:
+        set_factorial_cache(0)
+
+
 @given(integers(min_value=0, max_value=12345),
        integers(min_value=0, max_value=12345))
 def test_perm(x, y):
@@ -125,6 +298,155 @@ def test_lcm_nary(xs):
     assert lcm(*xs) == r
 
 
+@given(lists(bigints(min_value=1), max_size=12))
+@example([])
+@example([15, 21, 35, 11, 23])
+def test_batch_gcd(xs):
+    mxs = list(map(mpz, xs))
+    r = [math.gcd(x, math.prod(xs[:i] + xs[i + 1:]))
+         for i, x in enumerate(xs)]
+    assert batch_gcd(mxs) == r
+    assert batch_gcd(xs) == r
+
+
+@given(bigints(), lists(bigints(min_value=1), max_size=12))
+@example(-1, [])
+@example(100, [3, 7, 11])
+def test_multimod(x, ms):
+    mx = mpz(x)
+    mms = list(map(mpz, ms))
+    r = [x % m for m in ms]
+    assert multimod(mx, mms) == r
+    assert multimod(x, ms) == r
+
+
+@given(bigints(), lists(bigints(min_value=1), max_size=12))
+@example(1, [])
+@example(100, [3, 7, 11])
+def test_crt(x, ms):
+    cms = []
+    for m in ms:
+        if all(math.gcd(m, c) == 1 for c in cms):
+            cms.append(m)
+    mcms = list(map(mpz, cms))
+    rs = [x % m for m in cms]
+    r = x % math.prod(cms)
+    assert crt(rs, mcms) == r
+    assert crt(list(map(mpz, rs)), cms) == r
+    basis = CRTBasis(cms)
+    assert len(basis) == len(cms)
+    assert basis.modulus == math.prod(cms)
+    assert basis.crt([x]*len(cms)) == r
+    assert basis.crt(basis.multimod(x)) == r
+
+
+@given(bigints())
+@example(2047)
+@example(3215031751)
+@example(3825123056546413051)
+@example(318665857834031151167461)
+@example(340282366920938463942989953348216553641)
+@example((1<<127) - 1)
+def test_is_prime(x):
+    mx = mpz(x)
+    r = python_is_prime(x)
+    assert is_prime(mx) == r
+    assert is_prime(x) == r
+    assert is_prime(x, reps=5) == r
+
+
+@given(bigints(), bigints())
+@example(3, 0)
+@example(-1, 0)
+@example(5, -8)
+@example(-5, -8)
+def test_invert_kronecker(x, n):
+    mx, mn = mpz(x), mpz(n)
+    r = python_kronecker(x, n)
+    assert kronecker(mx, mn) == r
+    assert kronecker(x, n) == r
+    if n > 0 and n % 2:
+        assert jacobi(mx, mn) == r
+        if n > 1:
+            assert legendre(x, mn) == r
+    if n:
+        try:
+            r = pow(x, -1, n)
+        except ValueError:
+            with pytest.raises(ValueError, match="not invertible"):
+                invert(mx, mn)
+        else:
+            assert invert(mx, mn) == r
+            assert invert(x, n) == r
+
+
+@given(bigints(), integers(min_value=2, max_value=1<<130))
+@example(5, 17)
+@example(1, 2)
+@example(2, 7)
+@example(3, 1 + 2**64*3*5*17)
+def test_sqrtmod(x, p):
+    p = next_prime(p - 1)
+    if p > 2 and python_kronecker(x, p) == -1:
+        with pytest.raises(ValueError, match="no square root exists"):
+            sqrtmod(x, p)
+    else:
+        r = sqrtmod(mpz(x), mpz(p))
+        assert 0 <= r <= p//2
+        assert (r*r - x) % p == 0
+
+
+@given(integers(min_value=-10, max_value=1<<130))
+@example(2)
+@example(4294967290)
+@example(4294967291)
+def test_next_prime(x):
+    mx = mpz(x)
+    p = next_prime(mx)
+    assert p > x
+    assert python_is_prime(p)
+    assert not any(map(python_is_prime, range(x + 1, p)))
+    assert next_prime(x) == p
+    if x > 2:
+        q = prev_prime(mx)
+        assert q < x
+        assert python_is_prime(q)
+        assert not any(map(python_is_prime, range(q + 1, x)))
+        assert prev_prime(x) == q
+
+
+@given(integers(min_value=-10, max_value=1<<70),
+       integers(min_value=0, max_value=1000))
+@example(0, 70000)
+@example(4294967296 - 1000, 3000)
+@example(18446744073709551616 - 1000, 2000)
+def test_primes(start, length):
+    stop = start + length
+    r = list(filter(python_is_prime, range(start, stop)))
+    assert list(primes(mpz(start), stop)) == r
+    assert list(primes(start, mpz(stop))) == r
+    if start == 0:
+        assert list(primes(stop)) == r
+
+
+@given(lists(integers(min_value=2, max_value=1<<40), min_size=0,
+             max_size=4),
+       sampled_from(["auto", "rho", "ecm"]))
+@example([4294967291, 4294967291, 1099511627689], "auto")
+@example([1000000007, 1000000009, 4294967311], "ecm")
+@example([65537, 65537, 65537], "auto")
+@example([65537, 65537, 65537, 65539], "auto")
+@example([3, 65537, 65537, 65537], "auto")
+@example([65537, 65537, 65537, 65539], "ecm")
+def test_factor(ps, method):
+    ps = [next_prime(p - 1) for p in ps]
+    n = math.prod(ps)
+    r = factor(n, method=method)
+    assert [p for p, _ in r] == sorted(set(ps))
+    assert all(e == ps.count(p) for p, e in r)
+    assert factor(int(n), method, None) == r
+
+
 @given(booleans(), bigints(min_value=0), bigints(),
        integers(min_value=1, max_value=1<<30),
        sampled_from(["n", "f", "c", "u", "d"]))
@@ -145,6 +467,13 @@ def test_mpmath_normalize(sign, man, exp, prec, rnd):
     res = mpmath_normalize(sign, man, exp, bc, prec, rnd)
     assert all(type(_) is int for _ in res)
     assert _mpmath_normalize(sign, mman, exp, bc, prec, rnd) == res
+    if bc <= prec and man % 2:
+        assert _mpmath_normalize(sign, mman, exp, bc, prec, rnd)[1] is mman
+    res = tuple([_] for _ in res)
+    assert _mpmath_normalize_many([sign], [mman], [exp], (bc,),
+                                  prec, rnd) == res
+    assert _mpmath_normalize_many([sign]*2, [mman]*2, [exp]*2, [bc]*2,
+                                  prec, rnd) == tuple(_*2 for _ in res)
 
 
 @given(bigints(), bigints(),
@@ -161,6 +490,43 @@ def test_mpmath_create(man, exp, prec, rnd):
     assert _mpmath_create(man, exp, prec, rnd) == res
 
 
+@given(mpmath_mpfs(), mpmath_mpfs(),
+       integers(min_value=0, max_value=1<<12),
+       sampled_from(["n", "f", "c", "u", "d"]))
+@example((0, 1, 1000, 1), (1, 1, -1000, 1), 53, "n")
+@example((0, 3, 1000, 2), (1, 1, -1000, 1), 53, "n")
+@example((0, 1, 0, 1), (0, 1, -1000, 1), 0, "d")
+def test_mpmath_arith(s, t, prec, rnd):
+    ms = (s[0], mpz(s[1]), s[2], s[3])
+    for f, fm in [(mpmath_add, _mpmath_add), (mpmath_sub, _mpmath_sub),
+                  (mpmath_mul, _mpmath_mul)]:
+        res = f(s, t, prec, rnd)
+        assert fm(s, t, prec, rnd) == res
+        assert fm(ms, t, prec, rnd) == res
+    if not prec:
+        assert _mpmath_add(s, t) == mpmath_add(s, t)
+        return
+    try:
+        res = mpmath_div(s, t, prec, rnd)
+    except ZeroDivisionError:
+        with pytest.raises(ZeroDivisionError):
+            _mpmath_div(s, t, prec, rnd)
+    else:
+        assert _mpmath_div(s, t, prec, rnd) == res
+    try:
+        res = mpmath_sqrt(s, prec, rnd)
+    except ValueError:
+        with pytest.raises(ValueError):
+            _mpmath_sqrt(s, prec, rnd)
+    else:
+        assert _mpmath_sqrt(ms, prec, rnd) == res
+    res = _mpmath_shift(s, prec)
+    if s[1]:
+        assert res == (s[0], s[1], s[2] + prec, s[3])
+    else:
+        assert res == s
+
+
 def test_interfaces():
     assert factorial(123) == fac(123)
     with pytest.raises(TypeError):
@@ -211,6 +577,114 @@ def test_interfaces():
         perm(2**1000, 1)
     with pytest.raises(OverflowError):
         perm(1, 2**1000)
+    with pytest.raises(TypeError):
+        batch_gcd(123)
+    with pytest.raises(TypeError):
+        batch_gcd([1, 2j])
+    with pytest.raises(ValueError, match="moduli must be positive"):
+        batch_gcd([1, 0])
+    with pytest.raises(TypeError):
+        multimod(1)
+    with pytest.raises(TypeError):
+        multimod(1j, [2])
+    with pytest.raises(ValueError, match="moduli must be positive"):
+        multimod(1, [-2])
+    with pytest.raises(TypeError):
+        crt([1])
+    with pytest.raises(ValueError, match="as many residues as moduli"):
+        crt([1, 2], [3])
+    with pytest.raises(ValueError, match="moduli must be pairwise coprime"):
+        crt([1, 2], [2, 4])
+    with pytest.raises(ValueError, match="moduli must be pairwise coprime"):
+        CRTBasis([6, 4])
+    with pytest.raises(TypeError):
+        is_prime(1j)
+    with pytest.raises(TypeError):
+        is_prime(reps=2)
+    with pytest.raises(ValueError, match="reps must be nonnegative"):
+        is_prime(7, -1)
+    with pytest.raises(TypeError):
+        next_prime(1j)
+    with pytest.raises(ValueError, match="no primes below"):
+        prev_prime(2)
+    with pytest.raises(TypeError):
+        primes()
+    with pytest.raises(TypeError):
+        primes(1, 2, 3)
+    with pytest.raises(TypeError):
+        primes(stop=10)
+    with pytest.raises(TypeError):
+        primes(1j)
+    with pytest.raises(TypeError):
+        comb_row(1j)
+    with pytest.raises(ValueError, match="not defined for negative"):
+        comb_row(-1)
+    with pytest.raises(TypeError):
+        set_factorial_cache(1j)
+    with pytest.raises(ValueError, match="size must be in range"):
+        set_factorial_cache(-1)
+    with pytest.raises(ValueError, match="size must be in range"):
+        set_factorial_cache(MAX_FACTORIAL_CACHE + 1)
+    for f in [fib, fib2, lucas, primorial, double_factorial]:
+        with pytest.raises(TypeError):
+            f(1j)
+        with pytest.raises(ValueError, match="not defined for negative"):
+            f(-1)
+        with pytest.raises(OverflowError):
+            f(1<<64)
+    for f in [fib, fib2, lucas]:
+        with pytest.raises(OverflowError, match="should not exceed"):
+            f(BITCNT_MAX*3//2)
+    with pytest.raises(OverflowError):
+        primorial(1<<32)
+    with pytest.raises(TypeError):
+        iroot(1)
+    with pytest.raises(TypeError):
+        iroot(1j, 2)
+    with pytest.raises(TypeError):
+        iroot_rem(2, 1j)
+    with pytest.raises(ValueError, match="k must be positive"):
+        iroot(2, 0)
+    with pytest.raises(ValueError, match="nonnegative for even k"):
+        iroot_rem(-8, 2)
+    with pytest.raises(TypeError):
+        is_square(1j)
+    with pytest.raises(TypeError):
+        is_power(1j)
+    for f in [and_count, divexact, hamdist, invert, jacobi, legendre,
+              kronecker, sqrtmod]:
+        with pytest.raises(TypeError, match="expects two arguments"):
+            f(1)
+        with pytest.raises(TypeError):
+            f(1j, 3)
+        with pytest.raises(TypeError):
+            f(3, 1j)
+    with pytest.raises(ZeroDivisionError):
+        invert(3, 0)
+    with pytest.raises(ValueError, match="must be odd and positive"):
+        jacobi(3, 4)
+    with pytest.raises(ValueError, match="must be odd and positive"):
+        jacobi(3, -3)
+    with pytest.raises(ValueError, match="must be an odd prime"):
+        legendre(3, 1)
+    with pytest.raises(ValueError, match="must be a prime"):
+        sqrtmod(3, 16)
+    with pytest.raises(ValueError, match="must be a prime"):
+        sqrtmod(3, 1)
+    with pytest.raises(TypeError):
+        factor(1j)
+    with pytest.raises(TypeError):
+        factor(method="rho")
+    with pytest.raises(ValueError, match="argument must be positive"):
+        factor(0)
+    with pytest.raises(ValueError, match="method must be"):
+        factor(12, method="qs")
+    with pytest.raises(ValueError, match="method must be"):
+        factor(12, method=1)
+    with pytest.raises(TypeError):
+        factor(12, timeout="1")
+    with pytest.raises(TimeoutError):
+        factor(next_prime(1<<100)*next_prime(1<<101), timeout=0.01)
     with pytest.raises(TypeError):
         _mpmath_create(1j)
     with pytest.raises(TypeError):
@@ -233,6 +707,51 @@ def test_interfaces():
         _mpmath_normalize(1, mpz(111), 1j, 12, 13, "c")
     with pytest.raises(ValueError, match="invalid rounding mode specified"):
         _mpmath_normalize(1, mpz(111), 11, 12, 13, 1j)
+    assert _mpmath_normalize_many([], [], [], [], 10, "n") == ([],)*4
+    with pytest.raises(TypeError):
+        _mpmath_normalize_many([], [], [], [], 10)
+    with pytest.raises(TypeError, match="expects sequences"):
+        _mpmath_normalize_many([], [], 1, [], 10, "n")
+    with pytest.raises(ValueError, match="must have the same length"):
+        _mpmath_normalize_many([0], [mpz(1)], [], [1], 10, "n")
+    with pytest.raises(TypeError):
+        _mpmath_normalize_many([0], [1], [0], [1], 10, "n")
+    with pytest.raises(TypeError, match="bad prec argument"):
+        _mpmath_normalize_many([], [], [], [], 1j, "n")
+    with pytest.raises(ValueError, match="invalid rounding mode specified"):
+        _mpmath_normalize_many([], [], [], [], 10, "q")
+    with pytest.raises(TypeError, match="expects mpf tuples"):
+        _mpmath_add((0, 1, 0), (0, 1, 0, 1))
+    with pytest.raises(TypeError, match="expects mpf tuples"):
+        _mpmath_mul((0, 1, 0, 1), (0, -1, 0, 1))
+    with pytest.raises(TypeError, match="expects mpf tuples"):
+        _mpmath_sub((0, 1, 0, 1), (0, 0, 1, 0))
+    with pytest.raises(TypeError, match="expects mpf tuples"):
+        _mpmath_sqrt((0, 1.0, 0, 1), 10)
+    with pytest.raises(TypeError, match="expects mpf tuples"):
+        _mpmath_shift((0, 1, 1j, 1), 10)
+    with pytest.raises(TypeError):
+        _mpmath_add((0, 1, 0, 1))
+    with pytest.raises(TypeError):
+        _mpmath_div((0, 1, 0, 1), (0, 1, 0, 1))
+    with pytest.raises(TypeError):
+        _mpmath_shift((0, 1, 0, 1))
+    with pytest.raises(TypeError):
+        _mpmath_shift((0, 1, 0, 1), 1j)
+    with pytest.raises(TypeError, match="bad prec argument"):
+        _mpmath_add((0, 1, 0, 1), (0, 1, 0, 1), 1j)
+    with pytest.raises(ValueError, match="bad prec argument"):
+        _mpmath_add((0, 1, 0, 1), (0, 1, 0, 1), -1)
+    with pytest.raises(ValueError, match="requires positive precision"):
+        _mpmath_div((0, 1, 0, 1), (0, 1, 0, 1), 0)
+    with pytest.raises(ValueError, match="invalid rounding mode specified"):
+        _mpmath_sqrt((0, 1, 0, 1), 10, "q")
+    with pytest.raises(ZeroDivisionError):
+        _mpmath_div(MPMATH_NAN, (0, 0, 0, 0), 10)
+    with pytest.raises(OverflowError):
+        _mpmath_add((0, 1, 1<<70, 1), (0, 1, 0, 1))
+    assert _mpmath_add(MPMATH_INF, (0, 1, 1, 1), 10) is MPMATH_INF
+    assert _mpmath_shift((0, 1, 1<<70, 1), 1) == (0, 1, (1<<70) + 1, 1)
 
 
 @pytest.mark.skipif(platform.python_implementation() == "GraalVM",
@@ -0,0 +1,188 @@
+import math
+from concurrent.futures import ThreadPoolExecutor
+from fractions import Fraction
+
+import pytest
+from gmp import get_mpf_context, mpf, mpz, set_mpf_context
+from hypothesis import example, given
+from hypothesis.strategies import floats, integers, sampled_from
+from utils import (
+    MPMATH_INF,
+    MPMATH_NAN,
+    MPMATH_NINF,
+    MPMATH_ZERO,
+    bigints,
+    mpmath_add,
+    mpmath_div,
+    mpmath_from_man_exp,
+    mpmath_mpfs,
+    mpmath_mul,
+    mpmath_normalize,
+    mpmath_sqrt,
+    mpmath_sub,
+)
+
+
+@pytest.fixture(autouse=True)
+def restore_context():
+    ctx = get_mpf_context()
+    yield
+    set_mpf_context(*ctx)
+
+
+def mpmath_round(s, prec, rnd):
+    sign, man, exp, bc = s
+    if not man:
+        return s
+    return mpmath_normalize(sign, man, exp, bc, prec, rnd)
+
+
+def mpf_to_fraction(s):
+    if s == MPMATH_INF:
+        return math.inf
+    if s == MPMATH_NINF:
+        return -math.inf
+    sign, man, exp, _ = s
+    return (-1)**sign*Fraction(man)*Fraction(2)**exp
+
+
+@given(mpmath_mpfs(), mpmath_mpfs(),
+       integers(min_value=1, max_value=1<<12),
+       sampled_from(["n", "f", "c", "u", "d"]))
+@example(MPMATH_INF, MPMATH_NINF, 53, "n")
+@example((0, 1, 1000, 1), (1, 1, -1000, 1), 53, "n")
+def test_arith(s, t, prec, rnd):
+    set_mpf_context(prec, rnd)
+    assert get_mpf_context() == (prec, rnd)
+    x, y = mpf(s), mpf(t)
+    s, t = mpmath_round(s, prec, rnd), mpmath_round(t, prec, rnd)
+    assert x._mpf_ == s
+    assert y._mpf_ == t
+    assert mpf(x)._mpf_ == s
+    assert (+x)._mpf_ == s
+    assert (x + y)._mpf_ == mpmath_add(s, t, prec, rnd)
+    assert (x - y)._mpf_ == mpmath_sub(s, t, prec, rnd)
+    assert (x * y)._mpf_ == mpmath_mul(s, t, prec, rnd)
+    try:
+        r = mpmath_div(s, t, prec, rnd)
+    except ZeroDivisionError:
+        with pytest.raises(ZeroDivisionError):
+            x / y
+    else:
+        assert (x / y)._mpf_ == r
+    try:
+        r = mpmath_sqrt(s, prec, rnd)
+    except ValueError:
+        with pytest.raises(ValueError):
+            x.sqrt()
+    else:
+        assert x.sqrt()._mpf_ == r
+    if MPMATH_NAN not in (s, t):
+        sv, tv = mpf_to_fraction(s), mpf_to_fraction(t)
+        assert (x < y) == (sv < tv)
+        assert (x == y) == (sv == tv)
+        assert (x >= y) == (sv >= tv)
+        if s != MPMATH_INF and s != MPMATH_NINF:
+            assert (x == s[1]) == (sv == s[1])
+
+
+@given(floats(), floats())
+@example(5e-324, 1.0)
+@example(-0.0, 0.0)
+def test_float(x, y):
+    mx, my = mpf(x), mpf(y)
+    if math.isnan(x):
+        assert math.isnan(float(mx))
+        assert mx != mx
+    else:
+        assert float(mx) == x
+        assert hash(mx) == hash(x)
+    assert (mx < my) == (x < y)
+    assert (mx == my) == (x == y)
+    assert (mx == y) == (x == y)
+    assert (x != my) == (x != y)
+    assert (mx <= y) == (x <= y)
+    assert (x > my) == (x > y)
+    assert bool(mx) == bool(x)
+    assert float(-mx) == -x or math.isnan(x)
+    assert float(abs(mx)) == abs(x) or math.isnan(x)
+
+
+@given(bigints(), integers(min_value=1, max_value=1<<10))
+def test_int(n, prec):
+    set_mpf_context(prec)
+    x = mpf(n)
+    assert x._mpf_ == mpmath_from_man_exp(n, 0, prec, "n")
+    assert mpf(mpz(n)) == x
+    if n.bit_length() <= prec:
+        assert x == n
+        assert hash(x) == hash(n)
+    s, t = x._mpf_, mpmath_from_man_exp(n, 0)
+    assert (x + n)._mpf_ == mpmath_add(s, t, prec, "n")
+    assert (n - x)._mpf_ == mpmath_sub(t, s, prec, "n")
+    assert (n * x)._mpf_ == mpmath_mul(t, s, prec, "n")
+    assert (x - x)._mpf_ == MPMATH_ZERO
+
+
+def test_subnormal():
+    assert float(mpf((0, 1, -1075, 1))) == 0.0
+    assert float(mpf((0, 3, -1076, 2))) == 5e-324
+    assert float(mpf((1, 3, -1076, 2))) == -5e-324
+    assert float(mpf((0, 1, -2000, 1))) == 0.0
+    assert float(mpf((0, 1, 2000, 1))) == math.inf
+    assert float(mpf((0, 1, -1074, 1))) == 5e-324
+    assert float(mpf((0, 1, -1023, 1))) == 2**-1023
+    set_mpf_context(100)
+    x = mpf((0, (1<<60) + 1, -1082, 61))
+    assert float(x) == 2**-1022
+
+
+def test_context_threads():
+    set_mpf_context(100, "d")
+    assert get_mpf_context() == (100, "d")
+    with ThreadPoolExecutor(max_workers=1) as executor:
+        assert executor.submit(get_mpf_context).result() == (53, "n")
+    assert get_mpf_context() == (100, "d")
+
+
+def test_interfaces():
+    assert repr(mpf(1.5)) == "mpf((0, mpz(3), -1, 2))"
+    assert eval(repr(mpf(0.1))) == mpf(0.1)
+    assert mpf()._mpf_ == MPMATH_ZERO
+    assert mpf(float("nan"))._mpf_ == MPMATH_NAN
+    assert mpf(float("-inf"))._mpf_ == MPMATH_NINF
+    assert hash(mpf(float("inf"))) == hash(math.inf)
+    assert hash(mpf(float("-inf"))) == hash(-math.inf)
+    assert -mpf(float("-inf")) == math.inf
+    assert abs(mpf(float("-inf"))) == math.inf
+    x = mpf(float("inf"))
+    assert x + 1 is x
+    assert 1 + x == x
+    assert x.sqrt() is x
+    assert mpf(1) != "a"
+    with pytest.raises(TypeError):
+        mpf("1")
+    with pytest.raises(TypeError):
+        mpf(1j)
+    with pytest.raises(TypeError, match="expects mpf tuples"):
+        mpf((0, 1, 2))
+    with pytest.raises(TypeError):
+        mpf(1, 2)
+    with pytest.raises(TypeError):
+        mpf(1) + "a"
+    with pytest.raises(TypeError):
+        mpf(1) < "a"
+    with pytest.raises(ZeroDivisionError):
+        mpf(1) / 0
+    with pytest.raises(ValueError, match="square root of a negative"):
+        mpf(-1).sqrt()
+    with pytest.raises(TypeError):
+        set_mpf_context()
+    with pytest.raises(TypeError):
+        set_mpf_context(1j)
+    with pytest.raises(ValueError):
+        set_mpf_context(-1)
+    with pytest.raises(ValueError, match="requires positive precision"):
+        set_mpf_context(0)
+    with pytest.raises(ValueError, match="invalid rounding mode"):
+        set_mpf_context(10, "q")
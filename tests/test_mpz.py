@@ -1,8 +1,10 @@
 import decimal
 import inspect
+import io
 import locale
 import math
 import operator
+import os
 import pickle
 import platform
 import sys
@@ -11,7 +13,7 @@ from concurrent.futures import ThreadPoolExecutor
 from subprocess import run
 
 import pytest
-from gmp import mpz
+from gmp import compile_format, frexp, mpz
 from hypothesis import assume, example, given, settings
 from hypothesis.strategies import (
     booleans,
@@ -28,6 +30,7 @@ from utils import (
     SIZEOF_DIGIT,
     bigints,
     fmt_str,
+    mpmath_from_man_exp,
     numbers,
     python_truediv,
     to_digits,
@@ -115,10 +118,44 @@ def test_underscores_auto(s):
 @example(-3912, "028d")
 @example(-3912, "028_d")
 @example(-3912, "28n")
+@example(-391234567, "\u20ac=#30_x")
+@example(8364, "\u20ac^9c")
 def test_format_bulk(x, fmt):
     mx = mpz(x)
     r = format(x, fmt)
     assert format(mx, fmt) == r
+    assert compile_format(fmt)(mx) == r
+
+
+def test_compile_format():
+    f = compile_format(">30,d")
+    assert repr(f) == "gmp.compile_format('>30,d')"
+    assert f(mpz(10**10)) == f(10**10) == format(10**10, ">30,d")
+    assert compile_format("")(mpz(5)) == "5"
+    assert compile_format(".2f")(mpz(3)) == "3.00"
+    pytest.raises(ValueError, lambda: compile_format(",d")(1.5))
+    pytest.raises(TypeError, lambda: compile_format(1))
+    with pytest.raises(ValueError, match="Unknown format code"):
+        compile_format("q")
+    with pytest.raises(ValueError, match="Invalid format specifier"):
+        compile_format("xx")
+    with pytest.raises(ValueError, match="Cannot specify"):
+        compile_format("_c")
+    with pytest.raises(ValueError, match="Precision not allowed"):
+        compile_format(".3d")
+    with pytest.raises(ValueError, match="Negative zero coercion"):
+        compile_format("zd")
+    with pytest.raises(ValueError, match="Sign not allowed"):
+        compile_format("+c")
+    with pytest.raises(ValueError, match="Alternate form"):
+        compile_format("#c")
+    pytest.raises(TypeError, lambda: f())
+    pytest.raises(TypeError, lambda: f(1, 2))
+    pytest.raises(TypeError, lambda: f(1, spam=2))
+    specs = [f">{i},d" for i in range(20)]
+    for _ in range(3):
+        for spec in specs:
+            assert format(mpz(12345), spec) == format(12345, spec)
 
 
 def test_format_interface():
@@ -203,6 +240,7 @@ def test_format_interface():
         assert format(mpz(123456789), "n") == f"123{s}456{s}789"
         assert format(mpz(123), "011n") == f"000{s}000{s}123"
         locale.setlocale(locale.LC_ALL, "C")
+        assert format(mpz(123456789), "n") == "123456789"
         if platform.python_implementation() == "GraalVM":
             return  # XXX: oracle/graalpython#521
         locale.setlocale(locale.LC_NUMERIC, "ps_AF.UTF-8")
@@ -211,6 +249,7 @@ def test_format_interface():
     except locale.Error:
         pass
     locale.setlocale(locale.LC_ALL, "C")
+    assert format(mpz(123456789), "n") == "123456789"
 
 
 @given(bigints())
@@ -359,6 +398,16 @@ def test_repr(x):
 
 @given(bigints(), floats())
 @example(9007199254740993, 9007199254740992.0)
+@example(1<<70, 1180591620717411303424.0)
+@example((1<<70) + 1, 1180591620717411303424.0)
+@example(-(1<<70) - 1, -1180591620717411303424.0)
+@example((1<<64) - 1, 1.8446744073709552e+19)
+@example(-3, -2.5)
+@example(3, 5e-324)
+@example(-3, -5e-324)
+@example(0, -0.0)
+@example(1<<1100, float("inf"))
+@example(1, float("nan"))
 def test_richcompare_mixed(x, y):
     mx = mpz(x)
     for op in [operator.eq, operator.ne, operator.lt, operator.le,
@@ -580,6 +629,9 @@ def test_truediv_bulk(x, y):
 
 
 @given(bigints(), numbers())
+@example(1<<1100, 1.5)
+@example(3, -0.0)
+@example(9007199254740993, 3.0)
 def test_truediv_mixed(x, y):
     mx = mpz(x)
     if not x:
@@ -610,6 +662,30 @@ def test_truediv_errors():
     mx = mpz(123)
     pytest.raises(TypeError, lambda: mx / object())
     pytest.raises(TypeError, lambda: object() / mx)
+    with pytest.raises(ZeroDivisionError, match="float division by zero"):
+        mx / 0.0
+
+
+def test_float_subclass_reflected():
+    class F(float):
+        def __radd__(self, other):
+            return "radd"
+
+        def __rsub__(self, other):
+            return "rsub"
+
+        def __rmul__(self, other):
+            return "rmul"
+
+        def __rtruediv__(self, other):
+            return "rtruediv"
+
+    mx = mpz(1)
+    assert mx + F(2) == "radd"
+    assert mx - F(2) == "rsub"
+    assert mx * F(2) == "rmul"
+    assert mx / F(2) == "rtruediv"
+    assert F(2) + mx == 3.0
 
 
 @given(bigints(), integers(max_value=100000))
@@ -796,6 +872,138 @@ def test_rshift(x, y):
         assert x >> my == r
 
 
+@given(bigints(), bigints(), bigints())
+@example(0, 0, 0)
+@example(12, 0, 12)
+@example(-7, 1<<32, (1<<32) - 7)
+@example(1<<100, -(1<<50), 0)
+@example(-(1<<100), 3, 1<<100)
+def test_divisibility(x, c, d):
+    mx, mc, md = mpz(x), mpz(c), mpz(d)
+    r = x % d == 0 if d else x == 0
+    assert mx.is_divisible(d) == r
+    assert mx.is_divisible(md) == r
+    r = (x - c) % d == 0 if d else x == c
+    assert mx.is_congruent(c, d) == r
+    assert mx.is_congruent(mc, md) == r
+    assert mx.is_congruent(x + 3*d, d)
+    assert mx.is_congruent(mpz(x - d), md)
+    with pytest.raises(TypeError, match="expects two arguments"):
+        mx.is_congruent(c)
+    for f in [mx.is_divisible, lambda d: mx.is_congruent(1, d),
+              lambda c: mx.is_congruent(c, 3),
+              lambda c: mx.is_congruent(c, 1<<100)]:
+        with pytest.raises(TypeError, match="takes integer arguments"):
+            f(1.5)
+
+
+@given(bigints(), integers(min_value=0, max_value=12345))
+@example(0, 1<<70)
+@example(-1, 64)
+@example(1<<64, 64)
+def test_div_2exp(x, k):
+    mx = mpz(x)
+    tq = abs(x) >> k if x >= 0 else -(abs(x) >> k)
+    cq = -(-x >> k)
+    for mk in [k, mpz(k)]:
+        assert mx.is_divisible_2exp(mk) == (x % 2**k == 0 if k < 2**32
+                                            else x == 0)
+        if k > 2**32:
+            continue
+        assert mx.fdiv_q_2exp(mk) == x >> k
+        assert mx.fdiv_r_2exp(mk) == x % 2**k
+        assert mx.tdiv_q_2exp(mk) == tq
+        assert mx.tdiv_r_2exp(mk) == x - tq*2**k
+        assert mx.cdiv_q_2exp(mk) == cq
+        assert mx.cdiv_r_2exp(mk) == x - cq*2**k
+    for name in ["fdiv_q_2exp", "fdiv_r_2exp", "tdiv_q_2exp",
+                 "tdiv_r_2exp", "cdiv_q_2exp", "cdiv_r_2exp",
+                 "is_divisible_2exp"]:
+        f = getattr(mx, name)
+        with pytest.raises(ValueError, match="negative shift count"):
+            f(-1)
+        with pytest.raises(ValueError, match="negative shift count"):
+            f(mpz(-1<<100))
+        with pytest.raises(TypeError, match="takes an integer argument"):
+            f(1.5)
+    big = 1<<100
+    assert mx.tdiv_q_2exp(big) == mx.fdiv_q_2exp(big) + (x < 0) == 0
+    assert mx.tdiv_r_2exp(big) == x
+    if x >= 0:
+        assert mx.fdiv_r_2exp(big) == x
+    else:
+        with pytest.raises(OverflowError):
+            mx.fdiv_r_2exp(big)
+
+
+def _scan(x, start, bit):
+    for i in range(start, max(start, x.bit_length()) + 1):
+        if (x >> i) & 1 == bit:
+            return i
+    return None
+
+
+@given(bigints(), integers(min_value=0, max_value=12345),
+       integers(min_value=0, max_value=12345))
+@example(-1, 0, 1<<70)
+@example(-(1<<64), 64, 0)
+@example(-(1<<64), 63, 128)
+@example(1<<64, 64, 65)
+def test_bits(x, i, j):
+    mx = mpz(x)
+    for mi in [i, mpz(i)]:
+        assert mx.bit_test(mi) == bool(x >> i & 1)
+        assert mx.bit_set(mi) == x | 1 << i
+        assert mx.bit_clear(mi) == x & ~(1 << i)
+        assert mx.bit_flip(mi) == x ^ 1 << i
+        assert mx.bit_scan0(mi) == _scan(x, i, 0)
+        assert mx.bit_scan1(mi) == _scan(x, i, 1)
+    assert mx.bit_count_range(i) == (abs(x) >> i).bit_count()
+    assert mx.bit_count_range(mpz(i), None) == mx.bit_count_range(i)
+    assert mx.bit_count_range() == mx.bit_count_range(0, 1<<100)
+    assert mx.bit_count_range() == mx.bit_count()
+    assert mx.bit_scan0() == _scan(x, 0, 0)
+    assert mx.bit_scan1() == _scan(x, 0, 1)
+    if j < 1<<32:
+        assert mx.bits(i, j) == ((x >> i) % 2**(j - i) if j > i else 0)
+        r = ((abs(x) >> i) % 2**(j - i)).bit_count() if j > i else 0
+        assert mx.bit_count_range(i, j) == r
+        assert list(mx.iter_set(i, j)) == [k for k in range(i, j)
+                                           if x >> k & 1]
+    if x >= 0:
+        assert list(mx.iter_set()) == [k for k in range(x.bit_length())
+                                       if x >> k & 1]
+    else:
+        it = mx.iter_set(i)
+        assert [next(it) for _ in range(100)] == [
+            k for k in range(i, i + x.bit_length() + 100) if x >> k & 1][:100]
+    big = 1<<100
+    assert mx.bit_test(big) == (x < 0)
+    assert mx.bit_scan0(big) == (None if x < 0 else big)
+    assert mx.bit_scan1(mpz(big)) == (big if x < 0 else None)
+    for name in ["bit_test", "bit_set", "bit_clear", "bit_flip",
+                 "bit_scan0", "bit_scan1"]:
+        f = getattr(mx, name)
+        with pytest.raises(ValueError, match="negative bit index"):
+            f(-1)
+        with pytest.raises(TypeError, match="takes an integer argument"):
+            f(1.5)
+    with pytest.raises(OverflowError):
+        mx.bit_set(big) if x >= 0 else mx.bit_clear(big)
+    with pytest.raises(TypeError, match="at most one argument"):
+        mx.bit_scan1(1, 2)
+    with pytest.raises(TypeError, match="at most two arguments"):
+        mx.bit_count_range(1, 2, 3)
+    with pytest.raises(ValueError, match="negative bit index"):
+        mx.bit_count_range(-1)
+    with pytest.raises(TypeError, match="expects two arguments"):
+        mx.bits(1)
+    with pytest.raises(ValueError, match="negative bit index"):
+        mx.bits(1, -1)
+    with pytest.raises(TypeError, match="at most two arguments"):
+        mx.iter_set(1, 2, 3)
+
+
 @given(bigints())
 def test_getters(x):
     mx = mpz(x)
@@ -961,6 +1169,81 @@ def test_to_float(x):
         assert str(float(mx)) == str(fx)
 
 
+@given(bigints(), sampled_from(["n", "f", "c", "d", "u"]))
+@example(9007199254740993, "n")
+@example(9007199254740993, "u")
+@example(-9007199254740993, "f")
+@example((1<<1024) - (1<<970), "n")
+@example((1<<1024) - (1<<970), "d")
+@example(-(1<<1024) + (1<<970), "c")
+@example(-(1<<1024) + (1<<970), "u")
+@example(10<<10000, "d")
+def test_to_float_rnd(x, rnd):
+    mx = mpz(x)
+    sign, man, exp, _ = mpmath_from_man_exp(x, 0, 53, rnd)
+    if sign:
+        man = -man
+    try:
+        fx = math.ldexp(man, exp)
+    except OverflowError:
+        if rnd == "d" or rnd == ("c" if sign else "f"):
+            fmax = sys.float_info.max
+            assert mx.to_float(rnd) == (-fmax if sign else fmax)
+        else:
+            pytest.raises(OverflowError, lambda: mx.to_float(rnd))
+    else:
+        assert mx.to_float(rnd) == fx
+        if rnd == "n":
+            assert mx.to_float() == fx
+    if x and x.bit_length() < 1000:
+        m, e = math.frexp(float(x))
+        assert frexp(mx) == frexp(x) == (m, e)
+    if not x:
+        assert frexp(x) == (0.0, 0)
+
+
+@given(floats(allow_nan=False, allow_infinity=False))
+@example(0.0)
+@example(-0.0)
+@example(5e-324)
+@example(sys.float_info.max)
+def test_from_float_exact(x):
+    man, exp = mpz.from_float_exact(x)
+    assert type(man) is mpz
+    assert type(exp) is int
+    n, d = x.as_integer_ratio()
+    if x:
+        assert man % 2
+    else:
+        assert man == exp == 0
+    if exp >= 0:
+        assert d == 1
+        assert n == man << exp
+    else:
+        assert d == 1 << -exp
+        assert n == man
+
+
+def test_float_conversions_interface():
+    x = mpz(123)
+    pytest.raises(ValueError, lambda: x.to_float(1))
+    pytest.raises(TypeError, lambda: x.to_float("n", 1))
+    pytest.raises(TypeError, lambda: x.to_float(spam=1))
+    pytest.raises(ValueError, lambda: x.to_float("x"))
+    assert x.to_float(rnd="f") == 123.0
+    pytest.raises(TypeError, lambda: mpz.from_float_exact(1))
+    pytest.raises(TypeError, lambda: mpz.from_float_exact())
+    with pytest.raises(OverflowError,
+                       match="cannot convert float infinity to integer"):
+        mpz.from_float_exact(float("inf"))
+    with pytest.raises(ValueError,
+                       match="cannot convert float NaN to integer"):
+        mpz.from_float_exact(float("nan"))
+    pytest.raises(TypeError, lambda: frexp(1.5))
+    pytest.raises(TypeError, lambda: frexp("1"))
+    pytest.raises(TypeError, lambda: frexp())
+    assert frexp(mpz(-1)<<10000) == (-0.5, 10001)
+
 @given(bigints(), integers(min_value=-20, max_value=30))
 @example(-75, -1)
 @example(-68501870735943706700000000000000000001, -20)  # issue 117
@@ -1021,6 +1304,162 @@ def test_digits_interface():
     assert x.digits(10) == x.digits(base=10) == x.digits()
 
 
+@given(bigints(), integers(min_value=2, max_value=36),
+       integers(min_value=1, max_value=100))
+@example(10**64, 10, 1)
+@example(-(10**64) + 1, 10, 4)
+@example(0, 10, 1)
+def test_write_digits_bulk(x, base, chunk):
+    mx = mpz(x)
+    r = mx.digits(base)
+    f = io.StringIO()
+    assert mx.write_digits(f, base, chunk) == len(r)
+    assert f.getvalue() == r
+    f = io.BytesIO()
+    assert mx.write_digits(f, base=base, chunk=chunk) == len(r)
+    assert f.getvalue() == r.encode()
+
+
+def test_write_digits_interface(tmp_path):
+    x = mpz(7)**10000
+    path = tmp_path / "digits.txt"
+    with open(path, "w") as f:
+        assert x.write_digits(f, chunk=100) == len(str(x))
+    assert path.read_text() == str(x)
+    with open(path, "wb", buffering=0) as f:
+        x.write_digits(f, 16)
+    assert path.read_text() == x.digits(16)
+    fd = os.open(path, os.O_WRONLY | os.O_TRUNC)
+    try:
+        assert (-x).write_digits(fd) == len(str(x)) + 1
+    finally:
+        os.close(fd)
+    assert path.read_text() == str(-x)
+
+    class PartialWriter:
+        def __init__(self, n):
+            self.n = n
+            self.data = b""
+        def write(self, data):
+            self.data += data[:self.n]
+            return min(self.n, len(data))
+
+    f = PartialWriter(1)
+    assert mpz(-12345).write_digits(f) == 6
+    assert f.data == b"-12345"
+    with pytest.raises(OSError, match="write\\(\\) returned 0"):
+        x.write_digits(PartialWriter(0))
+
+    class NonBlockingWriter(io.RawIOBase):
+        def writable(self):
+            return True
+        def write(self, data):
+            return None
+
+    with pytest.raises(BlockingIOError) as e:
+        x.write_digits(NonBlockingWriter())
+    assert e.value.characters_written == 0
+    f = io.StringIO()
+    with pytest.raises(TypeError):
+        x.write_digits()
+    with pytest.raises(TypeError):
+        x.write_digits(object())
+    with pytest.raises(TypeError):
+        x.write_digits(f, "10")
+    with pytest.raises(TypeError):
+        x.write_digits(f, chunk="10")
+    with pytest.raises(TypeError):
+        x.write_digits(f, spam=1)
+    with pytest.raises(ValueError, match="mpz base must be >= 2 and <= 36"):
+        x.write_digits(f, 37)
+    with pytest.raises(ValueError, match="chunk must be positive"):
+        x.write_digits(f, chunk=0)
+    with pytest.raises(OverflowError):
+        x.write_digits(f, base=10**100)
+    with pytest.raises(OverflowError):
+        x.write_digits(f, chunk=10**100)
+    with pytest.raises(OSError):
+        x.write_digits(-1)
+    assert f.getvalue() == ""
+
+
+@given(bigints(), integers(min_value=2, max_value=36))
+@example(0, 10)
+@example(-(10**64), 16)
+def test_read_digits_bulk(x, base):
+    s = mpz(x).digits(base)
+    assert mpz.read_digits(s.encode(), base) == x
+    assert mpz.read_digits(io.BytesIO(s.encode()), base=base) == x
+    assert mpz.read_digits(io.StringIO(s), base) == x
+    s = format(x, "#_x")
+    assert mpz.read_digits(f" {s}\n".encode(), 0) == x
+    assert mpz.read_digits(s.encode(), 16) == x
+
+
+@given(text(alphabet=" \t\n+-_0123456789abfoxOBX", max_size=12),
+       sampled_from([0, 2, 8, 10, 16, 36]))
+@example("0_0", 0)
+@example("012", 0)
+@example("0x_1f", 16)
+@example("0b1", 16)
+@example(" - 1", 10)
+def test_read_digits_syntax(s, base):
+    try:
+        r = int(s, base)
+    except ValueError:
+        with pytest.raises(ValueError, match="invalid literal for mpz"):
+            mpz.read_digits(s.encode(), base)
+        with pytest.raises(ValueError, match="invalid literal for mpz"):
+            mpz.read_digits(io.StringIO(s), base)
+    else:
+        assert mpz.read_digits(s.encode(), base) == r
+        assert mpz.read_digits(io.StringIO(s), base) == r
+
+
+def test_read_digits_interface(tmp_path):
+    x = mpz(7)**200000
+    path = tmp_path / "digits.txt"
+    with open(path, "w") as f:
+        x.write_digits(f)
+    with open(path, "rb") as f:
+        assert mpz.read_digits(f) == x
+    with open(path) as f:
+        assert mpz.read_digits(f) == x
+    s = path.read_bytes()
+    assert mpz.read_digits(bytearray(s)) == x
+    assert mpz.read_digits(memoryview(s)) == x
+    assert mpz.read_digits(b"-" + s + b" ") == -x
+    with pytest.raises(ValueError, match="at position 3"):
+        mpz.read_digits(b"123x")
+    with pytest.raises(ValueError, match="at position 5"):
+        mpz.read_digits(b"12_3_")
+    with pytest.raises(ValueError, match="invalid literal for mpz"):
+        mpz.read_digits(b"")
+    with pytest.raises(ValueError, match="invalid literal for mpz"):
+        mpz.read_digits("\u0661".encode())
+
+    class BadFile:
+        def read(self, size):
+            return 123
+
+    with pytest.raises(TypeError, match="should return bytes or str"):
+        mpz.read_digits(BadFile())
+    with pytest.raises(TypeError):
+        mpz.read_digits()
+    with pytest.raises(TypeError):
+        mpz.read_digits(123)
+    with pytest.raises(TypeError):
+        mpz.read_digits("123")
+    with pytest.raises(TypeError):
+        mpz.read_digits(b"123", "10")
+    with pytest.raises(TypeError):
+        mpz.read_digits(b"123", spam=1)
+    with pytest.raises(ValueError, match="mpz base must be >= 2 and <= 36"):
+        mpz.read_digits(b"123", 37)
+    with pytest.raises(OverflowError):
+        mpz.read_digits(b"123", 10**100)
+    assert mpz.read_digits(b"123", base=8) == 0o123
+
 @given(bigints(), integers(min_value=2, max_value=36))
 def test_digits_frombase(x, base):
     mx = mpz(x)
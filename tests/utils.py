@@ -45,6 +45,58 @@ def python_isqrtrem(x):
     return y, x - y*y
 
 
+def python_is_prime(n):
+    """Miller-Rabin test, deterministic for n < 3317044064679887385961981."""
+    if n < 2:
+        return False
+    bases = [2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41]
+    for p in bases:
+        if n % p == 0:
+            return n == p
+    d, s = n - 1, 0
+    while not d & 1:
+        d, s = d >> 1, s + 1
+    for a in bases:
+        x = pow(a, d, n)
+        if x in (1, n - 1):
+            continue
+        for _ in range(s - 1):
+            x = x*x % n
+            if x == n - 1:
+                break
+        else:
+            return False
+    return True
+
+
+def python_kronecker(a, n):
+    """Kronecker symbol (a/n)."""
+    if n == 0:
+        return int(abs(a) == 1)
+    t = 1
+    if n < 0:
+        n = -n
+        if a < 0:
+            t = -t
+    while n % 2 == 0:
+        if a % 2 == 0:
+            return 0
+        n //= 2
+        if a % 8 in (3, 5):
+            t = -t
+    a %= n
+    while a:
+        while a % 2 == 0:
+            a //= 2
+            if n % 8 in (3, 5):
+                t = -t
+        a, n = n, a
+        if a % 4 == 3 and n % 4 == 3:
+            t = -t
+        a %= n
+    return t if n == 1 else 0
+
+
 DBL_MAX_EXP = sys.float_info.max_exp
 DBL_MIN_EXP = sys.float_info.min_exp
 DBL_MANT_DIG = sys.float_info.mant_dig
@@ -233,3 +285,152 @@ def mpmath_from_man_exp(man, exp, prec=0, rnd="d"):
     if not prec:
         prec = bc
     return mpmath_normalize(sign, man, exp, bc, prec, rnd)
+
+
+MPMATH_ZERO = (0, 0, 0, 0)
+MPMATH_NAN = (0, 0, -123, -1)
+MPMATH_INF = (0, 0, -456, -2)
+MPMATH_NINF = (1, 0, -789, -3)
+
+
+def mpmath_sign(s):
+    sign, man, exp, _ = s
+    if not man:
+        if s == MPMATH_INF:
+            return 1
+        if s == MPMATH_NINF:
+            return -1
+        return 0
+    return (-1)**sign
+
+
+def mpmath_neg(s):
+    sign, man, exp, bc = s
+    if not man:
+        if exp:
+            if s == MPMATH_INF:
+                return MPMATH_NINF
+            if s == MPMATH_NINF:
+                return MPMATH_INF
+        return s
+    return 1 - sign, man, exp, bc
+
+
+def mpmath_add(s, t, prec=0, rnd="d"):
+    """Add two raw mpfs, as mpmath.libmp.mpf_add()."""
+    ssign, sman, sexp, sbc = s
+    tsign, tman, texp, tbc = t
+    if sman and tman:
+        if sexp < texp:
+            ssign, sman, sexp, sbc, tsign, tman, texp, tbc = (tsign, tman,
+                                                              texp, tbc,
+                                                              ssign, sman,
+                                                              sexp, sbc)
+        offset = sexp - texp
+        if offset > 100 and prec:
+            delta = sbc + sexp - tbc - texp
+            if delta > prec + 4:
+                offset = prec + 4
+                sman <<= offset
+                sman += 1 if tsign == ssign else -1
+                return mpmath_normalize(ssign, sman, sexp - offset,
+                                        sman.bit_length(), prec, rnd)
+        man = (-1)**tsign*tman + ((-1)**ssign*sman << offset)
+        return mpmath_from_man_exp(man, texp, prec, rnd)
+    if not sman:
+        if sexp:
+            if s == t or tman or not texp:
+                return s
+            return MPMATH_NAN
+        if tman:
+            return mpmath_from_man_exp((-1)**tsign*tman, texp, prec, rnd)
+        return t
+    if texp:
+        return t
+    return mpmath_from_man_exp((-1)**ssign*sman, sexp, prec, rnd)
+
+
+def mpmath_sub(s, t, prec=0, rnd="d"):
+    return mpmath_add(s, mpmath_neg(t), prec, rnd)
+
+
+def mpmath_mul(s, t, prec=0, rnd="d"):
+    """Multiply two raw mpfs, as mpmath.libmp.mpf_mul()."""
+    ssign, sman, sexp, sbc = s
+    tsign, tman, texp, tbc = t
+    if sman and tman:
+        return mpmath_from_man_exp((-1)**(ssign ^ tsign)*sman*tman,
+                                   sexp + texp, prec, rnd)
+    if not (not sman and sexp) and not (not tman and texp):
+        return MPMATH_ZERO
+    if MPMATH_NAN in (s, t):
+        return MPMATH_NAN
+    if not tman and texp:
+        s, t = t, s
+    if t == MPMATH_ZERO:
+        return MPMATH_NAN
+    sign = mpmath_sign(s)*mpmath_sign(t)
+    return MPMATH_INF if sign > 0 else MPMATH_NINF
+
+
+def mpmath_div(s, t, prec, rnd="d"):
+    """Divide two raw mpfs, as mpmath.libmp.mpf_div()."""
+    ssign, sman, sexp, sbc = s
+    tsign, tman, texp, tbc = t
+    if not sman or not tman:
+        if t == MPMATH_ZERO:
+            raise ZeroDivisionError
+        if s == MPMATH_ZERO:
+            return MPMATH_NAN if t == MPMATH_NAN else MPMATH_ZERO
+        if (sexp and texp and not sman and not tman
+                or MPMATH_NAN in (s, t)):
+            return MPMATH_NAN
+        if tman:
+            sign = mpmath_sign(s)*mpmath_sign(t)
+            return MPMATH_INF if sign > 0 else MPMATH_NINF
+        return MPMATH_ZERO
+    sign = ssign ^ tsign
+    extra = 0
+    if tman != 1:
+        extra = max(prec - sbc + tbc + 5, 5)
+        sman, rem = divmod(sman << extra, tman)
+        if rem:
+            sman = (sman << 1) + 1
+            extra += 1
+    return mpmath_normalize(sign, sman, sexp - texp - extra,
+                            sman.bit_length(), prec, rnd)
+
+
+def mpmath_sqrt(s, prec, rnd="d"):
+    """Square root of a raw mpf, as mpmath.libmp.mpf_sqrt()."""
+    sign, man, exp, bc = s
+    if sign:
+        raise ValueError("square root of a negative number")
+    if not man:
+        return s
+    if exp & 1:
+        exp -= 1
+        man <<= 1
+        bc += 1
+    elif man == 1:
+        return mpmath_normalize(sign, man, exp//2, bc, prec, rnd)
+    shift = max(4, 2*prec - bc + 4)
+    shift += shift & 1
+    if rnd in "fd":
+        man = math.isqrt(man << shift)
+    else:
+        man, rem = python_isqrtrem(man << shift)
+        if rem:
+            man = (man << 1) + 1
+            shift += 2
+    return mpmath_from_man_exp(man, (exp - shift)//2, prec, rnd)
+
+
+@composite
+def mpmath_mpfs(draw):
+    if draw(integers(min_value=0, max_value=9)) == 0:
+        return draw(sampled_from([MPMATH_ZERO, MPMATH_NAN,
+                                  MPMATH_INF, MPMATH_NINF]))
+    man = draw(bigints())
+    exp = draw(integers(min_value=-(1<<10), max_value=1<<10))
+    return mpmath_from_man_exp(man, exp)